@@ -2,11 +2,11 @@
 
 /* Open a device */
 int
-lc_deviceOpen(char *device) {
+lc_deviceOpen(char *device, bool *direct) {
     int fd, err;
 
     fd = open(device, O_RDWR | O_EXCL, 0);
-    if (fd != -1) {
+    if ((fd != -1) && *direct) {
         err = fcntl(fd, F_NOCACHE);
         if (err == -1) {
             perror("fcntl");
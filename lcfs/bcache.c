@@ -1,67 +1,167 @@
 #include "includes.h"
 
-/* Return the hash number for the block number provided */
-/* XXX Figure out a better hashing scheme */
-static inline int
-lc_pageBlockHash(struct fs *fs, uint64_t block) {
+/* Return the hash number for the block number provided.  Bits of the block
+ * number are mixed so that blocks allocated sequentially are spread across
+ * hash lists.
+ */
+static inline uint64_t
+lc_pageBlockHash(uint64_t block) {
     assert(block);
     assert(block != LC_INVALID_BLOCK);
-    return block % fs->fs_bcache->lb_pcacheSize;
+    return lc_hashMix(block);
+}
+
+/* Find the hash list for a hash when the table has size lists.  Hash table
+ * is grown by splitting lists one at a time (linear hashing), so lists below
+ * size in the next power of two are in use.
+ */
+static inline uint32_t
+lc_pcacheIndex(uint32_t size, uint64_t hash) {
+    uint64_t mask = (2ull << (63 - __builtin_clzll(size))) - 1;
+    uint64_t index = hash & mask;
+
+    return (index < size) ? index : (hash & (mask >> 1));
+}
+
+/* Return the hash list at the specified index */
+static inline struct pcache *
+lc_pcacheList(struct lbcache *lbcache, uint32_t index) {
+    return &lbcache->lb_pcache[index / LC_PCACHE_SEGMENT_SIZE]->ps_pcache[
+                                            index % LC_PCACHE_SEGMENT_SIZE];
+}
+
+/* Return the lock protecting the hash list at the specified index */
+static inline pthread_mutex_t *
+lc_pcacheLock(struct lbcache *lbcache, uint32_t index) {
+    return &lbcache->lb_pcache[index / LC_PCACHE_SEGMENT_SIZE]->ps_locks[
+                                            index % LC_PCACHE_SEGMENT_LOCKS];
 }
 
-/* Add a page to free list */
+/* Find the eviction queue shard for a block.  Blocks of a read cluster are
+ * kept in the same shard.
+ */
+static inline uint32_t
+lc_pageShard(uint64_t block) {
+    return (block / LC_READ_CLUSTER_SIZE) % LC_PCACHE_SHARDS;
+}
+
+/* Add a page to the tail of an eviction queue of a shard */
 static void
-lc_insertPageToFreeList(struct lbcache *lbcache, struct page *page) {
+lc_insertPageToQueue(struct lbshard *shard, struct page *page,
+                     enum lc_pageQueue queue) {
+    struct page **head, **tail;
+
     assert(page->p_fnext == NULL);
     assert(page->p_fprev == NULL);
+    assert(page->p_queue == LC_PAGE_UNQUEUED);
 
-    /* Add the page at the tail of current free list */
-    if (lbcache->lb_ftail) {
-        page->p_fprev = lbcache->lb_ftail;
-        lbcache->lb_ftail->p_fnext = page;
+    if (queue == LC_PAGE_PROBATION) {
+        head = &shard->ls_phead;
+        tail = &shard->ls_ptail;
+        shard->ls_pcount++;
     } else {
-        assert(lbcache->lb_fhead == NULL);
-        lbcache->lb_fhead = page;
+        head = &shard->ls_ahead;
+        tail = &shard->ls_atail;
+        shard->ls_acount++;
     }
-    lbcache->lb_ftail = page;
-}
-
-/* Add a list of pages to free list */
-void
-lc_insertPagesToFreeList(struct lbcache *lbcache, struct page *first,
-                         struct page *last) {
-    assert(first->p_fprev == NULL);
-    assert(last->p_fnext == NULL);
-
-    pthread_mutex_lock(&lbcache->lb_flock);
-    if (lbcache->lb_ftail) {
-        lbcache->lb_ftail->p_fnext = first;
-        first->p_fprev = lbcache->lb_ftail;
+    if (*tail) {
+        page->p_fprev = *tail;
+        (*tail)->p_fnext = page;
     } else {
-        assert(lbcache->lb_fhead == NULL);
-        lbcache->lb_fhead = first;
+        assert(*head == NULL);
+        *head = page;
     }
-    lbcache->lb_ftail = last;
-    pthread_mutex_unlock(&lbcache->lb_flock);
+    *tail = page;
+    page->p_queue = queue;
 }
 
-/* Remove a page from freelist */
+/* Remove a page from the eviction queue it is on */
 static void
-lc_removePageFromFreeList(struct lbcache *lbcache, struct page *page) {
+lc_removePageFromQueue(struct lbshard *shard, struct page *page) {
+    struct page **head, **tail;
+
+    if (page->p_queue == LC_PAGE_PROBATION) {
+        head = &shard->ls_phead;
+        tail = &shard->ls_ptail;
+        assert(shard->ls_pcount > 0);
+        shard->ls_pcount--;
+    } else {
+        assert(page->p_queue == LC_PAGE_PROTECTED);
+        head = &shard->ls_ahead;
+        tail = &shard->ls_atail;
+        assert(shard->ls_acount > 0);
+        shard->ls_acount--;
+    }
     if (page->p_fprev) {
         page->p_fprev->p_fnext = page->p_fnext;
     }
     if (page->p_fnext) {
         page->p_fnext->p_fprev = page->p_fprev;
     }
-    if (lbcache->lb_fhead == page) {
-        lbcache->lb_fhead = page->p_fnext;
+    if (*head == page) {
+        *head = page->p_fnext;
     }
-    if (lbcache->lb_ftail == page) {
-        lbcache->lb_ftail = page->p_fprev;
+    if (*tail == page) {
+        *tail = page->p_fprev;
     }
     page->p_fnext = NULL;
     page->p_fprev = NULL;
+    page->p_queue = LC_PAGE_UNQUEUED;
+}
+
+/* Add a page not in any eviction queue to the probation queue */
+static void
+lc_insertPageToFreeList(struct lbcache *lbcache, struct page *page) {
+    struct lbshard *shard;
+    uint32_t index;
+
+    /* Pages already queued are not moved, just hit count is updated */
+    if (page->p_queue != LC_PAGE_UNQUEUED) {
+        return;
+    }
+    index = lc_pageShard(page->p_block);
+    shard = &lbcache->lb_shards[index];
+    pthread_mutex_lock(&shard->ls_lock);
+    if (page->p_queue == LC_PAGE_UNQUEUED) {
+        page->p_shard = index;
+        lc_insertPageToQueue(shard, page, LC_PAGE_PROBATION);
+    }
+    pthread_mutex_unlock(&shard->ls_lock);
+}
+
+/* Add a list of pages to probation queues */
+void
+lc_insertPagesToFreeList(struct lbcache *lbcache, struct page *first,
+                         struct page *last) {
+    struct page *page = first, *next;
+    struct lbshard *shard = NULL;
+    uint32_t index = -1;
+
+    assert(first->p_fprev == NULL);
+    assert(last->p_fnext == NULL);
+
+    /* Pages are usually contiguous on disk, so many pages are added to a shard
+     * while holding its lock.
+     */
+    while (page) {
+        next = page->p_fnext;
+        page->p_fnext = NULL;
+        page->p_fprev = NULL;
+        if (index != lc_pageShard(page->p_block)) {
+            if (shard) {
+                pthread_mutex_unlock(&shard->ls_lock);
+            }
+            index = lc_pageShard(page->p_block);
+            shard = &lbcache->lb_shards[index];
+            pthread_mutex_lock(&shard->ls_lock);
+        }
+        page->p_shard = index;
+        lc_insertPageToQueue(shard, page, LC_PAGE_PROBATION);
+        page = next;
+    }
+    if (shard) {
+        pthread_mutex_unlock(&shard->ls_lock);
+    }
 }
 
 /* Allocate a new page. Memory is counted against the base layer */
@@ -73,6 +173,8 @@ lc_newPage(struct gfs *gfs, struct fs *fs) {
     page->p_block = LC_INVALID_BLOCK;
     page->p_refCount = 1;
     page->p_hitCount = 0;
+    page->p_queue = LC_PAGE_UNQUEUED;
+    page->p_shard = 0;
     page->p_nohash = 0;
     page->p_nofree = 0;
     page->p_cache = 0;
@@ -87,33 +189,95 @@ lc_newPage(struct gfs *gfs, struct fs *fs) {
     return page;
 }
 
+/* Free a page structure once threads looking up pages are done with it */
+static void
+lc_freePageRcu(struct rcu_head *head) {
+    free(caa_container_of(head, struct page, p_rcu));
+}
+
+/* Take a reference on a page found without locking the hash list, unless the
+ * page is being freed.
+ */
+static inline bool
+lc_pageTryGet(struct page *page) {
+    uint32_t count;
+
+    do {
+        count = page->p_refCount;
+        if (count == LC_PAGE_DEAD) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&page->p_refCount, count,
+                                           count + 1));
+    return true;
+}
+
+/* Mark an unused page as being freed, so that it cannot be looked up anymore.
+ * Called with the hash list locked.
+ */
+static inline bool
+lc_pageKill(struct page *page) {
+    return __sync_bool_compare_and_swap(&page->p_refCount, 0, LC_PAGE_DEAD);
+}
+
 /* Free a page */
 static void
 lc_freePage(struct gfs *gfs, struct fs *fs, struct page *page) {
     struct lbcache *lbcache = fs->fs_bcache;
+    struct lbshard *shard;
 
-    assert(page->p_refCount == 0);
+    assert((page->p_refCount == 0) || (page->p_refCount == LC_PAGE_DEAD));
     assert(page->p_block == LC_INVALID_BLOCK);
     assert(page->p_cnext == NULL);
     assert(page->p_dnext == NULL);
 
-    /* Remove the page from free list */
-    if (!page->p_nohash) {
-        pthread_mutex_lock(&lbcache->lb_flock);
-        lc_removePageFromFreeList(lbcache, page);
-        pthread_mutex_unlock(&lbcache->lb_flock);
+    /* Remove the page from eviction queue.  Queue of a page cannot change
+     * once the page is taken off the hash list.
+     */
+    if (page->p_queue != LC_PAGE_UNQUEUED) {
+        shard = &lbcache->lb_shards[page->p_shard];
+        pthread_mutex_lock(&shard->ls_lock);
+        lc_removePageFromQueue(shard, page);
+        pthread_mutex_unlock(&shard->ls_lock);
     }
     assert(page->p_fprev == NULL);
     assert(page->p_fnext == NULL);
-    assert(lbcache->lb_fhead != page);
     if (page->p_data && !page->p_nofree) {
         lc_freePageData(gfs, fs->fs_rfs, page->p_data);
     }
-    lc_free(fs->fs_rfs, page, sizeof(struct page), LC_MEMTYPE_PAGE);
-    __sync_sub_and_fetch(&fs->fs_bcache->lb_pcount, 1);
+
+    /* Pages which were in hash lists could be still looked at by threads
+     * looking up pages without locking.
+     */
+    if (page->p_refCount == LC_PAGE_DEAD) {
+        lc_freeRcu(fs->fs_rfs, &page->p_rcu, sizeof(struct page),
+                   LC_MEMTYPE_PAGE, lc_freePageRcu);
+    } else {
+        lc_free(fs->fs_rfs, page, sizeof(struct page), LC_MEMTYPE_PAGE);
+    }
+    __sync_sub_and_fetch(&lbcache->lb_pcount, 1);
     __sync_sub_and_fetch(&gfs->gfs_pcount, 1);
 }
 
+/* Allocate a segment of hash table */
+static void
+lc_pcacheSegmentAlloc(struct fs *fs, struct lbcache *lbcache) {
+    struct pcsegment *segment;
+    int i;
+
+    assert(lbcache->lb_pcacheSegments < LC_PCACHE_SEGMENTS_MAX);
+    segment = lc_malloc(fs, sizeof(struct pcsegment), LC_MEMTYPE_PCACHE);
+    memset(segment->ps_pcache, 0, sizeof(segment->ps_pcache));
+    for (i = 0; i < LC_PCACHE_SEGMENT_LOCKS; i++) {
+        pthread_mutex_init(&segment->ps_locks[i], NULL);
+    }
+    lbcache->lb_pcache[lbcache->lb_pcacheSegments] = segment;
+
+    /* Make sure segment is initialized before table grows into it */
+    __sync_synchronize();
+    lbcache->lb_pcacheSegments++;
+}
+
 /* Allocate and initialize page block hash table */
 void
 lc_bcacheInit(struct fs *fs, uint32_t count, uint32_t lcount) {
@@ -122,23 +286,36 @@ lc_bcacheInit(struct fs *fs, uint32_t count, uint32_t lcount) {
     int i;
 
     lbcache = lc_malloc(fs, sizeof(struct lbcache), LC_MEMTYPE_LBCACHE);
-    lbcache->lb_pcache = lc_malloc(fs, sizeof(struct pcache) * count,
-                                   LC_MEMTYPE_PCACHE);
-    memset(lbcache->lb_pcache, 0, sizeof(struct pcache) * count);
+    lbcache->lb_pcache = lc_malloc(fs, sizeof(struct pcsegment *) *
+                                   LC_PCACHE_SEGMENTS_MAX, LC_MEMTYPE_PCACHE);
+    memset(lbcache->lb_pcache, 0,
+           sizeof(struct pcsegment *) * LC_PCACHE_SEGMENTS_MAX);
+    lbcache->lb_pcacheSegments = 0;
+    while ((lbcache->lb_pcacheSegments * LC_PCACHE_SEGMENT_SIZE) < count) {
+        lc_pcacheSegmentAlloc(fs, lbcache);
+    }
+    pthread_mutex_init(&lbcache->lb_rlock, NULL);
 
     /* Allocate specified number of locks */
-    locks = lc_malloc(fs, sizeof(pthread_mutex_t) * lcount * 2,
+    locks = lc_malloc(fs, sizeof(pthread_mutex_t) * lcount,
                       LC_MEMTYPE_PCLOCK);
-    lbcache->lb_pcacheLocks = locks;
-    lbcache->lb_pioLocks = locks + lcount;
-    for (i = 0; i < (lcount * 2); i++) {
+    lbcache->lb_pioLocks = locks;
+    for (i = 0; i < lcount; i++) {
         pthread_mutex_init(&locks[i], NULL);
     }
-    pthread_mutex_init(&lbcache->lb_flock, NULL);
-    lbcache->lb_fhead = NULL;
-    lbcache->lb_ftail = NULL;
+
+    /* Initialize eviction queues */
+    lbcache->lb_shards = lc_malloc(fs,
+                                   sizeof(struct lbshard) * LC_PCACHE_SHARDS,
+                                   LC_MEMTYPE_PCLOCK);
+    memset(lbcache->lb_shards, 0, sizeof(struct lbshard) * LC_PCACHE_SHARDS);
+    for (i = 0; i < LC_PCACHE_SHARDS; i++) {
+        pthread_mutex_init(&lbcache->lb_shards[i].ls_lock, NULL);
+    }
+    lbcache->lb_shardNext = 0;
     lbcache->lb_pcacheSize = count;
-    lbcache->lb_pcacheLockCount = lcount;
+    lbcache->lb_pcacheSizeMin = count;
+    lbcache->lb_pioLockCount = lcount;
     lbcache->lb_pcount = 0;
     fs->fs_bcache = lbcache;
 }
@@ -147,54 +324,187 @@ lc_bcacheInit(struct fs *fs, uint32_t count, uint32_t lcount) {
 void
 lc_bcacheFree(struct fs *fs) {
     struct lbcache *lbcache = fs->fs_bcache;
-    uint32_t lcount;
+    uint32_t i;
 #ifdef LC_MUTEX_DESTROY
-    pthread_mutex_t *locks;
-    uint32_t lcount;
+    uint32_t j;
 #endif
 
     /* Free the bcache when the base layer is deleted/unmounted */
     if (fs->fs_parent == NULL) {
-        assert(lbcache->lb_fhead == NULL);
-        assert(lbcache->lb_ftail == NULL);
         assert(lbcache->lb_pcount == 0);
+        for (i = 0; i < lbcache->lb_pcacheSegments; i++) {
+#ifdef LC_MUTEX_DESTROY
+            for (j = 0; j < LC_PCACHE_SEGMENT_LOCKS; j++) {
+                pthread_mutex_destroy(&lbcache->lb_pcache[i]->ps_locks[j]);
+            }
+#endif
+            lc_free(fs, lbcache->lb_pcache[i], sizeof(struct pcsegment),
+                    LC_MEMTYPE_PCACHE);
+        }
         lc_free(fs, lbcache->lb_pcache,
-                sizeof(struct pcache) * lbcache->lb_pcacheSize,
+                sizeof(struct pcsegment *) * LC_PCACHE_SEGMENTS_MAX,
                 LC_MEMTYPE_PCACHE);
-        lcount = lbcache->lb_pcacheLockCount * 2;
 #ifdef LC_MUTEX_DESTROY
-        locks = lbcache->lb_pcacheLocks;
-        for (i = 0; i < lcount; i++) {
-            pthread_mutex_destroy(&locks[i]);
+        for (i = 0; i < lbcache->lb_pioLockCount; i++) {
+            pthread_mutex_destroy(&lbcache->lb_pioLocks[i]);
         }
-        pthread_mutex_destroy(&lbcache->lb_flock);
+        for (i = 0; i < LC_PCACHE_SHARDS; i++) {
+            assert(lbcache->lb_shards[i].ls_phead == NULL);
+            assert(lbcache->lb_shards[i].ls_ahead == NULL);
+            pthread_mutex_destroy(&lbcache->lb_shards[i].ls_lock);
+        }
+        pthread_mutex_destroy(&lbcache->lb_rlock);
 #endif
-        lc_free(fs, lbcache->lb_pcacheLocks,
-                sizeof(pthread_mutex_t) * lcount, LC_MEMTYPE_PCLOCK);
+        lc_free(fs, lbcache->lb_pioLocks,
+                sizeof(pthread_mutex_t) * lbcache->lb_pioLockCount,
+                LC_MEMTYPE_PCLOCK);
+        lc_free(fs, lbcache->lb_shards,
+                sizeof(struct lbshard) * LC_PCACHE_SHARDS, LC_MEMTYPE_PCLOCK);
         lc_free(fs, lbcache, sizeof(struct lbcache), LC_MEMTYPE_LBCACHE);
     }
     fs->fs_bcache = NULL;
 }
 
-/* Find the lock hash for the list */
-static inline uint32_t
-lc_lockHash(struct fs *fs, uint64_t hash) {
-    return hash % fs->fs_bcache->lb_pcacheLockCount;
-}
-
-/* Lock a hash list */
+/* Lock the hash list for a hash and return index of the list.  Size of the
+ * table is checked again after taking the lock, as the list could have been
+ * split or merged meanwhile.
+ */
 static inline uint32_t
 lc_pcLockHash(struct fs *fs, uint64_t hash) {
-    uint32_t lhash = lc_lockHash(fs, hash);
-
-    pthread_mutex_lock(&fs->fs_bcache->lb_pcacheLocks[lhash]);
-    return lhash;
+    struct lbcache *lbcache = fs->fs_bcache;
+    pthread_mutex_t *lock;
+    uint32_t index;
+
+    for (;;) {
+        index = lc_pcacheIndex(lbcache->lb_pcacheSize, hash);
+        lock = lc_pcacheLock(lbcache, index);
+        pthread_mutex_lock(lock);
+        if (index == lc_pcacheIndex(lbcache->lb_pcacheSize, hash)) {
+            return index;
+        }
+        pthread_mutex_unlock(lock);
+    }
 }
 
 /* Unlock a hash list */
 static inline void
-lc_pcUnLockHash(struct fs *fs, uint32_t lhash) {
-    pthread_mutex_unlock(&fs->fs_bcache->lb_pcacheLocks[lhash]);
+lc_pcUnLockHash(struct fs *fs, uint32_t index) {
+    pthread_mutex_unlock(lc_pcacheLock(fs->fs_bcache, index));
+}
+
+/* Lock two hash lists while moving pages between those */
+static void
+lc_pcLockLists(struct lbcache *lbcache, uint32_t from, uint32_t to) {
+    pthread_mutex_t *flock = lc_pcacheLock(lbcache, from);
+    pthread_mutex_t *tlock = lc_pcacheLock(lbcache, to);
+
+    /* Take locks in the order of index */
+    if (flock == tlock) {
+        pthread_mutex_lock(flock);
+    } else if (from < to) {
+        pthread_mutex_lock(flock);
+        pthread_mutex_lock(tlock);
+    } else {
+        pthread_mutex_lock(tlock);
+        pthread_mutex_lock(flock);
+    }
+}
+
+/* Unlock two hash lists locked for moving pages */
+static void
+lc_pcUnlockLists(struct lbcache *lbcache, uint32_t from, uint32_t to) {
+    pthread_mutex_t *flock = lc_pcacheLock(lbcache, from);
+    pthread_mutex_t *tlock = lc_pcacheLock(lbcache, to);
+
+    pthread_mutex_unlock(flock);
+    if (flock != tlock) {
+        pthread_mutex_unlock(tlock);
+    }
+}
+
+/* Grow the hash table by splitting a hash list if lists are getting long */
+static void
+lc_pcacheGrow(struct fs *fs) {
+    struct lbcache *lbcache = fs->fs_bcache;
+    struct page *page, **prev;
+    struct pcache *from, *to;
+    uint32_t size, findex;
+
+    if ((lbcache->lb_pcount <=
+         ((uint64_t)lbcache->lb_pcacheSize * LC_PCACHE_LOAD_MAX)) ||
+        (lbcache->lb_pcacheSize >=
+         (LC_PCACHE_SEGMENTS_MAX * LC_PCACHE_SEGMENT_SIZE)) ||
+        pthread_mutex_trylock(&lbcache->lb_rlock)) {
+        return;
+    }
+    size = lbcache->lb_pcacheSize;
+    if (size == (lbcache->lb_pcacheSegments * LC_PCACHE_SEGMENT_SIZE)) {
+        lc_pcacheSegmentAlloc(fs->fs_rfs, lbcache);
+    }
+
+    /* Move pages which belong to the new list */
+    findex = lc_pcacheIndex(size, size);
+    from = lc_pcacheList(lbcache, findex);
+    to = lc_pcacheList(lbcache, size);
+    lc_pcLockLists(lbcache, findex, size);
+    assert(to->pc_head == NULL);
+    prev = &from->pc_head;
+    page = from->pc_head;
+    while (page) {
+        if (lc_pcacheIndex(size + 1,
+                           lc_pageBlockHash(page->p_block)) == size) {
+            *prev = page->p_cnext;
+            page->p_cnext = to->pc_head;
+            rcu_assign_pointer(to->pc_head, page);
+            from->pc_pcount--;
+            to->pc_pcount++;
+        } else {
+            prev = &page->p_cnext;
+        }
+        page = *prev;
+    }
+    lbcache->lb_pcacheSize = size + 1;
+    lc_pcUnlockLists(lbcache, findex, size);
+    pthread_mutex_unlock(&lbcache->lb_rlock);
+}
+
+/* Shrink the hash table by merging hash lists if the table is sparse.
+ * Segments allocated are kept around as other threads may be looking at
+ * those without any locks.
+ */
+static void
+lc_pcacheShrink(struct fs *fs) {
+    struct lbcache *lbcache = fs->fs_bcache;
+    uint32_t size, tindex, count = 0;
+    struct pcache *from, *to;
+    struct page *page;
+
+    if (pthread_mutex_trylock(&lbcache->lb_rlock)) {
+        return;
+    }
+    while ((count < LC_PCACHE_SHRINK_COUNT) &&
+           (lbcache->lb_pcacheSize > lbcache->lb_pcacheSizeMin) &&
+           ((lbcache->lb_pcount * 2) < lbcache->lb_pcacheSize)) {
+        size = lbcache->lb_pcacheSize - 1;
+        tindex = lc_pcacheIndex(size, size);
+        from = lc_pcacheList(lbcache, size);
+        to = lc_pcacheList(lbcache, tindex);
+        lc_pcLockLists(lbcache, size, tindex);
+
+        /* Move all pages of the last list to the list it was split from */
+        while (from->pc_head) {
+            page = from->pc_head;
+            from->pc_head = page->p_cnext;
+            page->p_cnext = to->pc_head;
+            rcu_assign_pointer(to->pc_head, page);
+        }
+        to->pc_pcount += from->pc_pcount;
+        from->pc_pcount = 0;
+        lbcache->lb_pcacheSize = size;
+        lc_pcUnlockLists(lbcache, size, tindex);
+        count++;
+    }
+    pthread_mutex_unlock(&lbcache->lb_rlock);
 }
 
 /* Return the read cluster block number */
@@ -206,7 +516,7 @@ lc_clusterBlock(uint64_t block) {
 /* Lock taken while reading a page */
 static inline uint32_t
 lc_lockPageRead(struct fs *fs, uint64_t block) {
-    uint32_t lhash = lc_lockHash(fs, lc_clusterBlock(block));
+    uint32_t lhash = lc_clusterBlock(block) % fs->fs_bcache->lb_pioLockCount;
 
     pthread_mutex_lock(&fs->fs_bcache->lb_pioLocks[lhash]);
     return lhash;
@@ -226,7 +536,6 @@ lc_destroyPages(struct gfs *gfs, struct fs *fs, bool remove) {
     uint64_t i, count = 0, pcount;
     int gindex = fs->fs_pinval;
     struct pcache *pcache;
-    uint32_t lhash = -1;
     bool all;
 
     if (lbcache == NULL) {
@@ -239,23 +548,30 @@ lc_destroyPages(struct gfs *gfs, struct fs *fs, bool remove) {
         fs->fs_bcache = NULL;
         return;
     }
-    pcache = lbcache->lb_pcache;
+
+    /* Keep hash table from being resized while processing all lists */
+    if (!all) {
+        pthread_mutex_lock(&lbcache->lb_rlock);
+    }
     for (i = 0; i < lbcache->lb_pcacheSize; i++) {
-        if (pcache[i].pc_head == NULL) {
+        pcache = lc_pcacheList(lbcache, i);
+        if (pcache->pc_head == NULL) {
             continue;
         }
         if (!all) {
             if (fs->fs_rfs->fs_removed) {
                 break;
             }
-            lhash = lc_pcLockHash(fs, i);
+            pthread_mutex_lock(lc_pcacheLock(lbcache, i));
             fpage = NULL;
         }
         pcount = 0;
-        page = pcache[i].pc_head;
-        prev = &pcache[i].pc_head;
+        page = pcache->pc_head;
+        prev = &pcache->pc_head;
         while (page) {
-            if (all || (page->p_lindex == gindex)) {
+
+            /* Skip pages just looked up by another layer */
+            if ((all || (page->p_lindex == gindex)) && lc_pageKill(page)) {
                 *prev = page->p_cnext;
                 page->p_block = LC_INVALID_BLOCK;
                 page->p_dvalid = 0;
@@ -273,11 +589,11 @@ lc_destroyPages(struct gfs *gfs, struct fs *fs, bool remove) {
             page = *prev;
         }
         if (all) {
-            assert(pcount == pcache[i].pc_pcount);
-            assert(pcache[i].pc_head == NULL);
+            assert(pcount == pcache->pc_pcount);
+            assert(pcache->pc_head == NULL);
         } else {
-            pcache[i].pc_pcount -= pcount;
-            lc_pcUnLockHash(fs, lhash);
+            pcache->pc_pcount -= pcount;
+            pthread_mutex_unlock(lc_pcacheLock(lbcache, i));
 
             /* Free the pages invalidated */
             while (fpage) {
@@ -289,6 +605,9 @@ lc_destroyPages(struct gfs *gfs, struct fs *fs, bool remove) {
         }
         count += pcount;
     }
+    if (!all) {
+        pthread_mutex_unlock(&lbcache->lb_rlock);
+    }
 
     /* Free the bcache header */
     lc_bcacheFree(fs);
@@ -299,62 +618,75 @@ lc_destroyPages(struct gfs *gfs, struct fs *fs, bool remove) {
 
 /* Remove a page from a hash list */
 static void
-lc_removePageFromHashList(struct pcache *pcache, struct page *page,
-                          uint64_t hash) {
-    assert(page->p_refCount == 0);
-    assert(pcache[hash].pc_pcount > 0);
+lc_removePageFromHashList(struct pcache *pcache, struct page *page) {
+    assert(page->p_refCount == LC_PAGE_DEAD);
+    assert(pcache->pc_pcount > 0);
 
     page->p_block = LC_INVALID_BLOCK;
     page->p_cnext = NULL;
-    pcache[hash].pc_pcount--;
+    pcache->pc_pcount--;
 }
 
 /* Release a page */
 void
 lc_releasePage(struct gfs *gfs, struct fs *fs, struct page *page, bool read,
                bool inval) {
-    bool invalidate = (inval || page->p_nocache) && !page->p_cache;
-    struct pcache *pcache = fs->fs_bcache->lb_pcache;
-    struct page *cpage, *fpage = NULL, **prev;
+    uint64_t hash = lc_pageBlockHash(page->p_block);
+    struct page *cpage, **prev;
+    struct pcache *pcache;
+    bool invalidate;
     uint32_t lhash;
-    uint64_t hash;
-
-    /* Find the hash list and lock it */
-    hash = lc_pageBlockHash(fs, page->p_block);
-    lhash = lc_pcLockHash(fs, hash);
 
-    /* Decrement the reference count on the page */
     assert(page->p_refCount > 0);
+    assert(page->p_refCount != LC_PAGE_DEAD);
     assert(!page->p_nohash);
-    page->p_refCount--;
 
-    /* If page does not have to be cached, then free it. */
-    if (invalidate && (page->p_refCount == 0)) {
-        cpage = pcache[hash].pc_head;
-        prev = &pcache[hash].pc_head;
+    /* If page was read, increment hit count */
+    if (read) {
+        page->p_hitCount++;
+    }
+
+    /* Decrement the reference count on the page.  Page could be freed by
+     * another thread once the reference is dropped.  A page is marked for
+     * invalidation before trying to free it, so the thread dropping last
+     * reference would see that.
+     */
+    lc_rcuRegister();
+    rcu_read_lock();
+    invalidate = (__sync_sub_and_fetch(&page->p_refCount, 1) == 0) &&
+                 (inval || page->p_nocache) && !page->p_cache;
+    rcu_read_unlock();
+    if (!invalidate) {
+        return;
+    }
+
+    /* If page does not have to be cached, then free it, unless it was freed
+     * or looked up meanwhile.
+     */
+    lhash = lc_pcLockHash(fs, hash);
+    pcache = lc_pcacheList(fs->fs_bcache, lhash);
+    cpage = pcache->pc_head;
+    prev = &pcache->pc_head;
 
-        /* Find the previous page in the singly linked list */
-        while (cpage) {
-            if (cpage == page) {
+    /* Find the previous page in the singly linked list */
+    while (cpage) {
+        if (cpage == page) {
+            if (lc_pageKill(page)) {
                 *prev = page->p_cnext;
-                break;
+                lc_removePageFromHashList(pcache, page);
+            } else {
+                cpage = NULL;
             }
-            prev = &cpage->p_cnext;
-            cpage = cpage->p_cnext;
+            break;
         }
-        assert(cpage);
-        lc_removePageFromHashList(pcache, page, hash);
-        fpage = page;
-    } else if (read) {
-
-        /* If page was read, increment hit count */
-        page->p_hitCount++;
+        prev = &cpage->p_cnext;
+        cpage = cpage->p_cnext;
     }
     lc_pcUnLockHash(fs, lhash);
 
     /* Free the page picked for freeing */
-    if (fpage) {
-        lc_freePage(gfs, fs, fpage);
+    if (cpage) {
+        lc_freePage(gfs, fs, cpage);
         __sync_add_and_fetch(&gfs->gfs_precycle, 1);
     }
 }
@@ -384,9 +716,9 @@ lc_releasePages(struct gfs *gfs, struct fs *fs, struct page *head,
              */
             assert(page->p_lindex == fs->fs_pinval);
             assert(page->p_refCount == 1);
-            page->p_refCount = 0;
             page->p_hitCount = 0;
             page->p_nocache = 1;
+            __sync_sub_and_fetch(&page->p_refCount, 1);
         } else {
             lc_releasePage(gfs, fs, page, false, inval);
         }
@@ -404,16 +736,15 @@ lc_releaseReadPages(struct gfs *gfs, struct fs *fs, struct page **pages,
     struct lbcache *lbcache = fs->fs_bcache;
     uint64_t i;
 
-    /* Move pages to the tail of the freelist */
+    /* Add pages not queued already to probation queues.  Pages queued
+     * already are promoted based on hit count while purging.
+     */
     if (recycle && !nocache) {
-        pthread_mutex_lock(&lbcache->lb_flock);
         for (i = 0; i < pcount; i++) {
             if (!pages[i]->p_nocache) {
-                lc_removePageFromFreeList(lbcache, pages[i]);
                 lc_insertPageToFreeList(lbcache, pages[i]);
             }
         }
-        pthread_mutex_unlock(&lbcache->lb_flock);
     }
     for (i = 0; i < pcount; i++) {
         lc_releasePage(gfs, fs, pages[i], true, nocache);
@@ -423,30 +754,28 @@ lc_releaseReadPages(struct gfs *gfs, struct fs *fs, struct page **pages,
 /* Invalidate a page if present in cache */
 int
 lc_invalPage(struct gfs *gfs, struct fs *fs, uint64_t block) {
-    struct pcache *pcache = fs->fs_bcache->lb_pcache;
-    int hash = lc_pageBlockHash(fs, block);
-    struct page *page = NULL, **prev = &pcache[hash].pc_head;
+    struct page *page, **prev;
+    struct pcache *pcache;
     uint32_t lhash, ret = 0;
 
-    if (pcache[hash].pc_head == NULL) {
-        return 0;
-    }
-    lhash = lc_pcLockHash(fs, hash);
-    page = pcache[hash].pc_head;
+    lhash = lc_pcLockHash(fs, lc_pageBlockHash(block));
+    pcache = lc_pcacheList(fs->fs_bcache, lhash);
+    page = pcache->pc_head;
+    prev = &pcache->pc_head;
 
     /* Traverse the list looking for the page and invalidate it if found */
     while (page) {
         if (page->p_block == block) {
-            page->p_cache = 0;
-            if (page->p_refCount) {
 
-                /* Mark the page for delayed invalidation */
-                page->p_nocache = 1;
+            /* Mark the page for delayed invalidation if in use */
+            page->p_cache = 0;
+            page->p_nocache = 1;
+            if (!lc_pageKill(page)) {
                 page = NULL;
                 break;
             }
             *prev = page->p_cnext;
-            lc_removePageFromHashList(pcache, page, hash);
+            lc_removePageFromHashList(pcache, page);
             break;
         }
         prev = &page->p_cnext;
@@ -476,24 +805,34 @@ lc_setPageBlock(struct page *page, uint64_t block) {
 void
 lc_addPageBlockHash(struct gfs *gfs, struct fs *fs,
                     struct page *page, uint64_t block) {
-    struct pcache *pcache = fs->fs_bcache->lb_pcache;
-    int hash = lc_pageBlockHash(fs, block);
     struct page *cpage, **prev;
+    struct pcache *pcache;
     uint32_t lhash;
 
     /* Initialize the page structure and lock the hash list */
     lc_setPageBlock(page, block);
-    lhash = lc_pcLockHash(fs, hash);
-    cpage = pcache[hash].pc_head;
-    prev = &pcache[hash].pc_head;
+    lhash = lc_pcLockHash(fs, lc_pageBlockHash(block));
+    pcache = lc_pcacheList(fs->fs_bcache, lhash);
+    cpage = pcache->pc_head;
+    prev = &pcache->pc_head;
 
     /* Invalidate previous instance of this block if there is one.
      * Blocks are not invalidated in cache when freed.
      */
     while (cpage) {
         if (cpage->p_block == block) {
-            *prev = cpage->p_cnext;
-            lc_removePageFromHashList(pcache, cpage, hash);
+
+            /* If the page is in use, invalidate it when released.  New page
+             * is found first as it is added at the head of the list.
+             */
+            cpage->p_cache = 0;
+            cpage->p_nocache = 1;
+            if (lc_pageKill(cpage)) {
+                *prev = cpage->p_cnext;
+                lc_removePageFromHashList(pcache, cpage);
+            } else {
+                cpage = NULL;
+            }
             break;
         }
         prev = &cpage->p_cnext;
@@ -501,30 +840,69 @@ lc_addPageBlockHash(struct gfs *gfs, struct fs *fs,
     }
 
     /* Add the new page at the head of the list */
-    page->p_cnext = pcache[hash].pc_head;
-    pcache[hash].pc_head = page;
-    pcache[hash].pc_pcount++;
+    page->p_cnext = pcache->pc_head;
+    rcu_assign_pointer(pcache->pc_head, page);
+    pcache->pc_pcount++;
     lc_pcUnLockHash(fs, lhash);
     if (cpage) {
         lc_freePage(gfs, fs, cpage);
     }
+    lc_pcacheGrow(fs);
+}
+
+/* Lookup a page in the block hash without locking the hash list.  Pages are
+ * freed only after threads looking at those are done, and references are
+ * taken on pages not being freed.  Returns NULL if page is not found, which
+ * could be because of a race with a thread modifying the hash list.
+ */
+static struct page *
+lc_lookupPage(struct fs *fs, uint64_t block, uint64_t hash) {
+    struct lbcache *lbcache = fs->fs_bcache;
+    struct pcache *pcache;
+    struct page *page;
+
+    lc_rcuRegister();
+    rcu_read_lock();
+    pcache = lc_pcacheList(lbcache,
+                           lc_pcacheIndex(lbcache->lb_pcacheSize, hash));
+    page = rcu_dereference(pcache->pc_head);
+    while (page && (page->p_block != block)) {
+        page = rcu_dereference(page->p_cnext);
+    }
+    if (page && !lc_pageTryGet(page)) {
+        page = NULL;
+    }
+    rcu_read_unlock();
+
+    /* Block of a page does not change while page is not being freed */
+    assert((page == NULL) || (page->p_block == block));
+    return page;
 }
 
 /* Lookup/Create a page in the block hash */
 struct page *
 lc_getPage(struct fs *fs, uint64_t block, char *data, bool read) {
-    int hash = lc_pageBlockHash(fs, block), gindex = fs->fs_gindex;
-    struct pcache *pcache = fs->fs_bcache->lb_pcache;
-    bool hit = false, missed = false;
+    bool hit = false, missed = false, added = false;
+    uint64_t hash = lc_pageBlockHash(block);
     struct page *page, *new = NULL;
+    int gindex = fs->fs_gindex;
     struct gfs *gfs = fs->fs_gfs;
+    struct pcache *pcache;
     uint32_t lhash;
 
+    /* Look for the page without locking the hash list first */
+    page = lc_lookupPage(fs, block, hash);
+    hit = (page != NULL);
+    if (hit) {
+        goto found;
+    }
+
     /* Lock the hash list and look for a page */
 
 retry:
     lhash = lc_pcLockHash(fs, hash);
-    page = pcache[hash].pc_head;
+    pcache = lc_pcacheList(fs->fs_bcache, lhash);
+    page = pcache->pc_head;
     while (page && (page->p_block != block)) {
         page = page->p_cnext;
     }
@@ -532,21 +910,17 @@ retry:
     if (hit) {
 
         /* If a page is found, increment reference count */
-        page->p_refCount++;
-        if (page->p_lindex != gindex) {
-
-            /* If a page is shared by many layers, untag it */
-            page->p_lindex = 0;
-        }
+        __sync_add_and_fetch(&page->p_refCount, 1);
     } else if (new) {
 
         /* If page is not found, instantiate one */
         page = new;
         new = NULL;
         page->p_block = block;
-        page->p_cnext = pcache[hash].pc_head;
-        pcache[hash].pc_head = page;
-        pcache[hash].pc_pcount++;
+        page->p_cnext = pcache->pc_head;
+        rcu_assign_pointer(pcache->pc_head, page);
+        pcache->pc_pcount++;
+        added = true;
     }
     lc_pcUnLockHash(fs, lhash);
 
@@ -568,6 +942,20 @@ retry:
     if (new) {
         new->p_refCount = 0;
         lc_freePage(gfs, fs, new);
+    } else if (added) {
+        lc_pcacheGrow(fs);
+    }
+
+found:
+    if (hit) {
+        if (page->p_queue == LC_PAGE_PROTECTED) {
+            __sync_add_and_fetch(&gfs->gfs_pahit, 1);
+        }
+        if (page->p_lindex && (page->p_lindex != gindex)) {
+
+            /* If a page is shared by many layers, untag it */
+            page->p_lindex = 0;
+        }
     }
 
     /* If page is missing data, read from disk */
@@ -660,6 +1048,7 @@ lc_readPages(struct gfs *gfs, struct fs *fs, struct page **pages,
     uint32_t i, iovcnt = 0, j = 0, rcount = 0;
     uint64_t sblock, pblock = 0, cblock;
     struct page *page = pages[0];
+    struct iobatch batch;
     struct iovec *iovec;
     uint32_t lhash;
 
@@ -679,6 +1068,7 @@ lc_readPages(struct gfs *gfs, struct fs *fs, struct page **pages,
         }
     } else {
         iovec = alloca(count * sizeof(struct iovec));
+        lc_ioBatchInit(&batch);
         sblock = page->p_block;
         cblock = lc_clusterBlock(sblock);
         lhash = lc_lockPageRead(fs, sblock);
@@ -697,12 +1087,7 @@ lc_readPages(struct gfs *gfs, struct fs *fs, struct page **pages,
                 (((pblock + 1) != page->p_block) ||
                 (cblock != lc_clusterBlock(page->p_block)) ||
                 (iovcnt >= LC_READ_CLUSTER_SIZE))) {
-                lc_readBlocks(gfs, fs, iovec, iovcnt, sblock);
-
-                /* Mark pages having valid data */
-                for (; j < i; j++) {
-                    pages[j]->p_dvalid = 1;
-                }
+                lc_readBlocks(gfs, fs, iovec, iovcnt, sblock, &batch);
                 rcount += iovcnt;
                 iovcnt = 0;
             }
@@ -711,6 +1096,14 @@ lc_readPages(struct gfs *gfs, struct fs *fs, struct page **pages,
             if (i && (iovcnt == 0)) {
                 sblock = page->p_block;
                 if (cblock != lc_clusterBlock(sblock)) {
+
+                    /* Wait for reads issued under current lock and mark pages
+                     * having valid data.
+                     */
+                    lc_ioBatchWait(gfs, &batch);
+                    for (; j < i; j++) {
+                        pages[j]->p_dvalid = 1;
+                    }
                     lc_unlockPageRead(fs, lhash);
                     lhash = lc_lockPageRead(fs, sblock);
                     if (page->p_dvalid) {
@@ -732,12 +1125,14 @@ lc_readPages(struct gfs *gfs, struct fs *fs, struct page **pages,
 
         /* Issue I/O on any remaining pages */
         if (iovcnt) {
-            lc_readBlocks(gfs, fs, iovec, iovcnt, sblock);
-            for (; j < count; j++) {
-                pages[j]->p_dvalid = 1;
-            }
+            lc_readBlocks(gfs, fs, iovec, iovcnt, sblock, &batch);
             rcount += iovcnt;
         }
+        lc_ioBatchWait(gfs, &batch);
+        lc_ioBatchDeinit(&batch);
+        for (; j < count; j++) {
+            pages[j]->p_dvalid = 1;
+        }
         lc_unlockPageRead(fs, lhash);
     }
     return rcount;
@@ -749,6 +1144,7 @@ lc_flushPageCluster(struct gfs *gfs, struct fs *fs,
                     struct page *head, uint64_t count) {
     struct page *page = head;
     uint64_t i, j, iovcount;
+    struct iobatch batch;
     struct iovec *iovec;
     uint64_t block = 0;
 
@@ -764,6 +1160,7 @@ lc_flushPageCluster(struct gfs *gfs, struct fs *fs,
         iovcount = (count < LC_WRITE_CLUSTER_SIZE) ?
                         count : LC_WRITE_CLUSTER_SIZE;
         iovec = alloca(iovcount * sizeof(struct iovec));
+        lc_ioBatchInit(&batch);
 
         /* Issue the I/O in block order */
         for (i = 0, j = 0; i < count; i++, j++) {
@@ -775,11 +1172,7 @@ lc_flushPageCluster(struct gfs *gfs, struct fs *fs,
              */
             if ((j >= iovcount) || (j && ((block + j) != page->p_block))) {
                 assert(block != 0);
-                if (j == 1) {
-                    lc_writeBlock(gfs, fs, iovec[0].iov_base, block);
-                } else {
-                    lc_writeBlocks(gfs, fs, iovec, j, block);
-                }
+                lc_writeBlocks(gfs, fs, iovec, j, block, &batch);
                 j = 0;
             }
             iovec[j].iov_base = page->p_data;
@@ -791,13 +1184,16 @@ lc_flushPageCluster(struct gfs *gfs, struct fs *fs,
         }
         assert(page == NULL);
         assert(block != 0);
-        if (j == 1) {
-            lc_writeBlock(gfs, fs, iovec[0].iov_base, block);
-        } else {
-            lc_writeBlocks(gfs, fs, iovec, j, block);
-        }
+        lc_writeBlocks(gfs, fs, iovec, j, block, &batch);
+
+        /* Wait for all writes to complete before releasing the pages */
+        lc_ioBatchWait(gfs, &batch);
+        lc_ioBatchDeinit(&batch);
     }
 
+    /* Account pages written for estimating write back bandwidth */
+    __sync_add_and_fetch(&fs->fs_wbPages, count);
+
     /* Release the pages after writing */
     lc_releasePages(gfs, fs, head, fs->fs_removed && (fs->fs_pinval != -1));
 }
@@ -859,7 +1255,120 @@ lc_invalidateDirtyPages(struct gfs *gfs, struct fs *fs) {
     }
 }
 
-/* Background thread for flushing dirty pages */
+/* Add a layer to the queue of a flusher thread.  Called with gfs_flock held.
+ */
+static void
+lc_flushQueueLocked(struct gfs *gfs, int gindex) {
+    uint32_t tail;
+
+    switch (gfs->gfs_flushState[gindex]) {
+    case LC_FLUSH_IDLE:
+        assert(gfs->gfs_flushCount < LC_LAYER_MAX);
+        tail = (gfs->gfs_flushHead + gfs->gfs_flushCount) % LC_LAYER_MAX;
+        gfs->gfs_flushQueue[tail] = gindex;
+        gfs->gfs_flushCount++;
+        gfs->gfs_flushState[gindex] = LC_FLUSH_QUEUED;
+        pthread_cond_signal(&gfs->gfs_flushWorkCond);
+        break;
+
+    case LC_FLUSH_RUNNING:
+
+        /* Flush the layer again after the current flush completes */
+        gfs->gfs_flushState[gindex] = LC_FLUSH_REQUEUE;
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Queue a layer for flushing its dirty data by a flusher thread */
+void
+lc_flushQueue(struct gfs *gfs, int gindex) {
+    if (gfs->gfs_flushState[gindex] == LC_FLUSH_QUEUED) {
+        return;
+    }
+    pthread_mutex_lock(&gfs->gfs_flock);
+    lc_flushQueueLocked(gfs, gindex);
+    pthread_mutex_unlock(&gfs->gfs_flock);
+}
+
+/* Flush dirty data of a layer */
+static void
+lc_flushLayer(struct gfs *gfs, int gindex) {
+    struct fs *fs;
+    bool force;
+
+    rcu_read_lock();
+    fs = rcu_dereference(gfs->gfs_fs[gindex]);
+    if ((fs == NULL) || lc_tryLock(fs, false)) {
+        rcu_read_unlock();
+        return;
+    }
+    rcu_read_unlock();
+
+    /* Layer may have moved to another index or been removed before it was
+     * locked, if a layer was committed or deleted.
+     */
+    if ((fs->fs_gindex != gindex) ||
+        (gfs->gfs_roots[gindex] != fs->fs_root)) {
+        lc_unlock(fs);
+        return;
+    }
+    force = !lc_checkMemoryAvailable(true) ||
+            gfs->gfs_pcleaning || gfs->gfs_pcleaningForced;
+
+    /* Flush dirty data pages from read-write layers.
+     * Dirty data from read only layers are flushed as those are created.
+     */
+    if (!fs->fs_readOnly && fs->fs_pcount &&
+        !(fs->fs_super->sb_flags & LC_SUPER_INIT)) {
+        lc_flushDirtyInodeList(fs, force);
+    }
+
+    /* Write out dirty pages of the layer */
+    lc_flushDirtyPages(gfs, fs);
+    lc_unlock(fs);
+}
+
+/* Thread flushing layers queued for flushing */
+void *
+lc_flushWorker(void *data) {
+    struct gfs *gfs = (struct gfs *)data;
+    int gindex;
+
+    lc_rcuRegister();
+    pthread_mutex_lock(&gfs->gfs_flock);
+    while (!gfs->gfs_unmounting) {
+        if (gfs->gfs_flushCount == 0) {
+            pthread_cond_wait(&gfs->gfs_flushWorkCond, &gfs->gfs_flock);
+            continue;
+        }
+
+        /* Take the first layer from the queue */
+        gindex = gfs->gfs_flushQueue[gfs->gfs_flushHead];
+        gfs->gfs_flushHead = (gfs->gfs_flushHead + 1) % LC_LAYER_MAX;
+        gfs->gfs_flushCount--;
+        assert(gfs->gfs_flushState[gindex] == LC_FLUSH_QUEUED);
+        gfs->gfs_flushState[gindex] = LC_FLUSH_RUNNING;
+        pthread_mutex_unlock(&gfs->gfs_flock);
+        lc_flushLayer(gfs, gindex);
+        pthread_mutex_lock(&gfs->gfs_flock);
+        if (gfs->gfs_flushState[gindex] == LC_FLUSH_REQUEUE) {
+            gfs->gfs_flushState[gindex] = LC_FLUSH_IDLE;
+            lc_flushQueueLocked(gfs, gindex);
+        } else {
+            gfs->gfs_flushState[gindex] = LC_FLUSH_IDLE;
+        }
+    }
+    pthread_mutex_unlock(&gfs->gfs_flock);
+    return NULL;
+}
+
+/* Background thread for finding layers with too much dirty data and
+ * queueing those for flusher threads, so that multiple layers are flushed in
+ * parallel.
+ */
 void *
 lc_flusher(void *data) {
     struct gfs *gfs = (struct gfs *)data;
@@ -878,7 +1387,7 @@ lc_flusher(void *data) {
         pthread_cond_timedwait(&gfs->gfs_flusherCond, &gfs->gfs_flock,
                                &interval);
         pthread_mutex_unlock(&gfs->gfs_flock);
-        rcu_register_thread();
+        lc_rcuRegister();
         rcu_read_lock();
 
         /* Check if any layers accumulated too many dirty pages */
@@ -894,39 +1403,131 @@ lc_flusher(void *data) {
             gettimeofday(&now, NULL);
             recent = now.tv_sec - LC_FLUSH_TIME;
 
-            /* Flush dirty data pages from read-write layers.
-             * Dirty data from read only layers are flushed as those are
-             * created.
+            /* Flush dirty data pages from read-write layers and dirty pages
+             * queued by any layers.
              */
-            if (!fs->fs_readOnly && fs->fs_pcount &&
-                ((fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) ||
-                 force || (fs->fs_super->sb_ctime < recent)) &&
-                !(fs->fs_super->sb_flags & LC_SUPER_INIT) &&
-                !lc_tryLock(fs, false)) {
-                rcu_read_unlock();
-                if (fs->fs_pcount) {
-                    lc_flushDirtyInodeList(fs, force);
-                }
-                lc_flushDirtyPages(gfs, fs);
-                lc_unlock(fs);
-                rcu_read_lock();
-            } else if (((fs->fs_dpcount >= LC_SYNCER_DIRTY_COUNT) ||
-                        (fs->fs_dpcount && force)) &&
-                       !lc_tryLock(fs, false)) {
-                rcu_read_unlock();
-
-                /* Write out dirty pages of a layer */
-                lc_flushDirtyPages(gfs, fs);
-                lc_unlock(fs);
-                rcu_read_lock();
+            if ((!fs->fs_readOnly && fs->fs_pcount &&
+                 ((fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) ||
+                  force || (fs->fs_super->sb_ctime < recent)) &&
+                 !(fs->fs_super->sb_flags & LC_SUPER_INIT)) ||
+                (fs->fs_dpcount >= LC_SYNCER_DIRTY_COUNT) ||
+                (fs->fs_dpcount && force)) {
+                lc_flushQueue(gfs, i);
             }
         }
         rcu_read_unlock();
-        rcu_unregister_thread();
     }
     return NULL;
 }
 
+/* Queue a range of blocks for reading ahead */
+void
+lc_readAheadQueue(struct gfs *gfs, struct fs *fs, uint64_t block,
+                  uint32_t count) {
+    struct rarequest *req;
+
+    /* Drop the request if too many requests are pending already */
+    if ((gfs->gfs_raCount >= LC_RA_QUEUE_MAX) || gfs->gfs_unmounting) {
+        return;
+    }
+    req = lc_malloc(NULL, sizeof(struct rarequest), LC_MEMTYPE_GFS);
+    req->rr_next = NULL;
+    req->rr_root = fs->fs_root;
+    req->rr_block = block;
+    req->rr_count = count;
+    req->rr_gindex = fs->fs_gindex;
+    pthread_mutex_lock(&gfs->gfs_raLock);
+    if (gfs->gfs_raTail) {
+        gfs->gfs_raTail->rr_next = req;
+    } else {
+        gfs->gfs_raHead = req;
+    }
+    gfs->gfs_raTail = req;
+    gfs->gfs_raCount++;
+    pthread_cond_signal(&gfs->gfs_raCond);
+    pthread_mutex_unlock(&gfs->gfs_raLock);
+}
+
+/* Read a range of blocks into the page cache */
+static void
+lc_readAheadBlocks(struct gfs *gfs, struct fs *fs, uint64_t block,
+                   uint32_t count) {
+    struct page **pages = alloca(count * sizeof(struct page *));
+    uint32_t i, pcount = 0, rcount;
+    struct page *page;
+
+    /* Skip pages already in the cache */
+    for (i = 0; i < count; i++) {
+        page = lc_getPageNewData(fs, block + i, NULL);
+        if (page->p_dvalid) {
+            lc_releasePage(gfs, fs, page, false, false);
+        } else {
+            pages[pcount++] = page;
+        }
+    }
+    if (pcount) {
+        rcount = lc_readPages(gfs, fs, pages, pcount);
+        for (i = 0; i < pcount; i++) {
+            lc_insertPageToFreeList(fs->fs_bcache, pages[i]);
+            lc_releasePage(gfs, fs, pages[i], false, false);
+        }
+        __sync_add_and_fetch(&gfs->gfs_raPages, rcount);
+    }
+}
+
+/* Background thread for reading ahead blocks of files read sequentially */
+void *
+lc_readAhead(void *data) {
+    struct gfs *gfs = (struct gfs *)data;
+    struct rarequest *req;
+    struct fs *fs;
+
+    lc_rcuRegister();
+    pthread_mutex_lock(&gfs->gfs_raLock);
+    while (!gfs->gfs_unmounting) {
+        req = gfs->gfs_raHead;
+        if (req == NULL) {
+            pthread_cond_wait(&gfs->gfs_raCond, &gfs->gfs_raLock);
+            continue;
+        }
+        gfs->gfs_raHead = req->rr_next;
+        if (gfs->gfs_raHead == NULL) {
+            gfs->gfs_raTail = NULL;
+        }
+        gfs->gfs_raCount--;
+        pthread_mutex_unlock(&gfs->gfs_raLock);
+
+        /* Skip the request if the layer is gone or being modified, or if
+         * memory is running low.
+         */
+        rcu_read_lock();
+        fs = rcu_dereference(gfs->gfs_fs[req->rr_gindex]);
+        if (fs && (fs->fs_root == req->rr_root) &&
+            lc_checkMemoryAvailable(false) && !lc_tryLock(fs, false)) {
+            rcu_read_unlock();
+            if (!fs->fs_removed && (fs->fs_gindex == req->rr_gindex)) {
+                lc_readAheadBlocks(gfs, fs, req->rr_block, req->rr_count);
+            }
+            lc_unlock(fs);
+        } else {
+            rcu_read_unlock();
+        }
+        lc_free(NULL, req, sizeof(struct rarequest), LC_MEMTYPE_GFS);
+        pthread_mutex_lock(&gfs->gfs_raLock);
+    }
+
+    /* Discard pending requests */
+    while (gfs->gfs_raHead) {
+        req = gfs->gfs_raHead;
+        gfs->gfs_raHead = req->rr_next;
+        gfs->gfs_raCount--;
+        lc_free(NULL, req, sizeof(struct rarequest), LC_MEMTYPE_GFS);
+    }
+    gfs->gfs_raTail = NULL;
+    pthread_mutex_unlock(&gfs->gfs_raLock);
+    return NULL;
+}
+
 /* Wakeup cleaner thread and wait for it to free up memory */
 void
 lc_wakeupCleaner(struct gfs *gfs, bool wait) {
@@ -960,35 +1561,115 @@ lc_wakeupCleaner(struct gfs *gfs, bool wait) {
 static uint64_t
 lc_purgeTreePages(struct gfs *gfs, struct fs *fs, uint64_t *blocks,
                   bool force) {
+    uint64_t count = 0, pcount = 0, scount, max, promoted = 0, demoted = 0;
+    uint64_t aevicted = 0, limit = LC_PAGE_PURGE_COUNT / LC_PCACHE_SHARDS;
     struct lbcache *lbcache = fs->fs_bcache;
     bool all = gfs->gfs_pcleaningForced;
-    uint64_t count = 0, pcount = 0;
-    struct page *page;
+    struct lbshard *shard;
+    struct page *page, *next;
+    uint32_t i;
 
     assert(fs->fs_parent == NULL);
 
-    if (lbcache->lb_fhead == NULL) {
+    if (lbcache->lb_pcount == 0) {
         return 0;
     }
 
-    /* Invalidate pages from the head of the free list */
-    pthread_mutex_lock(&lbcache->lb_flock);
-    page = lbcache->lb_fhead;
-    while (page && (pcount < LC_PAGE_PURGE_COUNT)) {
-        if ((page->p_block != LC_INVALID_BLOCK) &&
-            (all || (page->p_refCount == 0))) {
-            if (!all && page->p_hitCount) {
-                page->p_hitCount--;
+    /* Scan a few pages from every shard starting from where the last pass
+     * stopped.
+     */
+    for (i = 0; i < LC_PCACHE_SHARDS; i++) {
+        shard = &lbcache->lb_shards[lbcache->lb_shardNext];
+        lbcache->lb_shardNext = (lbcache->lb_shardNext + 1) % LC_PCACHE_SHARDS;
+        if ((shard->ls_phead == NULL) && (shard->ls_ahead == NULL)) {
+            continue;
+        }
+        scount = 0;
+        pthread_mutex_lock(&shard->ls_lock);
+
+        /* Evict pages from the head of the probation queue, promoting pages
+         * accessed again after those were added to the queue.
+         */
+        page = shard->ls_phead;
+        max = shard->ls_pcount;
+        while (page && max-- && (scount < limit)) {
+            next = page->p_fnext;
+            if ((page->p_block != LC_INVALID_BLOCK) &&
+                (all || (page->p_refCount == 0))) {
+                if (!all && (page->p_hitCount >= LC_PAGE_PROMOTE_HITS)) {
+                    lc_removePageFromQueue(shard, page);
+                    page->p_hitCount = 0;
+                    lc_insertPageToQueue(shard, page, LC_PAGE_PROTECTED);
+                    promoted++;
+                } else {
+                    blocks[pcount++] = page->p_block;
+                    scount++;
+                }
+            }
+            page = next;
+        }
+
+        /* Keep protected queue within its limit by demoting pages not
+         * accessed recently, giving a second chance to others.
+         */
+        max = shard->ls_acount;
+        while (shard->ls_ahead && max-- &&
+               ((shard->ls_acount * 100) >
+                ((shard->ls_acount + shard->ls_pcount) *
+                 LC_PAGE_PROTECTED_PCT))) {
+            page = shard->ls_ahead;
+            lc_removePageFromQueue(shard, page);
+            if (page->p_hitCount) {
+                page->p_hitCount = 0;
+                lc_insertPageToQueue(shard, page, LC_PAGE_PROTECTED);
             } else {
-                blocks[pcount++] = page->p_block;
+                lc_insertPageToQueue(shard, page, LC_PAGE_PROBATION);
+                demoted++;
+            }
+        }
+
+        /* Evict from protected queue if nothing could be evicted from the
+         * probation queue.
+         */
+        if (scount == 0) {
+            page = shard->ls_ahead;
+            max = shard->ls_acount;
+            while (page && max-- && (scount < limit)) {
+                next = page->p_fnext;
+                if ((page->p_block != LC_INVALID_BLOCK) &&
+                    (all || (page->p_refCount == 0))) {
+                    if (!all && page->p_hitCount) {
+                        lc_removePageFromQueue(shard, page);
+                        page->p_hitCount = 0;
+                        lc_insertPageToQueue(shard, page, LC_PAGE_PROTECTED);
+                    } else {
+                        blocks[pcount++] = page->p_block;
+                        scount++;
+                        aevicted++;
+                    }
+                }
+                page = next;
             }
         }
-        page = page->p_fnext;
+        pthread_mutex_unlock(&shard->ls_lock);
+    }
+    if (promoted) {
+        __sync_add_and_fetch(&gfs->gfs_ppromoted, promoted);
+    }
+    if (demoted) {
+        __sync_add_and_fetch(&gfs->gfs_pdemoted, demoted);
+    }
+    if (aevicted) {
+        __sync_add_and_fetch(&gfs->gfs_paevicted, aevicted);
     }
-    pthread_mutex_unlock(&lbcache->lb_flock);
     while (pcount && !fs->fs_removed) {
         count += lc_invalPage(gfs, fs, blocks[--pcount]);
     }
+
+    /* Shrink hash table if many pages are purged */
+    if (count && !fs->fs_removed) {
+        lc_pcacheShrink(fs);
+    }
     return count;
 }
 
@@ -1000,7 +1681,7 @@ lc_purgePages(struct gfs *gfs, bool force) {
     int i;
 
     gfs->gfs_pcleaning = true;
-    rcu_register_thread();
+    lc_rcuRegister();
 
 retry:
     rcu_read_lock();
@@ -1048,9 +1729,11 @@ retry:
     pthread_mutex_lock(&gfs->gfs_clock);
     pthread_cond_broadcast(&gfs->gfs_mcond);
     pthread_mutex_unlock(&gfs->gfs_clock);
-    rcu_unregister_thread();
     if (count) {
         gfs->gfs_purged += count;
+
+        /* Give memory of purged pages back to the system */
+        lc_memRelease();
     }
 }
 
@@ -14,13 +14,11 @@
 /* Initializes the block allocator */
 void
 lc_blockAllocatorInit(struct gfs *gfs, struct fs *fs) {
-    struct extent *extent;
 
     /* Initialize a space extent covering the whole device */
-    extent = lc_malloc(fs, sizeof(struct extent), LC_MEMTYPE_EXTENT);
-    lc_initExtent(gfs, extent, LC_EXTENT_SPACE, LC_START_BLOCK,
-                  0, gfs->gfs_super->sb_tblocks - LC_START_BLOCK, NULL);
-    gfs->gfs_extents = extent;
+    gfs->gfs_space = lc_spaceInit(fs, true);
+    lc_spaceAdd(fs, gfs->gfs_space, LC_START_BLOCK,
+                gfs->gfs_super->sb_tblocks - LC_START_BLOCK);
     gfs->gfs_blocksReserved = (gfs->gfs_super->sb_tblocks *
                                LC_RESERVED_BLOCKS) / 100ul;
 }
@@ -50,11 +48,11 @@ lc_reclaimSpace(struct gfs *gfs) {
     struct fs *fs;
     int i;
 
-    if (gfs->gfs_fextents) {
+    if (lc_spaceCount(gfs->gfs_fextents)) {
         lc_layerChanged(gfs, false, true);
         queued = true;
     }
-    rcu_register_thread();
+    lc_rcuRegister();
     rcu_read_lock();
     for (i = 0; i <= gfs->gfs_scount; i++) {
         fs = rcu_dereference(gfs->gfs_fs[i]);
@@ -83,7 +81,6 @@ lc_reclaimSpace(struct gfs *gfs) {
         }
     }
     rcu_read_unlock();
-    rcu_unregister_thread();
     return count;
 }
 
@@ -120,14 +117,46 @@ lc_addSpaceExtent(struct gfs *gfs, struct fs *fs, struct extent **extents,
     lc_addExtent(gfs, fs, extents, start, 0, count, sort);
 }
 
-/* Allocate from a free list of extents */
+/* Track an extent allocated in a layer */
+static void
+lc_addAllocatedExtent(struct fs *fs, uint64_t block, uint64_t count) {
+    if (fs->fs_aextents == NULL) {
+        fs->fs_aextents = lc_spaceInit(fs, false);
+    }
+    lc_spaceAdd(fs, fs->fs_aextents, block, count);
+}
+
+/* Track an extent freed from layers, not to be reused until next commit */
+static void
+lc_addGlobalFreedExtent(struct gfs *gfs, struct fs *rfs, uint64_t block,
+                        uint64_t count) {
+    if (gfs->gfs_fextents == NULL) {
+        gfs->gfs_fextents = lc_spaceInit(rfs, false);
+    }
+    lc_spaceAdd(rfs, gfs->gfs_fextents, block, count);
+}
+
+/* Allocate from the free list of extents of the layer or from the global
+ * free space map.
+ */
 static uint64_t
 lc_allocateBlock(struct gfs *gfs, struct fs *fs, uint64_t count, bool layer) {
     struct extent *extent, **prev;
     uint64_t block;
     bool release;
 
-    prev = layer ? &fs->fs_extents : &gfs->gfs_extents;
+    if (!layer) {
+        block = lc_spaceAlloc(lc_getGlobalFs(gfs), gfs->gfs_space, count);
+        if (block != LC_INVALID_BLOCK) {
+
+            /* Update global usage */
+            gfs->gfs_super->sb_blocks += count;
+            assert(gfs->gfs_super->sb_tblocks > gfs->gfs_super->sb_blocks);
+            assert(block < gfs->gfs_super->sb_tblocks);
+        }
+        return block;
+    }
+    prev = &fs->fs_extents;
     extent = *prev;
     while (extent) {
         if (lc_getExtentCount(extent) >= count) {
@@ -142,23 +171,14 @@ lc_allocateBlock(struct gfs *gfs, struct fs *fs, uint64_t count, bool layer) {
                 lc_incrExtentStart(NULL, extent, count);
             }
 
-            if (layer) {
-
-                /* Update reserved pool and register this extent in the
-                 * allocated list of extents.
-                 */
-                assert(fs->fs_reservedBlocks >= count);
-                fs->fs_reservedBlocks -= count;
-                if (fs != lc_getGlobalFs(gfs)) {
-                    lc_addSpaceExtent(gfs, fs, &fs->fs_aextents, block,
-                                      count, true);
-                    fs->fs_blocks += count;
-                }
-            } else {
-
-                /* Update global usage */
-                gfs->gfs_super->sb_blocks += count;
-                assert(gfs->gfs_super->sb_tblocks > gfs->gfs_super->sb_blocks);
+            /* Update reserved pool and register this extent in the
+             * allocated list of extents.
+             */
+            assert(fs->fs_reservedBlocks >= count);
+            fs->fs_reservedBlocks -= count;
+            if (fs != lc_getGlobalFs(gfs)) {
+                lc_addAllocatedExtent(fs, block, count);
+                fs->fs_blocks += count;
             }
             assert(block < gfs->gfs_super->sb_tblocks);
             return block;
@@ -198,8 +218,7 @@ lc_findFreeBlock(struct gfs *gfs, struct fs *fs,
             if (fs != rfs) {
 
                 /* Track the allocated space for the layer */
-                lc_addSpaceExtent(gfs, fs, &fs->fs_aextents, block, count,
-                                  true);
+                lc_addAllocatedExtent(fs, block, count);
                 lc_markExtentsDirty(rfs);
             }
             fs->fs_blocks += count;
@@ -250,49 +269,62 @@ lc_freeExtentBlocks(struct gfs *gfs, struct fs *fs, uint64_t block,
     }
     assert(gfs->gfs_super->sb_blocks >= count);
     gfs->gfs_super->sb_blocks -= count;
-    lc_addSpaceExtent(gfs, fs, &gfs->gfs_fextents, block, count, true);
+    lc_addGlobalFreedExtent(gfs, fs, block, count);
     if (lock) {
         pthread_mutex_unlock(&gfs->gfs_alock);
         lc_markExtentsDirty(fs);
     }
 }
 
+/* Add an extent to the blocks being prepared for writing extents to disk */
+static void
+lc_addDiskExtent(struct gfs *gfs, struct fs *rfs, struct dextentBlock **eblock,
+                 struct page **page, uint64_t *count, uint64_t *pcount,
+                 uint64_t start, uint64_t ecount) {
+    struct dextent *dextent;
+
+    /* Start a new block if the current one is full */
+    if (*count >= LC_EXTENT_BLOCK) {
+        if (*eblock) {
+            *page = lc_getPageNoBlock(gfs, rfs, (char *)*eblock, *page);
+        }
+        lc_mallocBlockAligned(rfs, (void **)eblock, LC_MEMTYPE_DATA);
+        (*pcount)++;
+        *count = 0;
+    }
+    dextent = &(*eblock)->de_extents[(*count)++];
+    dextent->de_start = start;
+    dextent->de_count = ecount;
+}
+
+/* Allocate page for the last block of extents being written to disk */
+static struct page *
+lc_finishDiskExtents(struct gfs *gfs, struct fs *rfs,
+                     struct dextentBlock *eblock, struct page *page,
+                     uint64_t count) {
+    if (eblock) {
+        if (count < LC_EXTENT_BLOCK) {
+            eblock->de_extents[count].de_start = 0;
+        }
+        page = lc_getPageNoBlock(gfs, rfs, (char *)eblock, page);
+    }
+    return page;
+}
+
 /* Perform requested actions on the extent list */
 uint64_t
 lc_blockFreeExtents(struct gfs *gfs, struct fs *fs, struct extent *extents,
                     uint8_t flags) {
-    bool flush = flags & LC_EXTENT_FLUSH, efree = flags & LC_EXTENT_EFREE;
-    uint64_t count = LC_EXTENT_BLOCK, pcount = 0, block, freed = 0;
-    struct fs *rfs = flush ? lc_getGlobalFs(gfs) : NULL;
-    struct extent *extent = extents, *tmp;
-    bool free = !(flags & LC_EXTENT_KEEP);
-    bool layer = flags & LC_EXTENT_LAYER;
+    bool efree = flags & LC_EXTENT_EFREE, layer = flags & LC_EXTENT_LAYER;
     bool reuse = flags & LC_EXTENT_REUSE;
-    struct dextentBlock *eblock = NULL;
-    struct page *page = NULL;
-    uint64_t estart, ecount;
-    struct dextent *dextent;
-    struct super *super;
+    struct extent *extent = extents, *tmp;
+    uint64_t estart, ecount, freed = 0;
 
     while (extent) {
         tmp = extent;
         assert(extent->ex_type == LC_EXTENT_SPACE);
         lc_validateExtent(gfs, extent);
-        if (flush) {
-
-            /* Add this extent to the disk block */
-            if (count >= LC_EXTENT_BLOCK) {
-                if (eblock) {
-                    page = lc_getPageNoBlock(gfs, rfs, (char *)eblock, page);
-                }
-                lc_mallocBlockAligned(rfs, (void **)&eblock, LC_MEMTYPE_DATA);
-                pcount++;
-                count = 0;
-            }
-            dextent = &eblock->de_extents[count++];
-            dextent->de_start = lc_getExtentStart(extent);
-            dextent->de_count = lc_getExtentCount(extent);
-        } else if (efree) {
+        if (efree) {
 
             /* Free extent blocks */
             estart = lc_getExtentStart(extent);
@@ -301,50 +333,66 @@ lc_blockFreeExtents(struct gfs *gfs, struct fs *fs, struct extent *extents,
             lc_blockFree(gfs, fs, estart, ecount, layer, reuse);
         }
         extent = extent->ex_next;
-
-        /* Free the extent structure unless requested not to do so */
-        if (free) {
-            lc_free(fs, tmp, sizeof(struct extent), LC_MEMTYPE_EXTENT);
-        }
-    }
-
-    /* Allocate page for the last block */
-    if (eblock) {
-        if (count < LC_EXTENT_BLOCK) {
-            eblock->de_extents[count].de_start = 0;
-        }
-        page = lc_getPageNoBlock(gfs, rfs, (char *)eblock, page);
+        lc_free(fs, tmp, sizeof(struct extent), LC_MEMTYPE_EXTENT);
     }
+    return freed;
+}
 
-    /* Write out the allocated/free extent info to disk */
-    if (flush) {
-        assert(pcount);
-        if (layer) {
-            super = fs->fs_super;
-            if (super->sb_extentCount) {
-                lc_freeExtentBlocks(gfs, rfs, super->sb_extentBlock,
-                                    super->sb_extentCount, false);
-            }
+/* Write a map of extents to disk, either the global map of free space or
+ * the map of extents allocated in a layer.
+ */
+static void
+lc_flushSpaceMap(struct gfs *gfs, struct fs *fs, struct spacemap *space,
+                 bool layer) {
+    uint64_t count = LC_EXTENT_BLOCK, pcount = 0, block;
+    struct fs *rfs = lc_getGlobalFs(gfs);
+    struct dextentBlock *eblock = NULL;
+    struct fextent *fextent;
+    struct page *page = NULL;
+    struct super *super;
 
-            /* Allocate a new block */
-            block = lc_blockAllocExact(rfs, pcount, true, false);
-            super->sb_extentBlock = block;
-            super->sb_extentCount = pcount;
-            lc_printf("Syncing allocated map layer %d block %ld count %ld\n",
-                      fs->fs_gindex, block, pcount);
-        } else {
+    fextent = lc_spaceFirst(space);
+    while (fextent) {
+        lc_addDiskExtent(gfs, rfs, &eblock, &page, &count, &pcount,
+                         fextent->fe_start, fextent->fe_count);
+        fextent = lc_spaceNext(fextent);
+    }
 
-            /* Use the pre-allocated block */
-            block = gfs->gfs_super->sb_extentBlock;
-            assert(block != LC_INVALID_BLOCK);
-            lc_printf("Syncing free extent map to block %ld count %ld\n",
-                      block, pcount);
+    /* Write an empty block if all blocks allocated in the layer are freed, so
+     * that the stale map on disk is not read back.
+     */
+    if (eblock == NULL) {
+        assert(layer);
+        lc_mallocBlockAligned(rfs, (void **)&eblock, LC_MEMTYPE_DATA);
+        pcount++;
+        count = 0;
+    }
+    page = lc_finishDiskExtents(gfs, rfs, eblock, page, count);
+    assert(pcount);
+    if (layer) {
+        super = fs->fs_super;
+        if (super->sb_extentCount) {
+            lc_freeExtentBlocks(gfs, rfs, super->sb_extentBlock,
+                                super->sb_extentCount, false);
         }
 
-        /* Queue write of newly created pages */
-        lc_flushExtentPages(gfs, rfs, page, pcount, block);
+        /* Allocate a new block */
+        block = lc_blockAllocExact(rfs, pcount, true, false);
+        super->sb_extentBlock = block;
+        super->sb_extentCount = pcount;
+        lc_printf("Syncing allocated map layer %d block %ld count %ld\n",
+                  fs->fs_gindex, block, pcount);
+    } else {
+
+        /* Use the pre-allocated block */
+        block = gfs->gfs_super->sb_extentBlock;
+        assert(block != LC_INVALID_BLOCK);
+        lc_printf("Syncing free extent map to block %ld count %ld\n",
+                  block, pcount);
     }
-    return freed;
+
+    /* Queue write of newly created pages */
+    lc_flushExtentPages(gfs, rfs, page, pcount, block);
 }
 
 /* Read extents list */
@@ -354,8 +402,8 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
     struct fs *rfs = lc_getGlobalFs(gfs);
     bool allocated = (fs != rfs);
     struct dextentBlock *eblock;
+    struct spacemap *space;
     struct dextent *dextent;
-    struct extent **extents;
     int i;
 
     block = fs->fs_super->sb_extentBlock;
@@ -367,7 +415,12 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
         assert(fs->fs_super->sb_flags & LC_SUPER_DIRTY);
         return;
     }
-    extents = allocated ? &fs->fs_aextents : &gfs->gfs_extents;
+    space = lc_spaceInit(fs, !allocated);
+    if (allocated) {
+        fs->fs_aextents = space;
+    } else {
+        gfs->gfs_space = space;
+    }
     lc_mallocBlockAligned(fs, (void **)&eblock, LC_MEMTYPE_BLOCK);
     while (block != LC_INVALID_BLOCK) {
         //lc_printf("Reading extents from block %ld\n", block);
@@ -382,8 +435,7 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
             if ((dextent->de_start == 0) || (dextent->de_count == 0)) {
                 break;
             }
-            lc_addSpaceExtent(gfs, fs, extents, dextent->de_start,
-                              dextent->de_count, true);
+            lc_spaceAdd(fs, space, dextent->de_start, dextent->de_count);
             count += dextent->de_count;
         }
         block = eblock->de_next;
@@ -391,7 +443,7 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
     }
     assert((ecount == fs->fs_super->sb_extentCount) ||
            (!allocated && (ecount < fs->fs_super->sb_extentCount)));
-    lc_free(fs, eblock, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    lc_freeBlockAligned(fs, eblock, LC_MEMTYPE_BLOCK);
     if (allocated) {
         fs->fs_blocks = count;
         lc_printf("Total blocks in use in layer %ld\n", fs->fs_blocks);
@@ -419,7 +471,7 @@ lc_freeLayerExtent(struct gfs *gfs, struct fs *fs, struct fs *rfs,
 
         /* Find the portion of the extent which is allocated in the layer */
         pthread_mutex_lock(&fs->fs_alock);
-        freed = lc_removeExtent(fs, &fs->fs_aextents, block, count);
+        freed = lc_spaceRemove(fs, fs->fs_aextents, block, count);
         pthread_mutex_unlock(&fs->fs_alock);
         if (freed) {
             lc_freeExtentBlocks(gfs, rfs, block, freed, true);
@@ -527,9 +579,11 @@ lc_blockFree(struct gfs *gfs, struct fs *fs, uint64_t block,
 
         /* Add blocks back to the global free list */
         pthread_mutex_lock(&gfs->gfs_alock);
-        lc_addSpaceExtent(gfs, rfs,
-                          reuse ? &gfs->gfs_extents : &gfs->gfs_fextents,
-                          block, count, true);
+        if (reuse) {
+            lc_spaceAdd(rfs, gfs->gfs_space, block, count);
+        } else {
+            lc_addGlobalFreedExtent(gfs, rfs, block, count);
+        }
         assert(gfs->gfs_super->sb_blocks >= count);
         gfs->gfs_super->sb_blocks -= count;
         pthread_mutex_unlock(&gfs->gfs_alock);
@@ -545,28 +599,38 @@ lc_blockFree(struct gfs *gfs, struct fs *fs, uint64_t block,
 static void
 lc_flushAllocatedExtents(struct gfs *gfs, struct fs *fs,
                          bool unmount, bool remove, bool flush) {
-    struct extent *extent = fs->fs_aextents;
-    int flags = flush ? LC_EXTENT_KEEP : 0;
+    struct spacemap *space = fs->fs_aextents;
     bool release = unmount || remove;
-    uint64_t freed;
+    struct fextent *fextent;
+    uint64_t freed = 0;
 
-    if (remove) {
-        flags |= LC_EXTENT_EFREE;
-    } else if (fs->fs_extentsDirty) {
-        flags |= LC_EXTENT_FLUSH | LC_EXTENT_LAYER;
-        lc_markSuperDirty(fs);
-    } else if (!unmount) {
+    assert(flush == !release);
+    if (!remove && !fs->fs_extentsDirty && !unmount) {
         return;
     }
     if (release) {
 
         /* Reset this so that extents being freed will not be consulted with
-         * this list again.
+         * this map again.
          */
         fs->fs_aextents = NULL;
     }
-    freed = lc_blockFreeExtents(gfs, fs, extent, flags);
+    if (remove) {
+
+        /* Free all blocks allocated in the layer */
+        fextent = lc_spaceFirst(space);
+        while (fextent) {
+            freed += fextent->fe_count;
+            lc_blockFree(gfs, fs, fextent->fe_start, fextent->fe_count,
+                         false, false);
+            fextent = lc_spaceNext(fextent);
+        }
+    } else if (fs->fs_extentsDirty) {
+        lc_markSuperDirty(fs);
+        lc_flushSpaceMap(gfs, fs, space, true);
+    }
     if (release) {
+        lc_spaceDeinit(fs, space);
         fs->fs_freed += freed;
     }
     fs->fs_extentsDirty = false;
@@ -712,35 +776,24 @@ lc_countExtents(struct gfs *gfs, struct extent *extent, uint64_t *bcount) {
 void
 lc_processFreeExtents(struct gfs *gfs, struct fs *fs, bool umount) {
     uint64_t count, pcount, block = LC_INVALID_BLOCK, bcount = 0;
-    bool release, flush = fs->fs_extentsDirty;
-    struct extent *extent, **prev;
+    struct spacemap *fspace = gfs->gfs_fextents;
+    bool flush = fs->fs_extentsDirty;
+    struct fextent *fextent;
 
     if (flush) {
 
         /* Count the number of free extents to find number of blocks needed */
-        count = lc_countExtents(gfs, gfs->gfs_extents, &bcount);
-        count += lc_countExtents(gfs, gfs->gfs_fextents, &bcount);
+        count = lc_spaceCount(gfs->gfs_space) + lc_spaceCount(fspace);
+        bcount = gfs->gfs_space->sm_blocks;
+        if (fspace) {
+            bcount += fspace->sm_blocks;
+        }
         pcount = (count + LC_EXTENT_BLOCK - 1) / LC_EXTENT_BLOCK;
         assert(pcount);
 
         /* Allocate blocks for storing free space extents */
         /* XXX Make sure space exists for tracking free space extents */
-        prev = &gfs->gfs_extents;
-        extent = gfs->gfs_extents;
-        while (extent) {
-            if (lc_getExtentCount(extent) >= pcount) {
-                block = lc_getExtentStart(extent);
-                release = lc_decrExtentCount(gfs, extent, pcount);
-                if (release) {
-                    lc_freeExtent(gfs, fs, extent, prev, true);
-                } else {
-                    lc_incrExtentStart(NULL, extent, pcount);
-                }
-                break;
-            }
-            prev = &extent->ex_next;
-            extent = extent->ex_next;
-        }
+        block = lc_spaceAlloc(fs, gfs->gfs_space, pcount);
         assert(block != LC_INVALID_BLOCK);
         assert((block + pcount) < gfs->gfs_super->sb_tblocks);
         gfs->gfs_super->sb_blocks += pcount;
@@ -759,23 +812,25 @@ lc_processFreeExtents(struct gfs *gfs, struct fs *fs, bool umount) {
     }
 
     /* Transfer all the extents freed so far */
-    prev = &gfs->gfs_fextents;
-    extent = gfs->gfs_fextents;
-    while (extent) {
-        lc_addSpaceExtent(gfs, fs, &gfs->gfs_extents,
-                          lc_getExtentStart(extent), lc_getExtentCount(extent),
-                          true);
-        *prev = extent->ex_next;
-        lc_free(fs, extent, sizeof(struct extent), LC_MEMTYPE_EXTENT);
-        extent = *prev;
-    }
-
-    /* Flush global list of free extents to disk */
-    lc_blockFreeExtents(gfs, fs, gfs->gfs_extents,
-                        (umount ? 0 : LC_EXTENT_KEEP) |
-                        (flush ? LC_EXTENT_FLUSH : 0));
+    fspace = gfs->gfs_fextents;
+    if (fspace) {
+        fextent = lc_spaceFirst(fspace);
+        while (fextent) {
+            lc_spaceAdd(fs, gfs->gfs_space, fextent->fe_start,
+                        fextent->fe_count);
+            fextent = lc_spaceNext(fextent);
+        }
+        lc_spaceDeinit(fs, fspace);
+        gfs->gfs_fextents = NULL;
+    }
+
+    /* Flush global map of free extents to disk */
+    if (flush) {
+        lc_flushSpaceMap(gfs, fs, gfs->gfs_space, false);
+    }
     if (umount) {
-        gfs->gfs_extents = NULL;
+        lc_spaceDeinit(fs, gfs->gfs_space);
+        gfs->gfs_space = NULL;
     }
     if (flush) {
         fs->fs_extentsDirty = false;
@@ -804,8 +859,7 @@ lc_grow(struct gfs *gfs) {
     lc_lockExclusive(fs);
     pthread_mutex_lock(&gfs->gfs_alock);
     super->sb_tblocks = block;
-    lc_addSpaceExtent(gfs, fs, &gfs->gfs_extents, oblock, block - oblock,
-                      true);
+    lc_spaceAdd(fs, gfs->gfs_space, oblock, block - oblock);
     gfs->gfs_blocksReserved = (super->sb_tblocks * LC_RESERVED_BLOCKS) / 100ul;
     pthread_mutex_unlock(&gfs->gfs_alock);
     lc_markExtentsDirty(fs);
@@ -97,6 +97,15 @@ cmd_group lcfs_cmd_group[] = {
         2,
         cmd_ioctl
     },
+    {
+        "icache",
+        "Adjust memory limit for metadata of image layers (default none)",
+        "<mnt> <limit>",
+        "\tmnt     - mount point\n"
+        "\tlimit   - memory limit in MB, 0 for no limit (default 0)\n",
+        2,
+        cmd_ioctl
+    },
     {
         "flush",
         "Release pages not in use",
@@ -20,7 +20,7 @@ usage(char *prog) {
 #ifndef __MUSL__
                        " [-p]"
 #endif
-                       " [-f] [-c] [-d] [-m] [-r] [-t] [-s] [-v]\n",
+                       " [-f] [-c] [-d] [-m] [-r] [-t] [-s] [-v] [-b] [-g]\n",
                        prog);
     lc_syslog(LOG_ERR, "\tdevice        - device or file - image layers"
                        " will be saved here\n"
@@ -37,7 +37,11 @@ usage(char *prog) {
                     "\t-p            - enable profiling (optional)\n"
 #endif
                     "\t-s            - swap layers when committed\n"
-                    "\t-v            - enable verbose mode (optional)\n");
+                    "\t-v            - enable verbose mode (optional)\n"
+                    "\t-b            - use host page cache for device I/O"
+                                       " (optional)\n"
+                    "\t-g            - use huge pages for data buffers"
+                                       " (optional)\n");
 }
 
 /* Notify parent process completion */
@@ -104,25 +108,50 @@ lc_stopSession(struct gfs *gfs, struct fuse_session *se, enum lc_mountId id) {
 static void *
 lc_startThreads(void *data) {
     struct gfs *gfs = (struct gfs *)data;
-    pthread_t flusher, syncer;
-    int err;
+    pthread_t flusher, syncer, readahead[LC_RA_THREADS];
+    pthread_t flushers[LC_FLUSH_THREADS];
+    int i, err;
 
-    /* Start a thread to flush dirty pages */
+    /* Start a thread to find layers with too many dirty pages */
     err = pthread_create(&flusher, NULL, lc_flusher, gfs);
     assert(err == 0);
 
+    /* Start threads to flush dirty pages of layers */
+    for (i = 0; i < LC_FLUSH_THREADS; i++) {
+        err = pthread_create(&flushers[i], NULL, lc_flushWorker, gfs);
+        assert(err == 0);
+    }
+
     /* Start a thread to checkpoint file system periodically */
     err = pthread_create(&syncer, NULL, lc_syncer, gfs);
     assert(err == 0);
 
+    /* Start threads to read ahead files read sequentially */
+    for (i = 0; i < LC_RA_THREADS; i++) {
+        err = pthread_create(&readahead[i], NULL, lc_readAhead, gfs);
+        assert(err == 0);
+    }
+
     /* Flush and purge pages in the background */
     lc_cleaner();
 
-    /* Wait for flusher and syncer to exit */
+    /* Wait for flusher, syncer and readahead threads to exit */
     pthread_cond_signal(&gfs->gfs_flusherCond);
     pthread_cond_signal(&gfs->gfs_syncerCond);
+    pthread_mutex_lock(&gfs->gfs_flock);
+    pthread_cond_broadcast(&gfs->gfs_flushWorkCond);
+    pthread_mutex_unlock(&gfs->gfs_flock);
+    pthread_mutex_lock(&gfs->gfs_raLock);
+    pthread_cond_broadcast(&gfs->gfs_raCond);
+    pthread_mutex_unlock(&gfs->gfs_raLock);
     pthread_join(syncer, NULL);
     pthread_join(flusher, NULL);
+    for (i = 0; i < LC_FLUSH_THREADS; i++) {
+        pthread_join(flushers[i], NULL);
+    }
+    for (i = 0; i < LC_RA_THREADS; i++) {
+        pthread_join(readahead[i], NULL);
+    }
     return NULL;
 }
 
@@ -314,6 +343,7 @@ lc_start(struct gfs *gfs, char *device, enum lc_mountId id) {
 int
 lcfs_main(char *pgm, int argc, char *argv[]) {
     bool daemon = true, format = false, ftypes = false, swap = false;
+    bool direct = true;
     int i, err = -1, waiter[2], fd, count;
     char *arg[argc + 1], completed;
     struct fuse_session *se;
@@ -353,8 +383,42 @@ lcfs_main(char *pgm, int argc, char *argv[]) {
         exit(errno);
     }
 
+    count = 4;
+    for (i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "-m")) {
+            lc_memStatsEnable();
+        } else if (!strcmp(argv[i], "-c")) {
+            format = true;
+        } else if (!strcmp(argv[i], "-r")) {
+            lc_statsEnable();
+        } else if (!strcmp(argv[i], "-t")) {
+            ftypes = true;
+#ifndef __MUSL__
+        } else if (!strcmp(argv[i], "-p")) {
+            profiling = true;
+#endif
+        } else if (!strcmp(argv[i], "-s")) {
+            swap = true;
+        } else if (!strcmp(argv[i], "-v")) {
+            lc_verbose = true;
+        } else if (!strcmp(argv[i], "-b")) {
+            direct = false;
+        } else if (!strcmp(argv[i], "-g")) {
+            lc_memHugePagesEnable();
+        } else {
+            if (!strcmp(argv[i], "-f") ||
+                !strcmp(argv[i], "-d")) {
+                daemon = false;
+            }
+            arg[count++] = argv[i];
+        }
+    }
+    for (i = count; i < argc; i++) {
+        arg[i] = NULL;
+    }
+
     /* Open the device for mounting */
-    fd = lc_deviceOpen(argv[1]);
+    fd = lc_deviceOpen(argv[1], &direct);
     if (fd == -1) {
         perror("open");
         lc_syslog(LOG_ERR, "Failed to open %s\n", argv[1]);
@@ -389,36 +453,6 @@ lcfs_main(char *pgm, int argc, char *argv[]) {
         exit(EINVAL);
     }
 
-    count = 4;
-    for (i = 4; i < argc; i++) {
-        if (!strcmp(argv[i], "-m")) {
-            lc_memStatsEnable();
-        } else if (!strcmp(argv[i], "-c")) {
-            format = true;
-        } else if (!strcmp(argv[i], "-r")) {
-            lc_statsEnable();
-        } else if (!strcmp(argv[i], "-t")) {
-            ftypes = true;
-#ifndef __MUSL__
-        } else if (!strcmp(argv[i], "-p")) {
-            profiling = true;
-#endif
-        } else if (!strcmp(argv[i], "-s")) {
-            swap = true;
-        } else if (!strcmp(argv[i], "-v")) {
-            lc_verbose = true;
-        } else {
-            if (!strcmp(argv[i], "-f") ||
-                !strcmp(argv[i], "-d")) {
-                daemon = false;
-            }
-            arg[count++] = argv[i];
-        }
-    }
-    for (i = count; i < argc; i++) {
-        arg[i] = NULL;
-    }
-
     /* Fork a new process if run in background mode */
     if (daemon) {
         err = pipe(waiter);
@@ -462,6 +496,10 @@ lcfs_main(char *pgm, int argc, char *argv[]) {
     gfs->gfs_profiling = profiling;
 #endif
     gfs->gfs_swapLayersForCommit = swap;
+    gfs->gfs_directIO = direct;
+    if (!direct) {
+        lc_syslog(LOG_INFO, "Using buffered I/O on %s\n", argv[1]);
+    }
 
     /* Setup arguments for fuse mount */
     arg[0] = pgm;
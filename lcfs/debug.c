@@ -26,18 +26,19 @@ lc_copyExtents(struct gfs *gfs, struct fs *fs, struct extent *src,
 static void
 lc_checkExtent(struct gfs *gfs, struct fs *fs, struct fs *rfs,
                uint64_t block, uint64_t count, struct extent **extents) {
-    struct extent *extent = fs->fs_aextents;
     uint64_t estart, ecount, found;
+    struct fextent *extent;
 
-    assert(extent);
+    assert(lc_spaceCount(fs->fs_aextents));
+    extent = lc_spaceFirst(fs->fs_aextents);
     while (count) {
         found = 1;
         while (extent) {
-            estart = lc_getExtentStart(extent);
+            estart = extent->fe_start;
             if (block < estart) {
                 break;
             }
-            ecount = lc_getExtentCount(extent);
+            ecount = extent->fe_count;
             if (block < (estart + ecount)) {
                 found = (estart + ecount) - block;
                 if (found > count) {
@@ -46,7 +47,7 @@ lc_checkExtent(struct gfs *gfs, struct fs *fs, struct fs *rfs,
                 lc_addSpaceExtent(gfs, rfs, extents, block, found, true);
                 break;
             }
-            extent = extent->ex_next;
+            extent = lc_spaceNext(extent);
         }
         block += found;
         count -= found;
@@ -62,10 +63,12 @@ lc_findAllocatedBlocks(struct gfs *gfs, struct fs *fs, struct fs *rfs,
     struct inode *inode;
     int i;
 
+    lc_icacheRehashDone(fs);
     for (i = 0; (i < fs->fs_icacheSize) && (count < icount); i++) {
         inode = fs->fs_icache[i].ic_head;
         while (inode) {
             count++;
+            lc_inodeLoad(inode);
             if (inode->i_private) {
                 if (inode->i_extentLength) {
                     lc_addSpaceExtent(gfs, rfs, extents, inode->i_extentBlock,
@@ -107,13 +110,17 @@ lc_findAllocatedBlocks(struct gfs *gfs, struct fs *fs, struct fs *rfs,
 static void
 lc_validateAllocatedBlocks(struct gfs *gfs, struct fs *fs, struct fs *rfs,
                            struct extent *extent, struct extent **extents) {
-    struct extent *aextent = fs->fs_aextents, *tmp;
+    struct fextent *aextent = NULL;
+    struct extent *tmp;
 
+    if (fs->fs_aextents) {
+        aextent = lc_spaceFirst(fs->fs_aextents);
+    }
     while (extent) {
         if (aextent) {
-            assert(lc_getExtentStart(extent) == lc_getExtentStart(aextent));
-            assert(lc_getExtentCount(extent) == lc_getExtentCount(aextent));
-            aextent = aextent->ex_next;
+            assert(lc_getExtentStart(extent) == aextent->fe_start);
+            assert(lc_getExtentCount(extent) == aextent->fe_count);
+            aextent = lc_spaceNext(aextent);
         }
         lc_addSpaceExtent(gfs, rfs, extents, lc_getExtentStart(extent),
                           lc_getExtentCount(extent), true);
@@ -129,6 +136,7 @@ void
 lc_validate(struct gfs *gfs) {
     struct extent *extents = NULL, *lextents, *rextents = NULL;
     struct fs *fs, *rfs = lc_getGlobalFs(gfs);
+    struct fextent *fextent;
     struct super *super;
     int i;
 
@@ -168,7 +176,12 @@ lc_validate(struct gfs *gfs) {
     /* Add all the free blocks and there should be a single extent covering the
      * whole file system.
      */
-    lc_copyExtents(gfs, rfs, gfs->gfs_extents, &extents, NULL);
+    fextent = lc_spaceFirst(gfs->gfs_space);
+    while (fextent) {
+        lc_addSpaceExtent(gfs, rfs, &extents, fextent->fe_start,
+                          fextent->fe_count, true);
+        fextent = lc_spaceNext(fextent);
+    }
     assert(extents->ex_next == NULL);
     assert(lc_getExtentStart(extents) == LC_START_BLOCK);
     assert(lc_getExtentCount(extents) ==
@@ -39,7 +39,7 @@ lc_addFile(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
     }
 
     /* Create a new entry and add at the end of the list */
-    cfile = lc_malloc(fs, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+    cfile = lc_arenaAlloc(fs, sizeof(struct cfile), LC_MEMTYPE_CFILE);
     cfile->cf_type = ctype;
     cfile->cf_name = name;
     cfile->cf_len = len;
@@ -47,6 +47,47 @@ lc_addFile(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
     *prev = cfile;
 }
 
+/* Compare a hash list of a directory with the same list in the parent layer.
+ * Entries in both lists are sorted on name hash and index among entries with
+ * the same hash, and entries copied from the parent layer keep those.
+ */
+static void
+lc_processHashList(struct fs *fs, struct dirent *dirent,
+                   struct dirent *pdirent, ino_t lastIno, struct cdir *cdir) {
+    uint64_t key, pkey;
+    bool renamed;
+
+    while (dirent || pdirent) {
+        key = dirent ? (((uint64_t)dirent->di_hash << 32) | dirent->di_index) :
+                       UINT64_MAX;
+        pkey = pdirent ? (((uint64_t)pdirent->di_hash << 32) |
+                          pdirent->di_index) : UINT64_MAX;
+        renamed = (pkey == key) &&
+                  ((dirent->di_ino != pdirent->di_ino) ||
+                   (dirent->di_size != pdirent->di_size) ||
+                   strcmp(pdirent->di_name, dirent->di_name));
+
+        /* Entries present only in the parent layer were removed and entries
+         * present only in the layer were added.
+         */
+        if ((pkey < key) || renamed) {
+            lc_addName(fs, cdir, pdirent->di_ino, pdirent->di_name,
+                       pdirent->di_mode, pdirent->di_size, lastIno,
+                       LC_REMOVED);
+        }
+        if ((key < pkey) || renamed) {
+            lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
+                       dirent->di_mode, dirent->di_size, lastIno, LC_ADDED);
+        }
+        if (pkey <= key) {
+            pdirent = lc_dirNext(pdirent);
+        }
+        if (key <= pkey) {
+            dirent = lc_dirNext(dirent);
+        }
+    }
+}
+
 /* Compare directory entries with parent layer and populate the change list
  * with changes in the directory.
  */
@@ -55,7 +96,8 @@ lc_processDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
                     ino_t lastIno, struct cdir *cdir) {
     struct dirent *dirent, *pdirent, *fdirent, *ldirent, *adirent;
     bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    int i, max;
+    struct dover *dover;
+    uint32_t i;
 
     assert(dir->i_fs == fs);
     assert(dir->i_fs != pdir->i_fs);
@@ -65,69 +107,85 @@ lc_processDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
         return;
     }
 
-    /* Traverse parent directory entries looking for missing entries */
+    /* Changes are tracked if the directory still shares entries */
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        for (i = 0; i < dover->do_rcount; i++) {
+            pdirent = dover->do_removed[i];
+            lc_addName(fs, cdir, pdirent->di_ino, pdirent->di_name,
+                       pdirent->di_mode, pdirent->di_size, lastIno,
+                       LC_REMOVED);
+        }
+        dirent = dover->do_added;
+        while (dirent) {
+            lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
+                       dirent->di_mode, dirent->di_size, lastIno, LC_ADDED);
+            dirent = lc_dirNext(dirent);
+        }
+        return;
+    }
+
+    /* Compare hash lists one by one in hashed directories */
     if (hashed) {
         assert(pdir->i_flags & LC_INODE_DHASHED);
-        max = LC_DIRCACHE_SIZE;
-    } else {
-        assert(!(pdir->i_flags & LC_INODE_DHASHED));
-        max = 1;
-    }
-    for (i = 0; i < max; i++) {
-        if (hashed) {
-            pdirent = pdir->i_hdirent[i];
-            dirent = dir->i_hdirent[i];
-        } else {
-            pdirent = pdir->i_dirent;
-            dirent = dir->i_dirent;
+        assert(dir->i_hdirent->dh_size == pdir->i_hdirent->dh_size);
+        for (i = 0; i < dir->i_hdirent->dh_size; i++) {
+            lc_processHashList(fs, dir->i_hdirent->dh_lists[i],
+                               pdir->i_hdirent->dh_lists[i], lastIno, cdir);
         }
-        fdirent = dirent;
-        adirent = NULL;
+        return;
+    }
 
-        /* Directory entries have the same order in both layers */
-        while (pdirent) {
-            ldirent = dirent;
-            while (dirent && (dirent->di_ino != pdirent->di_ino)) {
-                dirent = dirent->di_next;
+    /* Traverse parent directory entries looking for missing entries */
+    assert(!(pdir->i_flags & LC_INODE_DHASHED));
+    pdirent = pdir->i_dirent;
+    dirent = dir->i_dirent;
+    fdirent = dirent;
+    adirent = NULL;
+
+    /* Directory entries have the same order in both layers */
+    while (pdirent) {
+        ldirent = dirent;
+        while (dirent && (dirent->di_ino != pdirent->di_ino)) {
+            dirent = lc_dirNext(dirent);
+        }
+
+        /* Check if the file was renamed */
+        if (dirent) {
+            if (adirent == NULL) {
+                adirent = dirent;
             }
-
-            /* Check if the file was renamed */
-            if (dirent) {
-                if (adirent == NULL) {
-                    adirent = dirent;
-                }
-                assert(dirent->di_ino == pdirent->di_ino);
-                if ((dirent->di_size != pdirent->di_size) ||
-                    (strcmp(pdirent->di_name, dirent->di_name))) {
-                    lc_addName(fs, cdir, pdirent->di_ino, pdirent->di_name,
-                               pdirent->di_mode, pdirent->di_size,
-                               lastIno, LC_REMOVED);
-                    lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
-                               dirent->di_mode, dirent->di_size, lastIno,
-                               LC_ADDED);
-                }
-                dirent = dirent->di_next;
-            } else {
-
-                /* If the entry is not present in the layer, add a record for
-                 * the removed file.
-                 */
+            assert(dirent->di_ino == pdirent->di_ino);
+            if ((dirent->di_size != pdirent->di_size) ||
+                (strcmp(pdirent->di_name, dirent->di_name))) {
                 lc_addName(fs, cdir, pdirent->di_ino, pdirent->di_name,
                            pdirent->di_mode, pdirent->di_size,
                            lastIno, LC_REMOVED);
-                dirent = ldirent;
+                lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
+                           dirent->di_mode, dirent->di_size, lastIno,
+                           LC_ADDED);
             }
-            pdirent = pdirent->di_next;
+            dirent = lc_dirNext(dirent);
+        } else {
+
+            /* If the entry is not present in the layer, add a record for
+             * the removed file.
+             */
+            lc_addName(fs, cdir, pdirent->di_ino, pdirent->di_name,
+                       pdirent->di_mode, pdirent->di_size,
+                       lastIno, LC_REMOVED);
+            dirent = ldirent;
         }
+        pdirent = lc_dirNext(pdirent);
+    }
 
 
-        /* Process any newly created entries */
-        dirent = fdirent;
-        while (dirent != adirent) {
-            lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
-                       dirent->di_mode, dirent->di_size, lastIno, LC_ADDED);
-            dirent = dirent->di_next;
-        }
+    /* Process any newly created entries */
+    dirent = fdirent;
+    while (dirent != adirent) {
+        lc_addName(fs, cdir, dirent->di_ino, dirent->di_name,
+                   dirent->di_mode, dirent->di_size, lastIno, LC_ADDED);
+        dirent = lc_dirNext(dirent);
     }
 }
 
@@ -176,23 +234,31 @@ lc_pathLookup(struct fs *fs, char *path, uint16_t len) {
 static void
 lc_compareDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
                     ino_t lastIno, struct cdir *cdir) {
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    int i, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    int i, max = lc_dirLists(dir);
     ino_t ino = LC_INVALID_INODE;
     struct dirent *dirent;
     uint64_t count = 0;
 
+    /* Directories are compared list by list only when entries are kept in
+     * the same number of lists in both layers.
+     */
     if (pdir && ((dir == fs->fs_rootInode) || (pdir->i_ino == dir->i_ino)) &&
-        ((dir->i_flags & LC_INODE_DHASHED) ==
-         (pdir->i_flags & LC_INODE_DHASHED))) {
+        ((dir->i_flags & LC_INODE_DOVERLAY) ||
+         ((lc_dirLists(dir) == lc_dirLists(pdir)) &&
+          ((dir->i_flags & LC_INODE_DHASHED) ==
+           (pdir->i_flags & LC_INODE_DHASHED))))) {
         lc_processDirectory(fs, dir, pdir, lastIno, cdir);
         return;
     }
 
     /* Check for entries currently present */
     for (i = 0; i < max; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = lc_dirList(dir, i);
         while (dirent) {
+            if (lc_dirRemoved(dir, dirent)) {
+                dirent = lc_dirNext(dirent);
+                continue;
+            }
             if (pdir) {
                 ino = lc_dirLookup(fs, pdir, dirent->di_name);
             }
@@ -202,7 +268,7 @@ lc_compareDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
                            LC_ADDED);
             }
             count++;
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
         }
         if (count == dir->i_size) {
             break;
@@ -213,11 +279,10 @@ lc_compareDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
     }
 
     /* Check missing entries */
-    hashed = (pdir->i_flags & LC_INODE_DHASHED);
-    max = hashed ? LC_DIRCACHE_SIZE : 1;
+    max = lc_dirLists(pdir);
     count = 0;
     for (i = 0; i < max; i++) {
-        dirent = hashed ? pdir->i_hdirent[i] : pdir->i_dirent;
+        dirent = lc_dirList(pdir, i);
         while (dirent) {
             ino = lc_dirLookup(fs, dir, dirent->di_name);
             if (ino == LC_INVALID_INODE) {
@@ -226,7 +291,7 @@ lc_compareDirectory(struct fs *fs, struct inode *dir, struct inode *pdir,
                            LC_REMOVED);
             }
             count++;
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
         }
         if (count == pdir->i_size) {
             break;
@@ -318,7 +383,8 @@ lc_addDirectoryPath(struct fs *fs, ino_t ino, ino_t parent, struct cdir *new,
                 assert(new->cd_type == LC_ADDED);
                 assert(cfile->cf_type == LC_REMOVED);
                 *prev = cfile->cf_next;
-                lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+                lc_arenaFree(fs, cfile, sizeof(struct cfile),
+                             LC_MEMTYPE_CFILE);
                 new->cd_type = LC_MODIFIED;
             }
         }
@@ -378,7 +444,7 @@ retry:
     }
 
     /* Create a new entry for this directory */
-    new = lc_malloc(fs, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+    new = lc_arenaAlloc(fs, sizeof(struct cdir), LC_MEMTYPE_CDIR);
     new->cd_ino = ino;
     new->cd_type = ctype;
     new->cd_file = NULL;
@@ -485,7 +551,7 @@ lc_addName(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
 
         /* Flag the inode as tracked in change list */
         if (ctype != LC_REMOVED) {
-            inode = lc_lookupInodeCache(fs, ino, -1);
+            inode = lc_lookupInodeCache(fs, ino);
             if (inode && ((ino > lastIno) ||
                           !(inode->i_flags & LC_INODE_MLINKS))) {
                 assert(inode->i_fs == fs);
@@ -536,7 +602,7 @@ lc_replyDiff(fuse_req_t req, struct fs *fs) {
             memcpy(&pchange->ch_path, cfile->cf_name, cfile->cf_len);
             size += plen;
             cdir->cd_file = cfile->cf_next;
-            lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+            lc_arenaFree(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
         }
         if (cdir->cd_path) {
             lc_free(fs, cdir->cd_path, cdir->cd_len, LC_MEMTYPE_PATH);
@@ -545,7 +611,7 @@ lc_replyDiff(fuse_req_t req, struct fs *fs) {
         /* Remove the last record after all records are returned */
         if ((cdir->cd_next != NULL) || (size == 0)) {
             fs->fs_changes = cdir->cd_next;
-            lc_free(fs, cdir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+            lc_arenaFree(fs, cdir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
         } else {
             cdir->cd_path = NULL;
             break;
@@ -573,14 +639,14 @@ lc_freeChangeList(struct fs *fs) {
         while (cfile) {
             file = cfile;
             cfile = cfile->cf_next;
-            lc_free(fs, file, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+            lc_arenaFree(fs, file, sizeof(struct cfile), LC_MEMTYPE_CFILE);
         }
         if (cdir->cd_path) {
             lc_free(fs, cdir->cd_path, cdir->cd_len, LC_MEMTYPE_PATH);
         }
         dir = cdir;
         cdir = cdir->cd_next;
-        lc_free(fs, dir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+        lc_arenaFree(fs, dir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
     }
     fs->fs_changes = NULL;
 }
@@ -647,6 +713,7 @@ lc_layerDiff(fuse_req_t req, const char *name, size_t size) {
     lc_addDirectory(fs, fs->fs_rootInode, NULL, 0, lastIno, LC_MODIFIED);
 
     /* Traverse inode cache, looking for modified directories in this layer */
+    lc_icacheRehashDone(fs);
     for (i = 0; i < fs->fs_icacheSize; i++) {
         inode = fs->fs_icache[i].ic_head;
         while (inode) {
@@ -654,6 +721,7 @@ lc_layerDiff(fuse_req_t req, const char *name, size_t size) {
             /* Skip removed directories and those already processed */
             if (S_ISDIR(inode->i_mode) &&
                 !(inode->i_flags & (LC_INODE_REMOVED | LC_INODE_CTRACKED))) {
+                lc_inodeLoad(inode);
                 lc_addDirectory(fs, inode, NULL, 0, lastIno,
                                 lc_changeInode(inode->i_ino, lastIno));
             }
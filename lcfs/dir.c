@@ -1,65 +1,209 @@
 #include "includes.h"
 
-/* Calculate hash value for the name */
+/* Return the readdir offset of a directory entry */
+static inline off_t
+lc_dirOffset(struct dirent *dirent, bool hashed) {
+    return hashed ? (((off_t)dirent->di_hash << LC_DIRHASH_INDEX_BITS) |
+                     dirent->di_index) :
+                    (LC_DIRHASH_LINEAR | dirent->di_index);
+}
+
+/* Number of hash lists for a directory with the given number of entries */
 static uint32_t
-lc_dirhash(const char *name, size_t size) {
-    size_t i, hsize = (size > LC_DIRHASH_LEN) ? LC_DIRHASH_LEN : size;
-    uint32_t hash = 0;
+lc_dirHashSize(uint64_t count) {
+    uint32_t size = LC_DIRHASH_MINSIZE;
 
-    for (i = 0; i < hsize; i++) {
-        hash += name[i];
+    while ((size < LC_DIRHASH_MAXSIZE) &&
+           (((uint64_t)size * LC_DIRHASH_LOAD) < count)) {
+        size <<= 1;
     }
-    return (hash + size) % LC_DIRCACHE_SIZE;
+    return size;
+}
+
+/* Allocate a directory hash table with the specified number of lists */
+static struct dhash *
+lc_dirAllocHash(struct fs *fs, uint32_t size) {
+    size_t tsize = sizeof(struct dhash) + (size * sizeof(struct dirent *));
+    struct dhash *dhash;
+
+    assert((size & (size - 1)) == 0);
+    dhash = lc_malloc(fs, tsize, LC_MEMTYPE_DCACHE);
+    memset(dhash, 0, tsize);
+    dhash->dh_size = size;
+    dhash->dh_shift = 32 - __builtin_ctz(size);
+    return dhash;
+}
+
+/* Free a directory hash table */
+static void
+lc_dirReleaseHash(struct fs *fs, struct dhash *dhash) {
+    lc_free(fs, dhash,
+            sizeof(struct dhash) + (dhash->dh_size * sizeof(struct dirent *)),
+            LC_MEMTYPE_DCACHE);
+}
+
+/* Insert an entry to its hash list, after entries with a smaller hash or the
+ * same hash.  Entries with the same hash are numbered in the order added.
+ */
+static void
+lc_dirHashInsert(struct dhash *dhash, struct dirent *dirent) {
+    struct dirent **prev = &dhash->dh_lists[dirent->di_hash >>
+                                            dhash->dh_shift];
+    uint32_t index = 0;
+
+    while (*prev && ((*prev)->di_hash <= dirent->di_hash)) {
+        if ((*prev)->di_hash == dirent->di_hash) {
+            index = (*prev)->di_index;
+        }
+        prev = lc_dirLink(*prev);
+    }
+    assert(index < LC_DIRHASH_INDEX);
+    dirent->di_index = index + 1;
+    *lc_dirLink(dirent) = *prev;
+    *prev = dirent;
+}
+
+/* Move entries of a directory to a bigger hash table.  Entries are visited in
+ * the order of name hash, so those are appended to the new lists, without
+ * changing readdir offsets.
+ */
+static void
+lc_dirResizeHash(struct fs *fs, struct inode *dir, uint32_t size) {
+    struct dhash *old = dir->i_hdirent, *dhash = lc_dirAllocHash(fs, size);
+    struct dirent *dirent, *next, **tail = NULL;
+    uint32_t i, list, last = size;
+
+    for (i = 0; i < old->dh_size; i++) {
+        dirent = old->dh_lists[i];
+        while (dirent) {
+            next = lc_dirNext(dirent);
+            list = dirent->di_hash >> dhash->dh_shift;
+            if (list != last) {
+                assert(dhash->dh_lists[list] == NULL);
+                tail = &dhash->dh_lists[list];
+                last = list;
+            }
+            *lc_dirLink(dirent) = NULL;
+            *tail = dirent;
+            tail = lc_dirLink(dirent);
+            dirent = next;
+        }
+    }
+    dir->i_hdirent = dhash;
+    lc_dirReleaseHash(fs, old);
 }
 
 /* Allocate hash table for an inode */
 void
 lc_dirConvertHashed(struct fs *fs, struct inode *dir) {
-    struct dirent *dirent = dir->i_dirent, *next, **dcache;
-    uint32_t hash;
+    struct dirent *dirent = dir->i_dirent, *next;
+    struct dhash *dhash;
 
     assert(S_ISDIR(dir->i_mode));
-    dcache = lc_malloc(fs, LC_DIRCACHE_SIZE * sizeof(struct dirent *),
-                       LC_MEMTYPE_DCACHE);
-    memset(dcache, 0, LC_DIRCACHE_SIZE * sizeof(struct dirent *));
+    dhash = lc_dirAllocHash(fs, lc_dirHashSize(dir->i_size));
     while (dirent) {
-        next = dirent->di_next;
-        hash = lc_dirhash(dirent->di_name, dirent->di_size);
-        dirent->di_next = dcache[hash];
-        dcache[hash] = dirent;
-        /* XXX readdir may break */
-        dirent->di_index = dirent->di_next ?
-                           (dirent->di_next->di_index + 1) : 1;
+        next = lc_dirNext(dirent);
+        dirent->di_hash = lc_nameHash(dirent->di_name, dirent->di_size);
+        lc_dirHashInsert(dhash, dirent);
         dirent = next;
     }
-    dir->i_hdirent = dcache;
+    dir->i_hdirent = dhash;
     dir->i_flags |= LC_INODE_DHASHED;
     //lc_printf("Converted to hashed directory %ld\n", dir->i_ino);
 }
 
+/* Get the head of the hash list in which the name could exist */
+static inline struct dirent **
+lc_dirHashHead(struct dhash *dhash, const char *name, int len,
+               uint32_t *hashp) {
+    uint32_t hash = lc_nameHash(name, len);
+
+    *hashp = hash;
+    return &dhash->dh_lists[hash >> dhash->dh_shift];
+}
+
 /* Get the head of the directory list in which the name could exist */
 static inline struct dirent *
 lc_dirGetDirent(struct inode *dir, const char *name, int len,
                 struct dirent ***headp, uint32_t *hashp) {
-    struct dirent *dirent;
+    struct dirent **head;
     uint32_t hash;
 
+    assert(!(dir->i_flags & LC_INODE_DOVERLAY));
     if (dir->i_flags & LC_INODE_DHASHED) {
-        hash = lc_dirhash(name, len);
-        dirent = dir->i_hdirent[hash];
-        if (headp) {
-            *headp = &dir->i_hdirent[hash];
-        }
+        head = lc_dirHashHead(dir->i_hdirent, name, len, &hash);
         if (hashp) {
             *hashp = hash;
         }
     } else {
-        dirent = dir->i_dirent;
-        if (headp) {
-            *headp = &dir->i_dirent;
+        head = &dir->i_dirent;
+    }
+    if (headp) {
+        *headp = head;
+    }
+    return *head;
+}
+
+/* Search a directory list for the name */
+static struct dirent *
+lc_dirSearch(struct dirent **prev, bool hashed, uint32_t hash,
+             const char *name, int len, struct dirent ***prevp) {
+    struct dirent *dirent = *prev;
+
+    while (dirent != NULL) {
+        if (hashed && (dirent->di_hash != hash)) {
+
+            /* Hash lists are sorted on the name hash */
+            if (dirent->di_hash > hash) {
+                break;
+            }
+        } else if ((len == dirent->di_size) &&
+                   (strcmp(name, dirent->di_name) == 0)) {
+            if (prevp) {
+                *prevp = prev;
+            }
+            return dirent;
         }
+
+        /* Entries are not taken out of packed directories */
+        if (prevp) {
+            prev = lc_dirLink(dirent);
+        }
+        dirent = lc_dirNext(dirent);
     }
-    return dirent;
+    return NULL;
+}
+
+/* Find the entry with the name in the directory.  For entries shared with
+ * the parent layer, previous entry is returned as NULL.
+ */
+static struct dirent *
+lc_dirFind(struct inode *dir, const char *name, int len,
+           struct dirent ***prevp) {
+    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    struct dirent *dirent, **head;
+    struct dover *dover;
+    uint32_t hash = 0;
+
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+
+        /* Look at the entries added in the layer first */
+        dirent = lc_dirSearch(&dover->do_added, false, 0, name, len, prevp);
+        if (dirent) {
+            return dirent;
+        }
+        if (prevp) {
+            *prevp = NULL;
+        }
+        hashed = dover->do_hashed;
+        head = hashed ? lc_dirHashHead(dover->do_hdirent, name, len, &hash) :
+                        &dover->do_dirent;
+        dirent = lc_dirSearch(head, hashed, hash, name, len, NULL);
+        return (dirent && !lc_dirRemoved(dir, dirent)) ? dirent : NULL;
+    }
+    lc_dirGetDirent(dir, name, len, &head, &hash);
+    return lc_dirSearch(head, hashed, hash, name, len, prevp);
 }
 
 /* Lookup the specified name in the directory and return correponding inode
@@ -68,20 +212,49 @@ lc_dirGetDirent(struct inode *dir, const char *name, int len,
 ino_t
 lc_dirLookup(struct fs *fs, struct inode *dir, const char *name) {
     struct dirent *dirent;
-    int len = strlen(name);
-    ino_t dino;
 
     assert(S_ISDIR(dir->i_mode));
-    dirent = lc_dirGetDirent(dir, name, len, NULL, NULL);
-    while (dirent != NULL) {
-        if ((len == dirent->di_size) &&
-            (strcmp(name, dirent->di_name) == 0)) {
-            dino = dirent->di_ino;
-            return dino;
+    dirent = lc_dirFind(dir, name, strlen(name), NULL);
+    return dirent ? dirent->di_ino : LC_INVALID_INODE;
+}
+
+/* Allocate a new directory entry */
+static struct dirent *
+lc_dirNewEntry(struct fs *fs, ino_t ino, mode_t mode, const char *name,
+               int nsize) {
+    struct dlink *dlink;
+    struct dirent *dirent;
+
+    dlink = lc_arenaAlloc(fs, sizeof(struct dlink) + nsize + 1,
+                          LC_MEMTYPE_DIRENT);
+    dirent = &dlink->dl_dirent;
+    dirent->di_ino = ino;
+    dirent->di_name = ((char *)dlink) + sizeof(struct dlink);
+    memcpy(dirent->di_name, name, nsize);
+    dirent->di_name[nsize] = 0;
+    dirent->di_size = nsize;
+    dirent->di_packed = 0;
+    dirent->di_last = 0;
+    dirent->di_mode = mode & S_IFMT;
+    dirent->di_hash = 0;
+    dlink->dl_next = NULL;
+    return dirent;
+}
+
+/* Copy a directory tracking changes over the parent layer, if the specified
+ * number of changes cannot be tracked anymore.
+ */
+static void
+lc_dirOverlayCheck(struct inode *dir, uint32_t count) {
+    struct dover *dover;
+
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        if ((dover->do_acount + dover->do_rcount + count) >
+            LC_DIROVERLAY_MAX) {
+            lc_dirMaterialize(dir);
         }
-        dirent = dirent->di_next;
     }
-    return LC_INVALID_INODE;
 }
 
 /* Add a new directory entry to the given directory */
@@ -90,36 +263,52 @@ lc_dirAdd(struct inode *dir, ino_t ino, mode_t mode, const char *name,
           int nsize) {
     struct fs *fs = dir->i_fs;
     struct dirent *dirent;
-    int hash;
+    struct dover *dover;
+    uint32_t size;
 
     assert(S_ISDIR(dir->i_mode));
-    assert(!(dir->i_flags & LC_INODE_SHARED));
+    assert(!(dir->i_flags & (LC_INODE_SHARED | LC_INODE_DPACKED)));
     assert(ino > LC_ROOT_INODE);
 
+    /* Track the entry as added over the parent layer if possible */
+    lc_dirOverlayCheck(dir, 1);
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        dirent = lc_dirNewEntry(fs, ino, mode, name, nsize);
+        dirent->di_index = dover->do_added ?
+                           (dover->do_added->di_index + 1) : 1;
+        *lc_dirLink(dirent) = dover->do_added;
+        dover->do_added = dirent;
+        dover->do_acount++;
+        dir->i_size++;
+        return;
+    }
+
     /* Convert to a hash table when the directory grows bigger than a certain
-     * size.
+     * size, and grow the hash table as more entries are added.
      */
-    if ((dir->i_size >= LC_DIRCACHE_MIN) &&
-        !(dir->i_flags & LC_INODE_DHASHED)) {
-        lc_dirConvertHashed(fs, dir);
+    if (!(dir->i_flags & LC_INODE_DHASHED)) {
+        if (dir->i_size >= LC_DIRCACHE_MIN) {
+            lc_dirConvertHashed(fs, dir);
+        }
+    } else {
+        size = dir->i_hdirent->dh_size;
+        if ((size < LC_DIRHASH_MAXSIZE) &&
+            (dir->i_size >= ((uint64_t)size * LC_DIRHASH_LOAD))) {
+            size *= LC_DIRHASH_GROW;
+            lc_dirResizeHash(fs, dir, (size < LC_DIRHASH_MAXSIZE) ?
+                                      size : LC_DIRHASH_MAXSIZE);
+        }
     }
-    dirent = lc_malloc(fs, sizeof(struct dirent) + nsize + 1,
-                       LC_MEMTYPE_DIRENT);
-    dirent->di_ino = ino;
-    dirent->di_name = ((char *)dirent) + sizeof(struct dirent);
-    memcpy(dirent->di_name, name, nsize);
-    dirent->di_name[nsize] = 0;
-    dirent->di_size = nsize;
-    dirent->di_mode = mode & S_IFMT;
+    dirent = lc_dirNewEntry(fs, ino, mode, name, nsize);
     if (dir->i_flags & LC_INODE_DHASHED) {
-        hash = lc_dirhash(name, nsize);
-        dirent->di_next = dir->i_hdirent[hash];
-        dir->i_hdirent[hash] = dirent;
+        dirent->di_hash = lc_nameHash(name, nsize);
+        lc_dirHashInsert(dir->i_hdirent, dirent);
     } else {
-        dirent->di_next = dir->i_dirent;
+        dirent->di_index = dir->i_dirent ? (dir->i_dirent->di_index + 1) : 1;
+        *lc_dirLink(dirent) = dir->i_dirent;
         dir->i_dirent = dirent;
     }
-    dirent->di_index = dirent->di_next ? (dirent->di_next->di_index + 1) : 1;
     dir->i_size++;
 }
 
@@ -127,22 +316,23 @@ lc_dirAdd(struct inode *dir, ino_t ino, mode_t mode, const char *name,
 void
 lc_dirCopy(struct inode *dir) {
     bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    struct dirent *dirent, *new, **prev, **dcache;
+    struct dirent *dirent, *new, **prev;
+    struct dhash *dcache;
     struct fs *fs = dir->i_fs;
     uint64_t count = 0;
     uint32_t i, max;
-    size_t nsize;
 
     assert(dir->i_flags & LC_INODE_SHARED);
     assert(S_ISDIR(dir->i_mode));
     assert(dir->i_nlink >= 2);
     if (hashed) {
 
-        /* Parent is using hashed lists, allocate hash table */
+        /* Parent is using hashed lists, allocate hash table of same size,
+         * so that entries stay in the same order in both layers.
+         */
         dcache = dir->i_hdirent;
-        dir->i_hdirent = NULL;
-        lc_dirConvertHashed(fs, dir);
-        max = LC_DIRCACHE_SIZE;
+        dir->i_hdirent = lc_dirAllocHash(fs, dcache->dh_size);
+        max = dcache->dh_size;
         dirent = NULL;
     } else {
         dirent = dir->i_dirent;
@@ -153,33 +343,26 @@ lc_dirCopy(struct inode *dir) {
     dir->i_flags &= ~LC_INODE_SHARED;
     for (i = 0; i < max; i++) {
         if (hashed) {
-            dirent = dcache[i];
+            dirent = dcache->dh_lists[i];
 
             /* If all entries processed, stop */
             if (count == dir->i_size) {
                 break;
             }
-            prev = &dir->i_hdirent[i];
+            prev = &dir->i_hdirent->dh_lists[i];
         } else {
             prev = &dir->i_dirent;
         }
 
         /* Copy every entry in the list */
         while (dirent) {
-            nsize = dirent->di_size;
-            new = lc_malloc(fs, sizeof(struct dirent) + nsize + 1,
-                            LC_MEMTYPE_DIRENT);
-            new->di_ino = dirent->di_ino;
-            new->di_name = ((char *)new) + sizeof(struct dirent);
-            memcpy(new->di_name, dirent->di_name, nsize);
-            new->di_name[nsize] = 0;
-            new->di_size = nsize;
-            new->di_mode = dirent->di_mode;
+            new = lc_dirNewEntry(fs, dirent->di_ino, dirent->di_mode,
+                                 dirent->di_name, dirent->di_size);
             new->di_index = dirent->di_index;
-            new->di_next = NULL;
+            new->di_hash = dirent->di_hash;
             *prev = new;
-            prev = &new->di_next;
-            dirent = dirent->di_next;
+            prev = lc_dirLink(new);
+            dirent = lc_dirNext(dirent);
             count++;
         }
     }
@@ -190,33 +373,173 @@ lc_dirCopy(struct inode *dir) {
 /* Free a dirent structure */
 static inline void
 lc_freeDirent(struct fs *fs, struct dirent *dirent) {
-    lc_free(fs, dirent, sizeof(struct dirent) + dirent->di_size + 1,
-            LC_MEMTYPE_DIRENT);
+    assert(!dirent->di_packed);
+    lc_arenaFree(fs, dirent, sizeof(struct dlink) + dirent->di_size + 1,
+                 LC_MEMTYPE_DIRENT);
+}
+
+/* Pack entries of a directory in an immutable layer into an array, in the
+ * order those are visited.  Every list of the directory becomes a run of
+ * entries in the array, so entries are looked up and read as before, without
+ * a separate allocation or a link for every entry.  Names are interned, as
+ * names like "bin" or "lib" are present in many layers.
+ */
+void
+lc_dirPack(struct fs *fs, struct inode *dir) {
+    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    struct dirent *dirent, *next, *entries, **head;
+    uint64_t count = 0;
+    uint32_t i, max;
+
+    assert(S_ISDIR(dir->i_mode));
+    assert(!(dir->i_flags & (LC_INODE_SHARED | LC_INODE_DOVERLAY |
+                             LC_INODE_DPACKED)));
+    if (dir->i_size == 0) {
+        return;
+    }
+    entries = lc_malloc(fs, dir->i_size * sizeof(struct dirent),
+                        LC_MEMTYPE_DPACK);
+    max = lc_dirLists(dir);
+    for (i = 0; (i < max) && (count < dir->i_size); i++) {
+        head = hashed ? &dir->i_hdirent->dh_lists[i] : &dir->i_dirent;
+        dirent = *head;
+        if (dirent) {
+            *head = &entries[count];
+        }
+        while (dirent) {
+            next = lc_dirNext(dirent);
+            memcpy(&entries[count], dirent, sizeof(struct dirent));
+            entries[count].di_name = lc_istringGet(dirent->di_name,
+                                                   dirent->di_size);
+            entries[count].di_packed = 1;
+            entries[count].di_last = (next == NULL);
+            lc_freeDirent(fs, dirent);
+            dirent = next;
+            count++;
+        }
+    }
+    assert(count == dir->i_size);
+    dir->i_flags |= LC_INODE_DPACKED;
+}
+
+/* Free entries of a packed directory */
+static void
+lc_dirFreePacked(struct fs *fs, struct inode *dir) {
+    struct dirent *dirent, *entries = NULL;
+    int i, max = lc_dirLists(dir);
+
+    for (i = 0; i < max; i++) {
+        dirent = lc_dirList(dir, i);
+        if (entries == NULL) {
+            entries = dirent;
+        }
+        while (dirent) {
+            assert(dirent->di_packed);
+            lc_istringRelease(dirent->di_name);
+            dirent = lc_dirNext(dirent);
+        }
+    }
+    lc_free(fs, entries, dir->i_size * sizeof(struct dirent),
+            LC_MEMTYPE_DPACK);
+    dir->i_flags &= ~LC_INODE_DPACKED;
+}
+
+/* Start tracking changes to a directory sharing entries with the parent
+ * layer, instead of copying all the entries of the directory.
+ */
+void
+lc_dirOverlay(struct inode *dir) {
+    struct fs *fs = dir->i_fs;
+    struct dover *dover;
+
+    assert(dir->i_flags & LC_INODE_SHARED);
+    assert(S_ISDIR(dir->i_mode));
+
+    /* Entries can be shared only if the parent layer is immutable */
+    if ((fs->fs_parent == NULL) || !fs->fs_parent->fs_frozen) {
+        lc_dirCopy(dir);
+        return;
+    }
+    dover = lc_malloc(fs, sizeof(struct dover), LC_MEMTYPE_DOVER);
+    dover->do_dirent = dir->i_dirent;
+    dover->do_added = NULL;
+    dover->do_size = dir->i_size;
+    dover->do_acount = 0;
+    dover->do_rcount = 0;
+    dover->do_hashed = (dir->i_flags & LC_INODE_DHASHED);
+    dir->i_dover = dover;
+    dir->i_flags &= ~(LC_INODE_SHARED | LC_INODE_DHASHED);
+    dir->i_flags |= LC_INODE_DOVERLAY;
+    lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
+}
+
+/* Copy entries shared with the parent layer to a directory and apply the
+ * changes made in the layer.
+ */
+void
+lc_dirMaterialize(struct inode *dir) {
+    struct dover *dover = dir->i_dover;
+    struct dirent *dirent, *next;
+    uint64_t size = dir->i_size;
+    struct fs *fs = dir->i_fs;
+    uint32_t i;
+
+    assert(dir->i_flags & LC_INODE_DOVERLAY);
+    dir->i_dirent = dover->do_dirent;
+    dir->i_size = dover->do_size;
+    dir->i_flags &= ~LC_INODE_DOVERLAY;
+    dir->i_flags |= LC_INODE_SHARED |
+                    (dover->do_hashed ? LC_INODE_DHASHED : 0);
+    lc_dirCopy(dir);
+    for (i = 0; i < dover->do_rcount; i++) {
+        lc_dirRemove(dir, dover->do_removed[i]->di_name);
+    }
+    dirent = dover->do_added;
+    while (dirent) {
+        next = lc_dirNext(dirent);
+        lc_dirAdd(dir, dirent->di_ino, dirent->di_mode, dirent->di_name,
+                  dirent->di_size);
+        lc_freeDirent(fs, dirent);
+        dirent = next;
+    }
+    assert(dir->i_size == size);
+    lc_free(fs, dover, sizeof(struct dover), LC_MEMTYPE_DOVER);
+}
+
+/* Take an entry out of a directory */
+static void
+lc_dirUnlink(struct inode *dir, struct dirent *dirent, struct dirent **prev) {
+    struct dover *dover;
+
+    assert(!(dir->i_flags & LC_INODE_DPACKED));
+    if (prev == NULL) {
+
+        /* Entries shared with the parent layer are just marked removed */
+        dover = dir->i_dover;
+        assert(dover->do_rcount < LC_DIROVERLAY_MAX);
+        dover->do_removed[dover->do_rcount++] = dirent;
+    } else {
+        *prev = lc_dirNext(dirent);
+        if (dir->i_flags & LC_INODE_DOVERLAY) {
+            assert(dir->i_dover->do_acount > 0);
+            dir->i_dover->do_acount--;
+        }
+        lc_freeDirent(dir->i_fs, dirent);
+    }
+    dir->i_size--;
 }
 
 /* Remove a directory entry */
 void
 lc_dirRemove(struct inode *dir, const char *name) {
     struct dirent *dirent, **prev;
-    int len = strlen(name);
 
     assert(S_ISDIR(dir->i_mode));
     assert(!(dir->i_flags & LC_INODE_SHARED));
-    dirent = lc_dirGetDirent(dir, name, len, &prev, NULL);
-
-    /* Search the specified name and remove it if found */
-    while (dirent != NULL) {
-        if ((len == dirent->di_size) &&
-            (strcmp(name, dirent->di_name) == 0)) {
-            *prev = dirent->di_next;
-            dir->i_size--;
-            lc_freeDirent(dir->i_fs, dirent);
-            return;
-        }
-        prev = &dirent->di_next;
-        dirent = dirent->di_next;
-    }
-    assert(false);
+    lc_dirOverlayCheck(dir, 1);
+    dirent = lc_dirFind(dir, name, strlen(name), &prev);
+    assert(dirent != NULL);
+    lc_dirUnlink(dir, dirent, prev);
 }
 
 /* Rename a directory entry with a new name */
@@ -224,60 +547,56 @@ void
 lc_dirRename(struct inode *dir, ino_t ino,
               const char *name, const char *newname) {
     struct dirent *dirent, *new, **prev;
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    uint32_t hash, newhash;
     int len = strlen(name);
     struct fs *fs;
+    mode_t mode;
+    bool hashed;
 
     assert(S_ISDIR(dir->i_mode));
-    assert(!(dir->i_flags & LC_INODE_SHARED));
-    dirent = lc_dirGetDirent(dir, name, len, &prev, &hash);
+    assert(!(dir->i_flags & (LC_INODE_SHARED | LC_INODE_DPACKED)));
+
+    /* Overlay may be replaced with a hashed copy of the parent directory */
+    lc_dirOverlayCheck(dir, 2);
+    hashed = (dir->i_flags & LC_INODE_DHASHED);
+    dirent = lc_dirFind(dir, name, len, &prev);
 
     /* Search for entry with old name and replace that with new name */
-    while (dirent != NULL) {
-        if ((dirent->di_ino == ino) && (len == dirent->di_size) &&
-            (strcmp(name, dirent->di_name) == 0)) {
-            fs = dir->i_fs;
-            len = strlen(newname);
-            if (hashed) {
+    assert(dirent && (dirent->di_ino == ino));
+    len = strlen(newname);
+    if (prev == NULL) {
+
+        /* Entry shared with the parent layer is removed and added again */
+        mode = dirent->di_mode;
+        lc_dirUnlink(dir, dirent, NULL);
+        lc_dirAdd(dir, ino, mode, newname, len);
+        return;
+    }
+    fs = dir->i_fs;
 
-                /* Check if the entry needs to be moved to a different hash
-                 * list.
-                 */
-                newhash = lc_dirhash(newname, len);
-                if (hash != newhash) {
-                    *prev = dirent->di_next;
-                    dirent->di_next = dir->i_hdirent[newhash];
-                    dir->i_hdirent[newhash] = dirent;
-                    dirent->di_index = dirent->di_next ?
-                                       (dirent->di_next->di_index + 1) : 1;
-                    prev = &dir->i_hdirent[newhash];
-                }
-            }
+    /* Existing name can be used if size is not growing */
+    if (len > dirent->di_size) {
+        new = lc_arenaAlloc(fs, sizeof(struct dlink) + len + 1,
+                            LC_MEMTYPE_DIRENT);
+        memcpy(new, dirent, sizeof(struct dlink));
+        lc_freeDirent(fs, dirent);
+        dirent = new;
+        *prev = dirent;
+        dirent->di_name = ((char *)dirent) + sizeof(struct dlink);
+    } else if (dirent->di_size > len) {
+
+        /* Adjust memory stats if name size changed */
+        lc_arenaShrink(fs, dirent, dirent->di_size - len);
+    }
+    memcpy(dirent->di_name, newname, len);
+    dirent->di_name[len] = 0;
+    dirent->di_size = len;
+    if (hashed) {
 
-            /* Existing name can be used if size is not growing */
-            if (len > dirent->di_size) {
-                new = lc_malloc(fs, sizeof(struct dirent) + len + 1,
-                                LC_MEMTYPE_DIRENT);
-                memcpy(new, dirent, sizeof(struct dirent));
-                lc_freeDirent(fs, dirent);
-                dirent = new;
-                *prev = dirent;
-                dirent->di_name = ((char *)dirent) + sizeof(struct dirent);
-            } else if (dirent->di_size > len) {
-
-                /* Adjust memory stats if name size changed */
-                lc_memUpdateTotal(fs, dirent->di_size - len);
-            }
-            memcpy(dirent->di_name, newname, len);
-            dirent->di_name[len] = 0;
-            dirent->di_size = len;
-            return;
-        }
-        prev = &dirent->di_next;
-        dirent = dirent->di_next;
+        /* Move the entry to the position for the new name */
+        *prev = lc_dirNext(dirent);
+        dirent->di_hash = lc_nameHash(newname, len);
+        lc_dirHashInsert(dir->i_hdirent, dirent);
     }
-    assert(false);
 }
 
 /* Read a directory from disk */
@@ -330,6 +649,13 @@ lc_dirRead(struct gfs *gfs, struct fs *fs, struct inode *dir, void *buf) {
     }
     assert(dir->i_nlink == count);
     assert(dir->i_size == entries);
+
+    /* Entries of immutable layers do not change, other than those of the root
+     * directory, which is shared with child layers as is.
+     */
+    if (fs->fs_frozen && (dir != fs->fs_rootInode)) {
+        lc_dirPack(fs, dir);
+    }
 }
 
 /* Allocate a directory block and flush to disk */
@@ -376,7 +702,6 @@ lc_dirAddPage(struct gfs *gfs, struct fs *fs, struct dblock *dblock,
 void
 lc_dirFlush(struct gfs *gfs, struct fs *fs, struct inode *dir) {
     uint64_t block = LC_INVALID_BLOCK, count = 0, entries = 0;
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
     int i, remain = 0, dsize, subdir, max;
     struct dblock *dblock = NULL;
     struct page *page = NULL;
@@ -386,12 +711,16 @@ lc_dirFlush(struct gfs *gfs, struct fs *fs, struct inode *dir) {
 
     assert(S_ISDIR(dir->i_mode));
     subdir = (dir->i_flags & LC_INODE_REMOVED) ? 0 : 2;
-    max = hashed ? LC_DIRCACHE_SIZE : 1;
+    max = lc_dirLists(dir);
     for (i = 0; i < max; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = lc_dirList(dir, i);
 
         /* Copy entries in the list to page */
         while (dirent) {
+            if (lc_dirRemoved(dir, dirent)) {
+                dirent = lc_dirNext(dirent);
+                continue;
+            }
             dsize = LC_MIN_DIRENT_SIZE + dirent->di_size;
             if (remain < dsize) {
                 if (dblock) {
@@ -416,7 +745,7 @@ lc_dirFlush(struct gfs *gfs, struct fs *fs, struct inode *dir) {
             entries++;
             dbuf += dsize;
             remain -= dsize;
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
         }
 
         /* If all entries processed, stop */
@@ -447,8 +776,7 @@ lc_dirFlush(struct gfs *gfs, struct fs *fs, struct inode *dir) {
 /* Free directory hash table */
 void
 lc_dirFreeHash(struct fs *fs, struct inode *dir) {
-    lc_free(fs, dir->i_hdirent, LC_DIRCACHE_SIZE * sizeof(struct dirent *),
-            LC_MEMTYPE_DCACHE);
+    lc_dirReleaseHash(fs, dir->i_hdirent);
     dir->i_hdirent = NULL;
     dir->i_flags &= ~LC_INODE_DHASHED;
 }
@@ -458,6 +786,7 @@ void
 lc_dirFree(struct inode *dir) {
     bool hashed = (dir->i_flags & LC_INODE_DHASHED);
     struct dirent *dirent, *tmp;
+    struct dover *dover;
     uint64_t count = 0;
     struct fs *fs;
     int i, max;
@@ -469,14 +798,36 @@ lc_dirFree(struct inode *dir) {
         return;
     }
     fs = dir->i_fs;
-    max = hashed ? LC_DIRCACHE_SIZE : 1;
+
+    /* Free just the entries added over the parent layer */
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        dirent = dover->do_added;
+        while (dirent != NULL) {
+            tmp = dirent;
+            dirent = lc_dirNext(dirent);
+            lc_freeDirent(fs, tmp);
+        }
+        lc_free(fs, dover, sizeof(struct dover), LC_MEMTYPE_DOVER);
+        dir->i_flags &= ~LC_INODE_DOVERLAY;
+        dir->i_dirent = NULL;
+        return;
+    }
+
+    /* Entries of a packed directory are not allocated from the arena */
+    if (dir->i_flags & LC_INODE_DPACKED) {
+        lc_dirFreePacked(fs, dir);
+        max = 0;
+    } else {
+        max = lc_dirLists(dir);
+    }
     for (i = 0; i < max; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = hashed ? dir->i_hdirent->dh_lists[i] : dir->i_dirent;
 
         /* Free all entries in the list */
         while (dirent != NULL) {
             tmp = dirent;
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
             lc_freeDirent(fs, tmp);
             count++;
         }
@@ -496,16 +847,19 @@ lc_dirFree(struct inode *dir) {
  */
 void
 lc_removeTree(struct fs *fs, struct inode *dir) {
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
     struct gfs *gfs = fs->fs_gfs;
     struct dirent *dirent;
+    bool hashed, rmdir;
     int i, max;
-    bool rmdir;
 
-    assert(!(dir->i_flags & LC_INODE_SHARED));
-    max = hashed ? LC_DIRCACHE_SIZE : 1;
+    assert(!(dir->i_flags & (LC_INODE_SHARED | LC_INODE_DPACKED)));
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        lc_dirMaterialize(dir);
+    }
+    hashed = (dir->i_flags & LC_INODE_DHASHED);
+    max = lc_dirLists(dir);
     for (i = 0; (i < max) && dir->i_size; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = hashed ? dir->i_hdirent->dh_lists[i] : dir->i_dirent;
         while (dirent != NULL) {
             rmdir = S_ISDIR(dirent->di_mode);
             lc_removeInode(fs, dir, dirent->di_ino, rmdir, NULL);
@@ -521,13 +875,13 @@ lc_removeTree(struct fs *fs, struct inode *dir) {
                 assert(dir->i_nlink >= 2);
             }
             if (hashed) {
-                dir->i_hdirent[i] = dirent->di_next;
+                dir->i_hdirent->dh_lists[i] = lc_dirNext(dirent);
             } else {
-                dir->i_dirent = dirent->di_next;
+                dir->i_dirent = lc_dirNext(dirent);
             }
             dir->i_size--;
             lc_freeDirent(fs, dirent);
-            dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+            dirent = hashed ? dir->i_hdirent->dh_lists[i] : dir->i_dirent;
         }
     }
 }
@@ -555,179 +909,309 @@ lc_dirRemoveName(struct fs *fs, struct inode *dir,
     struct gfs *gfs = fs->fs_gfs;
     int len = strlen(name), err;
     struct fs *rfs;
+    char *iname;
 
     assert(S_ISDIR(dir->i_mode));
-    dirent = lc_dirGetDirent(dir, name, len, &prev, NULL);
+    lc_dirOverlayCheck(dir, 1);
 
-    /* Search the list for the specified name */
-    while (dirent != NULL) {
-        if ((len == dirent->di_size) &&
-            (strcmp(name, dirent->di_name) == 0)) {
-            ino = dirent->di_ino;
+    /* Search the directory for the specified name */
+    dirent = lc_dirFind(dir, name, len, &prev);
+    if (dirent == NULL) {
+        return ENOENT;
+    }
+    ino = dirent->di_ino;
 
-            /* Do not allow removing layer root directory, parent of that and
-             * anything in it.
-             */
-            if (rmdir && !layer && (fs->fs_gindex == 0) &&
-               ((ino == gfs->gfs_layerRoot) ||
-                ((gfs->gfs_layerRootInode != NULL) &&
-                 (ino == gfs->gfs_layerRootInode->i_parent)) ||
-                lc_getIndex(fs, parent, ino))) {
-                lc_reportError(__func__, __LINE__, parent, EEXIST);
-                err = EEXIST;
+    /* Do not allow removing layer root directory, parent of that and
+     * anything in it.
+     */
+    if (rmdir && !layer && (fs->fs_gindex == 0) &&
+       ((ino == gfs->gfs_layerRoot) ||
+        ((gfs->gfs_layerRootInode != NULL) &&
+         (ino == gfs->gfs_layerRootInode->i_parent)) ||
+        lc_getIndex(fs, parent, ino))) {
+        lc_reportError(__func__, __LINE__, parent, EEXIST);
+        err = EEXIST;
+    } else {
+        err = layer ? lc_removeRoot(fs, dir, ino, rmdir, fsp) :
+                      lc_removeInode(fs, dir, ino, rmdir, fsp);
+    }
+    if ((err == 0) || (err == ESTALE)) {
+        if (err == 0) {
+            if (rmdir) {
+                assert(dir->i_nlink > 2);
+                dir->i_nlink--;
             } else {
-                err = layer ? lc_removeRoot(fs, dir, ino, rmdir, fsp) :
-                              lc_removeInode(fs, dir, ino, rmdir, fsp);
+                assert(dir->i_nlink >= 2);
             }
-            if ((err == 0) || (err == ESTALE)) {
-                if (err == 0) {
-                    if (rmdir) {
-                        assert(dir->i_nlink > 2);
-                        dir->i_nlink--;
-                    } else {
-                        assert(dir->i_nlink >= 2);
-                    }
-                    if (dir != gfs->gfs_layerRootInode) {
-                        lc_updateInodeTimes(dir, false, true);
-                    }
-                } else {
-                    err = 0;
-                }
-                lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
-
-                /* Remove the entry from directory */
-                *prev = dirent->di_next;
-                dir->i_size--;
-                lc_freeDirent(fs, dirent);
+            if (dir != gfs->gfs_layerRootInode) {
+                lc_updateInodeTimes(dir, false, true);
             }
-            if (layer && (err == 0)) {
-
-                /* Remove init layer along with this one */
-                rfs = (struct fs *)*fsp;
-                if (rfs && rfs->fs_zfs &&
-                    !(rfs->fs_super->sb_flags & LC_SUPER_INIT)) {
-                    rfs = rfs->fs_zfs;
-                    ino = rfs->fs_root;
-                    len += strlen("-init");
-                    dirent = lc_dirGetDirent(dir, name, len, &prev, NULL);
-                    while (dirent && (dirent->di_ino != ino)) {
-                        prev = &dirent->di_next;
-                        dirent = dirent->di_next;
-                    }
-                    assert(dirent->di_ino == ino);
-                    assert(dirent->di_size == len);
-                    *prev = dirent->di_next;
-                    dir->i_size--;
-                    assert(dir->i_nlink > 2);
-                    dir->i_nlink--;
-                    lc_freeDirent(fs, dirent);
-                }
+        } else {
+            err = 0;
+        }
+        lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
+
+        /* Remove the entry from directory */
+        lc_dirUnlink(dir, dirent, prev);
+    }
+    if (layer && (err == 0)) {
+
+        /* Remove init layer along with this one */
+        rfs = (struct fs *)*fsp;
+        if (rfs && rfs->fs_zfs &&
+            !(rfs->fs_super->sb_flags & LC_SUPER_INIT)) {
+            rfs = rfs->fs_zfs;
+            ino = rfs->fs_root;
+            len += strlen("-init");
+            iname = alloca(len + 1);
+            snprintf(iname, len + 1, "%s-init", name);
+            dirent = lc_dirGetDirent(dir, iname, len, &prev, NULL);
+            while (dirent && (dirent->di_ino != ino)) {
+                prev = lc_dirLink(dirent);
+                dirent = lc_dirNext(dirent);
             }
-            return err;
+            assert(dirent->di_ino == ino);
+            assert(dirent->di_size == len);
+            *prev = lc_dirNext(dirent);
+            dir->i_size--;
+            assert(dir->i_nlink > 2);
+            dir->i_nlink--;
+            lc_freeDirent(fs, dirent);
         }
-        prev = &dirent->di_next;
-        dirent = dirent->di_next;
     }
-    return ENOENT;
+    return err;
+}
+
+/* Copy attributes of the root directory of an immutable layer, without
+ * locking the layer.  Layers are freed after RCU readers are done, and root
+ * directories of immutable layers are not locked.  Returns false if the layer
+ * is not immutable or not found, for taking the slow path.
+ */
+static bool
+lc_dirLayerRootStat(struct gfs *gfs, int gindex, ino_t ino,
+                    struct stat *attr) {
+    bool found = false;
+    struct fs *fs;
+
+    lc_rcuRegister();
+    rcu_read_lock();
+    fs = rcu_dereference(gfs->gfs_fs[gindex]);
+    if (fs && fs->fs_frozen && !fs->fs_removed &&
+        (fs->fs_gindex == gindex) && (fs->fs_root == ino) &&
+        fs->fs_rootInode) {
+        lc_copyStat(attr, fs->fs_rootInode);
+        found = true;
+    }
+    rcu_read_unlock();
+    return found;
+}
+
+/* Add entries of a directory to a readdirplus buffer, along with attributes
+ * of the inodes, which are looked up together.  Sets full if the buffer
+ * filled up before adding all the entries.  Nothing is added if any of the
+ * inodes is missing.
+ */
+static int
+lc_dirReaddirBatch(fuse_req_t req, struct fs *fs, struct dirent **dirents,
+                   off_t *offsets, int count, char *buf, size_t size,
+                   size_t *csize, bool *full) {
+    struct inode *inodes[LC_READDIR_BATCH], *inode;
+    ino_t inos[LC_READDIR_BATCH];
+    struct fuse_entry_param ep;
+    size_t esize;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        inos[i] = dirents[i]->di_ino;
+    }
+    lc_lookupInodes(fs, inos, inodes, count);
+    for (i = 0; i < count; i++) {
+        if (inodes[i] == NULL) {
+            lc_reportError(__func__, __LINE__, inos[i], ENOENT);
+            return ENOENT;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        inode = inodes[i];
+        lc_inodeLock(inode, false);
+
+        /* Size of a directory is known only after reading its entries */
+        if (S_ISDIR(inode->i_mode)) {
+            lc_inodeLoad(inode);
+        }
+        lc_copyStat(&ep.attr, inode);
+        lc_inodeUnlock(inode);
+        ep.ino = lc_setHandle(fs->fs_gindex, inos[i]);
+        lc_epInit(&ep);
+#ifdef FUSE3
+        esize = fuse_add_direntry_plus(req, &buf[*csize], size - *csize,
+                                       dirents[i]->di_name, &ep, offsets[i]);
+#else
+        esize = 0;
+#endif
+
+        /* Stop if buffer is filled up */
+        if ((*csize + esize) >= size) {
+            *full = true;
+            return 0;
+        }
+        *csize += esize;
+
+        /* Kernel takes a lookup reference on entries with attributes */
+        lc_inodeRef(inode, 1);
+    }
+    return 0;
 }
 
 /* Return directory entries */
 int
 lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
               uint64_t parent, size_t size, off_t off, struct stat *st) {
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    struct dirent *dirent = NULL;
+    bool overlay = (dir->i_flags & LC_INODE_DOVERLAY), hashed, added;
+    bool layers = (parent == fs->fs_gfs->gfs_layerRoot), full = false;
+    struct dirent *dirent = NULL, *dirents[LC_READDIR_BATCH];
+    off_t i, doff, offsets[LC_READDIR_BATCH];
+    int max, start, gindex, err, count = 0;
     struct fuse_entry_param ep;
     size_t csize = 0, esize;
-    int max, start, gindex;
+    struct inode *inode = NULL;
     struct fs *nfs = NULL;
-    struct inode *inode;
+    struct dhash *dhash;
     char buf[size];
-    off_t i, hoff;
     ino_t ino;
 
     /* FUSE/Kernel takes care of ./.. entries in a directory.
      * See FUSE_CAP_EXPORT_SUPPORT
      */
     assert(S_ISDIR(dir->i_mode));
-    if (hashed) {
-
-        /* Continue from last hash list processed */
-        if (off) {
-            start = off >> LC_DIRHASH_SHIFT;
-            assert(start <= LC_DIRCACHE_SIZE);
-
-            /* If directory switched to hashed mode in the middle of somebody
-             * reading it, start over from the beginning.
-             */
-            if (start == LC_DIRCACHE_SIZE) {
-                start = 0;
-                off = 0;
-            } else {
-                off &= LC_DIRHASH_INDEX;
-            }
+    hashed = overlay ? dir->i_dover->do_hashed :
+                       (dir->i_flags & LC_INODE_DHASHED);
+    max = lc_dirLists(dir);
+    if (off & LC_DIRHASH_OVERLAY) {
+
+        /* Continue with entries added over the parent layer, unless the
+         * directory was copied in the middle of somebody reading it.
+         */
+        if (overlay) {
+            start = max - 1;
+            off &= ~LC_DIRHASH_OVERLAY;
         } else {
             start = 0;
+            off = 0;
         }
-        max = LC_DIRCACHE_SIZE;
+    } else if (hashed) {
+
+        /* If directory switched to hashed mode in the middle of somebody
+         * reading it, start over from the beginning.
+         */
+        if (off & LC_DIRHASH_LINEAR) {
+            off = 0;
+        }
+
+        /* Continue from the hash list with the last entry returned, as
+         * offsets are derived from name hash and do not change when the
+         * hash table is resized.
+         */
+        dhash = overlay ? dir->i_dover->do_hdirent : dir->i_hdirent;
+        start = off ? ((off >> LC_DIRHASH_INDEX_BITS) >> dhash->dh_shift) : 0;
     } else {
         start = 0;
-        max = 1;
-        off &= LC_DIRHASH_INDEX;
+        off = (off & LC_DIRHASH_LINEAR) ? (off & ~LC_DIRHASH_LINEAR) : 0;
     }
     for (i = start; i < max; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = lc_dirList(dir, i);
+        added = overlay && (i == (max - 1));
 
         /* Skip entries already read from the list */
-        while (off && dirent && (dirent->di_index >= off)) {
-            dirent = dirent->di_next;
+        if (hashed && !added) {
+            while (off && dirent && (lc_dirOffset(dirent, true) <= off)) {
+                dirent = lc_dirNext(dirent);
+            }
+        } else {
+            while (off && dirent && (dirent->di_index >= off)) {
+                dirent = lc_dirNext(dirent);
+            }
         }
         off = 0;
-        hoff = (hashed ? i : LC_DIRCACHE_SIZE) << LC_DIRHASH_SHIFT;
         while (dirent != NULL) {
+
+            /* Skip entries of the parent layer removed in the layer */
+            if (lc_dirRemoved(dir, dirent)) {
+                dirent = lc_dirNext(dirent);
+                continue;
+            }
             ino = dirent->di_ino;
             assert(ino > LC_ROOT_INODE);
+            doff = added ? (LC_DIRHASH_OVERLAY | dirent->di_index) :
+                           lc_dirOffset(dirent, hashed);
             if (st) {
 
                 /* Add directory entry to the readdir buffer */
                 st->st_ino = lc_setHandle(lc_getIndex(fs, parent, ino), ino);
                 st->st_mode = dirent->di_mode;
                 esize = fuse_add_direntry(req, &buf[csize], size - csize,
-                                          dirent->di_name, st,
-                                          hoff | dirent->di_index);
+                                          dirent->di_name, st, doff);
+            } else if (!layers) {
+
+                /* For readdirplus, look up inodes of a few entries together
+                 * and add those to the buffer along with attributes.
+                 */
+                dirents[count] = dirent;
+                offsets[count] = doff;
+                count++;
+                if (count == LC_READDIR_BATCH) {
+                    err = lc_dirReaddirBatch(req, fs, dirents, offsets, count,
+                                             buf, size, &csize, &full);
+                    count = 0;
+                    if (err) {
+                        goto err;
+                    }
+                    if (full) {
+                        goto out;
+                    }
+                }
+                dirent = lc_dirNext(dirent);
+                continue;
             } else {
 
-                /* For readdirplus, get attributes of the inode as well */
-                if (parent == fs->fs_gfs->gfs_layerRoot) {
-                    gindex = lc_getIndex(fs, parent, ino);
+                /* For readdirplus, get attributes of the layer root directory
+                 * as well, without locking the layer if it is immutable.
+                 */
+                gindex = lc_getIndex(fs, parent, ino);
+                inode = NULL;
+                if ((fs->fs_gindex == gindex) ||
+                    !lc_dirLayerRootStat(fs->fs_gfs, gindex, ino, &ep.attr)) {
                     if (fs->fs_gindex != gindex) {
                         nfs = lc_getLayerLocked(lc_setHandle(gindex, ino),
                                                 false);
                     }
-                } else {
-                    gindex = fs->fs_gindex;
-                }
-                inode = lc_getInode(nfs ? nfs : fs, ino, NULL, false, false);
-                if (inode == NULL) {
-                    lc_reportError(__func__, __LINE__, ino, ENOENT);
-                    fuse_reply_err(req, ENOENT);
+                    inode = lc_getInode(nfs ? nfs : fs, ino, NULL, false,
+                                        false);
+                    if (inode == NULL) {
+                        lc_reportError(__func__, __LINE__, ino, ENOENT);
+                        if (nfs) {
+                            lc_unlock(nfs);
+                        }
+                        err = ENOENT;
+                        goto err;
+                    }
+                    lc_copyStat(&ep.attr, inode);
+                    lc_inodeUnlock(inode);
                     if (nfs) {
                         lc_unlock(nfs);
+
+                        /* Metadata of layer root directories is not
+                         * released.
+                         */
+                        inode = NULL;
                     }
-                    return ENOENT;
+                    nfs = NULL;
                 }
-                lc_copyStat(&ep.attr, inode);
-                lc_inodeUnlock(inode);
-                if (nfs) {
-                    lc_unlock(nfs);
-                }
-                nfs = NULL;
                 ep.ino = lc_setHandle(gindex, ino);
                 lc_epInit(&ep);
 #ifdef FUSE3
                 esize = fuse_add_direntry_plus(req, &buf[csize], size - csize,
-                                               dirent->di_name, &ep,
-                                               hoff | dirent->di_index);
+                                               dirent->di_name, &ep, doff);
 #else
                 esize = 0;
 #endif
@@ -739,7 +1223,21 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
                 csize -= esize;
                 goto out;
             }
-            dirent = dirent->di_next;
+
+            /* Kernel takes a lookup reference on entries with attributes */
+            if (inode) {
+                lc_inodeRef(inode, 1);
+            }
+            dirent = lc_dirNext(dirent);
+        }
+    }
+
+    /* Add entries left over in the last batch */
+    if (count) {
+        err = lc_dirReaddirBatch(req, fs, dirents, offsets, count, buf, size,
+                                 &csize, &full);
+        if (err) {
+            goto err;
         }
     }
 
@@ -754,6 +1252,18 @@ out:
         fuse_reply_buf(req, NULL, 0);
     }
     return 0;
+
+err:
+
+    /* Kernel holds lookup references on entries already in the buffer, so
+     * return those and fail when reading from the next entry.
+     */
+    if (csize) {
+        fuse_reply_buf(req, buf, csize);
+        return 0;
+    }
+    fuse_reply_err(req, err);
+    return err;
 }
 
 /* Find directory entry with the given inode number */
@@ -761,23 +1271,22 @@ struct dirent *
 lc_getDirent(struct fs *fs, ino_t parent, ino_t ino, int *hash,
              struct dirent *sdirent) {
     struct inode * dir = lc_getInode(fs, parent, NULL, false, false);
-    struct dirent *dirent = sdirent ? sdirent->di_next : NULL;
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    int i = hash ? *hash : 0, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    struct dirent *dirent = sdirent ? lc_dirNext(sdirent) : NULL;
+    int i = hash ? *hash : 0, max = lc_dirLists(dir);
 
     for (; i < max; i++) {
         if (!sdirent) {
-            dirent = (hashed ? dir->i_hdirent[i] : dir->i_dirent);
+            dirent = lc_dirList(dir, i);
         }
         while (dirent) {
-            if (dirent->di_ino == ino) {
+            if ((dirent->di_ino == ino) && !lc_dirRemoved(dir, dirent)) {
                 if (hash) {
                     *hash = i;
                 }
                 i = max;
                 break;
             }
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
         }
         sdirent = NULL;
     }
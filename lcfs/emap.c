@@ -19,15 +19,102 @@ lc_addEmapExtent(struct gfs *gfs, struct fs *fs, struct extent **extents,
     }
 }
 
+/* Free the index over the emap list of the inode, done whenever the emap
+ * list is modified.
+ */
+void
+lc_emapIndexFree(struct inode *inode) {
+    struct rdata *rdata = lc_inodeGetRegData(inode);
+    struct eindex *index = rdata->rd_eindex;
+
+    if (index) {
+        rdata->rd_eindex = NULL;
+        lc_free(inode->i_fs, index, sizeof(struct eindex) +
+                (index->ei_count * sizeof(struct extent *)),
+                LC_MEMTYPE_EXTENT);
+    }
+}
+
+/* Build an index over the emap list of the inode if the list is long */
+static struct eindex *
+lc_emapIndexBuild(struct gfs *gfs, struct inode *inode) {
+    struct rdata *rdata = lc_inodeGetRegData(inode);
+    struct extent *extent = rdata->rd_emap;
+    struct eindex *index;
+    uint64_t count = 0;
+
+    while (extent) {
+        count++;
+        extent = extent->ex_next;
+    }
+    if (count < LC_EMAP_INDEX_MIN) {
+        return NULL;
+    }
+    index = lc_malloc(inode->i_fs, sizeof(struct eindex) +
+                      (count * sizeof(struct extent *)), LC_MEMTYPE_EXTENT);
+    index->ei_count = count;
+    count = 0;
+    extent = rdata->rd_emap;
+    while (extent) {
+        assert(extent->ex_type == LC_EXTENT_EMAP);
+        lc_validateExtent(gfs, extent);
+        index->ei_extents[count++] = extent;
+        extent = extent->ex_next;
+    }
+
+    /* Readers may race to build the index while holding the inode lock
+     * shared, keep the one installed first.
+     */
+    if (!__sync_bool_compare_and_swap(&rdata->rd_eindex, NULL, index)) {
+        lc_free(inode->i_fs, index, sizeof(struct eindex) +
+                (count * sizeof(struct extent *)), LC_MEMTYPE_EXTENT);
+        index = rdata->rd_eindex;
+    }
+    return index;
+}
+
+/* Find the extent to start looking for a page, which is the last extent
+ * starting at or before the page, or the first extent of the list.
+ */
+static struct extent *
+lc_emapIndexLookup(struct gfs *gfs, struct inode *inode, uint64_t page) {
+    struct eindex *index = lc_inodeGetEmapIndex(inode);
+    uint64_t low, high, mid;
+
+    if (index == NULL) {
+        index = lc_emapIndexBuild(gfs, inode);
+
+        /* Short lists are searched without an index */
+        if (index == NULL) {
+            return lc_inodeGetEmap(inode);
+        }
+    }
+    low = 0;
+    high = index->ei_count;
+    while ((high - low) > 1) {
+        mid = low + ((high - low) / 2);
+        if (lc_getExtentStart(index->ei_extents[mid]) <= page) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return index->ei_extents[low];
+}
+
 /* Check the inode extent list for the block mapping to the page */
 static uint64_t
 lc_inodeEmapExtentLookup(struct gfs *gfs, struct inode *inode, uint64_t page,
                          struct extent **extents) {
-    struct extent *extent = extents ? *extents : lc_inodeGetEmap(inode);
+    struct extent *extent = extents ? *extents : NULL;
 
     /* Continue searching from last extent if there is one, otherwise from the
-     * beginning. Extent list is sorted, so stop when a later page is found.
+     * extent the index points to. Extent list is sorted, so stop when a later
+     * page is found.
      */
+    if (extent == NULL) {
+        extent = lc_emapIndexLookup(gfs, inode, page);
+    }
     while (extent &&
            (page >= (lc_getExtentStart(extent) + lc_getExtentCount(extent)))) {
         assert(extent->ex_type == LC_EXTENT_EMAP);
@@ -97,6 +184,7 @@ lc_inodeEmapUpdate(struct gfs *gfs, struct fs *fs, struct inode *inode,
     assert(!(inode->i_flags & LC_INODE_SHARED));
     assert(inode->i_extentLength == 0);
     assert(count);
+    lc_emapIndexFree(inode);
 
     /* XXX Combine emap lookup and removal into a single operation */
     /* Remove existing blocks for the specified range from inode emap */
@@ -208,6 +296,7 @@ lc_copyEmap(struct gfs *gfs, struct fs *fs, struct inode *inode) {
 
     assert(S_ISREG(inode->i_mode));
     assert(inode->i_extentLength == 0);
+    lc_emapIndexFree(inode);
     lc_inodeSetEmap(inode, NULL);
     while (extent) {
         assert(extent->ex_type == LC_EXTENT_EMAP);
@@ -287,6 +376,7 @@ lc_emapFlush(struct gfs *gfs, struct fs *fs, struct inode *inode) {
         emap = &eblock->eb_emap[count++];
         emap->e_off = lc_getExtentStart(extent);
         emap->e_block = lc_getExtentBlock(extent);
+        assert(lc_getExtentCount(extent) <= LC_EXTENT_EMAP_MAX);
         emap->e_count = lc_getExtentCount(extent);
         bcount += emap->e_count;
         extent = extent->ex_next;
@@ -359,8 +449,10 @@ lc_emapRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
                 break;
             }
             assert(emap->e_count > 0);
-            lc_addEmapExtent(gfs, fs, extents,
-                             emap->e_off, emap->e_block, emap->e_count);
+
+            /* Each emap entry fits in an extent, add it at the end */
+            lc_addExtent(gfs, fs, extents, emap->e_off, emap->e_block,
+                         emap->e_count, false);
             extents = &((*extents)->ex_next);
             inode->i_dinode.di_blocks += emap->e_count;
         }
@@ -430,6 +522,7 @@ lc_emapTruncate(struct gfs *gfs, struct fs *fs, struct inode *inode,
 
     /* Remove blockmap entries past the new size */
     if (lc_inodeGetEmap(inode)) {
+        lc_emapIndexFree(inode);
         prev = lc_inodeGetEmapPtr(inode);
         extent = lc_inodeGetEmap(inode);
         while (extent) {
@@ -199,3 +199,238 @@ lc_inodeAddMetaExtent(struct gfs *gfs, struct fs *fs, struct extent **extents,
 #endif
     lc_addSpaceExtent(gfs, fs, extents, start, count, sort);
 }
+
+/* Order free extents by start block */
+static int
+lc_fextentCompareStart(struct tnode *a, struct tnode *b) {
+    uint64_t astart = lc_fextentByStart(a)->fe_start;
+    uint64_t bstart = lc_fextentByStart(b)->fe_start;
+
+    return (astart < bstart) ? -1 : (astart > bstart);
+}
+
+/* Order free extents by length, and by start block for same length */
+static int
+lc_fextentCompareLength(struct tnode *a, struct tnode *b) {
+    struct fextent *afe = lc_fextentByLength(a), *bfe = lc_fextentByLength(b);
+
+    if (afe->fe_count != bfe->fe_count) {
+        return (afe->fe_count < bfe->fe_count) ? -1 : 1;
+    }
+    return (afe->fe_start < bfe->fe_start) ? -1 :
+           (afe->fe_start > bfe->fe_start);
+}
+
+/* Allocate a map of extents tracking space.  Extents are indexed by length
+ * as well if the map is used for allocating space.
+ */
+struct spacemap *
+lc_spaceInit(struct fs *fs, bool length) {
+    struct spacemap *space;
+
+    space = lc_malloc(fs, sizeof(struct spacemap), LC_MEMTYPE_EXTENT);
+    lc_treeInit(&space->sm_start, lc_fextentCompareStart);
+    lc_treeInit(&space->sm_length, length ? lc_fextentCompareLength : NULL);
+    space->sm_blocks = 0;
+    return space;
+}
+
+/* Insert an extent to the map */
+static void
+lc_spaceInsert(struct spacemap *space, struct fextent *fextent) {
+    lc_treeInsert(&space->sm_start, &fextent->fe_snode);
+    if (space->sm_length.t_compare) {
+        lc_treeInsert(&space->sm_length, &fextent->fe_lnode);
+    }
+}
+
+/* Delete an extent from the map and free it */
+static void
+lc_spaceDelete(struct fs *fs, struct spacemap *space,
+               struct fextent *fextent) {
+    lc_treeRemove(&space->sm_start, &fextent->fe_snode);
+    if (space->sm_length.t_compare) {
+        lc_treeRemove(&space->sm_length, &fextent->fe_lnode);
+    }
+    lc_free(fs, fextent, sizeof(struct fextent), LC_MEMTYPE_EXTENT);
+}
+
+/* Resize an extent, keeping it at the right place in length order.
+ * Order by start does not change as extents in a map never overlap.
+ */
+static inline void
+lc_spaceResize(struct spacemap *space, struct fextent *fextent,
+               uint64_t start, uint64_t count) {
+    if (space->sm_length.t_compare) {
+        lc_treeRemove(&space->sm_length, &fextent->fe_lnode);
+    }
+    fextent->fe_start = start;
+    fextent->fe_count = count;
+    if (space->sm_length.t_compare) {
+        lc_treeInsert(&space->sm_length, &fextent->fe_lnode);
+    }
+}
+
+/* Find the extent starting at or before the specified block */
+static inline struct fextent *
+lc_spaceFind(struct spacemap *space, uint64_t start) {
+    struct fextent key;
+
+    key.fe_start = start;
+    return lc_fextentByStart(lc_treeSearch(&space->sm_start,
+                                           &key.fe_snode, false));
+}
+
+/* Add blocks to the map, merging with adjacent extents */
+void
+lc_spaceAdd(struct fs *fs, struct spacemap *space, uint64_t start,
+            uint64_t count) {
+    struct fextent *prev, *next, *fextent;
+
+    assert(start && count);
+    assert(start != LC_INVALID_BLOCK);
+    assert((start + count) <= fs->fs_gfs->gfs_super->sb_tblocks);
+    prev = lc_spaceFind(space, start);
+    next = lc_fextentByStart(prev ? lc_treeNext(&prev->fe_snode) :
+                                    lc_treeFirst(&space->sm_start));
+    assert((prev == NULL) || ((prev->fe_start + prev->fe_count) <= start));
+    assert((next == NULL) || ((start + count) <= next->fe_start));
+    space->sm_blocks += count;
+
+    /* Check if the blocks can be combined with the extent before */
+    if (prev && ((prev->fe_start + prev->fe_count) == start)) {
+        count += prev->fe_count;
+        start = prev->fe_start;
+
+        /* Check if the extent after can be combined as well */
+        if (next && ((start + count) == next->fe_start)) {
+            count += next->fe_count;
+            lc_spaceDelete(fs, space, next);
+        }
+        lc_spaceResize(space, prev, start, count);
+        return;
+    }
+
+    /* Check if the blocks can be combined with the extent after */
+    if (next && ((start + count) == next->fe_start)) {
+        lc_spaceResize(space, next, start, count + next->fe_count);
+        return;
+    }
+
+    /* Need to add a new extent */
+    fextent = lc_malloc(fs, sizeof(struct fextent), LC_MEMTYPE_EXTENT);
+    fextent->fe_start = start;
+    fextent->fe_count = count;
+    lc_spaceInsert(space, fextent);
+}
+
+/* Remove blocks starting at the specified block from the extent containing
+ * that block, and return the number of blocks removed.
+ */
+uint64_t
+lc_spaceRemove(struct fs *fs, struct spacemap *space, uint64_t start,
+               uint64_t count) {
+    uint64_t estart, end, removed;
+    struct fextent *fextent;
+
+    if (space == NULL) {
+        return 0;
+    }
+    fextent = lc_spaceFind(space, start);
+    if ((fextent == NULL) ||
+        ((fextent->fe_start + fextent->fe_count) <= start)) {
+        return 0;
+    }
+    estart = fextent->fe_start;
+    end = estart + fextent->fe_count;
+    removed = end - start;
+    if (removed > count) {
+        removed = count;
+    }
+    space->sm_blocks -= removed;
+    if (estart == start) {
+
+        /* Trim at the start */
+        if (removed == fextent->fe_count) {
+            lc_spaceDelete(fs, space, fextent);
+        } else {
+            lc_spaceResize(space, fextent, start + removed,
+                           fextent->fe_count - removed);
+        }
+    } else {
+
+        /* Trim at the end, and add back any remaining blocks after the
+         * removed ones.
+         */
+        lc_spaceResize(space, fextent, estart, start - estart);
+        if ((start + removed) < end) {
+            fextent = lc_malloc(fs, sizeof(struct fextent),
+                                LC_MEMTYPE_EXTENT);
+            fextent->fe_start = start + removed;
+            fextent->fe_count = end - (start + removed);
+            lc_spaceInsert(space, fextent);
+        }
+    }
+    return removed;
+}
+
+/* Allocate blocks from the smallest extent big enough, lowest one among
+ * those of the same size.
+ */
+uint64_t
+lc_spaceAlloc(struct fs *fs, struct spacemap *space, uint64_t count) {
+    struct fextent key, *fextent;
+    uint64_t block;
+
+    assert(count);
+    assert(space->sm_length.t_compare);
+    key.fe_start = 0;
+    key.fe_count = count;
+    fextent = lc_fextentByLength(lc_treeSearch(&space->sm_length,
+                                               &key.fe_lnode, true));
+    if (fextent == NULL) {
+        return LC_INVALID_BLOCK;
+    }
+    assert(fextent->fe_count >= count);
+    block = fextent->fe_start;
+    if (fextent->fe_count == count) {
+        lc_spaceDelete(fs, space, fextent);
+    } else {
+        lc_spaceResize(space, fextent, block + count,
+                       fextent->fe_count - count);
+    }
+    space->sm_blocks -= count;
+    return block;
+}
+
+/* Return the first extent in block order */
+struct fextent *
+lc_spaceFirst(struct spacemap *space) {
+    return lc_fextentByStart(lc_treeFirst(&space->sm_start));
+}
+
+/* Return the next extent in block order */
+struct fextent *
+lc_spaceNext(struct fextent *fextent) {
+    return lc_fextentByStart(lc_treeNext(&fextent->fe_snode));
+}
+
+/* Return number of extents in the map */
+uint64_t
+lc_spaceCount(struct spacemap *space) {
+    return space ? space->sm_start.t_count : 0;
+}
+
+/* Free a map of extents */
+void
+lc_spaceDeinit(struct fs *fs, struct spacemap *space) {
+    struct fextent *fextent;
+
+    if (space == NULL) {
+        return;
+    }
+    while ((fextent = lc_spaceFirst(space))) {
+        lc_spaceDelete(fs, space, fextent);
+    }
+    lc_free(fs, space, sizeof(struct spacemap), LC_MEMTYPE_EXTENT);
+}
@@ -13,9 +13,8 @@ enum lc_extentType {
     LC_EXTENT_EMAP = 1,
 } __attribute__((packed));
 
-/* Number of bits used to represent block in an emap extent */
-#define LC_EXTENT_EMAP_CSIZE    16
-#define LC_EXTENT_EMAP_MAX ((1 << LC_EXTENT_EMAP_CSIZE) - 1)
+/* Maximum count of an emap extent, same as what an emap on disk can hold */
+#define LC_EXTENT_EMAP_MAX      UINT32_MAX
 
 /* Representing an extent on disk */
 struct extent {
@@ -23,27 +22,21 @@ struct extent {
     /* Type of the extent */
     uint64_t ex_type:1;
 
-    /* Start block */
+    /* Start block or page */
     uint64_t ex_start:63;
 
-    union {
-        /* Count of blocks */
-        uint64_t ex_count;
-
-        struct {
+    /* Start block number of an emap extent */
+    uint64_t ex_block;
 
-            /* Count of blocks */
-            uint64_t ex_bcount:LC_EXTENT_EMAP_CSIZE;
-
-            /* Start block number */
-            uint64_t ex_block:48;
-        };
-    };
+    /* Count of blocks */
+    uint64_t ex_count;
 
     /* Next extent on the device */
     struct extent *ex_next;
 } __attribute__((packed));
 
+static_assert(sizeof(struct extent) == 32, "extent size != 32");
+
 /* Return start of the extent */
 static inline uint64_t
 lc_getExtentStart(struct extent *extent) {
@@ -59,8 +52,7 @@ lc_getExtentBlock(struct extent *extent) {
 /* Return count of the extent */
 static inline uint64_t
 lc_getExtentCount(struct extent *extent) {
-    return (extent->ex_type == LC_EXTENT_SPACE) ?
-           extent->ex_count : extent->ex_bcount;
+    return extent->ex_count;
 }
 
 /* Validate an extent */
@@ -83,20 +75,15 @@ lc_setExtentStart(struct extent *extent, uint64_t start) {
 /* Set block of the extent */
 static inline void
 lc_setExtentBlock(struct extent *extent, uint64_t block) {
-    if (extent->ex_type == LC_EXTENT_EMAP) {
-        extent->ex_block = block;
-    }
+    extent->ex_block = block;
 }
 
 /* Set count of the extent */
 static inline void
 lc_setExtentCount(struct extent *extent, uint64_t count) {
-    if (extent->ex_type == LC_EXTENT_SPACE) {
-        extent->ex_count = count;
-    } else {
-        assert(count <= LC_EXTENT_EMAP_MAX);
-        extent->ex_bcount = count;
-    }
+    assert((extent->ex_type == LC_EXTENT_SPACE) ||
+           (count <= LC_EXTENT_EMAP_MAX));
+    extent->ex_count = count;
 }
 
 /* Initialize an extent */
@@ -116,7 +103,7 @@ lc_initExtent(struct gfs *gfs, struct extent *extent, enum lc_extentType type,
 /* Increment start of an extent */
 static inline void
 lc_incrExtentStart(struct gfs *gfs, struct extent *extent, uint64_t count) {
-    extent->ex_start += count;
+    lc_setExtentStart(extent, lc_getExtentStart(extent) + count);
     if (extent->ex_type == LC_EXTENT_EMAP) {
         extent->ex_block += count;
     }
@@ -126,7 +113,7 @@ lc_incrExtentStart(struct gfs *gfs, struct extent *extent, uint64_t count) {
 /* Decrement start of an extent */
 static inline void
 lc_decrExtentStart(struct gfs *gfs, struct extent *extent, uint64_t count) {
-    extent->ex_start -= count;
+    lc_setExtentStart(extent, lc_getExtentStart(extent) - count);
     if (extent->ex_type == LC_EXTENT_EMAP) {
         extent->ex_block -= count;
     }
@@ -136,30 +123,20 @@ lc_decrExtentStart(struct gfs *gfs, struct extent *extent, uint64_t count) {
 /* Increment count of an extent */
 static inline void
 lc_incrExtentCount(struct gfs *gfs, struct extent *extent, uint64_t count) {
-    if (extent->ex_type == LC_EXTENT_SPACE) {
-        extent->ex_count += count;
-    } else {
-        assert((extent->ex_bcount + count) <= LC_EXTENT_EMAP_MAX);
-        extent->ex_bcount += count;
-    }
+    lc_setExtentCount(extent, lc_getExtentCount(extent) + count);
     lc_validateExtent(gfs, extent);
 }
 
 /* Decrement count of an extent */
 static inline bool
 lc_decrExtentCount(struct gfs *gfs, struct extent *extent, uint64_t count) {
-    uint64_t ecount = (extent->ex_type == LC_EXTENT_SPACE) ?
-                      extent->ex_count : extent->ex_bcount;
+    uint64_t ecount = lc_getExtentCount(extent);
 
     if (ecount == count) {
         return true;
     }
     assert(ecount > count);
-    if (extent->ex_type == LC_EXTENT_SPACE) {
-        extent->ex_count -= count;
-    } else {
-        extent->ex_bcount -= count;
-    }
+    lc_setExtentCount(extent, ecount - count);
     lc_validateExtent(gfs, extent);
     return false;
 }
@@ -178,11 +155,67 @@ lc_extentAdjacent(uint64_t estart, uint64_t eblock, uint64_t count,
     return ((estart + count) == nstart);
 }
 
+/* Minimum number of extents in an emap before an index is built for it */
+#define LC_EMAP_INDEX_MIN       32
+
+/* Index over the emap list of a fragmented file, for finding the extent
+ * mapping a page with a binary search instead of walking the list.
+ */
+struct eindex {
+
+    /* Number of extents in the index */
+    uint64_t ei_count;
+
+    /* Extents of the emap ordered by page */
+    struct extent *ei_extents[];
+} __attribute__((packed));
+
+/* An extent in a space map, indexed by start and by length */
+struct fextent {
+
+    /* Node in the tree ordered by start block */
+    struct tnode fe_snode;
+
+    /* Node in the tree ordered by length */
+    struct tnode fe_lnode;
+
+    /* Start block */
+    uint64_t fe_start;
+
+    /* Count of blocks */
+    uint64_t fe_count;
+} __attribute__((packed));
+
+/* Map of extents tracking space on the device */
+struct spacemap {
+
+    /* Extents ordered by start block, for merging and flushing */
+    struct tree sm_start;
+
+    /* Extents ordered by length, for allocating best fit.  Not maintained
+     * unless the map is used for allocating space.
+     */
+    struct tree sm_length;
+
+    /* Total number of blocks in the map */
+    uint64_t sm_blocks;
+} __attribute__((packed));
+
+/* Return free extent containing the node ordered by start */
+static inline struct fextent *
+lc_fextentByStart(struct tnode *node) {
+    return node ? caa_container_of(node, struct fextent, fe_snode) : NULL;
+}
+
+/* Return free extent containing the node ordered by length */
+static inline struct fextent *
+lc_fextentByLength(struct tnode *node) {
+    return node ? caa_container_of(node, struct fextent, fe_lnode) : NULL;
+}
+
 /* Flags used to manage extent list operations */
 #define LC_EXTENT_EFREE 0x01  /* Free extents */
-#define LC_EXTENT_FLUSH 0x02  /* Flush extent list to disk */
 #define LC_EXTENT_LAYER 0x04  /* Keep the extents in layer pool */
-#define LC_EXTENT_KEEP  0x08  /* Keep the extents after flush */
 #define LC_EXTENT_REUSE 0x10  /* Do not release to free pool */
 
 #endif
@@ -47,7 +47,7 @@ lc_createInode(struct fs *fs, ino_t parent, const char *name, mode_t mode,
 
     /* Clone the directory if needed */
     if (dir->i_flags & LC_INODE_SHARED) {
-        lc_dirCopy(dir);
+        lc_dirOverlay(dir);
     }
 
     /* Get a new inode */
@@ -117,6 +117,8 @@ lc_removeDir(struct fs *fs, struct inode *dir) {
     dir->i_nlink = 0;
     if (dir->i_flags & LC_INODE_DHASHED) {
         lc_dirFreeHash(fs, dir);
+    } else if (dir->i_flags & LC_INODE_DOVERLAY) {
+        lc_dirFree(dir);
     }
 }
 
@@ -243,7 +245,7 @@ lc_remove(struct fs *fs, ino_t parent, const char *name, void **inodep,
     }
     assert(S_ISDIR(dir->i_mode));
     if (dir->i_flags & LC_INODE_SHARED) {
-        lc_dirCopy(dir);
+        lc_dirOverlay(dir);
     }
 
     /* Lookup and remove the specified entry from the directory */
@@ -319,6 +321,7 @@ lc_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
         err = ENOENT;
     } else {
         lc_copyStat(&ep.attr, inode);
+        lc_inodeRef(inode, 1);
         lc_inodeUnlock(inode);
         ep.ino = lc_setHandle(gindex, ino);
         lc_epInit(&ep);
@@ -749,7 +752,7 @@ lc_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
     assert(ino != newparent);
     if (sdir->i_flags & LC_INODE_SHARED) {
-        lc_dirCopy(sdir);
+        lc_dirOverlay(sdir);
     }
     if ((parent != newparent) && !tdirFirst) {
         tdir = lc_getInode(fs, newparent, NULL, true, true);
@@ -764,7 +767,7 @@ lc_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
     assert(sdir != tdir);
     if (tdir && (tdir->i_flags & LC_INODE_SHARED)) {
-        lc_dirCopy(tdir);
+        lc_dirOverlay(tdir);
     }
 
     /* Need the inode if it is moved to a different directory */
@@ -879,7 +882,7 @@ lc_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
     assert(S_ISDIR(dir->i_mode));
     assert(dir->i_nlink >= 2);
     if (dir->i_flags & LC_INODE_SHARED) {
-        lc_dirCopy(dir);
+        lc_dirOverlay(dir);
     }
     inode = lc_getInode(fs, ino, NULL, true, true);
     if (unlikely(inode == NULL)) {
@@ -962,6 +965,10 @@ lc_openInode(struct fs *fs, fuse_ino_t ino, struct fuse_file_info *fi) {
         } else {
             __sync_add_and_fetch(&inode->i_ocount, 1);
         }
+    } else {
+
+        /* Keep metadata of the parent layer inode while open */
+        lc_inodeRef(inode, 1);
     }
     lc_inodeUnlock(inode);
     fi->fh = (uint64_t)inode;
@@ -984,6 +991,7 @@ lc_closeInode(struct fs *fs, struct inode *inode, struct fuse_file_info *fi,
 
     /* Nothing to do if inode is not part of this layer */
     if (inode->i_fs != fs) {
+        lc_inodeUnref(inode, 1);
         if (inval) {
 
             /* Invalidate pages in kernel page cache if multiple layers are
@@ -1053,7 +1061,7 @@ lc_closeInode(struct fs *fs, struct inode *inode, struct fuse_file_info *fi,
             if (fs->fs_pcount &&
                 (!lc_checkMemoryAvailable(false) ||
                  (fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES))) {
-                pthread_cond_signal(&fs->fs_gfs->gfs_flusherCond);
+                lc_flushQueue(fs->fs_gfs, fs->fs_gindex);
             }
             return;
         }
@@ -1502,7 +1510,7 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
         return;
     }
     if ((op != SYNCER_TIME) && (op != DCACHE_MEMORY) && (op != DCACHE_FLUSH) &&
-        (op != LCFS_COMMIT) && (op != LCFS_GROW)) {
+        (op != ICACHE_MEMORY) && (op != LCFS_COMMIT) && (op != LCFS_GROW)) {
         if (in_bufsz) {
             memcpy(name, in_buf, in_bufsz);
         }
@@ -1564,6 +1572,17 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
             break;
         }
 
+    case ICACHE_MEMORY:
+        value = atoll(in_buf);
+        gfs->gfs_super->sb_icache = value;
+        lc_metaMemoryInit(value * 1024ull * 1024ull);
+        lc_markSuperDirty(lc_getGlobalFs(gfs));
+        if (lc_metaMemoryExcess()) {
+            pthread_cond_signal(&gfs->gfs_syncerCond);
+        }
+        fuse_reply_ioctl(req, 0, NULL, 0);
+        break;
+
     case DCACHE_FLUSH:
         gfs->gfs_pcleaningForced = true;
         pthread_cond_signal(&gfs->gfs_flusherCond);
@@ -1626,13 +1645,12 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 static void
 lc_write_buf(fuse_req_t req, fuse_ino_t ino,
              struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
-    uint64_t pcount, counted = 0, count = 0;
-    struct fuse_bufvec *dst;
+    uint64_t pcount, counted = 0, count = 0, pause = 0;
     struct timeval start;
     struct inode *inode;
     struct dpage *dpages;
-    size_t size, wsize;
     struct gfs *gfs;
+    size_t size;
     struct fs *fs;
     int err = 0;
 
@@ -1641,10 +1659,9 @@ lc_write_buf(fuse_req_t req, fuse_ino_t ino,
     size = bufv->buf[bufv->idx].size;
     pcount = (((off + size) + LC_BLOCK_SIZE - 1) -
               (off & ~(LC_BLOCK_SIZE - 1))) / LC_BLOCK_SIZE;
-    wsize = sizeof(struct fuse_bufvec) + (sizeof(struct fuse_buf) * pcount);
-    dst = alloca(wsize);
-    memset(dst, 0, wsize);
     dpages = alloca(pcount * sizeof(struct dpage));
+
+retry:
     fs = lc_getLayerLocked(ino, false);
     gfs = fs->fs_gfs;
     if (unlikely(fs->fs_frozen)) {
@@ -1655,11 +1672,27 @@ lc_write_buf(fuse_req_t req, fuse_ino_t ino,
         goto out;
     }
 
-    /* Make sure enough memory available before proceeding */
-    lc_waitMemory(gfs, true);
+    /* Slow down the writer if too many dirty pages are around.  Sleep without
+     * holding the layer lock, so that the layer could be flushed, committed
+     * or removed meanwhile, and look up the layer again after that.
+     */
+    if (pause == 0) {
+        pause = lc_throttleWrite(fs, pcount);
+        if (pause) {
+            lc_unlock(fs);
+            usleep(pause);
+            goto retry;
+        }
+    }
 
     /* Copy in the data before taking the lock */
-    pcount = lc_copyPages(fs, off, size, dpages, bufv, dst);
+    err = lc_copyPages(fs, off, size, dpages, bufv, &pcount);
+    if (unlikely(err)) {
+        lc_reportError(__func__, __LINE__, ino, err);
+        fuse_reply_err(req, EIO);
+        err = EIO;
+        goto out;
+    }
     counted = __sync_add_and_fetch(&fs->fs_pcount, pcount);
     __sync_add_and_fetch(&gfs->gfs_dcount, pcount);
 
@@ -1708,7 +1741,7 @@ out:
     if (!err &&
         ((fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) ||
          !lc_checkMemoryAvailable(true))) {
-        pthread_cond_signal(&gfs->gfs_flusherCond);
+        lc_flushQueue(gfs, fs->fs_gindex);
     }
     lc_unlock(fs);
 }
@@ -1845,12 +1878,72 @@ lc_destroy(void *fsp) {
     }
 }
 
+/* Drop lookup references the kernel had on an inode */
+static void
+lc_forgetInode(struct gfs *gfs, fuse_ino_t ino, uint64_t nlookup) {
+    int gindex = lc_getFsHandle(ino);
+    struct fs *fs;
+
+    /* Layer could be removed while this is looking at it, and a layer being
+     * removed is locked exclusive while waiting for readers to go away.  So
+     * do not wait for the lock while in the RCU read section, but queue the
+     * request to be done when the layer is locked next.  Nothing to do if the
+     * layer is removed already.
+     */
+    lc_rcuRegister();
+retry:
+    rcu_read_lock();
+    fs = rcu_dereference(gfs->gfs_fs[gindex]);
+    if (fs == NULL) {
+        rcu_read_unlock();
+        return;
+    }
+    if (lc_tryLock(fs, false)) {
+        lc_inodeForgetDefer(fs, ino, nlookup);
+        rcu_read_unlock();
+        return;
+    }
+    rcu_read_unlock();
+
+    /* Index could be switched to another layer if a layer is committed */
+    if ((fs->fs_gindex != gindex) ||
+        (gfs->gfs_roots[gindex] != fs->fs_root)) {
+        lc_unlock(fs);
+        goto retry;
+    }
+    lc_inodeForgetDeferred(fs, true);
+    lc_inodeForget(fs, ino, nlookup);
+    lc_unlock(fs);
+}
+
+/* Kernel forgets an inode */
+static void
+lc_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    lc_displayEntry(__func__, ino, 0, NULL);
+    lc_forgetInode(getfs(), ino, nlookup);
+    fuse_reply_none(req);
+}
+
+/* Kernel forgets a batch of inodes */
+static void
+lc_forget_multi(fuse_req_t req, size_t count,
+                struct fuse_forget_data *forgets) {
+    struct gfs *gfs = getfs();
+    size_t i;
+
+    lc_displayEntry(__func__, 0, 0, NULL);
+    for (i = 0; i < count; i++) {
+        lc_forgetInode(gfs, forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
 /* Fuse operations registered with the fuse driver */
 struct fuse_lowlevel_ops lc_ll_oper = {
     .init       = lc_init,
     .destroy    = lc_destroy,
     .lookup     = lc_lookup,
-    //.forget     = lc_forget,
+    .forget     = lc_forget,
     .getattr    = lc_getattr,
     .setattr    = lc_setattr,
     .readlink   = lc_readlink,
@@ -1889,9 +1982,9 @@ struct fuse_lowlevel_ops lc_ll_oper = {
     .write_buf  = lc_write_buf,
 #if 0
     .retrieve_reply = lc_retrieve_reply,
-    .forget_multi = lc_forget_multi,
     .flock      = lc_flock,
 #endif
+    .forget_multi = lc_forget_multi,
 #ifdef LC_FALLOCATE_ENABLE
     .fallocate  = lc_fallocate,
 #endif
@@ -15,9 +15,12 @@ lc_newLayer(struct gfs *gfs, bool rw) {
 #endif
     pthread_mutex_init(&fs->fs_plock, NULL);
     pthread_mutex_init(&fs->fs_dilock, NULL);
+    pthread_mutex_init(&fs->fs_slock, NULL);
     pthread_mutex_init(&fs->fs_alock, NULL);
     pthread_mutex_init(&fs->fs_hlock, NULL);
+    pthread_mutex_init(&fs->fs_mlock, NULL);
     pthread_rwlock_init(&fs->fs_rwlock, NULL);
+    lc_arenaInit(fs);
     __sync_add_and_fetch(&gfs->gfs_count, 1);
     return fs;
 }
@@ -34,8 +37,8 @@ lc_invalidateInodeBlocks(struct gfs *gfs, struct fs *fs) {
         lc_releasePages(gfs, fs, page, true);
     }
     if (fs->fs_inodeBlocks) {
-        lc_free(fs->fs_rfs, fs->fs_inodeBlocks,
-                LC_BLOCK_SIZE, LC_MEMTYPE_DATA);
+        lc_freeBlockAligned(fs->fs_rfs, fs->fs_inodeBlocks,
+                            LC_MEMTYPE_DATA);
         fs->fs_inodeBlocks = NULL;
     }
 }
@@ -138,9 +141,11 @@ lc_freeLayer(struct fs *fs, bool remove) {
     pthread_mutex_destroy(&fs->fs_ilock);
 #endif
     pthread_mutex_destroy(&fs->fs_dilock);
+    pthread_mutex_destroy(&fs->fs_slock);
     pthread_mutex_destroy(&fs->fs_plock);
     pthread_mutex_destroy(&fs->fs_alock);
     pthread_mutex_destroy(&fs->fs_hlock);
+    pthread_mutex_destroy(&fs->fs_mlock);
 #endif
 #ifdef LC_RWLOCK_DESTROY
     pthread_rwlock_destroy(&fs->fs_rwlock);
@@ -152,8 +157,9 @@ lc_freeLayer(struct fs *fs, bool remove) {
     assert(!(fs->fs_super->sb_flags & LC_SUPER_DIRTY) || fs->fs_removed ||
            fs->fs_mcount || !fs->fs_frozen);
     lc_displayFtypeStats(fs);
-    lc_free(fs, fs->fs_super, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    lc_freeBlockAligned(fs, fs->fs_super, LC_MEMTYPE_BLOCK);
     lc_displayMemStats(fs);
+    lc_arenaDeinit(fs);
     lc_checkMemStats(fs, false);
     lc_free(NULL, fs, sizeof(struct fs), LC_MEMTYPE_GFS);
 }
@@ -161,6 +167,7 @@ lc_freeLayer(struct fs *fs, bool remove) {
 /* Delete a file system */
 void
 lc_destroyLayer(struct fs *fs, bool remove) {
+    lc_arenaBulk(fs);
     lc_freeChangeList(fs);
     lc_destroyInodes(fs, remove);
     lc_freeLayer(fs, remove);
@@ -206,6 +213,79 @@ lc_unlockExclusive(struct fs *fs) {
     lc_unlock(fs);
 }
 
+/* Try to lock a layer and all layers descending from it exclusive.  Called
+ * with gfs_lock held, so that layers are not added or removed meanwhile.
+ */
+bool
+lc_tryLockTree(struct fs *fs) {
+    struct fs *child, *cfs;
+
+    if (lc_tryLock(fs, true)) {
+        return false;
+    }
+    for (child = fs->fs_child; child; child = child->fs_next) {
+        if (!lc_tryLockTree(child)) {
+
+            /* Drop locks taken so far */
+            for (cfs = fs->fs_child; cfs != child; cfs = cfs->fs_next) {
+                lc_unlockTree(cfs);
+            }
+            lc_unlock(fs);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Unlock a layer and all layers descending from it */
+void
+lc_unlockTree(struct fs *fs) {
+    struct fs *child;
+
+    for (child = fs->fs_child; child; child = child->fs_next) {
+        lc_unlockTree(child);
+    }
+    lc_unlock(fs);
+}
+
+/* Return the hash list of a layer with the given root inode number */
+static inline int
+lc_rootHash(ino_t root) {
+    return root & (LC_ROOTHASH_SIZE - 1);
+}
+
+/* Record the root inode number of a layer and add it to the hash table used
+ * for finding layers using root inode numbers.  Called with gfs_lock held or
+ * while mounting.  Lookups are done in RCU read sections without locking, so
+ * the layer is linked after initializing it.  Index of a removed layer is not
+ * reused before readers are done with it, see lc_removeLayer().
+ */
+static void
+lc_addLayerRoot(struct gfs *gfs, int gindex, ino_t root) {
+    int hash = lc_rootHash(root);
+
+    assert(gindex > 0);
+    gfs->gfs_roots[gindex] = root;
+    gfs->gfs_rnext[gindex] = gfs->gfs_rhash[hash];
+    cmm_smp_wmb();
+    gfs->gfs_rhash[hash] = gindex;
+}
+
+/* Remove a layer from the hash table of root inode numbers.  Called with
+ * gfs_lock held.  Lookups could still be looking at the layer until a grace
+ * period elapses, so its next link and root are left alone.
+ */
+static void
+lc_removeLayerRoot(struct gfs *gfs, int gindex) {
+    uint16_t *prev = &gfs->gfs_rhash[lc_rootHash(gfs->gfs_roots[gindex])];
+
+    while (*prev != gindex) {
+        assert(*prev);
+        prev = &gfs->gfs_rnext[*prev];
+    }
+    *prev = gfs->gfs_rnext[gindex];
+}
+
 /* Check if the specified inode is a root of a file system and if so, return
  * the index of the new file system. Otherwise, return the index of current
  * file system.
@@ -220,11 +300,17 @@ lc_getIndex(struct fs *nfs, ino_t parent, ino_t ino) {
     if ((gindex == 0) && gfs->gfs_scount && (parent == gfs->gfs_layerRoot)) {
         root = lc_getInodeHandle(ino);
         assert(lc_globalRoot(ino));
-        for (i = 1; i <= gfs->gfs_scount; i++) {
+        lc_rcuRegister();
+        rcu_read_lock();
+        i = CMM_LOAD_SHARED(gfs->gfs_rhash[lc_rootHash(root)]);
+        while (i) {
             if (gfs->gfs_roots[i] == root) {
-                return i;
+                gindex = i;
+                break;
             }
+            i = CMM_LOAD_SHARED(gfs->gfs_rnext[i]);
         }
+        rcu_read_unlock();
     }
     return gindex;
 }
@@ -280,12 +366,48 @@ lc_removeChild(struct fs *fs) {
     }
 }
 
+/* Key for unregistering threads from RCU as those exit */
+static pthread_key_t lc_rcuKey;
+static pthread_once_t lc_rcuOnce = PTHREAD_ONCE_INIT;
+
+/* Unregister an exiting thread from RCU */
+static void
+lc_rcuUnregister(void *data) {
+    rcu_unregister_thread();
+}
+
+/* Create key for unregistering threads from RCU */
+static void
+lc_rcuKeyCreate(void) {
+    int err = pthread_key_create(&lc_rcuKey, lc_rcuUnregister);
+
+    assert(err == 0);
+}
+
+/* Register calling thread with RCU.  Threads stay registered until those
+ * exit, as RCU is used while looking up pages in block cache.
+ */
+void
+lc_rcuRegister(void) {
+    static __thread bool registered;
+
+    if (!registered) {
+        pthread_once(&lc_rcuOnce, lc_rcuKeyCreate);
+        rcu_register_thread();
+        pthread_setspecific(lc_rcuKey, (void *)1);
+        registered = true;
+    }
+}
+
 /* Remove a layer from the list of layers */
 void
 lc_removeLayer(struct gfs *gfs, struct fs *fs, int gindex) {
     fs->fs_removed = true;
     assert(gfs->gfs_roots[gindex] == fs->fs_root);
     rcu_assign_pointer(gfs->gfs_fs[gindex], NULL);
+    lc_removeLayerRoot(gfs, gindex);
+
+    /* Index is not reused until this returns, as gfs_lock is held */
     synchronize_rcu();
     gfs->gfs_roots[gindex] = 0;
     lc_removeChild(fs);
@@ -417,7 +539,7 @@ lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval) {
             fs->fs_gindex = i;
             fs->fs_super->sb_index = i;
             gfs->gfs_fs[i] = fs;
-            gfs->gfs_roots[i] = fs->fs_root;
+            lc_addLayerRoot(gfs, i, fs->fs_root);
             if (i > gfs->gfs_scount) {
                 gfs->gfs_scount = i;
             }
@@ -467,15 +589,32 @@ lc_gfsInit(struct gfs *gfs) {
     lc_mallocBlockAligned(NULL, (void **)&gfs->gfs_zPage, LC_MEMTYPE_GFS);
     memset(gfs->gfs_zPage, 0, LC_BLOCK_SIZE);
     memset(gfs->gfs_roots, 0, sizeof(ino_t) * LC_LAYER_MAX);
+    gfs->gfs_rhash = lc_malloc(NULL, sizeof(uint16_t) * LC_ROOTHASH_SIZE,
+                               LC_MEMTYPE_GFS);
+    memset(gfs->gfs_rhash, 0, sizeof(uint16_t) * LC_ROOTHASH_SIZE);
+    gfs->gfs_rnext = lc_malloc(NULL, sizeof(uint16_t) * LC_LAYER_MAX,
+                               LC_MEMTYPE_GFS);
+    gfs->gfs_raStreams = lc_malloc(NULL,
+                                   sizeof(struct rastream) * LC_RA_STREAMS,
+                                   LC_MEMTYPE_GFS);
+    memset(gfs->gfs_raStreams, 0, sizeof(struct rastream) * LC_RA_STREAMS);
+    gfs->gfs_flushQueue = lc_malloc(NULL, sizeof(uint16_t) * LC_LAYER_MAX,
+                                    LC_MEMTYPE_GFS);
+    gfs->gfs_flushState = lc_malloc(NULL, sizeof(uint8_t) * LC_LAYER_MAX,
+                                    LC_MEMTYPE_GFS);
+    memset(gfs->gfs_flushState, 0, sizeof(uint8_t) * LC_LAYER_MAX);
     gfs->gfs_syncInterval = LC_SYNC_INTERVAL;
     pthread_cond_init(&gfs->gfs_mcond, NULL);
     pthread_cond_init(&gfs->gfs_flusherCond, NULL);
     pthread_cond_init(&gfs->gfs_cleanerCond, NULL);
+    pthread_cond_init(&gfs->gfs_raCond, NULL);
+    pthread_cond_init(&gfs->gfs_flushWorkCond, NULL);
     pthread_mutex_init(&gfs->gfs_lock, NULL);
     pthread_mutex_init(&gfs->gfs_alock, NULL);
     pthread_mutex_init(&gfs->gfs_clock, NULL);
     pthread_mutex_init(&gfs->gfs_flock, NULL);
     pthread_mutex_init(&gfs->gfs_slock, NULL);
+    pthread_mutex_init(&gfs->gfs_raLock, NULL);
 }
 
 /* Free resources allocated for the global file system */
@@ -485,22 +624,41 @@ lc_gfsDeinit(struct gfs *gfs) {
 
     assert(gfs->gfs_pcount == 0);
     assert(gfs->gfs_dcount == 0);
-    assert(gfs->gfs_extents == NULL);
+    assert(gfs->gfs_space == NULL);
     assert(gfs->gfs_fextents == NULL);
+
+    /* Wait for pages freed to be released */
+    lc_rcuRegister();
+    rcu_barrier();
+    lc_ioDeinit(gfs);
     if (gfs->gfs_fd) {
         err = fsync(gfs->gfs_fd);
         assert(err == 0);
     }
     assert(gfs->gfs_count == 0);
-    lc_free(NULL, gfs->gfs_zPage, LC_BLOCK_SIZE, LC_MEMTYPE_GFS);
+    lc_freeBlockAligned(NULL, gfs->gfs_zPage, LC_MEMTYPE_GFS);
     lc_free(NULL, gfs->gfs_fs, sizeof(struct fs *) * LC_LAYER_MAX,
             LC_MEMTYPE_GFS);
     lc_free(NULL, gfs->gfs_roots, sizeof(ino_t) * LC_LAYER_MAX,
             LC_MEMTYPE_GFS);
+    lc_free(NULL, gfs->gfs_rhash, sizeof(uint16_t) * LC_ROOTHASH_SIZE,
+            LC_MEMTYPE_GFS);
+    lc_free(NULL, gfs->gfs_rnext, sizeof(uint16_t) * LC_LAYER_MAX,
+            LC_MEMTYPE_GFS);
+    assert(gfs->gfs_raHead == NULL);
+    lc_free(NULL, gfs->gfs_raStreams, sizeof(struct rastream) * LC_RA_STREAMS,
+            LC_MEMTYPE_GFS);
+    lc_free(NULL, gfs->gfs_flushQueue, sizeof(uint16_t) * LC_LAYER_MAX,
+            LC_MEMTYPE_GFS);
+    lc_free(NULL, gfs->gfs_flushState, sizeof(uint8_t) * LC_LAYER_MAX,
+            LC_MEMTYPE_GFS);
+    lc_istringDeinit();
 #ifdef LC_COND_DESTROY
     pthread_cond_destroy(&gfs->gfs_mcond);
     pthread_cond_destroy(&gfs->gfs_flusherCond);
     pthread_cond_destroy(&gfs->gfs_cleanerCond);
+    pthread_cond_destroy(&gfs->gfs_raCond);
+    pthread_cond_destroy(&gfs->gfs_flushWorkCond);
 #endif
 #ifdef LC_MUTEX_DESTROY
     pthread_mutex_destroy(&gfs->gfs_lock);
@@ -508,6 +666,7 @@ lc_gfsDeinit(struct gfs *gfs) {
     pthread_mutex_destroy(&gfs->gfs_clock);
     pthread_mutex_destroy(&gfs->gfs_flock);
     pthread_mutex_destroy(&gfs->gfs_slock);
+    pthread_mutex_destroy(&gfs->gfs_raLock);
 #endif
 }
 
@@ -546,7 +705,7 @@ lc_initLayer(struct gfs *gfs, struct fs *pfs, uint64_t block, bool child) {
         assert(fs->fs_readOnly);
         fs->fs_prev = pfs;
         pfs->fs_next = fs;
-        lc_bcacheInit(fs, LC_PCACHE_SIZE, LC_PCLOCK_COUNT);
+        lc_bcacheInit(fs, LC_PCACHE_SIZE_MIN, LC_PCLOCK_COUNT);
         fs->fs_rfs = fs;
         fs->fs_frozen = true;
     } else {
@@ -570,7 +729,7 @@ lc_initLayer(struct gfs *gfs, struct fs *pfs, uint64_t block, bool child) {
     assert(i < LC_LAYER_MAX);
     assert(gfs->gfs_fs[i] == NULL);
     gfs->gfs_fs[i] = fs;
-    gfs->gfs_roots[i] = fs->fs_root;
+    lc_addLayerRoot(gfs, i, fs->fs_root);
     if (i > gfs->gfs_scount) {
         gfs->gfs_scount = i;
     }
@@ -633,15 +792,116 @@ lc_setupSpecialInodes(struct gfs *gfs, struct fs *fs) {
     }
 }
 
+/* State shared by threads reading layers while mounting */
+struct lc_mountReader {
+
+    /* Global file system */
+    struct gfs *mr_gfs;
+
+    /* Next index in gfs_fs to be picked up by a thread */
+    int mr_next;
+};
+
+/* Check if a layer needs root directory of its parent layer to be read in
+ * first.  This happens when a layer crashed before it could be unmounted.
+ */
+static inline bool
+lc_layerNeedsParent(struct fs *fs) {
+    return fs->fs_gindex &&
+           (fs->fs_super->sb_inodeBlock == LC_INVALID_BLOCK);
+}
+
+/* Read extents and inodes of a layer */
+static void
+lc_readLayer(struct gfs *gfs, struct fs *fs) {
+    lc_readExtents(gfs, fs);
+    lc_readInodes(gfs, fs);
+    if (fs->fs_gindex) {
+        fs->fs_locked = false;
+    }
+}
+
+/* Read a layer after making sure root directory of parent is read in */
+static void
+lc_readLayerAfterParent(struct gfs *gfs, struct fs *fs) {
+    struct fs *pfs = fs->fs_parent;
+
+    if (pfs->fs_rootInode == NULL) {
+        lc_readLayerAfterParent(gfs, pfs);
+    }
+    lc_readLayer(gfs, fs);
+}
+
+/* Pick up layers not read yet and read those */
+static void *
+lc_readLayersWorker(void *data) {
+    struct lc_mountReader *mr = (struct lc_mountReader *)data;
+    struct gfs *gfs = mr->mr_gfs;
+    struct fs *fs;
+    int i;
+
+    lc_rcuRegister();
+    while ((i = __sync_fetch_and_add(&mr->mr_next, 1)) <= gfs->gfs_scount) {
+        fs = gfs->gfs_fs[i];
+        if (fs && !lc_layerNeedsParent(fs)) {
+            lc_readLayer(gfs, fs);
+        }
+    }
+    return NULL;
+}
+
+/* Read all layers after super blocks are read in.  Layers do not depend on
+ * each other and are read in parallel using a few threads, except the ones
+ * which need the root directory of the parent layer, which are read after
+ * every other layer is read in.
+ */
+static void
+lc_readLayers(struct gfs *gfs) {
+    pthread_t readers[LC_MOUNT_THREADS];
+    struct lc_mountReader mr;
+    int i, count, err;
+    struct fs *fs;
+
+    mr.mr_gfs = gfs;
+    mr.mr_next = 0;
+    count = gfs->gfs_scount + 1;
+    if (count > LC_MOUNT_THREADS) {
+        count = LC_MOUNT_THREADS;
+    }
+
+    /* Calling thread reads layers as well */
+    for (i = 1; i < count; i++) {
+        err = pthread_create(&readers[i], NULL, lc_readLayersWorker, &mr);
+        if (err) {
+            lc_syslog(LOG_ERR, "Failed to create mount thread, err %d\n",
+                      err);
+            break;
+        }
+    }
+    count = i;
+    lc_readLayersWorker(&mr);
+    for (i = 1; i < count; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    /* Read layers which could not be read in parallel */
+    for (i = 1; i <= gfs->gfs_scount; i++) {
+        fs = gfs->gfs_fs[i];
+        if (fs && lc_layerNeedsParent(fs) && (fs->fs_rootInode == NULL)) {
+            lc_readLayerAfterParent(gfs, fs);
+        }
+    }
+}
+
 /* Mount the device */
 void
 lc_mount(struct gfs *gfs, char *device, bool ftypes, size_t size,
          bool format) {
     bool grow = false;
     struct fs *fs;
-    int i;
 
     lc_gfsInit(gfs);
+    lc_ioInit(gfs);
 
     /* Initialize a file system structure in memory */
     fs = lc_newLayer(gfs, true);
@@ -674,17 +934,11 @@ lc_mount(struct gfs *gfs, char *device, bool ftypes, size_t size,
         if (gfs->gfs_super->sb_pcache) {
             lc_memoryInit(gfs->gfs_super->sb_pcache);
         }
-        lc_initLayers(gfs, fs);
-        for (i = 0; i <= gfs->gfs_scount; i++) {
-            fs = gfs->gfs_fs[i];
-            if (fs) {
-                lc_readExtents(gfs, fs);
-                lc_readInodes(gfs, fs);
-                if (i) {
-                    fs->fs_locked = false;
-                }
-            }
+        if (gfs->gfs_super->sb_icache) {
+            lc_metaMemoryInit(gfs->gfs_super->sb_icache * 1024ull * 1024ull);
         }
+        lc_initLayers(gfs, fs);
+        lc_readLayers(gfs);
         fs = lc_getGlobalFs(gfs);
         lc_setupSpecialInodes(gfs, fs);
         lc_cleanupAfterRestart(gfs, fs);
@@ -863,7 +1117,7 @@ lc_commit(struct gfs *gfs) {
     }
 
     /* Sync all layers */
-    rcu_register_thread();
+    lc_rcuRegister();
     rcu_read_lock();
     count = gfs->gfs_syncRequired;
     for (i = 1; i <= gfs->gfs_scount; i++) {
@@ -880,13 +1134,11 @@ lc_commit(struct gfs *gfs) {
         if (fs->fs_dpcount || fs->fs_pcount) {
             if (lc_tryLock(fs, false)) {
                 rcu_read_unlock();
-                rcu_unregister_thread();
                 return;
             }
             rcu_read_unlock();
             if (gfs->gfs_layerInProgress) {
                 lc_unlock(fs);
-                rcu_unregister_thread();
                 return;
             }
             assert(gindex == fs->fs_gindex);
@@ -903,14 +1155,12 @@ lc_commit(struct gfs *gfs) {
         if ((fs == NULL) || (gindex != fs->fs_gindex) ||
             gfs->gfs_layerInProgress || lc_tryLock(fs, true)) {
             rcu_read_unlock();
-            rcu_unregister_thread();
             return;
         }
         rcu_read_unlock();
         assert(gindex == fs->fs_gindex);
         if (gfs->gfs_layerInProgress) {
             lc_unlock(fs);
-            rcu_unregister_thread();
             return;
         }
         lc_sync(gfs, fs, false);
@@ -929,7 +1179,6 @@ lc_commit(struct gfs *gfs) {
         if (fs && fs->fs_frozen && fs->fs_dpcount) {
             if (lc_tryLock(fs, false)) {
                 rcu_read_unlock();
-                rcu_unregister_thread();
                 return;
             }
             rcu_read_unlock();
@@ -939,7 +1188,6 @@ lc_commit(struct gfs *gfs) {
         }
     }
     rcu_read_unlock();
-    rcu_unregister_thread();
     if ((gfs->gfs_layerInProgress == 0) && (count == gfs->gfs_syncRequired)) {
 
         /* Sync everything from the root layer */
@@ -970,6 +1218,7 @@ lc_syncer(void *data) {
         pthread_mutex_unlock(&gfs->gfs_slock);
         if (!gfs->gfs_unmounting) {
             lc_commit(gfs);
+            lc_shrinkInodeCache(gfs);
         }
     }
     return NULL;
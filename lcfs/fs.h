@@ -4,6 +4,9 @@
 /* Maximum number of layers */
 #define LC_LAYER_MAX  65535ull
 
+/* Number of hash lists for looking up layers using root inode numbers */
+#define LC_ROOTHASH_SIZE 4096
+
 /* Sessions for the mount points */
 enum lc_mountId {
     LC_BASE_MOUNT = 0,  /* Mount for base file system */
@@ -16,6 +19,9 @@ enum lc_mountId {
 /* Time in seconds syncer is woken to checkpoint file system */
 #define LC_SYNC_INTERVAL       60
 
+/* Maximum number of threads reading layers while mounting */
+#define LC_MOUNT_THREADS       8
+
 /* Global file system */
 struct gfs {
 
@@ -46,6 +52,14 @@ struct gfs {
     /* List of file system roots */
     ino_t *gfs_roots;
 
+    /* Hash lists of layers indexed by root inode number, linked through
+     * gfs_rnext, with 0 terminating a list.
+     */
+    uint16_t *gfs_rhash;
+
+    /* Next layer in the hash list of root inode numbers */
+    uint16_t *gfs_rnext;
+
     /* List of layer file systems starting with global root fs */
     struct fs **gfs_fs;
 
@@ -86,11 +100,11 @@ struct gfs {
     /* Number of blocks reserved */
     uint64_t gfs_blocksReserved;
 
-    /* Global list of extents tracking unused space */
-    struct extent *gfs_extents;
+    /* Global map of extents tracking unused space */
+    struct spacemap *gfs_space;
 
     /* Extents freed from layers. Not for reuse until commit */
-    struct extent *gfs_fextents;
+    struct spacemap *gfs_fextents;
 
     /* Lock protecting allocations */
     pthread_mutex_t gfs_alock;
@@ -110,6 +124,39 @@ struct gfs {
     /* Condition variable syncer thread is waiting on */
     pthread_cond_t gfs_syncerCond;
 
+    /* Sequential read streams tracked for readahead */
+    struct rastream *gfs_raStreams;
+
+    /* Queue of readahead requests */
+    struct rarequest *gfs_raHead;
+
+    /* Last request in the readahead queue */
+    struct rarequest *gfs_raTail;
+
+    /* Lock protecting readahead queue */
+    pthread_mutex_t gfs_raLock;
+
+    /* Condition variable readahead threads are waiting on */
+    pthread_cond_t gfs_raCond;
+
+    /* Number of readahead requests queued */
+    uint32_t gfs_raCount;
+
+    /* Indices of layers queued for flushing */
+    uint16_t *gfs_flushQueue;
+
+    /* Flush state of each layer, indexed by layer index */
+    uint8_t *gfs_flushState;
+
+    /* First entry in the flush queue */
+    uint32_t gfs_flushHead;
+
+    /* Number of layers in the flush queue */
+    uint32_t gfs_flushCount;
+
+    /* Condition variable flusher threads are waiting on for work */
+    pthread_cond_t gfs_flushWorkCond;
+
     /* Count of pages in use */
     uint64_t gfs_pcount;
 
@@ -131,6 +178,18 @@ struct gfs {
     /* Pages hit in cache */
     uint64_t gfs_phit;
 
+    /* Pages hit in protected queue of cache */
+    uint64_t gfs_pahit;
+
+    /* Pages promoted to protected queue */
+    uint64_t gfs_ppromoted;
+
+    /* Pages demoted to probation queue */
+    uint64_t gfs_pdemoted;
+
+    /* Pages evicted from protected queue */
+    uint64_t gfs_paevicted;
+
     /* Pages missed in cache */
     uint64_t gfs_pmissed;
 
@@ -143,6 +202,12 @@ struct gfs {
     /* Pages reused */
     uint64_t gfs_preused;
 
+    /* Pages read ahead */
+    uint64_t gfs_raPages;
+
+    /* Time writers were throttled in microseconds */
+    uint64_t gfs_throttleTime;
+
     /* Sync interval in seconds */
     int gfs_syncInterval;
 
@@ -180,6 +245,9 @@ struct gfs {
 
     /* Set if layers are swapped during commit */
     bool gfs_swapLayersForCommit;
+
+    /* Set if device is accessed bypassing host page cache */
+    bool gfs_directIO;
 } __attribute__((packed));
 
 /* A file system structure created for each layer */
@@ -215,6 +283,24 @@ struct fs {
     /* Number of hash lists in icache */
     uint64_t fs_icacheSize;
 
+    /* Inode hash table with inodes being moved to icache while resizing */
+    struct icache *fs_icacheOld;
+
+    /* Number of hash lists in fs_icacheOld */
+    uint64_t fs_icacheOldSize;
+
+    /* Hash lists in fs_icacheOld already moved to icache */
+    uint64_t fs_icacheMoved;
+
+    /* Odd while inodes are moved between hash tables */
+    uint64_t fs_icacheSeq;
+
+    /* Filter of inodes present in an immutable layer */
+    uint64_t *fs_ifilter;
+
+    /* Number of words in fs_ifilter minus one */
+    uint64_t fs_ifilterMask;
+
     /* Page block hash table */
     struct lbcache *fs_bcache;
 
@@ -276,6 +362,18 @@ struct fs {
     /* Lock protecting fs_dirtyInodes list */
     pthread_mutex_t fs_dilock;
 
+    /* Inodes modified since last sync */
+    struct inode **fs_syncList;
+
+    /* Number of inodes in fs_syncList */
+    uint64_t fs_syncCount;
+
+    /* Number of slots allocated in fs_syncList */
+    uint64_t fs_syncSize;
+
+    /* Lock protecting fs_syncList */
+    pthread_mutex_t fs_slock;
+
     /* Approximate size of the layer */
     uint64_t fs_size;
 
@@ -300,6 +398,9 @@ struct fs {
     /* Lock protecting hardlinks list */
     pthread_mutex_t fs_hlock;
 
+    /* Lock serializing reading metadata of inodes when first accessed */
+    pthread_mutex_t fs_mlock;
+
     /* Changes in this layer compared to parent */
     struct cdir *fs_changes;
 
@@ -307,7 +408,7 @@ struct fs {
     struct extent *fs_extents;
 
     /* Extents allocated by a layer.  Not used for root layer */
-    struct extent *fs_aextents;
+    struct spacemap *fs_aextents;
 
     /* Extents freed in layer, including inherited from parent layer */
     struct extent *fs_fextents;
@@ -348,6 +449,47 @@ struct fs {
     /* Inodes written */
     uint64_t fs_iwrite;
 
+    /* Inodes with metadata read after mount */
+    uint64_t fs_iload;
+
+    /* Inodes with metadata released for staying under memory limit */
+    uint64_t fs_ievict;
+
+    /* Memory used for metadata of inodes which could be released */
+    uint64_t fs_imemory;
+
+    /* Inode cache hash list to scan next while releasing metadata */
+    uint64_t fs_ievictIndex;
+
+    /* Lookup references dropped while the layer was locked exclusive */
+    struct iforget *fs_forgets;
+
+    /* Dirty pages written back */
+    uint64_t fs_wbPages;
+
+    /* Pages written back when bandwidth was last sampled */
+    uint64_t fs_wbLast;
+
+    /* Time bandwidth was last sampled in microseconds */
+    uint64_t fs_wbTime;
+
+    /* Estimated write back bandwidth in pages per second */
+    uint64_t fs_wbBandwidth;
+
+    /* Time writers were throttled in microseconds */
+    uint64_t fs_throttleTime;
+
+    /* Number of times writers were throttled */
+    uint64_t fs_throttleCount;
+
+    /* Pauses owed by writers of the layer in microseconds, accumulated until
+     * worth sleeping for.
+     */
+    uint64_t fs_throttleDebt;
+
+    /* Arena for metadata objects */
+    struct marena *fs_arena;
+
     /* Memory in use */
     uint64_t fs_memory;
 
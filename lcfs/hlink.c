@@ -8,7 +8,7 @@ lc_copyHlinks(struct fs *fs) {
     assert(fs->fs_sharedHlinks);
     fs->fs_hlinks = NULL;
     while (hldata) {
-        new = lc_malloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+        new = lc_arenaAlloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
         new->hl_ino = hldata->hl_ino;
         new->hl_parent = hldata->hl_parent;
         new->hl_nlink = hldata->hl_nlink;
@@ -48,7 +48,7 @@ lc_addHlink(struct fs *fs, struct inode *inode, ino_t parent) {
     /* If the current parent does not have a hardlink record, create one */
     if (!(inode->i_flags & LC_INODE_MLINKS)) {
         inode->i_flags |= LC_INODE_MLINKS;
-        hldata = lc_malloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+        hldata = lc_arenaAlloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
         hldata->hl_ino = ino;
         hldata->hl_parent = (inode->i_parent == fs->fs_root) ?
                                 LC_ROOT_INODE : inode->i_parent;
@@ -85,7 +85,7 @@ lc_addHlink(struct fs *fs, struct inode *inode, ino_t parent) {
     } else {
 
         /* Create a new hardlink record */
-        hldata = lc_malloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+        hldata = lc_arenaAlloc(fs, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
         hldata->hl_ino = ino;
         hldata->hl_parent = parent;
         hldata->hl_nlink = 1;
@@ -134,7 +134,7 @@ lc_removeHlink(struct fs *fs, struct inode *inode, ino_t parent) {
     if (hldata->hl_nlink == 0) {
         *prev = hldata->hl_next;
         pthread_mutex_unlock(&fs->fs_hlock);
-        lc_free(fs, hldata, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+        lc_arenaFree(fs, hldata, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
     } else {
         pthread_mutex_unlock(&fs->fs_hlock);
     }
@@ -146,12 +146,14 @@ lc_freeHlinks(struct fs *fs) {
     struct hldata *hldata = fs->fs_hlinks, *tmp;
 
     fs->fs_hlinks = NULL;
+
+    /* Records shared with the parent layer are freed with that layer */
     if (fs->fs_sharedHlinks) {
         return;
     }
     while (hldata) {
         tmp = hldata;
         hldata = hldata->hl_next;
-        lc_free(fs, tmp, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+        lc_arenaFree(fs, tmp, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
     }
 }
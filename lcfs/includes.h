@@ -30,6 +30,7 @@
 #include <zlib.h>
 #include <assert.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <urcu.h>
 #include <nmmintrin.h>
@@ -52,6 +53,7 @@
 #include "memory.h"
 #include "fs.h"
 #include "inode.h"
+#include "tree.h"
 #include "extent.h"
 #include "page.h"
 #include "diff.h"
@@ -69,16 +71,36 @@ int lcfs_main(char *pgm, int argc, char *argv[]);
 int ioctl_main(char *pgm, int argc, char *argv[]);
 
 void lc_memStatsEnable();
+void lc_memHugePagesEnable();
 uint64_t lc_memoryInit(uint64_t limit);
 void *lc_malloc(struct fs *fs, size_t size, enum lc_memTypes type);
 void lc_mallocBlockAligned(struct fs *fs, void **memptr,
                            enum lc_memTypes type);
+void lc_freeBlockAligned(struct fs *fs, void *ptr, enum lc_memTypes type);
 void lc_free(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type);
+void lc_arenaInit(struct fs *fs);
+void *lc_arenaAlloc(struct fs *fs, size_t size, enum lc_memTypes type);
+void lc_arenaFree(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type);
+bool lc_arenaBulk(struct fs *fs);
+void lc_arenaDeinit(struct fs *fs);
+void lc_arenaShrink(struct fs *fs, void *ptr, size_t size);
+void lc_freeRcu(struct fs *fs, struct rcu_head *head, size_t size,
+                enum lc_memTypes type, void (*func)(struct rcu_head *head));
 void lc_memMove(struct fs *fs, struct fs *to, size_t size,
                 enum lc_memTypes type);
+char *lc_istringGet(const char *data, uint32_t size);
+char *lc_istringDup(char *str);
+uint64_t lc_istringShare(char *str);
+void lc_istringRelease(char *str);
+void lc_istringDeinit(void);
 bool lc_checkMemoryAvailable(bool flush);
 void lc_waitMemory(struct gfs *gfs, bool wait);
-void lc_memUpdateTotal(struct fs *fs, size_t size);
+uint64_t lc_metaMemoryInit(uint64_t limit);
+void lc_metaMemoryAdd(struct fs *fs, uint64_t size);
+void lc_metaMemoryRemove(struct fs *fs, uint64_t size);
+uint64_t lc_metaMemoryExcess(void);
+uint64_t lc_throttleWrite(struct fs *fs, uint64_t pcount);
+void lc_memRelease(void);
 void lc_memTransferCount(struct fs *fs, struct fs *rfs, uint64_t count,
                          enum lc_memTypes type);
 void lc_memTransferExtents(struct gfs *gfs, struct fs *fs, struct fs *cfs,
@@ -87,16 +109,21 @@ void lc_checkMemStats(struct fs *fs, bool unmount);
 void lc_displayGlobalMemStats();
 void lc_displayMemStats(struct fs *fs);
 
+void lc_ioInit(struct gfs *gfs);
+void lc_ioDeinit(struct gfs *gfs);
+void lc_ioBatchInit(struct iobatch *batch);
+void lc_ioBatchDeinit(struct iobatch *batch);
+void lc_ioBatchWait(struct gfs *gfs, struct iobatch *batch);
 void lc_readBlock(struct gfs *gfs, struct fs *fs, off_t block, void *dbuf);
 void lc_readBlocks(struct gfs *gfs, struct fs *fs, struct iovec *iov,
-                   int iovcnt, off_t block);
+                   int iovcnt, off_t block, struct iobatch *batch);
 void lc_writeBlock(struct gfs *gfs, struct fs *fs, void *buf, off_t block);
-void lc_writeBlocks(struct gfs *gfs, struct fs *fs,
-                    struct iovec *iov, int iovcnt, off_t block);
+void lc_writeBlocks(struct gfs *gfs, struct fs *fs, struct iovec *iov,
+                    int iovcnt, off_t block, struct iobatch *batch);
 void lc_updateCRC(void *buf, uint32_t *crc);
 void lc_verifyBlock(void *buf, uint32_t *crc);
 
-int lc_deviceOpen(char *device);
+int lc_deviceOpen(char *device, bool *direct);
 uint64_t lc_getTotalMemory();
 
 void lc_addExtent(struct gfs *gfs, struct fs *fs, struct extent **extents,
@@ -108,6 +135,23 @@ void lc_freeExtent(struct gfs *gfs, struct fs *fs, struct extent *extent,
 void lc_inodeAddMetaExtent(struct gfs *gfs, struct fs *fs,
                            struct extent **extents, uint64_t start,
                            uint64_t count, bool sort);
+struct spacemap *lc_spaceInit(struct fs *fs, bool length);
+void lc_spaceAdd(struct fs *fs, struct spacemap *space, uint64_t start,
+                 uint64_t count);
+uint64_t lc_spaceRemove(struct fs *fs, struct spacemap *space, uint64_t start,
+                        uint64_t count);
+uint64_t lc_spaceAlloc(struct fs *fs, struct spacemap *space, uint64_t count);
+struct fextent *lc_spaceFirst(struct spacemap *space);
+struct fextent *lc_spaceNext(struct fextent *fextent);
+uint64_t lc_spaceCount(struct spacemap *space);
+void lc_spaceDeinit(struct fs *fs, struct spacemap *space);
+
+void lc_treeInit(struct tree *tree, lc_treeCompare compare);
+void lc_treeInsert(struct tree *tree, struct tnode *node);
+void lc_treeRemove(struct tree *tree, struct tnode *node);
+struct tnode *lc_treeFirst(struct tree *tree);
+struct tnode *lc_treeNext(struct tnode *node);
+struct tnode *lc_treeSearch(struct tree *tree, struct tnode *key, bool ceil);
 
 void lc_blockAllocatorInit(struct gfs *gfs, struct fs *fs);
 void lc_processFreeExtents(struct gfs *gfs, struct fs *fs, bool umount);
@@ -145,6 +189,7 @@ struct fs *lc_getLayerLocked(ino_t ino, bool exclusive);
 uint64_t lc_getLayerForRemoval(struct gfs *gfs, ino_t root, struct fs **fsp);
 int lc_getIndex(struct fs *nfs, ino_t parent, ino_t ino);
 int lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval);
+void lc_rcuRegister(void);
 void lc_removeLayer(struct gfs *gfs, struct fs *fs, int gindex);
 void lc_addChild(struct gfs *gfs, struct fs *pfs, struct fs *fs);
 void lc_removeChild(struct fs *fs);
@@ -153,6 +198,8 @@ int lc_tryLock(struct fs *fs, bool exclusive);
 void lc_lockExclusive(struct fs *fs);
 void lc_unlock(struct fs *fs);
 void lc_unlockExclusive(struct fs *fs);
+bool lc_tryLockTree(struct fs *fs);
+void lc_unlockTree(struct fs *fs);
 void lc_mount(struct gfs *gfs, char *device, bool ftypes, size_t size,
               bool format);
 void lc_cleanupAfterRestart(struct gfs *gfs, struct fs *fs);
@@ -167,6 +214,8 @@ struct fs *lc_newLayer(struct gfs *gfs, bool rw);
 void lc_destroyLayer(struct fs *fs, bool remove);
 
 void lc_icache_init(struct fs *fs, size_t size);
+void lc_icacheRehashDone(struct fs *fs);
+void lc_markInodeDirty(struct inode *inode, uint32_t flags);
 void lc_icache_deinit(struct icache *icache);
 void lc_copyStat(struct stat *st, struct inode *inode);
 void lc_copyFakeStat(struct stat *st);
@@ -174,8 +223,17 @@ ino_t lc_inodeAlloc(struct fs *fs);
 void lc_updateFtypeStats(struct fs *fs, mode_t mode, bool incr);
 void lc_displayFtypeStats(struct fs *fs);
 void lc_readInodes(struct gfs *gfs, struct fs *fs);
+void lc_inodeLoad(struct inode *inode);
+void lc_inodeRef(struct inode *inode, uint64_t count);
+void lc_inodeUnref(struct inode *inode, uint64_t count);
+void lc_inodeForget(struct fs *fs, ino_t ino, uint64_t nlookup);
+void lc_inodeForgetDefer(struct fs *fs, ino_t ino, uint64_t nlookup);
+void lc_inodeForgetDeferred(struct fs *fs, bool apply);
+void lc_shrinkInodeCache(struct gfs *gfs);
 void lc_destroyInodes(struct fs *fs, bool remove);
-struct inode *lc_lookupInodeCache(struct fs *fs, ino_t ino, int hash);
+struct inode *lc_lookupInodeCache(struct fs *fs, ino_t ino);
+void lc_lookupInodes(struct fs *fs, ino_t *inos, struct inode **inodes,
+                     int count);
 struct inode *lc_getInode(struct fs *fs, ino_t ino, struct inode *handle,
                           bool copy, bool exclusive);
 struct inode *lc_inodeInit(struct fs *fs, mode_t mode,
@@ -209,6 +267,9 @@ void lc_dirRemove(struct inode *dir, const char *name);
 void lc_dirRename(struct inode *dir, ino_t ino,
                    const char *name, const char *newname);
 void lc_dirCopy(struct inode *dir);
+void lc_dirOverlay(struct inode *dir);
+void lc_dirMaterialize(struct inode *dir);
+void lc_dirPack(struct fs *fs, struct inode *dir);
 void lc_dirRead(struct gfs *gfs, struct fs *fs, struct inode *dir, void *buf);
 void lc_dirFlush(struct gfs *gfs, struct fs *fs, struct inode *dir);
 void lc_removeTree(struct fs *fs, struct inode *dir);
@@ -219,6 +280,7 @@ void  lc_dirConvertHashed(struct fs *fs, struct inode *dir);
 void lc_dirFreeHash(struct fs *fs, struct inode *dir);
 void lc_dirFree(struct inode *dir);
 
+void lc_emapIndexFree(struct inode *inode);
 uint64_t lc_inodeEmapLookup(struct gfs *gfs, struct inode *inode,
                             uint64_t page, struct extent **extents);
 void lc_copyEmap(struct gfs *gfs, struct fs *fs, struct inode *inode);
@@ -261,12 +323,16 @@ void lc_addPageForWriteBack(struct gfs *gfs, struct fs *fs, struct page *head,
 void lc_insertPagesToFreeList(struct lbcache *lbcache, struct page *first,
                               struct page *last);
 void lc_processHiddenInodes(struct gfs *gfs, struct fs *fs);
+void lc_flushQueue(struct gfs *gfs, int gindex);
+void *lc_flushWorker(void *data);
 void *lc_flusher(void *data);
+void lc_readAheadQueue(struct gfs *gfs, struct fs *fs, uint64_t block,
+                       uint32_t count);
+void *lc_readAhead(void *data);
 void lc_cleaner(void);
 
-uint64_t lc_copyPages(struct fs *fs, off_t off, size_t size,
-                      struct dpage *dpages, struct fuse_bufvec *bufv,
-                      struct fuse_bufvec *dst);
+int lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
+                 struct fuse_bufvec *bufv, uint64_t *pcountp);
 void lc_updateInodeSize(struct gfs *gfs, struct inode *inode,
                         bool zero, uint64_t size);
 uint64_t lc_addPages(struct inode *inode, off_t off, size_t size,
@@ -300,6 +366,7 @@ bool lc_xattrCopy(struct inode *inode, struct inode *parent);
 void lc_xattrFlush(struct gfs *gfs, struct fs *fs, struct inode *inode);
 void lc_xattrRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
                   void *buf);
+void lc_xattrEnable(struct gfs *gfs, struct fs *fs);
 void lc_xattrFree(struct inode *inode);
 
 ino_t lc_getRootIno(struct fs *fs, const char *name, struct inode *pdir,
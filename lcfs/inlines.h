@@ -75,6 +75,35 @@ lc_atomicUpdate(struct fs *fs, uint64_t *value, uint64_t change, bool incr) {
     }
 }
 
+/* Mix bits of a 64 bit value, so that hash tables indexed using some of the
+ * bits of the result are used evenly.
+ */
+static inline uint64_t
+lc_hashMix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Calculate hash value for a name or any other string */
+static inline uint32_t
+lc_nameHash(const char *name, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ul;
+    size_t i;
+
+    /* FNV-1a over the whole name, followed by a finalizer so that the upper
+     * bits used for picking a hash list depend on every byte of the name.
+     */
+    for (i = 0; i < size; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3ul;
+    }
+    return lc_hashMix(hash) >> 32;
+}
+
 #define likely(_cond) __builtin_expect(!!(_cond), 1)
 #define unlikely(_cond) __builtin_expect(!!(_cond), 0)
 
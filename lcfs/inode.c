@@ -1,20 +1,23 @@
 #include "includes.h"
 
 /* Given an inode number, return the hash index */
-/* XXX Figure out a better hashing scheme */
 static inline int
 lc_inodeHash(struct fs *fs, ino_t ino) {
-    return ino % fs->fs_icacheSize;
+    return lc_hashMix(ino) & (fs->fs_icacheSize - 1);
 }
 
-/* Allocate and initialize inode hash table */
-void
-lc_icache_init(struct fs *fs, size_t size) {
+/* Allocate an inode hash table */
+static struct icache *
+lc_icacheAlloc(struct fs *fs, size_t size) {
     struct icache *icache = lc_malloc(fs, sizeof(struct icache) * size,
                                       LC_MEMTYPE_ICACHE);
 #ifdef LC_IC_LOCK
     int i;
+#endif
 
+    /* Size needs to be a power of two for indexing with a mask */
+    assert((size & (size - 1)) == 0);
+#ifdef LC_IC_LOCK
     for (i = 0; i < size; i++) {
         pthread_mutex_init(&icache[i].ic_lock, NULL);
         icache[i].ic_head = NULL;
@@ -24,8 +27,285 @@ lc_icache_init(struct fs *fs, size_t size) {
 #else
     memset(icache, 0, sizeof(struct icache) * size);
 #endif
+    return icache;
+}
+
+/* Allocate and initialize inode hash table */
+void
+lc_icache_init(struct fs *fs, size_t size) {
+    fs->fs_icache = lc_icacheAlloc(fs, size);
+    fs->fs_icacheSize = size;
+}
+
+/* Free an inode hash table once threads looking up inodes are done with it */
+static void
+lc_icacheFreeRcu(struct rcu_head *head) {
+    struct icacheRetired *retired = caa_container_of(head,
+                                                     struct icacheRetired,
+                                                     ir_rcu);
+
+    free(retired->ir_icache);
+    free(retired);
+}
+
+/* Free an inode hash table which could be still looked at by threads looking
+ * up inodes without locking.
+ */
+static void
+lc_icacheRetire(struct fs *fs, struct icache *icache, uint64_t size) {
+    struct icacheRetired *retired = lc_malloc(fs,
+                                              sizeof(struct icacheRetired),
+                                              LC_MEMTYPE_ICACHE);
+
+    retired->ir_icache = icache;
+    lc_freeRcu(fs, &retired->ir_rcu,
+               sizeof(struct icacheRetired) + (sizeof(struct icache) * size),
+               LC_MEMTYPE_ICACHE, lc_icacheFreeRcu);
+}
+
+/* Add an inode to a hash list */
+static inline void
+lc_icacheLink(struct icache *icache, struct inode *inode) {
+    ino_t ino = inode->i_ino;
+
+    if (icache->ic_highInode < ino) {
+        icache->ic_highInode = ino;
+    }
+    if ((icache->ic_lowInode == 0) || (icache->ic_lowInode > ino)) {
+        icache->ic_lowInode = ino;
+    }
+    inode->i_cnext = icache->ic_head;
+    cmm_smp_wmb();
+    icache->ic_head = inode;
+}
+
+/* Start moving inodes to a new hash table of the size specified.  Inodes are
+ * moved a few hash lists at a time as new inodes are added, while threads
+ * looking up inodes search both tables.
+ */
+static void
+lc_icacheRehashStart(struct fs *fs, uint64_t size) {
+    struct icache *icache = lc_icacheAlloc(fs, size);
+
+    assert(fs->fs_icacheOld == NULL);
+    __sync_add_and_fetch(&fs->fs_icacheSeq, 1);
+    fs->fs_icacheOldSize = fs->fs_icacheSize;
+    fs->fs_icacheMoved = 0;
+    cmm_smp_wmb();
+    fs->fs_icacheOld = fs->fs_icache;
+
+    /* Threads reading the old size with the new table stay within bounds */
+    cmm_smp_wmb();
     fs->fs_icache = icache;
+    cmm_smp_wmb();
     fs->fs_icacheSize = size;
+    __sync_add_and_fetch(&fs->fs_icacheSeq, 1);
+}
+
+/* Move some hash lists of the old hash table to the new one.  Old hash table
+ * is returned for freeing after all lists are moved.
+ */
+static struct icache *
+lc_icacheRehash(struct fs *fs, uint64_t count, uint64_t *size) {
+    uint64_t i = fs->fs_icacheMoved, end = i + count;
+    struct icache *icache = fs->fs_icacheOld;
+    struct inode *inode, *next;
+
+    if (end > fs->fs_icacheOldSize) {
+        end = fs->fs_icacheOldSize;
+    }
+    for (; i < end; i++) {
+        inode = icache[i].ic_head;
+        if (inode == NULL) {
+            continue;
+        }
+
+        /* Threads looking up inodes retry if inodes moved meanwhile */
+        __sync_add_and_fetch(&fs->fs_icacheSeq, 1);
+        icache[i].ic_head = NULL;
+        while (inode) {
+            next = inode->i_cnext;
+            lc_icacheLink(&fs->fs_icache[lc_inodeHash(fs, inode->i_ino)],
+                          inode);
+            inode = next;
+        }
+        __sync_add_and_fetch(&fs->fs_icacheSeq, 1);
+    }
+    fs->fs_icacheMoved = end;
+    if (end < fs->fs_icacheOldSize) {
+        return NULL;
+    }
+    *size = fs->fs_icacheOldSize;
+    fs->fs_icacheOld = NULL;
+    return icache;
+}
+
+/* Grow the hash table if hash lists are getting long, or continue moving
+ * inodes to the new table if resizing is in progress.  Called with the hash
+ * table locked.
+ */
+static struct icache *
+lc_icacheGrow(struct fs *fs, uint64_t *size) {
+#ifndef LC_IC_LOCK
+    if (fs->fs_icacheOld) {
+        return lc_icacheRehash(fs, LC_ICACHE_REHASH_COUNT, size);
+    }
+    if ((fs->fs_icount > (fs->fs_icacheSize * LC_ICACHE_LOAD)) &&
+        (fs->fs_icacheSize < LC_ICACHE_SIZE_LIMIT)) {
+        lc_icacheRehashStart(fs, fs->fs_icacheSize * LC_ICACHE_GROW);
+    }
+#endif
+    return NULL;
+}
+
+/* Finish moving inodes to the new hash table, if resizing is in progress.
+ * Called when no other thread could be adding inodes to the layer, or with
+ * the lock serializing those held, before walking the hash table.
+ */
+void
+lc_icacheRehashDone(struct fs *fs) {
+    struct icache *icache;
+    uint64_t size;
+
+    if (fs->fs_icacheOld) {
+        icache = lc_icacheRehash(fs, fs->fs_icacheOldSize, &size);
+        assert(icache != NULL);
+        lc_icacheRetire(fs, icache, size);
+    }
+}
+
+/* Shrink the hash table if most of the inodes are purged from the layer.
+ * Called with the layer locked exclusive.
+ */
+static void
+lc_icacheShrink(struct fs *fs) {
+    uint64_t size = LC_ICACHE_SIZE;
+
+    /* Layers with child layers are searched by threads not holding the lock
+     * on the layer.
+     */
+    if ((fs->fs_child != NULL) || (fs->fs_icacheSize <= LC_ICACHE_SIZE) ||
+        ((fs->fs_icount * 4) >= fs->fs_icacheSize)) {
+        return;
+    }
+    while ((size * LC_ICACHE_TARGET) < fs->fs_icount) {
+        size <<= 1;
+    }
+    lc_icacheRehashStart(fs, size);
+    lc_icacheRehashDone(fs);
+}
+
+/* Take an inode out of the hash table of the layer.
+ * Called with the layer locked exclusive.
+ */
+static void
+lc_icacheUnlink(struct fs *fs, struct inode *inode) {
+    struct inode **prev = &fs->fs_icache[lc_inodeHash(fs, inode->i_ino)].ic_head;
+
+    while (*prev != inode) {
+        assert(*prev != NULL);
+        prev = &(*prev)->i_cnext;
+    }
+    *prev = inode->i_cnext;
+}
+
+/* Add an inode to the list of inodes to be synced in the layer */
+static void
+lc_syncListAdd(struct fs *fs, struct inode *inode) {
+    struct inode **list;
+    uint64_t size;
+
+    pthread_mutex_lock(&fs->fs_slock);
+    if (inode->i_flags & LC_INODE_SYNCLIST) {
+        pthread_mutex_unlock(&fs->fs_slock);
+        return;
+    }
+    if (fs->fs_syncCount == fs->fs_syncSize) {
+        size = fs->fs_syncSize ? fs->fs_syncSize * 2 : LC_SYNCLIST_SIZE;
+        list = lc_malloc(fs, size * sizeof(struct inode *),
+                         LC_MEMTYPE_SYNCLIST);
+        if (fs->fs_syncCount) {
+            memcpy(list, fs->fs_syncList,
+                   fs->fs_syncCount * sizeof(struct inode *));
+        }
+        if (fs->fs_syncList) {
+            lc_free(fs, fs->fs_syncList,
+                    fs->fs_syncSize * sizeof(struct inode *),
+                    LC_MEMTYPE_SYNCLIST);
+        }
+        fs->fs_syncList = list;
+        fs->fs_syncSize = size;
+    }
+    fs->fs_syncList[fs->fs_syncCount++] = inode;
+    __sync_fetch_and_or(&inode->i_flags, LC_INODE_SYNCLIST);
+    pthread_mutex_unlock(&fs->fs_slock);
+}
+
+/* Free a list of inodes detached from the layer */
+static void
+lc_syncListRelease(struct fs *fs, struct inode **list, uint64_t size) {
+    if (list) {
+        lc_free(fs, list, size * sizeof(struct inode *), LC_MEMTYPE_SYNCLIST);
+    }
+}
+
+/* Detach the list of inodes to be synced from the layer */
+static struct inode **
+lc_syncListTake(struct fs *fs, uint64_t *count, uint64_t *size) {
+    struct inode **list;
+
+    pthread_mutex_lock(&fs->fs_slock);
+    list = fs->fs_syncList;
+    *count = fs->fs_syncCount;
+    *size = fs->fs_syncSize;
+    fs->fs_syncList = NULL;
+    fs->fs_syncCount = 0;
+    fs->fs_syncSize = 0;
+    pthread_mutex_unlock(&fs->fs_slock);
+    return list;
+}
+
+/* Free the list of inodes to be synced in the layer, without clearing the
+ * flag on those inodes.
+ */
+static void
+lc_syncListFree(struct fs *fs) {
+    uint64_t count, size;
+    struct inode **list = lc_syncListTake(fs, &count, &size);
+
+    lc_syncListRelease(fs, list, size);
+}
+
+/* Drop inodes moved to other layers from the list of inodes to be synced.
+ * Called with the layer locked exclusive.
+ */
+static void
+lc_syncListPrune(struct fs *fs) {
+    uint64_t i, count = 0;
+
+    for (i = 0; i < fs->fs_syncCount; i++) {
+        if (fs->fs_syncList[i]->i_fs == fs) {
+            fs->fs_syncList[count++] = fs->fs_syncList[i];
+        }
+    }
+    fs->fs_syncCount = count;
+}
+
+/* Mark inode dirty for flushing to disk */
+void
+lc_markInodeDirty(struct inode *inode, uint32_t flags) {
+    assert(!(flags & LC_INODE_DIRDIRTY) || S_ISDIR(inode->i_dinode.di_mode));
+    assert(!(flags & LC_INODE_EMAPDIRTY) || S_ISREG(inode->i_dinode.di_mode));
+
+    /* Reset notrunc flag when data modified in a layer */
+    if (flags & LC_INODE_EMAPDIRTY) {
+        inode->i_flags &= ~LC_INODE_NOTRUNC;
+    }
+    inode->i_flags |= flags | LC_INODE_DIRTY;
+    if (!(inode->i_flags & LC_INODE_SYNCLIST)) {
+        lc_syncListAdd(inode->i_fs, inode);
+    }
+    lc_markInodesDirty(inode->i_fs);
 }
 
 /* Copy disk inode to stat structure */
@@ -106,11 +386,11 @@ lc_newInode(struct fs *fs, uint64_t len, bool reg, bool new,
     if (len) {
         size += len + 1;
     }
-    inode = lc_malloc(fs, size, LC_MEMTYPE_INODE);
+    inode = lc_arenaAlloc(fs, size, LC_MEMTYPE_INODE);
     inode->i_fs = fs;
     if (lock) {
-        inode->i_rwlock = lc_malloc(fs, sizeof(pthread_rwlock_t),
-                                    LC_MEMTYPE_IRWLOCK);
+        inode->i_rwlock = lc_arenaAlloc(fs, sizeof(pthread_rwlock_t),
+                                        LC_MEMTYPE_IRWLOCK);
         pthread_rwlock_init(inode->i_rwlock, NULL);
     } else {
         inode->i_rwlock = NULL;
@@ -120,6 +400,8 @@ lc_newInode(struct fs *fs, uint64_t len, bool reg, bool new,
     inode->i_xattrData = NULL;
     inode->i_ocount = 0;
     inode->i_flags = block ? LC_INODE_DISK : 0;
+    inode->i_refs = 0;
+    inode->i_msize = 0;
     inode->i_page = NULL;
     if (reg) {
 
@@ -185,6 +467,7 @@ lc_freeInode(struct inode *inode) {
         lc_truncateFile(inode, 0, false);
         assert(inode->i_page == NULL);
         assert(lc_inodeGetEmap(inode) == NULL);
+        assert(lc_inodeGetEmapIndex(inode) == NULL);
         assert(lc_inodeGetPageCount(inode) == 0);
         assert(lc_inodeGetDirtyPageCount(inode) == 0);
         size += sizeof(struct rdata);
@@ -206,74 +489,70 @@ lc_freeInode(struct inode *inode) {
     if (inode->i_xattrData) {
         lc_xattrFree(inode);
     }
+    if (inode->i_msize) {
+        lc_metaMemoryRemove(fs, inode->i_msize);
+        inode->i_msize = 0;
+    }
     assert(inode->i_xattrData == NULL);
     if (inode->i_rwlock) {
 #ifdef LC_RWLOCK_DESTROY
         pthread_rwlock_destroy(inode->i_rwlock);
 #endif
-        lc_free(fs, inode->i_rwlock, sizeof(pthread_rwlock_t),
-                LC_MEMTYPE_IRWLOCK);
+        lc_arenaFree(fs, inode->i_rwlock, sizeof(pthread_rwlock_t),
+                     LC_MEMTYPE_IRWLOCK);
     }
     if (inode->i_emapDirExtents) {
         lc_blockFreeExtents(fs->fs_gfs, fs, inode->i_emapDirExtents, 0);
     }
-    lc_free(fs, inode, size, LC_MEMTYPE_INODE);
+    lc_arenaFree(fs, inode, size, LC_MEMTYPE_INODE);
 }
 
 /* Add an inode to the hash table of the layer */
 static struct inode *
-lc_addInode(struct fs *fs, struct inode *inode, int hash, bool lock,
-            struct inode *new, struct inode *last) {
+lc_addInode(struct fs *fs, struct inode *inode, bool lock,
+            struct inode *new) {
+    struct icache *icache = NULL;
     ino_t ino = inode->i_ino;
-
-    if (hash == -1) {
-        hash = lc_inodeHash(fs, ino);
-    }
+    uint64_t size;
+    int hash;
 
     if (lock) {
 #ifdef LC_IC_LOCK
+        hash = lc_inodeHash(fs, ino);
         pthread_mutex_lock(&fs->fs_icache[hash].ic_lock);
 #else
         pthread_mutex_lock(&fs->fs_ilock);
 #endif
     }
     if (new) {
-        if (last != fs->fs_icache[hash].ic_head) {
 
-            /* Check if raced with another thread */
-            inode = lc_lookupInodeCache(fs, ino, hash);
-            if (inode) {
+        /* Check if raced with another thread */
+        inode = lc_lookupInodeCache(fs, ino);
+        if (inode) {
 #ifdef LC_IC_LOCK
-                pthread_mutex_unlock(&fs->fs_icache[hash].ic_lock);
+            pthread_mutex_unlock(&fs->fs_icache[hash].ic_lock);
 #else
-                pthread_mutex_unlock(&fs->fs_ilock);
+            pthread_mutex_unlock(&fs->fs_ilock);
 #endif
-                new->i_flags |= LC_INODE_SHARED;
-                new->i_fs = fs;
+            new->i_flags |= LC_INODE_SHARED;
+            new->i_fs = fs;
 #ifdef LC_RWLOCK_DESTROY
-                lc_inodeUnlock(new);
+            lc_inodeUnlock(new);
 #endif
-                lc_freeInode(new);
-                __sync_sub_and_fetch(&fs->fs_icount, 1);
-                return inode;
-            }
+            lc_freeInode(new);
+            __sync_sub_and_fetch(&fs->fs_icount, 1);
+            return inode;
         }
         inode = new;
     }
 #ifdef DEBUG
-    assert(lc_lookupInodeCache(fs, ino, hash) == NULL);
+    assert(lc_lookupInodeCache(fs, ino) == NULL);
 #endif
 
     /* Add the inode to the hash list */
-    inode->i_cnext = fs->fs_icache[hash].ic_head;
-    fs->fs_icache[hash].ic_head = inode;
-    if (fs->fs_icache[hash].ic_highInode < ino) {
-        fs->fs_icache[hash].ic_highInode = ino;
-    }
-    if ((fs->fs_icache[hash].ic_lowInode == 0) ||
-        (fs->fs_icache[hash].ic_lowInode > ino)) {
-        fs->fs_icache[hash].ic_lowInode = ino;
-    }
+    icache = lc_icacheGrow(fs, &size);
+    hash = lc_inodeHash(fs, ino);
+    lc_icacheLink(&fs->fs_icache[hash], inode);
     if (lock) {
 #ifdef LC_IC_LOCK
         pthread_mutex_unlock(&fs->fs_icache[hash].ic_lock);
@@ -281,35 +560,68 @@ lc_addInode(struct fs *fs, struct inode *inode, int hash, bool lock,
         pthread_mutex_unlock(&fs->fs_ilock);
 #endif
     }
+    if (icache) {
+        lc_icacheRetire(fs, icache, size);
+    }
     return inode;
 }
 
-/* Lookup an inode in the hash list */
-struct inode *
-lc_lookupInodeCache(struct fs *fs, ino_t ino, int hash) {
+/* Lookup an inode in a hash list */
+static inline struct inode *
+lc_lookupInodeList(struct icache *icache, ino_t ino) {
     struct inode *inode;
 
-    if (hash == -1) {
-        hash = lc_inodeHash(fs, ino);
-    }
-    if ((fs->fs_icache[hash].ic_head == NULL) ||
-        (ino < fs->fs_icache[hash].ic_lowInode) ||
-        (ino > fs->fs_icache[hash].ic_highInode)) {
+    if ((icache->ic_head == NULL) || (ino < icache->ic_lowInode) ||
+        (ino > icache->ic_highInode)) {
         return NULL;
     }
-    /* XXX Locking not needed right now, as inodes are not removed */
-    //pthread_mutex_lock(&fs->fs_icache[hash].ic_lock);
-    inode = fs->fs_icache[hash].ic_head;
+    /* Inodes are not freed while threads could be searching the list, and
+     * those moved to another hash table are found by retrying the lookup.
+     */
+    inode = CMM_LOAD_SHARED(icache->ic_head);
     while (inode && (inode->i_ino != ino)) {
         inode = inode->i_cnext;
     }
-    //pthread_mutex_unlock(&fs->fs_icache[hash].ic_lock);
+    return inode;
+}
+
+/* Lookup an inode in the hash table without locking.  If the hash table is
+ * being resized, the old table is searched as well and the lookup is retried
+ * if inodes were moved between tables while searching.
+ */
+struct inode *
+lc_lookupInodeCache(struct fs *fs, ino_t ino) {
+    uint64_t hash = lc_hashMix(ino), seq, size;
+    struct icache *icache;
+    struct inode *inode;
+
+    lc_rcuRegister();
+    rcu_read_lock();
+    do {
+        seq = CMM_LOAD_SHARED(fs->fs_icacheSeq);
+        cmm_smp_rmb();
+        size = CMM_LOAD_SHARED(fs->fs_icacheSize);
+        cmm_smp_rmb();
+        icache = CMM_LOAD_SHARED(fs->fs_icache);
+        inode = lc_lookupInodeList(&icache[hash & (size - 1)], ino);
+        if (inode == NULL) {
+            size = CMM_LOAD_SHARED(fs->fs_icacheOldSize);
+            cmm_smp_rmb();
+            icache = CMM_LOAD_SHARED(fs->fs_icacheOld);
+            if (icache) {
+                inode = lc_lookupInodeList(&icache[hash & (size - 1)], ino);
+            }
+        }
+        cmm_smp_rmb();
+    } while ((inode == NULL) &&
+             ((seq & 1) || (seq != CMM_LOAD_SHARED(fs->fs_icacheSeq))));
+    rcu_read_unlock();
     return inode;
 }
 
 /* Lookup an inode in the hash list */
 static struct inode *
-lc_lookupInode(struct fs *fs, ino_t ino, int hash) {
+lc_lookupInode(struct fs *fs, ino_t ino) {
     struct gfs *gfs = fs->fs_gfs;
 
     if (ino == fs->fs_root) {
@@ -318,7 +630,7 @@ lc_lookupInode(struct fs *fs, ino_t ino, int hash) {
     if (ino == gfs->gfs_layerRoot) {
         return gfs->gfs_layerRootInode;
     }
-    return lc_lookupInodeCache(fs, ino, hash);
+    return lc_lookupInodeCache(fs, ino);
 }
 
 /* Update inode times */
@@ -343,7 +655,7 @@ lc_rootInit(struct fs *fs, ino_t root) {
                                     true, false);
 
     lc_dinodeInit(dir, root, S_IFDIR | 0755, 0, 0, 0, 0, root);
-    lc_addInode(fs, dir, -1, false, NULL, NULL);
+    lc_addInode(fs, dir, false, NULL);
     fs->fs_rootInode = dir;
     lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
 }
@@ -376,6 +688,74 @@ lc_setLayerRoot(struct gfs *gfs, ino_t ino) {
     lc_syslog(LOG_INFO, "layer root inode %ld\n", ino);
 }
 
+/* Find the word in inode filter and bits in that word for an inode.  All
+ * bits are in a single word, so that checking a layer touches a single
+ * cache line.
+ */
+static inline uint64_t
+lc_inodeFilterBits(ino_t ino, uint64_t *word) {
+    uint64_t hash = lc_hashMix(ino);
+
+    *word = hash >> 24;
+    return (1ull << (hash & 63)) | (1ull << ((hash >> 6) & 63)) |
+           (1ull << ((hash >> 12) & 63)) | (1ull << ((hash >> 18) & 63));
+}
+
+/* Check if an immutable layer may have an inode.  Layers without a filter
+ * need to be searched.
+ */
+static inline bool
+lc_inodeFilterCheck(struct fs *fs, uint64_t bits, uint64_t word) {
+    uint64_t *filter = fs->fs_ifilter;
+
+    return (filter == NULL) || ((filter[word & fs->fs_ifilterMask] & bits) ==
+                                bits);
+}
+
+/* Build filter of inodes present in a layer after the layer is made
+ * immutable.  Inodes are not added to the layer afterwards, so the filter
+ * does not change till the layer is removed.
+ */
+static void
+lc_inodeFilterBuild(struct fs *fs) {
+    uint64_t i, count = 0, words = 1, bits, word, mask, *filter;
+    struct icache *icache = fs->fs_icache;
+    struct inode *inode;
+
+    assert(fs->fs_ifilter == NULL);
+    while ((words * 64) < (fs->fs_icount * LC_IFILTER_BITS)) {
+        words <<= 1;
+    }
+    mask = words - 1;
+    filter = lc_malloc(fs, words * sizeof(uint64_t), LC_MEMTYPE_IFILTER);
+    memset(filter, 0, words * sizeof(uint64_t));
+    for (i = 0; (i < fs->fs_icacheSize) && (count < fs->fs_icount); i++) {
+        inode = icache[i].ic_head;
+        while (inode) {
+            count++;
+            bits = lc_inodeFilterBits(inode->i_ino, &word);
+            filter[word & mask] |= bits;
+            inode = inode->i_cnext;
+        }
+    }
+
+    /* Make the filter visible only after it is complete */
+    fs->fs_ifilterMask = mask;
+    __sync_synchronize();
+    fs->fs_ifilter = filter;
+}
+
+/* Free inode filter of a layer */
+static void
+lc_inodeFilterFree(struct fs *fs) {
+    if (fs->fs_ifilter) {
+        lc_free(fs, fs->fs_ifilter,
+                (fs->fs_ifilterMask + 1) * sizeof(uint64_t),
+                LC_MEMTYPE_IFILTER);
+        fs->fs_ifilter = NULL;
+    }
+}
+
 /* Purge removed inodes from cache */
 static void
 lc_purgeRemovedInodes(struct gfs *gfs, struct fs *fs, char *buf) {
@@ -430,6 +810,241 @@ lc_markAllInodesDirty(struct gfs *gfs, struct fs *fs) {
     lc_layerChanged(gfs, true, false);
 }
 
+/* Check if an inode has metadata to read from blocks other than the inode
+ * block.
+ */
+static inline bool
+lc_inodeHasMeta(struct inode *inode) {
+    if (inode->i_xattrBlock != LC_INVALID_BLOCK) {
+        return true;
+    }
+    if (S_ISREG(inode->i_mode)) {
+        return inode->i_dinode.di_blocks && (inode->i_extentLength == 0);
+    }
+    return S_ISDIR(inode->i_mode) &&
+           (inode->i_emapDirBlock != LC_INVALID_BLOCK);
+}
+
+/* Read emap, directory entries and extended attributes of an inode */
+static void
+lc_inodeReadMeta(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                 void *buf) {
+    if (S_ISREG(inode->i_mode)) {
+
+        /* Read emap of fragmented regular files */
+        lc_emapRead(gfs, fs, inode, buf);
+    } else if (S_ISDIR(inode->i_mode)) {
+
+        /* Read directory entries */
+        lc_dirRead(gfs, fs, inode, buf);
+    }
+
+    /* Read extended attributes */
+    lc_xattrRead(gfs, fs, inode, buf);
+}
+
+/* Return memory used for emap, directory entries and extended attributes of
+ * an inode, which could be released and read again when needed.
+ */
+static uint64_t
+lc_inodeMetaSize(struct inode *inode) {
+    bool hashed = (inode->i_flags & LC_INODE_DHASHED);
+    bool shared = (inode->i_flags & LC_INODE_SHARED);
+    struct extent *extent;
+    struct dirent *dirent;
+    struct xattr *xattr;
+    int i, max, start = 0;
+    uint64_t size = 0;
+
+    if (S_ISREG(inode->i_mode) && !shared) {
+        extent = lc_inodeGetEmap(inode);
+        while (extent) {
+            size += sizeof(struct extent);
+            extent = extent->ex_next;
+        }
+    } else if (S_ISDIR(inode->i_mode) && !shared) {
+        max = lc_dirLists(inode);
+        if (hashed) {
+            size += sizeof(struct dhash) + (max * sizeof(struct dirent *));
+        } else if (inode->i_flags & LC_INODE_DOVERLAY) {
+
+            /* Only entries added over the parent layer are owned */
+            size += sizeof(struct dover);
+            start = max - 1;
+        }
+        for (i = start; i < max; i++) {
+            dirent = lc_dirList(inode, i);
+            while (dirent) {
+
+                /* Names of packed directories are interned */
+                size += dirent->di_packed ?
+                        (sizeof(struct dirent) +
+                         lc_istringShare(dirent->di_name)) :
+                        (sizeof(struct dlink) + dirent->di_size + 1);
+                dirent = lc_dirNext(dirent);
+            }
+        }
+    }
+    if (inode->i_xattrData) {
+        size += sizeof(struct ixattr);
+        xattr = inode->i_xattr;
+        while (xattr) {
+            size += sizeof(struct xattr) + lc_istringShare(xattr->x_name);
+            if (xattr->x_value) {
+                size += lc_istringShare(xattr->x_value);
+            }
+            xattr = xattr->x_next;
+        }
+    }
+    return size;
+}
+
+/* Read metadata of an inode which was not read when the layer was mounted.
+ * This is done when the inode is looked up the first time, so that mounting
+ * a layer does not have to read every directory and emap in the layer.
+ */
+void
+lc_inodeLoad(struct inode *inode) {
+    struct fs *fs = inode->i_fs;
+    void *buf;
+
+    if (!(inode->i_flags & LC_INODE_UNLOADED)) {
+
+        /* Remember metadata was accessed, so that it is not released soon */
+        if (fs->fs_frozen && !(inode->i_flags & LC_INODE_REFERENCED)) {
+            __sync_fetch_and_or(&inode->i_flags, LC_INODE_REFERENCED);
+        }
+        return;
+    }
+
+    /* Inodes of frozen layers are not locked, serialize with others trying to
+     * read the same inode.
+     */
+    pthread_mutex_lock(&fs->fs_mlock);
+    if (inode->i_flags & LC_INODE_UNLOADED) {
+        lc_mallocBlockAligned(fs, &buf, LC_MEMTYPE_BLOCK);
+        lc_inodeReadMeta(fs->fs_gfs, fs, inode, buf);
+        lc_freeBlockAligned(fs, buf, LC_MEMTYPE_BLOCK);
+        if (fs->fs_frozen) {
+            assert(inode->i_msize == 0);
+            inode->i_msize = lc_inodeMetaSize(inode);
+            lc_metaMemoryAdd(fs, inode->i_msize);
+            __sync_fetch_and_or(&inode->i_flags, LC_INODE_REFERENCED);
+        }
+        __sync_fetch_and_and(&inode->i_flags, ~LC_INODE_UNLOADED);
+        __sync_add_and_fetch(&fs->fs_iload, 1);
+    }
+    pthread_mutex_unlock(&fs->fs_mlock);
+}
+
+/* Take references on an inode of an immutable layer, for lookups reported to
+ * the kernel and for files opened through child layers.  Metadata of an inode
+ * is not released while the inode is referenced.
+ */
+void
+lc_inodeRef(struct inode *inode, uint64_t count) {
+    if (inode->i_fs->fs_frozen) {
+        __sync_add_and_fetch(&inode->i_refs, count);
+    }
+}
+
+/* Drop references on an inode of an immutable layer */
+void
+lc_inodeUnref(struct inode *inode, uint64_t count) {
+    uint64_t refs;
+
+    if (!inode->i_fs->fs_frozen) {
+        return;
+    }
+    do {
+        refs = inode->i_refs;
+
+        /* References taken before the layer was frozen are not counted */
+        if (refs == 0) {
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&inode->i_refs, refs,
+                                           (count >= refs) ? 0 :
+                                                             refs - count));
+}
+
+/* Drop lookup references the kernel had on an inode.  The inode is looked up
+ * in the layer and its parent layers without reading its metadata.
+ */
+void
+lc_inodeForget(struct fs *fs, ino_t ino, uint64_t nlookup) {
+    ino_t inum = lc_getInodeHandle(ino);
+    struct inode *inode = NULL;
+
+    while (fs && (inode == NULL)) {
+        inode = lc_lookupInode(fs, inum);
+        fs = fs->fs_parent;
+    }
+    if (inode) {
+        lc_inodeUnref(inode, nlookup);
+    }
+}
+
+/* Queue lookup references dropped by the kernel while the layer is locked
+ * exclusive, instead of waiting for the lock.  Called in an RCU read section,
+ * so that a layer being removed is not destroyed before the request is queued
+ * or dropped.
+ */
+void
+lc_inodeForgetDefer(struct fs *fs, ino_t ino, uint64_t nlookup) {
+    struct iforget *iforget;
+
+    if (fs->fs_removed) {
+        return;
+    }
+    iforget = lc_malloc(fs, sizeof(struct iforget), LC_MEMTYPE_IFORGET);
+    iforget->if_ino = ino;
+    iforget->if_nlookup = nlookup;
+    do {
+        iforget->if_next = fs->fs_forgets;
+    } while (!__sync_bool_compare_and_swap(&fs->fs_forgets, iforget->if_next,
+                                           iforget));
+}
+
+/* Drop lookup references queued while the layer was locked exclusive, with
+ * the layer locked.  Requests for an index switched to another layer by a
+ * commit are queued on that layer.  Requests are just freed when the layer is
+ * going away.
+ */
+void
+lc_inodeForgetDeferred(struct fs *fs, bool apply) {
+    struct iforget *iforget, *next;
+    struct gfs *gfs = fs->fs_gfs;
+    struct fs *nfs;
+    int gindex;
+
+    if (fs->fs_forgets == NULL) {
+        return;
+    }
+    iforget = __sync_lock_test_and_set(&fs->fs_forgets, NULL);
+    while (iforget) {
+        next = iforget->if_next;
+        gindex = lc_getFsHandle(iforget->if_ino);
+        if (apply && !fs->fs_removed) {
+            if ((fs->fs_gindex == gindex) &&
+                (gfs->gfs_roots[gindex] == fs->fs_root)) {
+                lc_inodeForget(fs, iforget->if_ino, iforget->if_nlookup);
+            } else {
+                lc_rcuRegister();
+                rcu_read_lock();
+                nfs = rcu_dereference(gfs->gfs_fs[gindex]);
+                if (nfs && (nfs != fs)) {
+                    lc_inodeForgetDefer(nfs, iforget->if_ino,
+                                        iforget->if_nlookup);
+                }
+                rcu_read_unlock();
+            }
+        }
+        lc_free(fs, iforget, sizeof(struct iforget), LC_MEMTYPE_IFORGET);
+        iforget = next;
+    }
+}
+
 /* Read inodes from an inode block */
 static bool
 lc_readInodesBlock(struct gfs *gfs, struct fs *fs, uint64_t block,
@@ -452,7 +1067,7 @@ lc_readInodesBlock(struct gfs *gfs, struct fs *fs, uint64_t block,
 
         /* Check if the inode is already present in cache */
         if (fs->fs_super->sb_flags & LC_SUPER_ICHECK) {
-            cinode = lc_lookupInodeCache(fs, ino, lc_inodeHash(fs, ino));
+            cinode = lc_lookupInodeCache(fs, ino);
             if (cinode) {
                 if (S_ISLNK(inode->i_mode) && inode->i_nlink) {
                     assert(i == 0);
@@ -465,7 +1080,7 @@ lc_readInodesBlock(struct gfs *gfs, struct fs *fs, uint64_t block,
         len = S_ISLNK(inode->i_mode) ? inode->i_size : 0;
         inode = lc_newInode(fs, len, reg, false, lock, true);
         memcpy(&inode->i_dinode, &buf[offset], sizeof(struct dinode));
-        lc_addInode(fs, inode, -1, false, NULL, NULL);
+        lc_addInode(fs, inode, false, NULL);
 
         /* Check if this is a removed inode */
         if (inode->i_nlink == 0) {
@@ -474,15 +1089,7 @@ lc_readInodesBlock(struct gfs *gfs, struct fs *fs, uint64_t block,
             continue;
         }
         empty = false;
-        if (reg) {
-
-            /* Read emap of fragmented regular files */
-            lc_emapRead(gfs, fs, inode, ibuf);
-        } else if (S_ISDIR(inode->i_mode)) {
-
-            /* Read directory entries */
-            lc_dirRead(gfs, fs, inode, ibuf);
-        } else if (len) {
+        if (len) {
             assert(i == 0);
 
             /* Setup target of a symbolic link */
@@ -492,13 +1099,20 @@ lc_readInodesBlock(struct gfs *gfs, struct fs *fs, uint64_t block,
             i = LC_INODE_BLOCK_MAX;
         }
 
-        /* Read extended attributes */
-        lc_xattrRead(gfs, fs, inode, ibuf);
+        /* Enable extended attributes if the inode has any */
+        if (inode->i_xattrBlock != LC_INVALID_BLOCK) {
+            lc_xattrEnable(gfs, fs);
+        }
 
-        /* Set up root inode when read */
+        /* Set up root inode when read.  Metadata of other inodes is read when
+         * those are accessed first.
+         */
         if (inode->i_ino == fs->fs_root) {
             assert(S_ISDIR(inode->i_mode));
             fs->fs_rootInode = inode;
+            lc_inodeReadMeta(gfs, fs, inode, ibuf);
+        } else if (lc_inodeHasMeta(inode)) {
+            inode->i_flags |= LC_INODE_UNLOADED;
         }
     }
     return empty;
@@ -578,7 +1192,7 @@ lc_readInodes(struct gfs *gfs, struct fs *fs) {
                 if (rcount == 1) {
                     lc_readBlock(gfs, fs, iblock, ibuf);
                 } else {
-                    lc_readBlocks(gfs, fs, iovec, rcount, iblock);
+                    lc_readBlocks(gfs, fs, iovec, rcount, iblock, NULL);
                 }
                 while (rcount) {
                     if (lc_readInodesBlock(gfs, fs, iblock, iovec[j].iov_base,
@@ -594,12 +1208,13 @@ lc_readInodes(struct gfs *gfs, struct fs *fs) {
         block = buf->ib_next;
     }
     assert(fs->fs_rootInode != NULL);
+    lc_icacheRehashDone(fs);
     lc_purgeRemovedInodes(gfs, fs, ibuf);
-    lc_free(fs, buf, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    lc_freeBlockAligned(fs, buf, LC_MEMTYPE_BLOCK);
     for (i = 0; i < iovcnt; i++) {
-        lc_free(fs, iovec[i].iov_base, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+        lc_freeBlockAligned(fs, iovec[i].iov_base, LC_MEMTYPE_BLOCK);
     }
-    lc_free(fs, xbuf, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    lc_freeBlockAligned(fs, xbuf, LC_MEMTYPE_BLOCK);
 
     /* Rewrite inodes if some inode pages could be freed */
     if ((pcount + (bcount / 2)) > LC_INODE_RELOCATE_PCOUNT) {
@@ -619,6 +1234,9 @@ lc_readInodes(struct gfs *gfs, struct fs *fs) {
         lc_free(fs, extent, sizeof(struct extent), LC_MEMTYPE_EXTENT);
 #endif
     }
+    if (fs->fs_frozen) {
+        lc_inodeFilterBuild(fs);
+    }
 }
 
 /* Invalidate dirty inode pages */
@@ -827,13 +1445,20 @@ lc_flushInode(struct gfs *gfs, struct fs *fs, struct inode *inode) {
 /* Release inode locks as those are not needed anymore */
 void
 lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
-    uint64_t i, count = 0, rcount = 0, icsize, icacheSize = fs->fs_icacheSize;
-    struct icache *icache = fs->fs_icache;
+    uint64_t i, count = 0, rcount = 0, icsize, icacheSize;
     struct inode *inode, **prev;
+    struct icache *icache;
+    uint64_t msize = 0;
     bool resize;
 
     assert(fs->fs_readOnly || (fs->fs_super->sb_flags & LC_SUPER_INIT));
     assert(!fs->fs_frozen);
+    lc_icacheRehashDone(fs);
+
+    /* List of inodes to be synced is built again while walking the cache */
+    lc_syncListFree(fs);
+    icache = fs->fs_icache;
+    icacheSize = fs->fs_icacheSize;
     fs->fs_size = 0;
     assert(fs->fs_ricount < fs->fs_icount);
 
@@ -864,6 +1489,22 @@ lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
                 continue;
             }
 
+            /* Sync list is built again below */
+            inode->i_flags &= ~LC_INODE_SYNCLIST;
+
+            /* Child layers share directories of this layer as is, so
+             * materialize overlay directories and pack directories not
+             * shared with other layers before those become immutable.
+             */
+            if (inode->i_flags & LC_INODE_DOVERLAY) {
+                lc_dirMaterialize(inode);
+            }
+            if (S_ISDIR(inode->i_mode) && (inode != fs->fs_rootInode) &&
+                !(inode->i_flags & (LC_INODE_REMOVED | LC_INODE_SHARED |
+                                    LC_INODE_UNLOADED | LC_INODE_PINNED))) {
+                lc_dirPack(fs, inode);
+            }
+
             /* A newly committed layer may still have dirty pages */
             if (inode->i_flags & LC_INODE_EMAPDIRTY) {
                 lc_flushPages(gfs, fs, inode, true, false);
@@ -876,15 +1517,28 @@ lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
 #ifdef LC_RWLOCK_DESTROY
             pthread_rwlock_destroy(inode->i_rwlock);
 #endif
-            lc_free(fs, inode->i_rwlock, sizeof(pthread_rwlock_t),
-                    LC_MEMTYPE_IRWLOCK);
+            lc_arenaFree(fs, inode->i_rwlock, sizeof(pthread_rwlock_t),
+                         LC_MEMTYPE_IRWLOCK);
             inode->i_rwlock = NULL;
+            if (lc_inodeDirty(inode) &&
+                !(inode->i_flags & LC_INODE_SYNCLIST)) {
+                lc_syncListAdd(fs, inode);
+            }
             if (!(inode->i_flags & LC_INODE_REMOVED)) {
                 fs->fs_size += inode->i_size;
+
+                /* Account metadata which could be released later */
+                if ((inode != fs->fs_rootInode) &&
+                    !(inode->i_flags &
+                      (LC_INODE_SHARED | LC_INODE_UNLOADED))) {
+                    assert(inode->i_msize == 0);
+                    inode->i_msize = lc_inodeMetaSize(inode);
+                    msize += inode->i_msize;
+                }
             }
             if (resize) {
                 *prev = inode->i_cnext;
-                lc_addInode(fs, inode, -1, false, NULL, NULL);
+                lc_addInode(fs, inode, false, NULL);
             } else {
                 prev = &inode->i_cnext;
             }
@@ -899,6 +1553,9 @@ lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
 #endif
     }
     assert(fs->fs_pcount == 0);
+    if (msize) {
+        lc_metaMemoryAdd(fs, msize);
+    }
     if (rcount) {
         assert(fs->fs_icount > rcount);
         fs->fs_icount -= rcount;
@@ -918,17 +1575,155 @@ lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
         lc_free(fs, icache, sizeof(struct icache) * icacheSize,
                 LC_MEMTYPE_ICACHE);
     }
+    if (!fs->fs_removed) {
+        lc_inodeFilterBuild(fs);
+    }
+}
+
+/* Check if metadata of an inode could be released and read again later */
+static bool
+lc_inodeEvictable(struct fs *fs, struct inode *inode) {
+    return (inode != fs->fs_rootInode) &&
+           !(inode->i_flags & (LC_INODE_UNLOADED | LC_INODE_SHARED |
+                               LC_INODE_PINNED | LC_INODE_REMOVED)) &&
+           (inode->i_flags & LC_INODE_DISK) && !lc_inodeDirty(inode) &&
+           (inode->i_ocount == 0) && (lc_inodeGetRefs(inode) == 0) &&
+           lc_inodeHasMeta(inode);
+}
+
+/* Release metadata of an inode, which is read again when accessed next */
+static uint64_t
+lc_inodeEvict(struct gfs *gfs, struct fs *fs, struct inode *inode) {
+    uint64_t size = inode->i_msize;
+
+    if (S_ISREG(inode->i_mode)) {
+        lc_emapTruncate(gfs, fs, inode, 0, 0, false);
+    } else if (S_ISDIR(inode->i_mode)) {
+        lc_dirFree(inode);
+    }
+    lc_xattrFree(inode);
+    if (inode->i_emapDirExtents) {
+        lc_blockFreeExtents(gfs, fs, inode->i_emapDirExtents, 0);
+        inode->i_emapDirExtents = NULL;
+    }
+    __sync_fetch_and_or(&inode->i_flags, LC_INODE_UNLOADED);
+    inode->i_msize = 0;
+    return size;
+}
+
+/* Release metadata of inodes in an immutable layer not accessed recently,
+ * scanning the inode cache like a clock.  Inodes accessed since the last scan
+ * are skipped once.  Called with the layer and its descendants locked
+ * exclusive.
+ */
+static uint64_t
+lc_evictInodes(struct gfs *gfs, struct fs *fs, uint64_t target) {
+    uint64_t i, index, size = fs->fs_icacheSize, freed = 0, count = 0;
+    struct inode *inode;
+
+    /* Inodes could be released once kernel dropped references on those */
+    lc_inodeForgetDeferred(fs, true);
+    index = fs->fs_ievictIndex % size;
+    for (i = 0; (i < size) && (freed < target); i++) {
+        inode = fs->fs_icache[index].ic_head;
+        while (inode) {
+            if (inode->i_flags & LC_INODE_REFERENCED) {
+                __sync_fetch_and_and(&inode->i_flags, ~LC_INODE_REFERENCED);
+            } else if (lc_inodeEvictable(fs, inode)) {
+                freed += lc_inodeEvict(gfs, fs, inode);
+                count++;
+            }
+            inode = inode->i_cnext;
+        }
+        index = (index + 1) % size;
+    }
+    fs->fs_ievictIndex = index;
+    if (count) {
+        fs->fs_ievict += count;
+        lc_metaMemoryRemove(fs, freed);
+        lc_printf("Released metadata of %ld inodes, %ld bytes, layer %d\n",
+                  count, freed, fs->fs_gindex);
+    }
+    return freed;
+}
+
+/* Release metadata of inodes in immutable layers if memory used for metadata
+ * exceeds the limit.  Layers busy with other operations are skipped.
+ */
+void
+lc_shrinkInodeCache(struct gfs *gfs) {
+    uint64_t excess = lc_metaMemoryExcess(), freed;
+    struct fs *fs;
+    int i, pass;
+
+    if ((excess == 0) || gfs->gfs_layerInProgress) {
+        return;
+    }
+    pthread_mutex_lock(&gfs->gfs_lock);
+
+    /* First pass may only find inodes accessed recently */
+    for (pass = 0; (pass < 2) && excess; pass++) {
+        for (i = 1; (i <= gfs->gfs_scount) && excess; i++) {
+            fs = gfs->gfs_fs[i];
+            if ((fs == NULL) || !fs->fs_frozen || fs->fs_removed ||
+                (fs->fs_imemory == 0) || gfs->gfs_layerInProgress) {
+                continue;
+            }
+
+            /* Inodes of the layer are accessed by its descendants */
+            if (!lc_tryLockTree(fs)) {
+                continue;
+            }
+
+            /* Skip the layer if inodes are pending to be hidden */
+            freed = fs->fs_dirtyInodes ? 0 : lc_evictInodes(gfs, fs, excess);
+            lc_unlockTree(fs);
+            excess = (freed < excess) ? (excess - freed) : 0;
+        }
+    }
+    pthread_mutex_unlock(&gfs->gfs_lock);
+}
+
+/* Flush an inode if dirty and return true if the inode could be purged from
+ * the cache.
+ */
+static bool
+lc_syncInode(struct gfs *gfs, struct fs *fs, struct inode *inode,
+             bool unmount, uint64_t *count) {
+    bool purge = unmount ||
+                 ((inode->i_flags & LC_INODE_REMOVED) &&
+                  !(inode->i_flags & LC_INODE_NOTRUNC) &&
+                  (inode->i_ocount == 0));
+
+    if (purge && (inode->i_flags & LC_INODE_REMOVED)) {
+        assert(lc_inodeDirty(inode));
+
+        /* Truncate pages of a removed inode on umount */
+        if (S_ISREG(inode->i_mode) && inode->i_size) {
+            lc_truncateFile(inode, 0, true);
+            inode->i_size = 0;
+        }
+        lc_inodeFreeMetaExtents(gfs, fs, inode);
+        inode->i_flags &= ~(LC_INODE_DIRDIRTY | LC_INODE_EMAPDIRTY |
+                            LC_INODE_XATTRDIRTY);
+    }
+    if (lc_inodeDirty(inode)) {
+        *count += lc_flushInode(gfs, fs, inode);
+    }
+    return purge;
 }
 
 /* Sync all dirty inodes */
 void
 lc_syncInodes(struct gfs *gfs, struct fs *fs, bool unmount) {
     uint64_t count = 0, icount = 0, rcount = 0, fcount = 0;
-    struct inode *inode, **prev;
+    uint64_t j, lcount, lsize;
+    struct inode *inode, **prev, **list;
     int i;
 
     lc_printf("Syncing inodes for fs %d %ld\n", fs->fs_gindex, fs->fs_root);
     lc_markSuperDirty(fs);
+    lc_icacheRehashDone(fs);
 
     /* Start with new inode blocks */
     lc_releaseInodeBlock(gfs, fs);
@@ -948,58 +1743,54 @@ lc_syncInodes(struct gfs *gfs, struct fs *fs, bool unmount) {
         }
     }
 
-    /* Flush rest of the dirty inodes */
-    for (i = 0; (i < fs->fs_icacheSize) && (icount < fs->fs_icount) &&
-                !fs->fs_removed; i++) {
-        inode = fs->fs_icache[i].ic_head;
-        prev = &fs->fs_icache[i].ic_head;
-        while (inode && !fs->fs_removed) {
-            if ((inode->i_flags & LC_INODE_REMOVED) &&
-                (unmount ||
-                 (!(inode->i_flags & LC_INODE_NOTRUNC) &&
-                  (inode->i_ocount == 0)))) {
-                assert(lc_inodeDirty(inode));
-
-                /* Truncate pages of a removed inode on umount */
-                if (S_ISREG(inode->i_mode) && inode->i_size) {
-                    lc_truncateFile(inode, 0, true);
-                    inode->i_size = 0;
-                }
-                lc_inodeFreeMetaExtents(gfs, fs, inode);
-                inode->i_flags &= ~(LC_INODE_DIRDIRTY | LC_INODE_EMAPDIRTY |
-                                    LC_INODE_XATTRDIRTY);
-            }
-            if (lc_inodeDirty(inode)) {
-                count += lc_flushInode(gfs, fs, inode);
-            }
-            if (unmount ||
-                ((inode->i_flags & LC_INODE_REMOVED) &&
-                 !(inode->i_flags & LC_INODE_NOTRUNC) &&
-                 (inode->i_ocount == 0))) {
-
-                /* Purge removed inodes or when unmounted */
+    /* Free all inodes when unmounted */
+    if (unmount) {
+        for (i = 0; (i < fs->fs_icacheSize) && (icount < fs->fs_icount) &&
+                    !fs->fs_removed; i++) {
+            inode = fs->fs_icache[i].ic_head;
+            prev = &fs->fs_icache[i].ic_head;
+            while (inode && !fs->fs_removed) {
+                lc_syncInode(gfs, fs, inode, true, &count);
                 *prev = inode->i_cnext;
                 lc_freeInode(inode);
-                if (unmount) {
-                    fcount++;
-                } else {
-                    rcount++;
-                }
-            } else {
-                prev = &inode->i_cnext;
+                fcount++;
+                icount++;
+                inode = *prev;
             }
-            icount++;
-            inode = *prev;
         }
-    }
-    if (unmount) {
+        lc_syncListFree(fs);
         assert(fs->fs_icount == fcount);
         fs->fs_icount = 0;
-    } else if (rcount) {
-        assert(fs->fs_ricount >= rcount);
-        fs->fs_ricount -= rcount;
-        assert(fs->fs_icount > rcount);
-        fs->fs_icount -= rcount;
+    } else {
+
+        /* Flush rest of the inodes modified since last sync */
+        list = lc_syncListTake(fs, &lcount, &lsize);
+        for (j = 0; (j < lcount) && !fs->fs_removed; j++) {
+            inode = list[j];
+            assert(inode->i_fs == fs);
+            __sync_fetch_and_and(&inode->i_flags, ~LC_INODE_SYNCLIST);
+            if (lc_syncInode(gfs, fs, inode, false, &count)) {
+
+                /* Purge removed inodes */
+                lc_icacheUnlink(fs, inode);
+                lc_freeInode(inode);
+                rcount++;
+            } else if ((lc_inodeDirty(inode) ||
+                        (inode->i_flags & LC_INODE_REMOVED)) &&
+                       !(inode->i_flags & LC_INODE_SYNCLIST)) {
+
+                /* Check again during next sync */
+                lc_syncListAdd(fs, inode);
+            }
+        }
+        lc_syncListRelease(fs, list, lsize);
+        if (rcount) {
+            assert(fs->fs_ricount >= rcount);
+            fs->fs_ricount -= rcount;
+            assert(fs->fs_icount > rcount);
+            fs->fs_icount -= rcount;
+            lc_icacheShrink(fs);
+        }
     }
     if (fs->fs_inodePagesCount && !fs->fs_removed) {
         lc_flushInodePages(gfs, fs);
@@ -1012,24 +1803,44 @@ lc_syncInodes(struct gfs *gfs, struct fs *fs, bool unmount) {
     }
 }
 
-/* Invalidate pages in kernel page cache for the layer */
+/* Invalidate pages in kernel page cache for the layer.  Called with the layer
+ * locked shared, while inodes could be added to the layer.  Inodes are
+ * collected with the hash table locked, after moving all inodes to the new
+ * hash table if resizing is in progress, and pages are invalidated after
+ * unlocking the hash table, as reads waited on by the kernel may add inodes.
+ */
 void
 lc_invalidateLayerPages(struct gfs *gfs, struct fs *fs) {
-    uint64_t i, count = 0;
+    uint64_t i, count = 0, icount, size;
     struct inode *inode;
+    ino_t *inos;
 
-    for (i = 0;
-         (i < fs->fs_icacheSize) && (count < fs->fs_icount) && !fs->fs_removed;
-         i++) {
+#ifndef LC_IC_LOCK
+    pthread_mutex_lock(&fs->fs_ilock);
+    lc_icacheRehashDone(fs);
+#endif
+    icount = fs->fs_icount;
+    size = icount * sizeof(ino_t);
+    inos = icount ? lc_malloc(fs, size, LC_MEMTYPE_ICACHE) : NULL;
+    for (i = 0; (i < fs->fs_icacheSize) && !fs->fs_removed; i++) {
         inode = fs->fs_icache[i].ic_head;
-        while (inode && !fs->fs_removed) {
+        while (inode) {
             if (S_ISREG(inode->i_mode) && !inode->i_private && inode->i_size) {
-                lc_invalInodePages(gfs, inode->i_ino);
+                assert(count < icount);
+                inos[count++] = inode->i_ino;
             }
-            count++;
             inode = inode->i_cnext;
         }
     }
+#ifndef LC_IC_LOCK
+    pthread_mutex_unlock(&fs->fs_ilock);
+#endif
+    for (i = 0; (i < count) && !fs->fs_removed; i++) {
+        lc_invalInodePages(gfs, inos[i]);
+    }
+    if (inos) {
+        lc_free(fs, inos, size, LC_MEMTYPE_ICACHE);
+    }
 }
 
 /* Destroy inodes belong to a file system */
@@ -1041,9 +1852,13 @@ lc_destroyInodes(struct fs *fs, bool remove) {
     ino_t last;
     int i;
 
+    lc_inodeForgetDeferred(fs, false);
     if (fs->fs_icache == NULL) {
         return;
     }
+    lc_icacheRehashDone(fs);
+    lc_inodeFilterFree(fs);
+    lc_syncListFree(fs);
     last = remove ? fs->fs_rootInode->i_ino : 0;
 
     /* Take the inode off the hash list */
@@ -1084,11 +1899,13 @@ lc_destroyInodes(struct fs *fs, bool remove) {
     }
     assert(fs->fs_icount == icount);
     fs->fs_icount = 0;
+    assert(fs->fs_imemory == 0);
 }
 
 /* Clone the root directory from parent */
 void
 lc_cloneRootDir(struct inode *pdir, struct inode *dir) {
+    assert(!(pdir->i_flags & LC_INODE_DOVERLAY));
     dir->i_size = pdir->i_size;
     dir->i_nlink = pdir->i_nlink;
     dir->i_dirent = pdir->i_dirent;
@@ -1099,10 +1916,18 @@ lc_cloneRootDir(struct inode *pdir, struct inode *dir) {
     }
 }
 
+/* Keep metadata of an inode shared with a child layer in memory */
+static inline void
+lc_inodePin(struct inode *inode) {
+    if (!(inode->i_flags & LC_INODE_PINNED)) {
+        __sync_fetch_and_or(&inode->i_flags, LC_INODE_PINNED);
+    }
+}
+
 /* Clone an inode from a parent layer */
 struct inode *
-lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
-              struct inode *last, bool exclusive) {
+lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino,
+              bool exclusive) {
     bool reg = S_ISREG(parent->i_mode);
     struct inode *inode, *new;
     int flags = 0;
@@ -1115,7 +1940,7 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
     new = lc_newInode(fs, 0, reg, false, true, false);
     memcpy(&new->i_dinode, &parent->i_dinode, sizeof(struct dinode));
     lc_inodeLock(new, true);
-    inode = lc_addInode(fs, new, hash, true, new, last);
+    inode = lc_addInode(fs, new, true, new);
     if (inode != new) {
         lc_inodeLock(inode, exclusive);
         return inode;
@@ -1134,6 +1959,7 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
                 assert(lc_inodeGetEmap(parent));
                 lc_inodeSetEmap(inode, lc_inodeGetEmap(parent));
                 inode->i_flags |= LC_INODE_SHARED;
+                lc_inodePin(parent);
                 flags |= LC_INODE_EMAPDIRTY;
             }
             flags |= LC_INODE_NOTRUNC;
@@ -1144,6 +1970,7 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
             inode->i_private = 1;
         }
     } else if (S_ISDIR(inode->i_mode)) {
+        assert(!(parent->i_flags & LC_INODE_DOVERLAY));
         if (parent->i_dirent) {
 
             /* Directory entries are shared initially */
@@ -1152,6 +1979,7 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
             if (parent->i_flags & LC_INODE_DHASHED) {
                 inode->i_flags |= LC_INODE_DHASHED;
             }
+            lc_inodePin(parent);
             flags |= LC_INODE_DIRDIRTY;
         } else {
             assert(parent->i_size == 0);
@@ -1188,36 +2016,34 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
 }
 
 /* Lookup the requested inode in the parent chain.  Inode is locked only if
- * cloned to the layer
+ * cloned to the layer.  Layers which could not have the inode are skipped
+ * without searching those.
  */
 static struct inode *
-lc_getInodeParent(struct fs *fs, ino_t inum, int fhash, struct inode *last,
-                  bool copy, bool exclusive) {
+lc_getInodeParent(struct fs *fs, ino_t inum, bool copy, bool exclusive) {
     struct inode *inode = NULL, *parent;
-    uint64_t csize = 0;
+    uint64_t bits, word;
     struct fs *pfs;
-    int hash = -1;
 
+    bits = lc_inodeFilterBits(inum, &word);
     pfs = fs->fs_parent;
     while (pfs) {
         assert(inum != pfs->fs_root);
         assert(pfs->fs_frozen || pfs->fs_commitInProgress);
-
-        /* Hash changes with inode cache size */
-        if (pfs->fs_icacheSize != csize) {
-            hash = lc_inodeHash(pfs, inum);
-            csize = pfs->fs_icacheSize;
+        if (!lc_inodeFilterCheck(pfs, bits, word)) {
+            pfs = pfs->fs_parent;
+            continue;
         }
 
         /* Check parent layers until an inode is found */
-        parent = lc_lookupInodeCache(pfs, inum, hash);
+        parent = lc_lookupInodeCache(pfs, inum);
         if (parent != NULL) {
             assert(!(parent->i_flags & LC_INODE_REMOVED));
+            lc_inodeLoad(parent);
             if (copy) {
 
                 /* Clone the inode only when modified */
-                inode = lc_cloneInode(fs, parent, inum, fhash, last,
-                                      exclusive);
+                inode = lc_cloneInode(fs, parent, inum, exclusive);
             } else {
 
                 /* XXX Remember this for future lookup */
@@ -1230,14 +2056,52 @@ lc_getInodeParent(struct fs *fs, ino_t inum, int fhash, struct inode *last,
     return inode;
 }
 
+/* Look up a batch of inodes for reading attributes, without locking those.
+ * Parent layers are searched one at a time for all the inodes not found so
+ * far, instead of walking the parent chain for every inode.  Inodes not found
+ * are returned as NULL.
+ */
+void
+lc_lookupInodes(struct fs *fs, ino_t *inos, struct inode **inodes,
+                int count) {
+    uint64_t bits, word;
+    int i, remain = 0;
+    struct fs *pfs;
+
+    lc_lockOwned(&fs->fs_rwlock, false);
+    for (i = 0; i < count; i++) {
+        inodes[i] = lc_lookupInode(fs, inos[i]);
+        if (inodes[i] == NULL) {
+            remain++;
+        }
+    }
+    pfs = fs->fs_parent;
+    while (remain && pfs) {
+        assert(pfs->fs_frozen || pfs->fs_commitInProgress);
+        for (i = 0; i < count; i++) {
+            if (inodes[i]) {
+                continue;
+            }
+            bits = lc_inodeFilterBits(inos[i], &word);
+            if (lc_inodeFilterCheck(pfs, bits, word)) {
+                inodes[i] = lc_lookupInodeCache(pfs, inos[i]);
+                if (inodes[i]) {
+                    assert(!(inodes[i]->i_flags & LC_INODE_REMOVED));
+                    remain--;
+                }
+            }
+        }
+        pfs = pfs->fs_parent;
+    }
+}
+
 /* Mark an inode as hidden */
 void
 lc_hideInode(struct fs *fs, ino_t ino, struct inode *inode) {
     struct fs *pfs;
 
     if (inode == NULL) {
-        inode = lc_getInodeParent(fs, ino, lc_inodeHash(fs, ino), NULL,
-                                  false, false);
+        inode = lc_getInodeParent(fs, ino, false, false);
     }
     if (inode && !(inode->i_flags & LC_INODE_HIDDEN) && inode->i_size) {
         pfs = inode->i_fs;
@@ -1251,8 +2115,7 @@ struct inode *
 lc_getInode(struct fs *fs, ino_t ino, struct inode *handle,
             bool copy, bool exclusive) {
     ino_t inum = lc_getInodeHandle(ino);
-    struct inode *inode, *last;
-    int hash;
+    struct inode *inode;
 
     assert(!fs->fs_removed);
     lc_lockOwned(&fs->fs_rwlock, false);
@@ -1262,15 +2125,15 @@ lc_getInode(struct fs *fs, ino_t ino, struct inode *handle,
         inode = handle;
         assert(inode->i_ino == inum);
         lc_inodeLock(inode, exclusive);
+        lc_inodeLoad(inode);
         return inode;
     }
 
     /* Check if the file system has the inode or not */
-    hash = lc_inodeHash(fs, inum);
-    last = fs->fs_icache[hash].ic_head;
-    inode = lc_lookupInode(fs, inum, hash);
+    inode = lc_lookupInode(fs, inum);
     if (inode) {
         lc_inodeLock(inode, exclusive);
+        lc_inodeLoad(inode);
         return inode;
     }
 
@@ -1280,12 +2143,13 @@ lc_getInode(struct fs *fs, ino_t ino, struct inode *handle,
         assert(inode->i_ino == inum);
         assert(inode->i_fs->fs_rfs == fs->fs_rfs);
         lc_inodeLock(inode, exclusive);
+        lc_inodeLoad(inode);
         return inode;
     }
 
     /* Lookup inode in the parent chain */
     if (fs->fs_parent) {
-        inode = lc_getInodeParent(fs, inum, hash, last, copy, exclusive);
+        inode = lc_getInodeParent(fs, inum, copy, exclusive);
     }
     lc_lockOwned(inode->i_rwlock, exclusive);
     assert(!copy || (inode->i_fs == fs));
@@ -1357,7 +2221,7 @@ lc_inodeInit(struct fs *fs, mode_t mode, uid_t uid, gid_t gid,
     }
     lc_dinodeInit(inode, lc_inodeAlloc(fs), mode, uid, gid, rdev, len, parent);
     lc_updateFtypeStats(fs, mode, true);
-    lc_addInode(fs, inode, -1, true, NULL, NULL);
+    lc_addInode(fs, inode, true, NULL);
     lc_inodeLock(inode, true);
     return inode;
 }
@@ -1371,6 +2235,7 @@ lc_moveInodes(struct fs *fs, struct fs *cfs) {
     ino_t parent;
     size_t size;
 
+    lc_icacheRehashDone(fs);
     for (i = 0; (i < fs->fs_icacheSize) && (count < icount); i++) {
         pinode = fs->fs_icache[i].ic_head;
         prev = &fs->fs_icache[i].ic_head;
@@ -1381,6 +2246,7 @@ lc_moveInodes(struct fs *fs, struct fs *cfs) {
             assert(pinode->i_emapDirExtents == NULL);
             assert(pinode->i_xattrData == NULL);
             assert(pinode->i_ocount == 0);
+            assert(pinode->i_msize == 0);
             if (pinode->i_flags & LC_INODE_REMOVED) {
                 prev = &pinode->i_cnext;
                 pinode = pinode->i_cnext;
@@ -1389,8 +2255,16 @@ lc_moveInodes(struct fs *fs, struct fs *cfs) {
             *prev = pinode->i_cnext;
             inode = pinode;
             pinode = pinode->i_cnext;
+
+            /* Entries shared with parent layer may not be there in the
+             * parent of the other layer.
+             */
+            if (inode->i_flags & LC_INODE_DOVERLAY) {
+                lc_dirMaterialize(inode);
+            }
             inode->i_fs = cfs;
-            lc_addInode(cfs, inode, -1, false, NULL, NULL);
+            inode->i_flags &= ~LC_INODE_SYNCLIST;
+            lc_addInode(cfs, inode, false, NULL);
             lc_markInodeDirty(inode,
                               S_ISDIR(inode->i_mode) ? LC_INODE_DIRDIRTY :
                               (S_ISREG(inode->i_mode) ?
@@ -1433,6 +2307,7 @@ lc_moveInodes(struct fs *fs, struct fs *cfs) {
         fs->fs_icount -= mcount;
         cfs->fs_icount += mcount;
     }
+    lc_syncListPrune(fs);
 }
 
 /* Move the root inode from one layer to another */
@@ -1440,8 +2315,10 @@ void
 lc_moveRootInode(struct gfs *gfs, struct fs *cfs, struct fs *fs) {
     struct inode *dir = cfs->fs_rootInode, *inode;
     ino_t root = dir->i_ino;
-    int hash = lc_inodeHash(cfs, root);
+    int hash;
 
+    lc_icacheRehashDone(cfs);
+    hash = lc_inodeHash(cfs, root);
     assert(dir->i_ocount == 0);
     assert(dir->i_xattrData == NULL);
     if (cfs->fs_icache[hash].ic_head == dir) {
@@ -1458,15 +2335,17 @@ lc_moveRootInode(struct gfs *gfs, struct fs *cfs, struct fs *fs) {
     if (dir->i_flags & LC_INODE_DISK) {
         inode = lc_newInode(cfs, 0, false, false, true, false);
         lc_dinodeInit(inode, root, S_IFDIR | 0755, 0, 0, 0, 0, root);
-        lc_addInode(cfs, inode, -1, false, NULL, NULL);
+        lc_addInode(cfs, inode, false, NULL);
         inode->i_nlink = 0;
         inode->i_flags |= LC_INODE_REMOVED | LC_INODE_DISK;
         cfs->fs_ricount++;
         lc_markInodeDirty(inode, LC_INODE_DIRDIRTY);
     }
     dir->i_fs = fs;
-    lc_addInode(fs, dir, -1, false, NULL, NULL);
+    dir->i_flags &= ~LC_INODE_SYNCLIST;
+    lc_addInode(fs, dir, false, NULL);
     lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
+    lc_syncListPrune(cfs);
 }
 
 /* Swap information between root inodes */
@@ -1496,29 +2375,38 @@ lc_swapRootInode(struct fs *fs, struct fs *cfs) {
     }
     dir->i_dirent = cdir->i_dirent;
     cdir->i_dirent = dirent;
-    dir->i_flags = cdir->i_flags;
-    cdir->i_flags = flags;
+    dir->i_flags = (cdir->i_flags & ~LC_INODE_SYNCLIST) |
+                   (flags & LC_INODE_SYNCLIST);
+    cdir->i_flags = (flags & ~LC_INODE_SYNCLIST) |
+                    (cdir->i_flags & LC_INODE_SYNCLIST);
     fs->fs_rootInode = cdir;
     cfs->fs_rootInode = dir;
+
+    /* Keep both root inodes listed for sync in their layers */
+    if (lc_inodeDirty(dir) && !(dir->i_flags & LC_INODE_SYNCLIST)) {
+        lc_syncListAdd(cfs, dir);
+    }
+    if (lc_inodeDirty(cdir) && !(cdir->i_flags & LC_INODE_SYNCLIST)) {
+        lc_syncListAdd(fs, cdir);
+    }
 }
 
 /* Switch parent inodes of files in root directory */
 void
 lc_switchInodeParent(struct fs *fs, ino_t root) {
     struct inode *dir = fs->fs_rootInode;
-    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
-    int i, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    int i, max = lc_dirLists(dir);
     struct dirent *dirent;
     struct inode *inode;
 
     for (i = 0; i < max; i++) {
-        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        dirent = lc_dirList(dir, i);
         while (dirent) {
-            inode = lc_lookupInodeCache(fs, dirent->di_ino, -1);
+            inode = lc_lookupInodeCache(fs, dirent->di_ino);
             if (inode) {
                 inode->i_parent = root;
             }
-            dirent = dirent->di_next;
+            dirent = lc_dirNext(dirent);
         }
     }
 }
@@ -1540,7 +2428,11 @@ lc_cloneInodes(struct gfs *gfs, struct fs *fs, struct fs *pfs) {
                 continue;
             }
             inode = lc_getInode(fs, pinode->i_ino, NULL, true, true);
-            if (inode->i_flags & LC_INODE_SHARED) {
+            if (inode->i_flags & LC_INODE_DOVERLAY) {
+
+                /* Entries shared with the parent layer are copied */
+                lc_dirMaterialize(inode);
+            } else if (inode->i_flags & LC_INODE_SHARED) {
                 if (S_ISREG(inode->i_mode)) {
                     lc_copyEmap(gfs, fs, inode);
                     flags = LC_INODE_EMAPDIRTY;
@@ -9,9 +9,27 @@
 #define LC_ICACHE_SIZE     1024
 #define LC_ICACHE_SIZE_MAX 8192
 
+/* Largest size the inode hash table grows to */
+#define LC_ICACHE_SIZE_LIMIT (1ull << 22)
+
 /* Used to size icache from number of inodes in the layer */
 #define LC_ICACHE_TARGET   2
 
+/* Average length of hash lists at which icache is grown */
+#define LC_ICACHE_LOAD     8
+
+/* Factor by which icache grows */
+#define LC_ICACHE_GROW     4
+
+/* Number of hash lists moved to the new icache while adding an inode */
+#define LC_ICACHE_REHASH_COUNT 16
+
+/* Bits in the inode filter of an immutable layer per inode */
+#define LC_IFILTER_BITS    16
+
+/* Initial number of slots in the list of modified inodes of a layer */
+#define LC_SYNCLIST_SIZE   64
+
 /* Current file name size limit */
 #define LC_FILENAME_MAX 255
 
@@ -33,23 +51,67 @@ struct icache {
     ino_t ic_highInode;
 };
 
+/* Inode hash table freed after threads looking up inodes in it are done */
+struct icacheRetired {
+
+    /* RCU callback */
+    struct rcu_head ir_rcu;
+
+    /* Hash table to be freed */
+    struct icache *ir_icache;
+};
+
+/* Lookup references dropped by the kernel while a layer was locked
+ * exclusive, dropped from the inode when the layer is locked next.
+ */
+struct iforget {
+
+    /* Next request in the list */
+    struct iforget *if_next;
+
+    /* Handle of the inode */
+    ino_t if_ino;
+
+    /* Number of references dropped */
+    uint64_t if_nlookup;
+};
+
 /* Minimum directory size before converting to hash table */
 #define LC_DIRCACHE_MIN  32
 
-/* Size of the directory hash table */
-/* XXX Use a hash size proportional to the size of the directory.
- * Rehash as the directory grows.
+/* Minimum number of hash lists in a directory hash table */
+#define LC_DIRHASH_MINSIZE 16
+
+/* Maximum number of hash lists in a directory hash table */
+#define LC_DIRHASH_MAXSIZE (1u << 24)
+
+/* Average length of hash lists at which a directory hash table is grown */
+#define LC_DIRHASH_LOAD    4
+
+/* Factor by which a directory hash table grows */
+#define LC_DIRHASH_GROW    4
+
+/* Bits in the readdir offset storing index of an entry among entries with
+ * the same name hash.  Name hash is stored in the bits above.
  */
-#define LC_DIRCACHE_SIZE 512
+#define LC_DIRHASH_INDEX_BITS 29
 
-/* Number of characters included from the name for calculating hash */
-#define LC_DIRHASH_LEN   10
+/* Readdir offsets of directories not using a hash table */
+#define LC_DIRHASH_LINEAR  (1ul << 62)
 
-/* Bytes shifted in readdir offset for storing hash index */
-#define LC_DIRHASH_SHIFT 32ul
+/* Readdir offsets of entries added over entries of the parent layer */
+#define LC_DIRHASH_OVERLAY (1ul << 61)
+
+/* Maximum number of entries added or removed in a directory, on top of the
+ * entries shared with the parent layer, before copying the directory.
+ */
+#define LC_DIROVERLAY_MAX  32
+
+/* Number of entries inodes are looked up together for readdirplus */
+#define LC_READDIR_BATCH   32
 
 /* Portion of the readdir offset storing index in the list */
-#define LC_DIRHASH_INDEX 0x00000000FFFFFFFFul
+#define LC_DIRHASH_INDEX   ((1ul << LC_DIRHASH_INDEX_BITS) - 1)
 
 /* Directory entry */
 struct dirent {
@@ -58,10 +120,13 @@ struct dirent {
     uint64_t di_ino:LC_FH_LAYER;
 
     /* Size of name */
-    uint64_t di_size:16;
+    uint64_t di_size:14;
 
-    /* Next entry in the directory */
-    struct dirent *di_next;
+    /* Set if the entry is in the array of a packed directory */
+    uint64_t di_packed:1;
+
+    /* Set on the last entry of a list in a packed directory */
+    uint64_t di_last:1;
 
     /* Name of the file/directory */
     char *di_name;
@@ -69,16 +134,87 @@ struct dirent {
     /* Index of this entry in the directory */
     uint32_t di_index;
 
+    /* Hash of the name, valid in hashed directories */
+    uint32_t di_hash;
+
     /* File mode */
     mode_t di_mode;
 }  __attribute__((packed));
 
+/* Directory entry linked in a list of a directory which is not packed.
+ * Entries of a packed directory are kept in an array, where every list is a
+ * run of entries.
+ */
+struct dlink {
+
+    /* Directory entry */
+    struct dirent dl_dirent;
+
+    /* Next entry in the list */
+    struct dirent *dl_next;
+}  __attribute__((packed));
+
+/* Hash table of a directory.  Hash lists are picked using the upper bits of
+ * the name hash and entries in each list are kept sorted on the name hash, so
+ * that entries are visited in the same order irrespective of the size of the
+ * table.
+ */
+struct dhash {
+
+    /* Number of hash lists */
+    uint32_t dh_size;
+
+    /* Bits the name hash is shifted to pick a hash list */
+    uint32_t dh_shift;
+
+    /* Hash lists */
+    struct dirent *dh_lists[];
+};
+
+/* Changes made in a layer to a directory sharing entries with the parent
+ * layer.  Entries of the parent layer do not change as the parent layer is
+ * immutable.
+ */
+struct dover {
+
+    /* Entries shared with the parent layer */
+    union {
+
+        /* List of entries */
+        struct dirent *do_dirent;
+
+        /* Hash table of entries */
+        struct dhash *do_hdirent;
+    };
+
+    /* Entries added in the layer */
+    struct dirent *do_added;
+
+    /* Entries of the parent layer removed in the layer */
+    struct dirent *do_removed[LC_DIROVERLAY_MAX];
+
+    /* Number of entries shared with the parent layer */
+    uint64_t do_size;
+
+    /* Number of entries in do_added */
+    uint32_t do_acount;
+
+    /* Number of entries in do_removed */
+    uint32_t do_rcount;
+
+    /* Set if entries of the parent layer are in a hash table */
+    bool do_hashed;
+};
+
 /* Data specific for regular files */
 struct rdata {
 
     /* Extent map */
     struct extent *rd_emap;
 
+    /* Index over extent map, built on demand for lookups */
+    struct eindex *rd_eindex;
+
     /* Next entry in the dirty list */
     struct inode *rd_dnext;
 
@@ -97,7 +233,7 @@ struct rdata {
     /* Count of dirty pages */
     uint32_t rd_dpcount;
 } __attribute__((packed));
-static_assert(sizeof(struct rdata) == 40, "rdata size != 40");
+static_assert(sizeof(struct rdata) == 48, "rdata size != 48");
 
 /* Data tracked for hard links */
 struct hldata {
@@ -159,6 +295,12 @@ struct ixattr {
 #define LC_INODE_SYMLINK        0x0800  /* Free symbolic link target */
 #define LC_INODE_DISK           0x1000  /* Inode flushed to disk */
 #define LC_INODE_HIDDEN         0x2000  /* Inode is hidden from child layers */
+#define LC_INODE_UNLOADED       0x4000  /* Emap, directory or xattrs not read */
+#define LC_INODE_PINNED         0x8000  /* Metadata shared with a child layer */
+#define LC_INODE_REFERENCED     0x10000 /* Metadata accessed since last scan */
+#define LC_INODE_SYNCLIST       0x20000 /* On list of inodes to sync */
+#define LC_INODE_DOVERLAY       0x40000 /* Directory changes over parent */
+#define LC_INODE_DPACKED        0x80000 /* Directory entries in an array */
 
 /* Fake inode number used to trigger layer commit operation */
 #define LC_COMMIT_TRIGGER_INODE     LC_ROOT_INODE
@@ -199,7 +341,10 @@ struct inode {
         struct dirent *i_dirent;
 
         /* Directory hash table */
-        struct dirent **i_hdirent;
+        struct dhash *i_hdirent;
+
+        /* Directory changes on top of the parent layer */
+        struct dover *i_dover;
 
         /* Target of a symbolic link */
         char *i_target;
@@ -210,13 +355,23 @@ struct inode {
 
     /* Various flags */
     uint32_t i_flags;
+
+    /* References from the kernel and from child layers on inodes of
+     * immutable layers.
+     */
+    uint64_t i_refs;
+
+    /* Memory of metadata charged to the layer, while the inode is in an
+     * immutable layer.
+     */
+    uint64_t i_msize;
 #ifdef __APPLE__
     /* Padding for darwin */
 #define DARWIN_INODE_SIZE 6
     char opaque[DARWIN_INODE_SIZE];
 #endif
 }  __attribute__((packed));
-static_assert(sizeof(struct inode) == 160, "inode size != 160");
+static_assert(sizeof(struct inode) == 176, "inode size != 176");
 static_assert((sizeof(struct inode) % sizeof(void *)) == 0,
               "Inode size is not aligned");
 
@@ -264,6 +419,14 @@ lc_inodeSetEmap(struct inode *inode, struct extent *extent) {
     rdata->rd_emap = extent;
 }
 
+/* Return the index over the emap list */
+static inline struct eindex *
+lc_inodeGetEmapIndex(struct inode *inode) {
+    struct rdata *rdata = lc_inodeGetRegData(inode);
+
+    return rdata->rd_eindex;
+}
+
 /* Return the size of inode page array */
 static inline uint32_t
 lc_inodeGetPageCount(struct inode *inode) {
@@ -369,18 +532,68 @@ lc_inodeSetLastPage(struct inode *inode, uint64_t page) {
     rdata->rd_lpage = page;
 }
 
-/* Mark inode dirty for flushing to disk */
-static inline void
-lc_markInodeDirty(struct inode *inode, uint32_t flags) {
-    assert(!(flags & LC_INODE_DIRDIRTY) || S_ISDIR(inode->i_dinode.di_mode));
-    assert(!(flags & LC_INODE_EMAPDIRTY) || S_ISREG(inode->i_dinode.di_mode));
+/* Return the number of lists holding entries of a directory.  Entries added
+ * over the parent layer are in the last list.
+ */
+static inline uint32_t
+lc_dirLists(struct inode *dir) {
+    struct dover *dover;
+
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        return (dover->do_hashed ? dover->do_hdirent->dh_size : 1) + 1;
+    }
+    return (dir->i_flags & LC_INODE_DHASHED) ? dir->i_hdirent->dh_size : 1;
+}
+
+/* Return the first entry in a list of a directory */
+static inline struct dirent *
+lc_dirList(struct inode *dir, uint32_t i) {
+    struct dover *dover;
 
-    /* Reset notrunc flag when data modified in a layer */
-    if (flags & LC_INODE_EMAPDIRTY) {
-        inode->i_flags &= ~LC_INODE_NOTRUNC;
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        if (i == (lc_dirLists(dir) - 1)) {
+            return dover->do_added;
+        }
+        return dover->do_hashed ? dover->do_hdirent->dh_lists[i] :
+                                  dover->do_dirent;
     }
-    inode->i_flags |= flags | LC_INODE_DIRTY;
-    lc_markInodesDirty(inode->i_fs);
+    return (dir->i_flags & LC_INODE_DHASHED) ? dir->i_hdirent->dh_lists[i] :
+                                               dir->i_dirent;
+}
+
+/* Return the entry next to an entry in a directory list */
+static inline struct dirent *
+lc_dirNext(struct dirent *dirent) {
+    if (dirent->di_packed) {
+        return dirent->di_last ? NULL : dirent + 1;
+    }
+    return ((struct dlink *)dirent)->dl_next;
+}
+
+/* Return the link to the next entry in a list of a directory not packed */
+static inline struct dirent **
+lc_dirLink(struct dirent *dirent) {
+    assert(!dirent->di_packed);
+    return &((struct dlink *)dirent)->dl_next;
+}
+
+/* Check if an entry shared with the parent layer is removed in the layer */
+static inline bool
+lc_dirRemoved(struct inode *dir, struct dirent *dirent) {
+    struct dover *dover;
+    uint32_t i;
+
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        dover = dir->i_dover;
+        for (i = 0; i < dover->do_rcount; i++) {
+            if (dover->do_removed[i] == dirent) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
 /* Check an inode is dirty or not */
@@ -390,6 +603,12 @@ lc_inodeDirty(struct inode *inode) {
                               LC_INODE_EMAPDIRTY | LC_INODE_XATTRDIRTY));
 }
 
+/* Return the count of references on an inode of an immutable layer */
+static inline uint64_t
+lc_inodeGetRefs(struct inode *inode) {
+    return inode->i_refs;
+}
+
 /* Find size of icache size based on number of inodes */
 static inline size_t
 lc_icache_size(struct fs *fs) {
@@ -414,8 +633,8 @@ lc_icache_size(struct fs *fs) {
     if (icsize <= LC_ICACHE_SIZE_MIN) {
         return LC_ICACHE_SIZE_MIN;
     }
-    if (icsize >= LC_ICACHE_SIZE_MAX) {
-        return LC_ICACHE_SIZE_MAX;
+    if (icsize >= LC_ICACHE_SIZE_LIMIT) {
+        return LC_ICACHE_SIZE_LIMIT;
     }
     return icsize;
 }
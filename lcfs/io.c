@@ -1,5 +1,269 @@
 #include "includes.h"
 
+#ifdef LC_IO_URING
+#include <liburing.h>
+
+/* Number of entries in the submission queue */
+#define LC_IO_RING_SIZE     256
+
+/* Asynchronous I/O engine shared by all layers */
+struct lc_ioring {
+
+    /* io_uring instance for the device */
+    struct io_uring r_ring;
+
+    /* Lock serializing submissions */
+    pthread_mutex_t r_lock;
+
+    /* Thread reaping completions */
+    pthread_t r_reaper;
+
+    /* Number of requests submitted and not reaped yet */
+    uint32_t r_inflight;
+
+    /* Maximum number of requests in flight, so that the completion queue
+     * never overflows.
+     */
+    uint32_t r_depth;
+
+    /* Set if the ring is usable */
+    bool r_enabled;
+};
+
+static struct lc_ioring lc_ioring;
+
+/* Tag of requests which could not be submitted, completed without a batch */
+#define LC_IO_CANCELLED     ((void *)&lc_ioring)
+
+/* Reap completions and wake up threads waiting on the batches */
+static void *
+lc_ioReaper(void *data) {
+    struct iobatch *batch;
+    struct io_uring_cqe *cqe;
+    int err, res;
+
+    for (;;) {
+        err = io_uring_wait_cqe(&lc_ioring.r_ring, &cqe);
+        if (err == -EINTR) {
+            continue;
+        }
+        assert(err == 0);
+        batch = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&lc_ioring.r_ring, cqe);
+
+        /* A request without a batch is queued to stop the thread */
+        if (batch == NULL) {
+            break;
+        }
+        __sync_sub_and_fetch(&lc_ioring.r_inflight, 1);
+        if (batch == LC_IO_CANCELLED) {
+            continue;
+        }
+        pthread_mutex_lock(&batch->ib_lock);
+        if (res > 0) {
+            batch->ib_completed += res;
+        }
+        assert(batch->ib_pending > 0);
+        batch->ib_pending--;
+        if (batch->ib_pending == 0) {
+            pthread_cond_signal(&batch->ib_cond);
+        }
+        pthread_mutex_unlock(&batch->ib_lock);
+    }
+    return NULL;
+}
+
+/* Queue a scatter gather I/O to the ring.  Requests are submitted right away,
+ * so that callers could reuse iovec arrays, but completions are not waited
+ * for until lc_ioBatchWait() is called.  Returns false if the request could
+ * not be submitted, and then the caller does the I/O synchronously.
+ */
+static bool
+lc_ioSubmit(struct gfs *gfs, struct iobatch *batch, struct iovec *iov,
+            int iovcnt, off_t block, bool write) {
+    struct io_uring_sqe *sqe;
+    int err;
+
+    pthread_mutex_lock(&lc_ioring.r_lock);
+    if (lc_ioring.r_inflight >= lc_ioring.r_depth) {
+        pthread_mutex_unlock(&lc_ioring.r_lock);
+        return false;
+    }
+    sqe = io_uring_get_sqe(&lc_ioring.r_ring);
+    if (sqe == NULL) {
+
+        /* Push out anything queued and try again */
+        io_uring_submit(&lc_ioring.r_ring);
+        sqe = io_uring_get_sqe(&lc_ioring.r_ring);
+        if (sqe == NULL) {
+            pthread_mutex_unlock(&lc_ioring.r_lock);
+            return false;
+        }
+    }
+    if (write) {
+        io_uring_prep_writev(sqe, gfs->gfs_fd, iov, iovcnt,
+                             block * LC_BLOCK_SIZE);
+    } else {
+        io_uring_prep_readv(sqe, gfs->gfs_fd, iov, iovcnt,
+                            block * LC_BLOCK_SIZE);
+    }
+    io_uring_sqe_set_data(sqe, batch);
+    pthread_mutex_lock(&batch->ib_lock);
+    batch->ib_pending++;
+    batch->ib_expected += iovcnt * LC_BLOCK_SIZE;
+    pthread_mutex_unlock(&batch->ib_lock);
+    __sync_add_and_fetch(&lc_ioring.r_inflight, 1);
+    err = io_uring_submit(&lc_ioring.r_ring);
+    if (err < 0) {
+
+        /* Request stays queued in the ring, so turn it into a no-op not
+         * completing any batch, as the caller may reuse the buffers.
+         */
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, LC_IO_CANCELLED);
+        pthread_mutex_lock(&batch->ib_lock);
+        assert(batch->ib_pending > 0);
+        batch->ib_pending--;
+        batch->ib_expected -= iovcnt * LC_BLOCK_SIZE;
+        pthread_mutex_unlock(&batch->ib_lock);
+        pthread_mutex_unlock(&lc_ioring.r_lock);
+        lc_syslog(LOG_ERR, "io_uring submission failed, err %d\n", -err);
+        return false;
+    }
+    pthread_mutex_unlock(&lc_ioring.r_lock);
+    return true;
+}
+#endif
+
+/* Initialize the I/O engine.  Falls back to synchronous I/O if io_uring is not
+ * supported by the kernel.
+ */
+void
+lc_ioInit(struct gfs *gfs) {
+#ifdef LC_IO_URING
+    struct io_uring_params params;
+    int err;
+
+    memset(&params, 0, sizeof(params));
+    err = io_uring_queue_init_params(LC_IO_RING_SIZE, &lc_ioring.r_ring,
+                                     &params);
+    if (err) {
+        lc_syslog(LOG_INFO, "io_uring not available, err %d, "
+                            "using synchronous I/O\n", -err);
+        return;
+    }
+
+    /* Callers reuse iovec arrays once requests are submitted */
+    if (!(params.features & IORING_FEAT_SUBMIT_STABLE)) {
+        lc_syslog(LOG_INFO, "io_uring does not support stable submissions, "
+                            "using synchronous I/O\n");
+        io_uring_queue_exit(&lc_ioring.r_ring);
+        return;
+    }
+    pthread_mutex_init(&lc_ioring.r_lock, NULL);
+
+    /* Leave room for the request stopping the reaper */
+    lc_ioring.r_depth = params.cq_entries - 1;
+    err = pthread_create(&lc_ioring.r_reaper, NULL, lc_ioReaper, NULL);
+    if (err) {
+        lc_syslog(LOG_ERR, "I/O reaper thread could not be created, "
+                           "err %d\n", err);
+        io_uring_queue_exit(&lc_ioring.r_ring);
+        return;
+    }
+    lc_ioring.r_enabled = true;
+    lc_syslog(LOG_INFO, "Using io_uring for I/O, queue depth %d\n",
+              LC_IO_RING_SIZE);
+#endif
+}
+
+/* Shutdown the I/O engine */
+void
+lc_ioDeinit(struct gfs *gfs) {
+#ifdef LC_IO_URING
+    struct io_uring_sqe *sqe;
+
+    if (!lc_ioring.r_enabled) {
+        return;
+    }
+
+    /* Queue a request without a batch for stopping the reaper */
+    pthread_mutex_lock(&lc_ioring.r_lock);
+    lc_ioring.r_enabled = false;
+    sqe = io_uring_get_sqe(&lc_ioring.r_ring);
+    assert(sqe);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_submit(&lc_ioring.r_ring);
+    pthread_mutex_unlock(&lc_ioring.r_lock);
+    pthread_join(lc_ioring.r_reaper, NULL);
+    io_uring_queue_exit(&lc_ioring.r_ring);
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&lc_ioring.r_lock);
+#endif
+#endif
+}
+
+/* Initialize a batch of I/Os */
+void
+lc_ioBatchInit(struct iobatch *batch) {
+    memset(batch, 0, sizeof(struct iobatch));
+#ifdef LC_IO_URING
+    if (lc_ioring.r_enabled) {
+        pthread_mutex_init(&batch->ib_lock, NULL);
+        pthread_cond_init(&batch->ib_cond, NULL);
+        batch->ib_async = true;
+    }
+#endif
+}
+
+/* Release resources of a batch of I/Os after waiting for those */
+void
+lc_ioBatchDeinit(struct iobatch *batch) {
+    if (!batch->ib_async) {
+        return;
+    }
+    assert(batch->ib_pending == 0);
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&batch->ib_lock);
+    pthread_cond_destroy(&batch->ib_cond);
+#endif
+}
+
+/* Wait for all I/Os issued as part of the batch to complete */
+void
+lc_ioBatchWait(struct gfs *gfs, struct iobatch *batch) {
+    if (!batch->ib_async) {
+        return;
+    }
+    pthread_mutex_lock(&batch->ib_lock);
+    while (batch->ib_pending) {
+        pthread_cond_wait(&batch->ib_cond, &batch->ib_lock);
+    }
+    assert(batch->ib_completed == batch->ib_expected);
+    batch->ib_completed = 0;
+    batch->ib_expected = 0;
+    pthread_mutex_unlock(&batch->ib_lock);
+}
+
+/* Check buffers are aligned as needed when device is accessed with direct I/O
+ */
+static inline bool
+lc_ioAligned(struct gfs *gfs, struct iovec *iov, int iovcnt) {
+    int i;
+
+    if (gfs->gfs_directIO) {
+        for (i = 0; i < iovcnt; i++) {
+            if (((uintptr_t)iov[i].iov_base % LC_BLOCK_SIZE) ||
+                (iov[i].iov_len % LC_BLOCK_SIZE)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 /* Read a file system block */
 void
 lc_readBlock(struct gfs *gfs, struct fs *fs, off_t block, void *dbuf) {
@@ -7,20 +271,32 @@ lc_readBlock(struct gfs *gfs, struct fs *fs, off_t block, void *dbuf) {
 
     //lc_printf("Reading block %ld\n", block);
     assert((block == LC_SUPER_BLOCK) || (block < gfs->gfs_super->sb_tblocks));
+    assert(!gfs->gfs_directIO || (((uintptr_t)dbuf % LC_BLOCK_SIZE) == 0));
     size = pread(gfs->gfs_fd, dbuf, LC_BLOCK_SIZE, block * LC_BLOCK_SIZE);
     assert(size == LC_BLOCK_SIZE);
     __sync_add_and_fetch(&gfs->gfs_reads, 1);
     __sync_add_and_fetch(&fs->fs_reads, 1);
 }
 
-/* Read into a scatter gather list of buffers */
+/* Read into a scatter gather list of buffers.  If a batch is specified, the
+ * read may complete asynchronously and the caller need to wait for the batch.
+ */
 void
-lc_readBlocks(struct gfs *gfs, struct fs *fs,
-              struct iovec *iov, int iovcnt, off_t block) {
+lc_readBlocks(struct gfs *gfs, struct fs *fs, struct iovec *iov, int iovcnt,
+              off_t block, struct iobatch *batch) {
     size_t size;
 
     //lc_printf("lc_readBlocks: Reading %d blocks %ld\n", iovcnt, block);
     assert((block + iovcnt) < gfs->gfs_super->sb_tblocks);
+    assert(lc_ioAligned(gfs, iov, iovcnt));
+#ifdef LC_IO_URING
+    if (batch && batch->ib_async &&
+        lc_ioSubmit(gfs, batch, iov, iovcnt, block, false)) {
+        __sync_add_and_fetch(&gfs->gfs_reads, 1);
+        __sync_add_and_fetch(&fs->fs_reads, 1);
+        return;
+    }
+#endif
     size = lc_preadv(gfs->gfs_fd, iov, iovcnt, block * LC_BLOCK_SIZE);
     assert(size == (iovcnt * LC_BLOCK_SIZE));
     __sync_add_and_fetch(&gfs->gfs_reads, 1);
@@ -34,23 +310,35 @@ lc_writeBlock(struct gfs *gfs, struct fs *fs, void *buf, off_t block) {
 
     //lc_printf("lc_writeBlock: Writing block %ld\n", block);
     assert(block < gfs->gfs_super->sb_tblocks);
+    assert(!gfs->gfs_directIO || (((uintptr_t)buf % LC_BLOCK_SIZE) == 0));
     count = pwrite(gfs->gfs_fd, buf, LC_BLOCK_SIZE, block * LC_BLOCK_SIZE);
     assert(count == LC_BLOCK_SIZE);
     __sync_add_and_fetch(&gfs->gfs_writes, 1);
     __sync_add_and_fetch(&fs->fs_writes, 1);
 }
 
-/* Write a scatter gather list of buffers */
+/* Write a scatter gather list of buffers.  If a batch is specified, the write
+ * may complete asynchronously and the caller need to wait for the batch.
+ */
 void
-lc_writeBlocks(struct gfs *gfs, struct fs *fs,
-               struct iovec *iov, int iovcnt, off_t block) {
+lc_writeBlocks(struct gfs *gfs, struct fs *fs, struct iovec *iov, int iovcnt,
+               off_t block, struct iobatch *batch) {
     ssize_t count;
 
     //lc_printf("lc_writeBlocks: Writing %d blocks %ld\n", iovcnt, block);
     assert((block + iovcnt) < gfs->gfs_super->sb_tblocks);
+    assert(lc_ioAligned(gfs, iov, iovcnt));
     if (fs->fs_removed) {
         return;
     }
+#ifdef LC_IO_URING
+    if (batch && batch->ib_async &&
+        lc_ioSubmit(gfs, batch, iov, iovcnt, block, true)) {
+        __sync_add_and_fetch(&gfs->gfs_writes, 1);
+        __sync_add_and_fetch(&fs->fs_writes, 1);
+        return;
+    }
+#endif
     count = lc_pwritev(gfs->gfs_fd, iov, iovcnt, block * LC_BLOCK_SIZE);
     assert(count == (iovcnt * LC_BLOCK_SIZE));
     __sync_add_and_fetch(&gfs->gfs_writes, 1);
@@ -22,6 +22,11 @@ usage(char *pgm, char *name) {
         fprintf(stderr, "usage: %s %s <mnt> <pcache>\n", pgm, name);
         fprintf(stderr, "\t mnt    - mount point\n");
         fprintf(stderr, "\t memory - memory limit in MB (default 512MB)\n");
+    } else if (strcmp(name, "icache") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <icache>\n", pgm, name);
+        fprintf(stderr, "\t mnt    - mount point\n");
+        fprintf(stderr, "\t memory - memory limit in MB "
+                "(default 0 for no limit)\n");
 #ifndef __MUSL__
     } else if (strcmp(name, "profile") == 0) {
         fprintf(stderr, "usage: %s %s <mnt> [enable|disable]\n", pgm, name);
@@ -140,6 +145,8 @@ ioctl_main(char *pgm, int argc, char *argv[]) {
             err = ioctl(fd, _IOW(0, SYNCER_TIME, int), argv[2]);
         } else if (value && (strcmp(argv[0], "pcache") == 0)) {
             err = ioctl(fd, _IOW(0, DCACHE_MEMORY, int), argv[2]);
+        } else if (strcmp(argv[0], "icache") == 0) {
+            err = ioctl(fd, _IOW(0, ICACHE_MEMORY, int), argv[2]);
         } else {
             close(fd);
             usage(pgm, argv[0]);
@@ -42,7 +42,7 @@ static void
 lc_invalidateFirstLayer(struct gfs *gfs, struct fs *pfs, int gindex) {
     struct fs *fs;
 
-    rcu_register_thread();
+    lc_rcuRegister();
     rcu_read_lock();
     fs = rcu_dereference(gfs->gfs_fs[gindex]);
     if (fs && !lc_tryLock(fs, false)) {
@@ -52,7 +52,6 @@ lc_invalidateFirstLayer(struct gfs *gfs, struct fs *pfs, int gindex) {
     } else {
         rcu_read_unlock();
     }
-    rcu_unregister_thread();
 }
 
 /* Create a new layer */
@@ -172,7 +171,7 @@ lc_createLayer(fuse_req_t req, struct gfs *gfs, const char *name,
     if (base) {
 
         /* Allocate block cache for a base layer */
-        lc_bcacheInit(fs, LC_PCACHE_SIZE, LC_PCLOCK_COUNT);
+        lc_bcacheInit(fs, LC_PCACHE_SIZE_MIN, LC_PCLOCK_COUNT);
     } else {
 
         /* Copy the parent root directory */
@@ -374,7 +373,7 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
         lc_unlock(fs);
 
         /* Sync dirty data */
-        rcu_register_thread();
+        lc_rcuRegister();
         rcu_read_lock();
         fs = rcu_dereference(gfs->gfs_fs[gindex]);
         if (fs && (fs->fs_root == lc_getInodeHandle(root)) &&
@@ -388,7 +387,6 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
         } else {
             rcu_read_unlock();
         }
-        rcu_unregister_thread();
     } else {
         fuse_reply_ioctl(req, 0, NULL, 0);
         if (fs->fs_super->sb_icount != fs->fs_icount) {
@@ -549,6 +547,9 @@ lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *layer,
 
     /* Clone root directories */
     dir = cfs->fs_rootInode;
+    if (dir->i_flags & LC_INODE_DOVERLAY) {
+        lc_dirMaterialize(dir);
+    }
     if (dir->i_flags & LC_INODE_SHARED) {
         lc_dirCopy(dir);
         dir = pfs->fs_rootInode;
@@ -560,6 +561,12 @@ lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *layer,
     }
     assert(!(dir->i_flags & LC_INODE_SHARED));
 
+    /* Inodes and directory entries are handed over between these layers,
+     * so memory of those cannot be released along with arenas in bulk.
+     */
+    fs->fs_arena->a_shared = true;
+    cfs->fs_arena->a_shared = true;
+
     /* Move inodes from the new layer to the layer being committed.
      * There could be open handles on inodes.
      */
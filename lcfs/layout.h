@@ -179,8 +179,11 @@ struct super {
     /* pcache limit */
     uint32_t sb_pcache;
 
+    /* Limit on memory for metadata of immutable layers in MB */
+    uint32_t sb_icache;
+
     /* Padding for filling up a block */
-    uint8_t  sb_pad[LC_BLOCK_SIZE - 216];
+    uint8_t  sb_pad[LC_BLOCK_SIZE - 220];
 } __attribute__((packed));
 static_assert(sizeof(struct super) == LC_BLOCK_SIZE, "superblock size != LC_BLOCK_SIZE");
 
@@ -18,6 +18,7 @@ enum ioctl_cmd {
     LCFS_GROW = 113,                /* Grow file system */
     LCFS_PROFILE = 114,             /* Enable/disable profiling */
     LCFS_VERBOSE = 115,             /* Enable/disable verbose mode */
+    ICACHE_MEMORY = 116,            /* Adjust memory limit for metadata */
 };
 
 /* Prefix of fake file name used to trigger layer commit */
@@ -1,9 +1,20 @@
 #include "includes.h"
 
-/* Open a device */
+/* Open a device.  If direct I/O is requested and not supported by the
+ * underlying file system (tmpfs for example), fallback to buffered I/O.
+ */
 int
-lc_deviceOpen(char *device) {
-    return open(device, O_RDWR | O_DIRECT | O_EXCL | O_NOATIME, 0);
+lc_deviceOpen(char *device, bool *direct) {
+    int fd, flags = O_RDWR | O_EXCL | O_NOATIME;
+
+    fd = open(device, flags | (*direct ? O_DIRECT : 0), 0);
+    if ((fd == -1) && *direct && (errno == EINVAL)) {
+        lc_syslog(LOG_INFO, "%s does not support direct I/O, "
+                            "using buffered I/O\n", device);
+        *direct = false;
+        fd = open(device, flags, 0);
+    }
+    return fd;
 }
 
 /* Find out how much memory the system has */
@@ -3,12 +3,21 @@
 /* Set for tracking memory allocation and free operations */
 static bool memStatsEnabled = false;
 
+/* Set for backing block sized buffers with huge pages */
+static bool memHugePages = false;
+
 /* Enable memory stats */
 void
 lc_memStatsEnable() {
     memStatsEnabled = true;
 }
 
+/* Back block sized buffers with huge pages */
+void
+lc_memHugePagesEnable() {
+    memHugePages = true;
+}
+
 static struct lc_memory {
 
     /* Total memory currently used for data pages */
@@ -20,6 +29,14 @@ static struct lc_memory {
     /* Amount of memory for data pages targetted by cleaner */
     uint64_t m_purgeMemory;
 
+    /* Memory used for metadata of inodes in immutable layers */
+    uint64_t m_metaMemory;
+
+    /* Maximum memory for metadata of inodes in immutable layers, 0 if there
+     * is no limit.
+     */
+    uint64_t m_metaLimit;
+
     /* Memory allocated globally */
     uint64_t m_globalMemory;
 
@@ -30,6 +47,85 @@ static struct lc_memory {
     uint64_t m_globalFree;
 } lc_mem;
 
+/* Shared pool of free block sized buffers, used for data pages and metadata
+ * blocks.  Buffers are carved out of large chunks instead of allocating those
+ * individually, and are never returned to malloc.
+ */
+static struct lc_slab {
+
+    /* Free buffers, ones with memory released to the system at the bottom */
+    void **s_free;
+
+    /* Number of free buffers */
+    uint64_t s_count;
+
+    /* Number of free buffers with memory released to the system */
+    uint64_t s_released;
+
+    /* Number of buffers the free array can hold */
+    uint64_t s_size;
+
+    /* Chunk being carved into buffers */
+    char *s_chunk;
+
+    /* Offset of the next unused buffer in the chunk */
+    uint64_t s_offset;
+
+    /* Number of chunks allocated */
+    uint64_t s_chunks;
+
+    /* Number of chunks backed by huge pages */
+    uint64_t s_hchunks;
+
+    /* Number of times memory of a free buffer released to the system */
+    uint64_t s_trimmed;
+
+    /* Lock protecting the pool */
+    pthread_mutex_t s_lock;
+} lc_slab = {
+    .s_offset = LC_SLAB_CHUNK_SIZE,
+    .s_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Free buffers cached by a thread, allocated and freed without locking */
+struct lc_magazine {
+
+    /* Free buffers */
+    void *m_bufs[LC_SLAB_MAGAZINE_SIZE];
+
+    /* Number of free buffers */
+    uint32_t m_count;
+
+    /* Set once buffers are returned to the pool when the thread exits */
+    bool m_registered;
+};
+
+static __thread struct lc_magazine lc_magazine;
+
+/* Partition of the table of interned strings */
+static struct lc_istringPart {
+
+    /* Hash lists */
+    struct istring **ip_lists;
+
+    /* Number of hash lists */
+    uint32_t ip_size;
+
+    /* Number of strings */
+    uint64_t ip_count;
+
+    /* Lock protecting the partition */
+    pthread_mutex_t ip_lock;
+} lc_istrings[LC_ISTRING_PARTS] = {
+    [0 ... LC_ISTRING_PARTS - 1] = {
+        .ip_lock = PTHREAD_MUTEX_INITIALIZER,
+    },
+};
+
+/* Key for returning cached buffers to the pool as threads exit */
+static pthread_key_t lc_slabKey;
+static pthread_once_t lc_slabOnce = PTHREAD_ONCE_INIT;
+
 /* Type of malloc requests */
 static const char *mrequests[] = {
     "GFS",
@@ -47,8 +143,6 @@ static const char *mrequests[] = {
     "DPAGEHASH",
     "HPAGE",
     "XATTR",
-    "XATTRNAME",
-    "XATTRVALUE",
     "XATTRBUF",
     "XATTRINODE",
     "CFILE",
@@ -58,6 +152,11 @@ static const char *mrequests[] = {
     "SYMLINK",
     "RWLOCK",
     "STATS",
+    "IFILTER",
+    "SYNCLIST",
+    "DOVER",
+    "DPACK",
+    "IFORGET",
 };
 
 /* Initialize limit based on available memory */
@@ -97,6 +196,174 @@ lc_waitMemory(struct gfs *gfs, bool wait) {
     }
 }
 
+/* Set limit on memory used for metadata of inodes in immutable layers */
+uint64_t
+lc_metaMemoryInit(uint64_t limit) {
+    lc_mem.m_metaLimit = limit;
+    if (limit) {
+        lc_syslog(LOG_INFO, "Maximum memory allowed for metadata %ld MB\n",
+                  limit / (1024 * 1024));
+    } else {
+        lc_syslog(LOG_INFO, "No limit on memory used for metadata\n");
+    }
+    return limit;
+}
+
+/* Account memory used for metadata of an inode and wake up syncer for
+ * releasing metadata not in use if limit is exceeded.
+ */
+void
+lc_metaMemoryAdd(struct fs *fs, uint64_t size) {
+    uint64_t limit = lc_mem.m_metaLimit, total;
+
+    __sync_add_and_fetch(&fs->fs_imemory, size);
+    total = __sync_add_and_fetch(&lc_mem.m_metaMemory, size);
+    if (limit && (total > limit) && ((total - size) <= limit)) {
+        pthread_cond_signal(&fs->fs_gfs->gfs_syncerCond);
+    }
+}
+
+/* Account memory released from metadata of inodes */
+void
+lc_metaMemoryRemove(struct fs *fs, uint64_t size) {
+    assert(size <= fs->fs_imemory);
+    assert(size <= lc_mem.m_metaMemory);
+    __sync_sub_and_fetch(&fs->fs_imemory, size);
+    __sync_sub_and_fetch(&lc_mem.m_metaMemory, size);
+}
+
+/* Return memory used for metadata over the limit */
+uint64_t
+lc_metaMemoryExcess(void) {
+    uint64_t limit = lc_mem.m_metaLimit, total = lc_mem.m_metaMemory;
+
+    return (limit && (total > limit)) ? (total - limit) : 0;
+}
+
+/* Current time in microseconds */
+static inline uint64_t
+lc_throttleNow(void) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec * 1000000ul) + now.tv_usec;
+}
+
+/* Sample write back bandwidth of a layer, smoothed over recent intervals */
+static uint64_t
+lc_throttleBandwidth(struct fs *fs, uint64_t now) {
+    uint64_t last = fs->fs_wbTime, bw = fs->fs_wbBandwidth;
+    uint64_t pages, written, elapsed;
+
+    if (bw == 0) {
+        bw = LC_THROTTLE_BW_INIT;
+    }
+    elapsed = now - last;
+    if ((elapsed < LC_THROTTLE_BW_INTERVAL) ||
+        !__sync_bool_compare_and_swap(&fs->fs_wbTime, last, now)) {
+        return bw;
+    }
+
+    /* Only one writer updates the estimate in each interval.  Intervals
+     * after the layer stayed idle for long are not sampled.
+     */
+    written = fs->fs_wbPages;
+    pages = written - fs->fs_wbLast;
+    fs->fs_wbLast = written;
+    if (last && (elapsed < (LC_THROTTLE_BW_INTERVAL * 5))) {
+        bw = ((bw * 7) + ((pages * 1000000ul) / elapsed)) / 8;
+        if (bw == 0) {
+            bw = 1;
+        }
+        fs->fs_wbBandwidth = bw;
+    }
+    return bw;
+}
+
+/* Throttle a writer in proportion to the amount of dirty data in the layer
+ * and globally, instead of blocking it once memory limit is reached.  Returns
+ * time in microseconds the writer should sleep for, after unlocking the layer.
+ */
+uint64_t
+lc_throttleWrite(struct fs *fs, uint64_t pcount) {
+    uint64_t dirty, freerun, limit, ratio = 0, lratio = 0, rate, pause;
+    uint64_t dcount, debt, start;
+    struct gfs *gfs = fs->fs_gfs;
+
+    /* Block the writer if hard limit is reached */
+    if (!lc_checkMemoryAvailable(false)) {
+        start = lc_throttleNow();
+        lc_wakeupCleaner(gfs, true);
+        pause = lc_throttleNow() - start;
+        __sync_add_and_fetch(&fs->fs_throttleTime, pause);
+        __sync_add_and_fetch(&fs->fs_throttleCount, 1);
+        __sync_add_and_fetch(&gfs->gfs_throttleTime, pause);
+        return 0;
+    }
+
+    /* Find how far dirty data is between the free run point and the limit,
+     * globally and for the layer.  Share of the global ratio charged to the
+     * layer depends on how much of the dirty data belongs to the layer.
+     */
+    dcount = gfs->gfs_dcount;
+    dirty = dcount * LC_BLOCK_SIZE;
+    limit = lc_mem.m_purgeMemory;
+    freerun = limit / 2;
+    if (dirty > freerun) {
+        ratio = (dirty >= limit) ? LC_THROTTLE_SCALE :
+                ((dirty - freerun) * LC_THROTTLE_SCALE) / (limit - freerun);
+        if (dcount > fs->fs_pcount) {
+            ratio = (ratio * fs->fs_pcount) / dcount;
+        }
+    }
+    if (fs->fs_pcount > (LC_MAX_LAYER_DIRTYPAGES / 2)) {
+        lratio = (fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) ?
+                 LC_THROTTLE_SCALE :
+                 ((fs->fs_pcount - (LC_MAX_LAYER_DIRTYPAGES / 2)) *
+                  LC_THROTTLE_SCALE) / (LC_MAX_LAYER_DIRTYPAGES / 2);
+    }
+    if (lratio > ratio) {
+        ratio = lratio;
+    }
+    if (ratio == 0) {
+        if (fs->fs_throttleDebt) {
+            fs->fs_throttleDebt = 0;
+        }
+        return 0;
+    }
+
+    /* Start writing back dirty pages of the layer */
+    lc_flushQueue(gfs, fs->fs_gindex);
+
+    /* Pace the writer to a fraction of the write back bandwidth of the
+     * layer, accumulating small pauses until worth sleeping for.
+     */
+    rate = (lc_throttleBandwidth(fs, lc_throttleNow()) *
+            (LC_THROTTLE_SCALE - ratio)) /
+           LC_THROTTLE_SCALE;
+    if (rate == 0) {
+        rate = 1;
+    }
+    pause = (pcount * 1000000ul) / rate;
+    if (pause > LC_THROTTLE_PAUSE_MAX) {
+        pause = LC_THROTTLE_PAUSE_MAX;
+    }
+
+    /* Debt is kept per layer, and the writer making it big enough pays it */
+    debt = __sync_add_and_fetch(&fs->fs_throttleDebt, pause);
+    if ((debt < LC_THROTTLE_PAUSE_MIN) ||
+        !__sync_bool_compare_and_swap(&fs->fs_throttleDebt, debt, 0)) {
+        return 0;
+    }
+    if (debt > LC_THROTTLE_PAUSE_MAX) {
+        debt = LC_THROTTLE_PAUSE_MAX;
+    }
+    __sync_add_and_fetch(&fs->fs_throttleTime, debt);
+    __sync_add_and_fetch(&fs->fs_throttleCount, 1);
+    __sync_add_and_fetch(&gfs->gfs_throttleTime, debt);
+    return debt;
+}
+
 /* Update memory stats */
 static inline void
 lc_memStatsUpdate(struct fs *fs, size_t size, bool alloc,
@@ -141,7 +408,7 @@ lc_memStatsUpdate(struct fs *fs, size_t size, bool alloc,
 }
 
 /* Substract total memory usage */
-void
+static void
 lc_memUpdateTotal(struct fs *fs, size_t size) {
     if (!memStatsEnabled) {
         return;
@@ -190,15 +457,205 @@ lc_malloc(struct fs *fs, size_t size, enum lc_memTypes type) {
     return malloc(size);
 }
 
+/* Allocate a chunk of memory to carve block sized buffers from */
+static char *
+lc_slabChunkAlloc(void) {
+    size_t size = LC_SLAB_CHUNK_SIZE;
+    char *chunk, *aligned;
+
+#ifdef MAP_HUGETLB
+    /* Try reserved huge pages first, if requested */
+    if (memHugePages) {
+        chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk != MAP_FAILED) {
+            lc_slab.s_hchunks++;
+            return chunk;
+        }
+    }
+#endif
+
+    /* Map twice the size and trim it, so that the chunk is aligned for
+     * transparent huge pages.
+     */
+    chunk = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(chunk != MAP_FAILED);
+    aligned = (char *)(((uintptr_t)chunk + size - 1) & ~(size - 1));
+    if (aligned != chunk) {
+        munmap(chunk, aligned - chunk);
+    }
+    if ((aligned + size) != (chunk + (size * 2))) {
+        munmap(aligned + size, (chunk + (size * 2)) - (aligned + size));
+    }
+#ifdef MADV_HUGEPAGE
+    if (memHugePages) {
+        madvise(aligned, size, MADV_HUGEPAGE);
+    }
+#endif
+    return aligned;
+}
+
+/* Fill up the magazine of a thread with buffers from the pool, carving new
+ * buffers out of chunks when the pool is empty.
+ */
+static void
+lc_slabRefill(struct lc_magazine *mag) {
+    uint64_t count;
+
+    assert(mag->m_count == 0);
+    pthread_mutex_lock(&lc_slab.s_lock);
+    count = (lc_slab.s_count < LC_SLAB_BATCH) ?
+            lc_slab.s_count : LC_SLAB_BATCH;
+    lc_slab.s_count -= count;
+    memcpy(mag->m_bufs, &lc_slab.s_free[lc_slab.s_count],
+           count * sizeof(void *));
+    if (lc_slab.s_released > lc_slab.s_count) {
+        lc_slab.s_released = lc_slab.s_count;
+    }
+    while (count < LC_SLAB_BATCH) {
+        if (lc_slab.s_offset == LC_SLAB_CHUNK_SIZE) {
+            lc_slab.s_chunk = lc_slabChunkAlloc();
+            lc_slab.s_offset = 0;
+            lc_slab.s_chunks++;
+
+            /* Make sure free array can hold all buffers */
+            lc_slab.s_size += LC_SLAB_CHUNK_SIZE / LC_BLOCK_SIZE;
+            lc_slab.s_free = realloc(lc_slab.s_free,
+                                     lc_slab.s_size * sizeof(void *));
+            assert(lc_slab.s_free);
+        }
+        mag->m_bufs[count++] = lc_slab.s_chunk + lc_slab.s_offset;
+        lc_slab.s_offset += LC_BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&lc_slab.s_lock);
+    mag->m_count = count;
+}
+
+/* Return buffers to the pool */
+static void
+lc_slabPut(void **bufs, uint32_t count) {
+    pthread_mutex_lock(&lc_slab.s_lock);
+    assert((lc_slab.s_count + count) <= lc_slab.s_size);
+    memcpy(&lc_slab.s_free[lc_slab.s_count], bufs, count * sizeof(void *));
+    lc_slab.s_count += count;
+    pthread_mutex_unlock(&lc_slab.s_lock);
+}
+
+/* Return buffers cached by an exiting thread to the pool */
+static void
+lc_slabThreadExit(void *data) {
+    struct lc_magazine *mag = data;
+
+    lc_slabPut(mag->m_bufs, mag->m_count);
+    mag->m_count = 0;
+}
+
+/* Create key for returning buffers of exiting threads */
+static void
+lc_slabKeyCreate(void) {
+    int err = pthread_key_create(&lc_slabKey, lc_slabThreadExit);
+
+    assert(err == 0);
+}
+
+/* Return the magazine of the calling thread */
+static inline struct lc_magazine *
+lc_slabMagazine(void) {
+    struct lc_magazine *mag = &lc_magazine;
+
+    if (unlikely(!mag->m_registered)) {
+        pthread_once(&lc_slabOnce, lc_slabKeyCreate);
+        pthread_setspecific(lc_slabKey, mag);
+        mag->m_registered = true;
+    }
+    return mag;
+}
+
+/* Compare addresses of two buffers */
+static int
+lc_slabCompare(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void **)a, y = (uintptr_t)*(void **)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Release memory of free buffers in the pool back to the system, keeping
+ * some resident for reuse.  Not done when buffers are backed by huge pages,
+ * as that would break up those.
+ */
+void
+lc_memRelease(void) {
+    uint64_t i, j, count;
+    char *start;
+
+    if (memHugePages ||
+        (lc_slab.s_count <= (lc_slab.s_released + LC_SLAB_RESIDENT_MAX))) {
+        return;
+    }
+    pthread_mutex_lock(&lc_slab.s_lock);
+    if (lc_slab.s_count > (lc_slab.s_released + LC_SLAB_RESIDENT_MAX)) {
+        count = lc_slab.s_count - LC_SLAB_RESIDENT_MAX;
+
+        /* Sort the buffers so that adjacent ones are released together */
+        qsort(&lc_slab.s_free[lc_slab.s_released],
+              count - lc_slab.s_released, sizeof(void *), lc_slabCompare);
+        i = lc_slab.s_released;
+        while (i < count) {
+            start = lc_slab.s_free[i];
+            j = i + 1;
+            while ((j < count) &&
+                   (lc_slab.s_free[j] ==
+                    (start + ((j - i) * LC_BLOCK_SIZE)))) {
+                j++;
+            }
+            madvise(start, (j - i) * LC_BLOCK_SIZE, MADV_DONTNEED);
+            i = j;
+        }
+        lc_slab.s_trimmed += count - lc_slab.s_released;
+        lc_slab.s_released = count;
+    }
+    pthread_mutex_unlock(&lc_slab.s_lock);
+}
+
+/* Get a block sized buffer from the slab */
+static void *
+lc_slabAlloc(void) {
+    struct lc_magazine *mag = lc_slabMagazine();
+
+    if (mag->m_count == 0) {
+        lc_slabRefill(mag);
+    }
+    return mag->m_bufs[--mag->m_count];
+}
+
+/* Return a block sized buffer to the slab */
+static void
+lc_slabFree(void *ptr) {
+    struct lc_magazine *mag = lc_slabMagazine();
+
+    assert(((uintptr_t)ptr & (LC_BLOCK_SIZE - 1)) == 0);
+    if (mag->m_count == LC_SLAB_MAGAZINE_SIZE) {
+        lc_slabPut(&mag->m_bufs[LC_SLAB_BATCH], LC_SLAB_BATCH);
+        mag->m_count = LC_SLAB_BATCH;
+    }
+    mag->m_bufs[mag->m_count++] = ptr;
+}
+
 /* Allocate block aligned memory, needed for direct I/O */
 void
 lc_mallocBlockAligned(struct fs *fs, void **memptr, enum lc_memTypes type) {
-    int err = posix_memalign(memptr, LC_BLOCK_SIZE, LC_BLOCK_SIZE);
-
-    assert(err == 0);
+    *memptr = lc_slabAlloc();
     lc_memStatsUpdate(fs, LC_BLOCK_SIZE, true, type);
 }
 
+/* Release memory allocated with lc_mallocBlockAligned */
+void
+lc_freeBlockAligned(struct fs *fs, void *ptr, enum lc_memTypes type) {
+    lc_slabFree(ptr);
+    lc_memStatsUpdate(fs, LC_BLOCK_SIZE, false, type);
+}
+
 /* Release previously allocated memory */
 void
 lc_free(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type) {
@@ -207,6 +664,320 @@ lc_free(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type) {
     lc_memStatsUpdate(fs, size, false, type);
 }
 
+/* Initialize the arena of a layer */
+void
+lc_arenaInit(struct fs *fs) {
+    struct marena *arena = lc_malloc(NULL, sizeof(struct marena),
+                                     LC_MEMTYPE_GFS);
+
+    memset(arena, 0, sizeof(struct marena));
+    pthread_mutex_init(&arena->a_lock, NULL);
+    fs->fs_arena = arena;
+}
+
+/* Release all memory of an arena */
+static void
+lc_arenaRelease(struct marena *arena) {
+    struct mchunk *chunk;
+
+    while ((chunk = arena->a_chunks)) {
+        arena->a_chunks = chunk->c_next;
+        lc_slabFree(chunk);
+    }
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&arena->a_lock);
+#endif
+    lc_free(NULL, arena, sizeof(struct marena), LC_MEMTYPE_GFS);
+}
+
+/* Allocate a metadata object for a layer from its arena.  Objects larger than
+ * LC_ARENA_OBJECT_MAX are allocated with malloc, so size specified while
+ * freeing an object should not cross that limit.
+ */
+void *
+lc_arenaAlloc(struct fs *fs, size_t size, enum lc_memTypes type) {
+    struct marena *arena = fs->fs_arena;
+    uint32_t class, osize, count, i;
+    struct mchunk *chunk;
+    char *obj;
+    void *ptr;
+
+    if (size > LC_ARENA_OBJECT_MAX) {
+        return lc_malloc(fs, size, type);
+    }
+    assert(size);
+    class = ((size + LC_ARENA_ALIGN - 1) / LC_ARENA_ALIGN) - 1;
+    pthread_mutex_lock(&arena->a_lock);
+    ptr = arena->a_free[class];
+    if (ptr == NULL) {
+
+        /* Carve a new chunk into objects of the requested size */
+        chunk = lc_slabAlloc();
+        chunk->c_arena = arena;
+        chunk->c_class = class;
+        chunk->c_next = arena->a_chunks;
+        arena->a_chunks = chunk;
+        arena->a_chunkCount++;
+        osize = (class + 1) * LC_ARENA_ALIGN;
+        count = (LC_BLOCK_SIZE - LC_ARENA_HEADER) / osize;
+        obj = ((char *)chunk) + LC_ARENA_HEADER;
+        for (i = 0; i < (count - 1); i++) {
+            *(void **)&obj[i * osize] = &obj[(i + 1) * osize];
+        }
+        *(void **)&obj[i * osize] = NULL;
+        ptr = obj;
+    }
+    arena->a_free[class] = *(void **)ptr;
+    arena->a_count++;
+    arena->a_memory += size;
+    pthread_mutex_unlock(&arena->a_lock);
+    lc_memStatsUpdate(fs, size, true, type);
+    return ptr;
+}
+
+/* Free a metadata object allocated with lc_arenaAlloc.  Object is returned to
+ * the arena it was allocated from, which may not be the arena of the layer
+ * if the object was handed over from another layer.
+ */
+void
+lc_arenaFree(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type) {
+    struct mchunk *chunk;
+    struct marena *arena;
+    bool release;
+
+    if (size > LC_ARENA_OBJECT_MAX) {
+        lc_free(fs, ptr, size, type);
+        return;
+    }
+    chunk = (struct mchunk *)((uintptr_t)ptr & ~((uintptr_t)LC_BLOCK_SIZE - 1));
+    arena = chunk->c_arena;
+
+    /* Objects are not reused if the whole arena is released soon.  Arena is
+     * not used by other layers then, so lock is not needed.
+     */
+    if (arena->a_bulk) {
+        assert(arena->a_count > 0);
+        arena->a_count--;
+        arena->a_memory -= size;
+        lc_memStatsUpdate(fs, size, false, type);
+        return;
+    }
+    pthread_mutex_lock(&arena->a_lock);
+    *(void **)ptr = arena->a_free[chunk->c_class];
+    arena->a_free[chunk->c_class] = ptr;
+    assert(arena->a_count > 0);
+    arena->a_count--;
+    arena->a_memory -= size;
+    release = arena->a_orphan && (arena->a_count == 0);
+    pthread_mutex_unlock(&arena->a_lock);
+    lc_memStatsUpdate(fs, size, false, type);
+
+    /* Release the arena after all objects of a freed layer are gone */
+    if (release) {
+        lc_arenaRelease(arena);
+    }
+}
+
+/* Check if metadata objects of a layer being destroyed could be released
+ * with its arena, without returning those to free lists.  That is not
+ * possible if objects were handed over to other layers.
+ */
+bool
+lc_arenaBulk(struct fs *fs) {
+    struct marena *arena = fs->fs_arena;
+
+    arena->a_bulk = !arena->a_shared;
+    return arena->a_bulk;
+}
+
+/* Free the arena of a layer being freed */
+void
+lc_arenaDeinit(struct fs *fs) {
+    struct marena *arena = fs->fs_arena;
+    bool release;
+
+    fs->fs_arena = NULL;
+
+    /* Objects not freed are reported as leaked by lc_checkMemStats */
+    if (arena->a_bulk) {
+        lc_arenaRelease(arena);
+        return;
+    }
+
+    /* Arena stays around while other layers use some of the objects */
+    pthread_mutex_lock(&arena->a_lock);
+    arena->a_orphan = true;
+    release = (arena->a_count == 0);
+    pthread_mutex_unlock(&arena->a_lock);
+    if (release) {
+        lc_arenaRelease(arena);
+    }
+}
+
+/* Update memory usage of an arena object which shrunk in place */
+void
+lc_arenaShrink(struct fs *fs, void *ptr, size_t size) {
+    struct mchunk *chunk;
+    struct marena *arena;
+
+    chunk = (struct mchunk *)((uintptr_t)ptr & ~((uintptr_t)LC_BLOCK_SIZE - 1));
+    arena = chunk->c_arena;
+    pthread_mutex_lock(&arena->a_lock);
+    assert(arena->a_memory >= size);
+    arena->a_memory -= size;
+    pthread_mutex_unlock(&arena->a_lock);
+    lc_memUpdateTotal(fs, size);
+}
+
+/* Account memory as freed, but free it after current RCU readers are done,
+ * using the function provided.
+ */
+void
+lc_freeRcu(struct fs *fs, struct rcu_head *head, size_t size,
+           enum lc_memTypes type, void (*func)(struct rcu_head *head)) {
+    lc_memStatsUpdate(fs, size, false, type);
+    lc_rcuRegister();
+    call_rcu(head, func);
+}
+
+/* Return the hash list of a string in a partition of interned strings */
+static inline uint32_t
+lc_istringList(struct lc_istringPart *part, uint32_t hash) {
+    return (hash >> LC_ISTRING_PART_BITS) & (part->ip_size - 1);
+}
+
+/* Move interned strings of a partition to a hash table of the given size */
+static void
+lc_istringResize(struct lc_istringPart *part, uint32_t size) {
+    struct istring **lists = part->ip_lists, *istr;
+    uint32_t i, list, osize = part->ip_size;
+
+    part->ip_lists = lc_malloc(NULL, size * sizeof(struct istring *),
+                               LC_MEMTYPE_GFS);
+    memset(part->ip_lists, 0, size * sizeof(struct istring *));
+    part->ip_size = size;
+    for (i = 0; i < osize; i++) {
+        while ((istr = lists[i])) {
+            lists[i] = istr->is_next;
+            list = lc_istringList(part, istr->is_hash);
+            istr->is_next = part->ip_lists[list];
+            part->ip_lists[list] = istr;
+        }
+    }
+    if (lists) {
+        lc_free(NULL, lists, osize * sizeof(struct istring *),
+                LC_MEMTYPE_GFS);
+    }
+}
+
+/* Return the interned copy of a string, shared with all others using the
+ * same string, taking a reference on it.
+ */
+char *
+lc_istringGet(const char *data, uint32_t size) {
+    uint32_t hash = lc_nameHash(data, size);
+    struct lc_istringPart *part = &lc_istrings[hash & (LC_ISTRING_PARTS - 1)];
+    struct istring *istr, **prev;
+
+    pthread_mutex_lock(&part->ip_lock);
+    if (part->ip_lists == NULL) {
+        lc_istringResize(part, LC_ISTRING_MINSIZE);
+    }
+    prev = &part->ip_lists[lc_istringList(part, hash)];
+    istr = *prev;
+    while (istr) {
+        if ((istr->is_hash == hash) && (istr->is_size == size) &&
+            (memcmp(istr->is_data, data, size) == 0)) {
+            __sync_add_and_fetch(&istr->is_refs, 1);
+            pthread_mutex_unlock(&part->ip_lock);
+            return istr->is_data;
+        }
+        istr = istr->is_next;
+    }
+
+    /* Add a new string */
+    istr = lc_malloc(NULL, sizeof(struct istring) + size + 1, LC_MEMTYPE_GFS);
+    istr->is_hash = hash;
+    istr->is_refs = 1;
+    istr->is_size = size;
+    memcpy(istr->is_data, data, size);
+    istr->is_data[size] = 0;
+    istr->is_next = *prev;
+    *prev = istr;
+    part->ip_count++;
+    if ((part->ip_count > ((uint64_t)part->ip_size * LC_ISTRING_LOAD)) &&
+        (part->ip_size < (UINT32_MAX >> LC_ISTRING_PART_BITS))) {
+        lc_istringResize(part, part->ip_size * 2);
+    }
+    pthread_mutex_unlock(&part->ip_lock);
+    return istr->is_data;
+}
+
+/* Return the interned string header of a string */
+static inline struct istring *
+lc_istringHeader(char *str) {
+    return (struct istring *)(str - offsetof(struct istring, is_data));
+}
+
+/* Take another reference on an interned string */
+char *
+lc_istringDup(char *str) {
+    __sync_add_and_fetch(&lc_istringHeader(str)->is_refs, 1);
+    return str;
+}
+
+/* Return the share of the memory of an interned string held by a reference */
+uint64_t
+lc_istringShare(char *str) {
+    struct istring *istr = lc_istringHeader(str);
+
+    return (sizeof(struct istring) + istr->is_size + 1) / istr->is_refs;
+}
+
+/* Drop a reference on an interned string, freeing it with the last one */
+void
+lc_istringRelease(char *str) {
+    struct istring *istr = lc_istringHeader(str);
+    struct lc_istringPart *part;
+    struct istring **prev;
+
+    part = &lc_istrings[istr->is_hash & (LC_ISTRING_PARTS - 1)];
+    pthread_mutex_lock(&part->ip_lock);
+    assert(istr->is_refs > 0);
+    if (__sync_sub_and_fetch(&istr->is_refs, 1)) {
+        pthread_mutex_unlock(&part->ip_lock);
+        return;
+    }
+    prev = &part->ip_lists[lc_istringList(part, istr->is_hash)];
+    while (*prev != istr) {
+        prev = &(*prev)->is_next;
+    }
+    *prev = istr->is_next;
+    assert(part->ip_count > 0);
+    part->ip_count--;
+    pthread_mutex_unlock(&part->ip_lock);
+    lc_free(NULL, istr, sizeof(struct istring) + istr->is_size + 1,
+            LC_MEMTYPE_GFS);
+}
+
+/* Free the table of interned strings after all layers are freed */
+void
+lc_istringDeinit(void) {
+    struct lc_istringPart *part;
+    uint32_t i;
+
+    for (i = 0; i < LC_ISTRING_PARTS; i++) {
+        part = &lc_istrings[i];
+        assert(part->ip_count == 0);
+        if (part->ip_lists) {
+            lc_free(NULL, part->ip_lists,
+                    part->ip_size * sizeof(struct istring *), LC_MEMTYPE_GFS);
+            part->ip_lists = NULL;
+            part->ip_size = 0;
+        }
+    }
+}
+
 /* Move previously allocated memory from one layer to another */
 void
 lc_memMove(struct fs *from, struct fs *to, size_t size,
@@ -243,6 +1014,12 @@ lc_displayGlobalMemStats() {
     }
     lc_syslog(LOG_INFO, "Total memory used for pages %ld limit %ldMB\n",
               lc_mem.m_totalMemory, lc_mem.m_purgeMemory / (1024 * 1024));
+    lc_syslog(LOG_INFO, "Memory used for metadata %ld limit %ldMB\n",
+              lc_mem.m_metaMemory, lc_mem.m_metaLimit / (1024 * 1024));
+    lc_syslog(LOG_INFO, "Block buffer chunks %ld (huge pages %ld) free buffers "
+              "%ld released %ld (total released %ld)\n",
+              lc_slab.s_chunks, lc_slab.s_hchunks, lc_slab.s_count,
+              lc_slab.s_released, lc_slab.s_trimmed);
 }
 
 /* Display memory stats */
@@ -268,6 +1045,11 @@ lc_displayMemStats(struct fs *fs) {
                       fs->fs_malloc[i] - fs->fs_free[i]);
         }
     }
+    if (fs->fs_arena) {
+        lc_syslog(LOG_INFO, "\tArena chunks %ld objects %ld in use %ld "
+                  "bytes\n", fs->fs_arena->a_chunkCount,
+                  fs->fs_arena->a_count, fs->fs_arena->a_memory);
+    }
     lc_syslog(LOG_INFO, "\n\tTotal memory in use %ld bytes\n\n",
               fs->fs_memory);
 }
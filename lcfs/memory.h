@@ -18,18 +18,135 @@ enum lc_memTypes {
     LC_MEMTYPE_DPAGEHASH = 12,      /* Dirty page hash table */
     LC_MEMTYPE_HPAGE = 13,          /* Dirty pages */
     LC_MEMTYPE_XATTR = 14,          /* Extended attributes */
-    LC_MEMTYPE_XATTRNAME = 15,      /* Extended attribute names */
-    LC_MEMTYPE_XATTRVALUE = 16,     /* Extended attribute values */
-    LC_MEMTYPE_XATTRBUF = 17,       /* Extended attributes buffers */
-    LC_MEMTYPE_XATTRINODE = 18,     /* Extended attribute portion in inode */
-    LC_MEMTYPE_CFILE = 19,          /* Tracking a file change */
-    LC_MEMTYPE_CDIR = 20,           /* Tracking a directory change */
-    LC_MEMTYPE_PATH = 21,           /* Path to a directory */
-    LC_MEMTYPE_HLDATA = 22,         /* Hard links */
-    LC_MEMTYPE_SYMLINK = 23,        /* Symbolic link */
-    LC_MEMTYPE_IRWLOCK = 24,        /* Inode lock */
-    LC_MEMTYPE_STATS = 25,          /* Request stats */
-    LC_MEMTYPE_MAX = 26,
+    LC_MEMTYPE_XATTRBUF = 15,       /* Extended attributes buffers */
+    LC_MEMTYPE_XATTRINODE = 16,     /* Extended attribute portion in inode */
+    LC_MEMTYPE_CFILE = 17,          /* Tracking a file change */
+    LC_MEMTYPE_CDIR = 18,           /* Tracking a directory change */
+    LC_MEMTYPE_PATH = 19,           /* Path to a directory */
+    LC_MEMTYPE_HLDATA = 20,         /* Hard links */
+    LC_MEMTYPE_SYMLINK = 21,        /* Symbolic link */
+    LC_MEMTYPE_IRWLOCK = 22,        /* Inode lock */
+    LC_MEMTYPE_STATS = 23,          /* Request stats */
+    LC_MEMTYPE_IFILTER = 24,        /* Inode filter */
+    LC_MEMTYPE_SYNCLIST = 25,       /* List of modified inodes */
+    LC_MEMTYPE_DOVER = 26,          /* Directory changes over parent */
+    LC_MEMTYPE_DPACK = 27,          /* Packed directory entries */
+    LC_MEMTYPE_IFORGET = 28,        /* Deferred inode forgets */
+    LC_MEMTYPE_MAX = 29,
 };
 
+/* Size of a chunk of memory carved into block sized buffers.  Chunks are
+ * aligned to this size so that those could be backed by huge pages.
+ */
+#define LC_SLAB_CHUNK_SIZE      (2ull * 1024ull * 1024ull)
+
+/* Number of free buffers cached by a thread */
+#define LC_SLAB_MAGAZINE_SIZE   64
+
+/* Number of free buffers moved between threads and the shared pool at once */
+#define LC_SLAB_BATCH           (LC_SLAB_MAGAZINE_SIZE / 2)
+
+/* Number of free buffers in the shared pool kept resident when memory is
+ * released back to the system.
+ */
+#define LC_SLAB_RESIDENT_MAX    (4 * (LC_SLAB_CHUNK_SIZE / LC_BLOCK_SIZE))
+
+/* Largest metadata object allocated from the arena of a layer.  Larger
+ * objects are allocated with malloc.
+ */
+#define LC_ARENA_OBJECT_MAX     512
+
+/* Size of objects in an arena is rounded up to a multiple of this */
+#define LC_ARENA_ALIGN          16
+
+/* Number of distinct object sizes in an arena */
+#define LC_ARENA_CLASSES        (LC_ARENA_OBJECT_MAX / LC_ARENA_ALIGN)
+
+/* Number of partitions of the table of interned strings, each with its own
+ * lock and hash table, picked using the lower bits of the hash of a string.
+ */
+#define LC_ISTRING_PART_BITS    6
+#define LC_ISTRING_PARTS        (1u << LC_ISTRING_PART_BITS)
+
+/* Initial number of hash lists in a partition */
+#define LC_ISTRING_MINSIZE      64
+
+/* Average length of hash lists at which a partition is grown */
+#define LC_ISTRING_LOAD         4
+
+/* String interned in a global table, shared by all layers using the same
+ * string, like names of files in immutable layers and extended attributes.
+ * Strings are freed when the last reference is dropped.
+ */
+struct istring {
+
+    /* Next string in the hash list */
+    struct istring *is_next;
+
+    /* Hash of the string */
+    uint32_t is_hash;
+
+    /* Number of references */
+    uint32_t is_refs;
+
+    /* Size of the string, not including the terminating null */
+    uint32_t is_size;
+
+    /* String */
+    char is_data[];
+} __attribute__((packed));
+
+/* Block sized chunk of an arena, holding objects of a single size */
+struct mchunk {
+
+    /* Arena the chunk belongs to */
+    struct marena *c_arena;
+
+    /* Next chunk in the arena */
+    struct mchunk *c_next;
+
+    /* Size class of objects in the chunk */
+    uint32_t c_class;
+} __attribute__((packed));
+
+/* Offset of the first object in a chunk */
+#define LC_ARENA_HEADER         (((sizeof(struct mchunk) + LC_ARENA_ALIGN - 1) \
+                                  / LC_ARENA_ALIGN) * LC_ARENA_ALIGN)
+
+/* Arena for small metadata objects of a layer, like inodes and directory
+ * entries.  Memory of the arena is released in bulk when the layer is
+ * destroyed, instead of freeing every object.
+ */
+struct marena {
+
+    /* Free objects of each size */
+    void *a_free[LC_ARENA_CLASSES];
+
+    /* Chunks allocated for the arena */
+    struct mchunk *a_chunks;
+
+    /* Number of chunks allocated */
+    uint64_t a_chunkCount;
+
+    /* Number of objects in use */
+    uint64_t a_count;
+
+    /* Memory in use by objects, as accounted for the layer */
+    uint64_t a_memory;
+
+    /* Lock protecting the arena */
+    pthread_mutex_t a_lock;
+
+    /* Set if objects are handed over to other layers */
+    bool a_shared;
+
+    /* Set while the layer is destroyed, if freed objects need not be
+     * returned to free lists of the arena.
+     */
+    bool a_bulk;
+
+    /* Set once the layer is freed, while other layers use objects */
+    bool a_orphan;
+} __attribute__((packed));
+
 #endif
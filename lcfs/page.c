@@ -31,7 +31,7 @@ lc_updateInodePageMarkers(struct inode *inode, uint64_t pg) {
 void
 lc_freePageData(struct gfs *gfs, struct fs *fs, char *data) {
     if (data != gfs->gfs_zPage) {
-        lc_free(fs, data, LC_BLOCK_SIZE, LC_MEMTYPE_DATA);
+        lc_freeBlockAligned(fs, data, LC_MEMTYPE_DATA);
     }
 }
 
@@ -198,7 +198,7 @@ lc_invalidateParentPages(struct gfs *gfs, struct fs *fs, struct inode *inode) {
             extent = extent->ex_next;
         }
     }
-    inode->i_flags |= LC_INODE_HIDDEN;
+    __sync_fetch_and_or(&inode->i_flags, LC_INODE_HIDDEN);
     if (count) {
         __sync_add_and_fetch(&gfs->gfs_precycle, count);
     }
@@ -437,15 +437,6 @@ lc_removeDirtyPage(struct gfs *gfs, struct inode *inode, uint64_t pg,
     return release ? NULL : pdata;
 }
 
-/* Add the page to bufvec */
-static inline void
-lc_updateVec(char *pdata, struct fuse_bufvec *bufv,
-              off_t poffset, size_t psize) {
-    bufv->buf[bufv->count].mem = &pdata[poffset];
-    bufv->buf[bufv->count].size = psize;
-    bufv->count++;
-}
-
 /* Allocate/extend inode page table */
 static void
 lc_inodeAllocPages(struct inode *inode) {
@@ -683,16 +674,68 @@ lc_mergePage(struct gfs *gfs, struct inode *inode, uint64_t pg,
     return 0;
 }
 
-/* Copy in provided data into page aligned buffers */
-uint64_t
+/* Read data from a file descriptor backed fuse buffer straight into page
+ * buffers.  Returns an error if the data could not be read completely.
+ */
+static int
+lc_readBufFd(struct fuse_buf *buf, off_t pos, struct iovec *iov, int iovcnt,
+             size_t size) {
+    ssize_t count;
+
+    while (size) {
+        if (buf->flags & FUSE_BUF_FD_SEEK) {
+            count = pread(buf->fd, iov->iov_base, iov->iov_len, pos);
+        } else {
+            count = readv(buf->fd, iov, iovcnt);
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        /* Data ended before the size of the write */
+        if (count == 0) {
+            return EIO;
+        }
+        assert(count <= size);
+        size -= count;
+        pos += count;
+
+        /* Skip over buffers filled completely and continue with the rest */
+        while (iovcnt && (count >= iov->iov_len)) {
+            count -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (count) {
+            iov->iov_base = (char *)iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+    return 0;
+}
+
+/* Copy in provided data into page aligned buffers.  Data in a spliced pipe
+ * is read into the pages with a single readv(2) call, instead of reading
+ * each page separately into an intermediate vector.  Number of pages
+ * allocated is returned in pcountp, even when data could not be read.
+ */
+int
 lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
-             struct fuse_bufvec *bufv, struct fuse_bufvec *dst) {
+             struct fuse_bufvec *bufv, uint64_t *pcountp) {
+    struct fuse_buf *buf = &bufv->buf[bufv->idx];
     uint64_t page, spage, pcount = 0, poffset;
     size_t wsize = size, psize;
-    char *pdata;
+    struct iovec *iov;
+    char *pdata, *src;
 
+    assert((bufv->off + size) <= buf->size);
     spage = off / LC_BLOCK_SIZE;
     page = spage;
+    iov = alloca(((size / LC_BLOCK_SIZE) + 2) * sizeof(struct iovec));
+    src = (buf->flags & FUSE_BUF_IS_FD) ? NULL : (char *)buf->mem + bufv->off;
 
     /* Break the down the write into pages */
     while (wsize) {
@@ -707,7 +750,13 @@ lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
             psize = wsize;
         }
         lc_mallocBlockAligned(fs, (void **)&pdata, LC_MEMTYPE_DATA);
-        lc_updateVec(pdata, dst, poffset, psize);
+        if (src) {
+            memcpy(&pdata[poffset], src, psize);
+            src += psize;
+        } else {
+            iov[pcount].iov_base = &pdata[poffset];
+            iov[pcount].iov_len = psize;
+        }
         dpages[pcount].dp_data = pdata;
         dpages[pcount].dp_poffset = poffset;
         dpages[pcount].dp_psize = psize;
@@ -717,9 +766,9 @@ lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
     }
 
     /* Read data from fuse */
-    wsize = fuse_buf_copy(dst, bufv, FUSE_BUF_SPLICE_MOVE);
-    assert(wsize == size);
-    return pcount;
+    *pcountp = pcount;
+    return src ? 0 : lc_readBufFd(buf, buf->pos + bufv->off, iov, pcount,
+                                  size);
 }
 
 /* Fill up the last page with zeroes when a file grows */
@@ -766,7 +815,7 @@ uint64_t
 lc_addPages(struct inode *inode, off_t off, size_t size,
             struct dpage *dpages, uint64_t pcount) {
     uint64_t page = off / LC_BLOCK_SIZE, count = 0;
-    struct extent *extent = lc_inodeGetEmap(inode);
+    struct extent *extent = NULL;
     struct fs *fs = inode->i_fs;
     struct gfs *gfs = fs->fs_gfs;
     off_t endoffset = off + size;
@@ -820,13 +869,89 @@ lc_addPages(struct inode *inode, off_t off, size_t size,
     return added;
 }
 
+/* Find the readahead stream slot of a file */
+static inline struct rastream *
+lc_readAheadStream(struct gfs *gfs, struct fs *fs, ino_t ino) {
+    return &gfs->gfs_raStreams[(ino ^ ((uint64_t)fs->fs_gindex << 32)) %
+                               LC_RA_STREAMS];
+}
+
+/* Queue pages following the current read for reading ahead if the file is
+ * read sequentially.  Window of pages read ahead grows as long as the file
+ * is read sequentially.  Called with inode locked.
+ */
+static void
+lc_readFileAhead(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                 uint64_t spg, uint64_t epg) {
+    struct rastream *ra = lc_readAheadStream(gfs, fs, inode->i_ino);
+    uint64_t pg, lpg, start, block, sblock = 0;
+    struct extent *extent = NULL;
+    uint32_t count = 0;
+
+    /* Blocks of files in layers still being modified could be freed and
+     * reused before being read ahead.
+     */
+    if (!inode->i_fs->fs_frozen) {
+        return;
+    }
+
+    /* Stream state is updated without any locking, as that is only a hint */
+    if ((ra->rs_ino != inode->i_ino) || (ra->rs_gindex != fs->fs_gindex) ||
+        (ra->rs_next != spg)) {
+        ra->rs_ino = inode->i_ino;
+        ra->rs_gindex = fs->fs_gindex;
+        ra->rs_next = epg;
+        ra->rs_issued = epg;
+        ra->rs_window = 0;
+        return;
+    }
+    ra->rs_next = epg;
+
+    /* Issue more once half of the pages read ahead are consumed */
+    if ((ra->rs_issued > epg) &&
+        ((ra->rs_issued - epg) > (ra->rs_window / 2))) {
+        return;
+    }
+    ra->rs_window = ra->rs_window ? ra->rs_window * 2 : LC_RA_WINDOW_MIN;
+    if (ra->rs_window > LC_RA_WINDOW_MAX) {
+        ra->rs_window = LC_RA_WINDOW_MAX;
+    }
+    start = (ra->rs_issued > epg) ? ra->rs_issued : epg;
+    lpg = (inode->i_size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE;
+    if (lpg > (epg + ra->rs_window)) {
+        lpg = epg + ra->rs_window;
+    }
+    if ((start >= lpg) || !lc_checkMemoryAvailable(false)) {
+        return;
+    }
+    ra->rs_issued = lpg;
+
+    /* Queue runs of pages contiguous on disk, skipping holes */
+    for (pg = start; pg < lpg; pg++) {
+        block = lc_inodeEmapLookup(gfs, inode, pg, &extent);
+        if (count && (block != (sblock + count))) {
+            lc_readAheadQueue(gfs, fs, sblock, count);
+            count = 0;
+        }
+        if (block != LC_PAGE_HOLE) {
+            if (count == 0) {
+                sblock = block;
+            }
+            count++;
+        }
+    }
+    if (count) {
+        lc_readAheadQueue(gfs, fs, sblock, count);
+    }
+}
+
 /* Read specified pages of a file */
 int
 lc_readFile(fuse_req_t req, struct fs *fs, struct inode *inode, off_t soffset,
             off_t endoffset, uint64_t asize, struct page **pages, char **dbuf,
             struct fuse_bufvec *bufv) {
     uint64_t block, pg = soffset / LC_BLOCK_SIZE, pcount = 0, dcount = 0;
-    struct extent *extent = lc_inodeGetEmap(inode);
+    struct extent *extent = NULL;
     size_t psize, rsize = endoffset - soffset;
     struct page *page = NULL, **rpages = NULL;
     off_t poffset, off = soffset;
@@ -907,6 +1032,7 @@ lc_readFile(fuse_req_t req, struct fs *fs, struct inode *inode, off_t soffset,
         rcount = lc_readPages(gfs, fs, rpages, rcount);
     }
     fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    lc_readFileAhead(gfs, fs, inode, soffset / LC_BLOCK_SIZE, pg);
     ino = inode->i_ino;
     lc_inodeUnlock(inode);
     if (pcount) {
@@ -1101,7 +1227,7 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
             }
             assert(page->p_fnext == NULL);
             assert(page->p_fprev == NULL);
-            assert(lbcache->lb_fhead != page);
+            assert(page->p_queue == LC_PAGE_UNQUEUED);
             if (cache) {
                 page->p_cache = 1;
             } else {
@@ -1154,6 +1280,7 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
                 extent = extent->ex_next;
                 lc_free(fs, tmp, sizeof(struct extent), LC_MEMTYPE_EXTENT);
             }
+            lc_emapIndexFree(inode);
             lc_inodeSetEmap(inode, NULL);
         }
         inode->i_extentBlock = eblock;
@@ -1182,7 +1309,7 @@ out:
     }
     lc_initInodePageMarkers(inode);
 
-    /* Add the pages to free list */
+    /* Add the pages to eviction queues */
     if (first) {
         lc_insertPagesToFreeList(lbcache, first, page);
     }
@@ -1410,6 +1537,7 @@ lc_truncateFile(struct inode *inode, off_t size, bool remove) {
                 inode->i_flags &= ~LC_INODE_SHARED;
                 inode->i_private = 1;
             }
+            lc_emapIndexFree(inode);
             lc_inodeSetEmap(inode, NULL);
             lc_invalidatePages(gfs, fs, inode, size);
             return;
@@ -6,12 +6,25 @@
 /* HOLE representation for a page of an inode */
 #define LC_PAGE_HOLE       ((uint64_t)-1)
 
-/* Initial size of the page hash table */
-/* XXX This needs to consider available memory */
+/* Initial size of the page hash table, which grows as pages are cached */
 #define LC_PCACHE_SIZE_MIN  1024
-#define LC_PCACHE_SIZE      (128 * 1024)
 
-/* Number of locks for the block cache hash lists */
+/* Number of hash lists in a segment of the page hash table */
+#define LC_PCACHE_SEGMENT_SIZE      1024
+
+/* Number of locks for the hash lists of a segment */
+#define LC_PCACHE_SEGMENT_LOCKS     64
+
+/* Maximum number of segments in a page hash table */
+#define LC_PCACHE_SEGMENTS_MAX      4096
+
+/* Average number of pages in a hash list before the hash table is grown */
+#define LC_PCACHE_LOAD_MAX          2
+
+/* Maximum number of hash lists merged in one pass while shrinking */
+#define LC_PCACHE_SHRINK_COUNT      1024
+
+/* Number of locks for serializing reads to the block cache */
 #define LC_PCLOCK_COUNT     1024
 
 /* Number of hash lists for the dirty pages */
@@ -70,6 +83,119 @@
 /* Number of pages freed in one pass */
 #define LC_PAGE_PURGE_COUNT        4096
 
+/* Number of shards of the eviction queues of a block cache (at most 256) */
+#define LC_PCACHE_SHARDS        32
+
+/* Number of accesses before a page is promoted to the protected queue */
+#define LC_PAGE_PROMOTE_HITS    2
+
+/* Maximum percentage of pages of a shard kept in the protected queue */
+#define LC_PAGE_PROTECTED_PCT   75
+
+/* Reference count of a page being freed, which cannot be looked up anymore */
+#define LC_PAGE_DEAD            ((uint32_t)-1)
+
+/* Number of sequential read streams tracked for readahead */
+#define LC_RA_STREAMS           1024
+
+/* Initial readahead window in pages */
+#define LC_RA_WINDOW_MIN        8
+
+/* Maximum readahead window in pages */
+#define LC_RA_WINDOW_MAX        256
+
+/* Maximum number of readahead requests queued */
+#define LC_RA_QUEUE_MAX         512
+
+/* Number of threads processing readahead requests */
+#define LC_RA_THREADS           4
+
+/* Number of threads flushing dirty data of layers */
+#define LC_FLUSH_THREADS        4
+
+/* Scale of the dirty ratio used for throttling writers */
+#define LC_THROTTLE_SCALE       1024
+
+/* Initial write back bandwidth assumed for a layer in pages per second */
+#define LC_THROTTLE_BW_INIT     25600
+
+/* Interval in microseconds write back bandwidth of a layer is sampled */
+#define LC_THROTTLE_BW_INTERVAL 200000
+
+/* Minimum pause in microseconds a writer is made to sleep */
+#define LC_THROTTLE_PAUSE_MIN   1000
+
+/* Maximum pause in microseconds a writer is made to sleep for a write */
+#define LC_THROTTLE_PAUSE_MAX   200000
+
+/* States of a layer in the flush queue */
+enum lc_flushState {
+    LC_FLUSH_IDLE = 0,          /* Not queued */
+    LC_FLUSH_QUEUED = 1,        /* Waiting for a flusher thread */
+    LC_FLUSH_RUNNING = 2,       /* Being flushed */
+    LC_FLUSH_REQUEUE = 3,       /* Being flushed, queue again after that */
+};
+
+/* A set of I/Os issued together and waited for at once */
+struct iobatch {
+
+    /* Lock protecting the batch */
+    pthread_mutex_t ib_lock;
+
+    /* Condition signaled when all I/Os in the batch are complete */
+    pthread_cond_t ib_cond;
+
+    /* Number of bytes expected to be transferred */
+    uint64_t ib_expected;
+
+    /* Number of bytes transferred so far */
+    uint64_t ib_completed;
+
+    /* Number of I/Os in flight */
+    uint32_t ib_pending;
+
+    /* Set if I/Os could be issued asynchronously */
+    bool ib_async;
+};
+
+/* Sequential read stream of a file */
+struct rastream {
+
+    /* Inode number of the file */
+    ino_t rs_ino;
+
+    /* Page expected to be read next */
+    uint64_t rs_next;
+
+    /* Page up to which readahead issued */
+    uint64_t rs_issued;
+
+    /* Current readahead window in pages */
+    uint32_t rs_window;
+
+    /* Layer file is read from */
+    int rs_gindex;
+} __attribute__((packed));
+
+/* Request for reading ahead a range of blocks */
+struct rarequest {
+
+    /* Next request in the queue */
+    struct rarequest *rr_next;
+
+    /* Root inode of the layer requested readahead */
+    ino_t rr_root;
+
+    /* First block */
+    uint64_t rr_block;
+
+    /* Number of blocks */
+    uint32_t rr_count;
+
+    /* Layer requested readahead */
+    int rr_gindex;
+} __attribute__((packed));
+
 /* Page cache header */
 struct pcache {
     /* Page hash chains */
@@ -80,32 +206,83 @@ struct pcache {
 } __attribute__((packed));
 
 
-/* Block cache for a layer tree */
-struct lbcache {
+/* Segment of the page hash table.  Hash table grows by splitting one hash
+ * list at a time, allocating segments as needed.
+ */
+struct pcsegment {
+
+    /* Hash lists */
+    struct pcache ps_pcache[LC_PCACHE_SEGMENT_SIZE];
+
+    /* Locks for the hash lists */
+    pthread_mutex_t ps_locks[LC_PCACHE_SEGMENT_LOCKS];
+};
+
+/* Eviction queue a page is on */
+enum lc_pageQueue {
+    LC_PAGE_UNQUEUED = 0,
+    LC_PAGE_PROBATION = 1,
+    LC_PAGE_PROTECTED = 2,
+};
+
+/* Shard of eviction queues of a block cache.  Pages enter the probation queue
+ * and are promoted to the protected queue when accessed again.  Pages are
+ * evicted from the probation queue first, so that pages read just once do not
+ * push out pages used repeatedly.
+ */
+struct lbshard {
 
-    /* Block cache hash headers */
-    struct pcache *lb_pcache;
+    /* Head of probation queue */
+    struct page *ls_phead;
 
-    /* free page list head */
-    struct page *lb_fhead;
+    /* Tail of probation queue */
+    struct page *ls_ptail;
 
-    /* free page list head */
-    struct page *lb_ftail;
+    /* Head of protected queue */
+    struct page *ls_ahead;
 
-    /* Locks for the page cache lists */
-    pthread_mutex_t *lb_pcacheLocks;
+    /* Tail of protected queue */
+    struct page *ls_atail;
+
+    /* Lock protecting the queues */
+    pthread_mutex_t ls_lock;
+
+    /* Number of pages in probation queue */
+    uint64_t ls_pcount;
+
+    /* Number of pages in protected queue */
+    uint64_t ls_acount;
+} __attribute__((packed));
+
+/* Block cache for a layer tree */
+struct lbcache {
+
+    /* Segments of block cache hash table */
+    struct pcsegment **lb_pcache;
+
+    /* Eviction queues */
+    struct lbshard *lb_shards;
 
     /* Locks for serializing I/Os */
     pthread_mutex_t *lb_pioLocks;
 
-    /* Lock protecting free list */
-    pthread_mutex_t lb_flock;
+    /* Lock serializing resizing of hash table */
+    pthread_mutex_t lb_rlock;
+
+    /* Shard to be scanned next while purging pages */
+    uint32_t lb_shardNext;
 
     /* Number of hash lists in pcache */
     uint32_t lb_pcacheSize;
 
-    /* Number of page cache locks */
-    uint32_t lb_pcacheLockCount;
+    /* Initial number of hash lists in pcache */
+    uint32_t lb_pcacheSizeMin;
+
+    /* Number of segments allocated */
+    uint32_t lb_pcacheSegments;
+
+    /* Number of locks for serializing I/Os */
+    uint32_t lb_pioLockCount;
 
     /* Count of clean pages */
     uint64_t lb_pcount;
@@ -118,16 +295,26 @@ struct page {
     char *p_data;
 
     /* Block mapping to */
-    uint64_t p_block:48;
+    uint64_t p_block;
 
-    /* Layer index allocated this block */
-    uint64_t p_lindex:16;
-
-    /* Reference count on this page */
+    /* Reference count on this page, updated atomically as pages are looked
+     * up without locking hash lists.
+     */
     uint32_t p_refCount;
 
     /* Page cache hitcount */
-    uint32_t p_hitCount:27;
+    uint32_t p_hitCount;
+
+    /* Eviction queue page is on */
+    uint8_t p_queue;
+
+    /* Shard of eviction queues page is on */
+    uint8_t p_shard;
+
+    /* Layer index allocated this block, cleared without locking once the
+     * page is looked up by another layer.
+     */
+    uint16_t p_lindex;
 
     /* page is not in hash lists */
     uint32_t p_nohash:1;
@@ -150,11 +337,19 @@ struct page {
     /* Next page in file system dirty list */
     struct page *p_dnext;
 
-    /* Previous page in free list */
-    struct page *p_fprev;
+    union {
+        struct {
+
+            /* Previous page in eviction queue */
+            struct page *p_fprev;
+
+            /* Next page in eviction queue */
+            struct page *p_fnext;
+        };
 
-    /* Next page in free list */
-    struct page *p_fnext;
+        /* Used for freeing the page after lookups are done with it */
+        struct rcu_head p_rcu;
+    };
 };
 
 /* Page structure used for caching dirty pages of an inode
@@ -167,10 +167,17 @@ lc_displayStats(struct fs *fs) {
 out:
     lc_displayFtypeStats(fs);
     lc_displayAllocStats(fs);
-    lc_syslog(LOG_INFO, "\t%ld inodes %ld pages\n",
-              fs->fs_icount, fs->fs_pcount);
+    lc_syslog(LOG_INFO, "\t%ld inodes (%ld loaded on demand, %ld released) "
+              "%ld pages\n", fs->fs_icount, fs->fs_iload, fs->fs_ievict,
+              fs->fs_pcount);
     lc_syslog(LOG_INFO, "\t%ld reads %ld writes (%ld inodes written)\n",
            fs->fs_reads, fs->fs_writes, fs->fs_iwrite);
+    if (fs->fs_throttleCount) {
+        lc_syslog(LOG_INFO,
+                  "\twriters throttled %ld times for %ld.%06lds\n",
+                  fs->fs_throttleCount, fs->fs_throttleTime / 1000000,
+                  fs->fs_throttleTime % 1000000);
+    }
     lc_syslog(LOG_INFO, "\n\n");
 }
 
@@ -187,7 +194,7 @@ lc_displayStatsAll(struct gfs *gfs) {
     struct fs *fs;
     int i;
 
-    rcu_register_thread();
+    lc_rcuRegister();
     rcu_read_lock();
     for (i = 0; i <= gfs->gfs_scount; i++) {
         fs = rcu_dereference(gfs->gfs_fs[i]);
@@ -199,7 +206,6 @@ lc_displayStatsAll(struct gfs *gfs) {
         }
     }
     rcu_read_unlock();
-    rcu_unregister_thread();
 }
 
 /* Display global stats */
@@ -227,6 +233,25 @@ lc_displayGlobalStats(struct gfs *gfs) {
                   "reused %ld purged %ld\n", gfs->gfs_phit, gfs->gfs_pmissed,
                   gfs->gfs_precycle, gfs->gfs_preused, gfs->gfs_purged);
     }
+    if (gfs->gfs_phit || gfs->gfs_pmissed) {
+        lc_syslog(LOG_INFO,
+                  "page cache hit rate %ld%% (protected hits %ld)\n",
+                  (gfs->gfs_phit * 100) / (gfs->gfs_phit + gfs->gfs_pmissed),
+                  gfs->gfs_pahit);
+    }
+    if (gfs->gfs_ppromoted || gfs->gfs_pdemoted || gfs->gfs_paevicted) {
+        lc_syslog(LOG_INFO,
+                  "pages promoted %ld demoted %ld evicted from protected %ld\n",
+                  gfs->gfs_ppromoted, gfs->gfs_pdemoted, gfs->gfs_paevicted);
+    }
+    if (gfs->gfs_raPages) {
+        lc_syslog(LOG_INFO, "pages read ahead %ld\n", gfs->gfs_raPages);
+    }
+    if (gfs->gfs_throttleTime) {
+        lc_syslog(LOG_INFO, "writers throttled for %ld.%06lds\n",
+                  gfs->gfs_throttleTime / 1000000,
+                  gfs->gfs_throttleTime % 1000000);
+    }
 }
 
 /* Free resources associated with the stats of a file system */
@@ -5,6 +5,7 @@ MNT2=/lcfs
 LCFS=$PWD/lcfs
 XATTR=$PWD/testxattr
 TESTDIFF=$PWD/testdiff
+TESTDIR=$PWD/testdir
 
 umount -f $MNT $MNT2 2>/dev/null
 sleep 10
@@ -108,6 +109,61 @@ dd if=/dev/urandom of=file1 count=1 bs=1024 seek=23 conv=notrunc
 dd if=/dev/urandom of=file1 count=1 bs=1024 seek=22 conv=notrunc
 dd if=/dev/urandom of=file1 count=1 bs=1024 seek=24 conv=notrunc
 
+#Fragment a file enough for its emap to be indexed and read it back at
+#random offsets.
+dd if=/dev/urandom of=/tmp/lcfs-testfile count=256 bs=4096
+set +x
+for (( i = 255; i >= 0; i-- ))
+do
+    dd if=/tmp/lcfs-testfile of=file2 count=1 bs=4096 seek=$i skip=$i conv=notrunc,fsync 2>/dev/null
+    dd if=/dev/urandom of=file3 count=1 bs=4096 seek=$i conv=notrunc,fsync 2>/dev/null
+done
+set -x
+$LCFS flush $MNT
+echo 3 > /proc/sys/vm/drop_caches
+cmp file2 /tmp/lcfs-testfile
+set +x
+for (( i = 0; i < 64; i++ ))
+do
+    j=$(( RANDOM % 256 ))
+    cmp <(dd if=file2 count=1 bs=4096 skip=$j 2>/dev/null) \
+        <(dd if=/tmp/lcfs-testfile count=1 bs=4096 skip=$j 2>/dev/null) || break
+done
+set -x
+
+#Write and read back blocks at offsets past 2^59 bytes.
+dd if=/tmp/lcfs-testfile of=file4 count=2 bs=4096 seek=$(( (1 << 47) + 1 ))
+dd if=/tmp/lcfs-testfile of=file4 count=1 bs=4096 seek=$(( (1 << 50) - 1 )) conv=notrunc,fsync
+ls -l file4
+echo 3 > /proc/sys/vm/drop_caches
+cmp <(dd if=file4 count=2 bs=4096 skip=$(( (1 << 47) + 1 )) 2>/dev/null) \
+    <(dd if=/tmp/lcfs-testfile count=2 bs=4096 2>/dev/null)
+cmp <(dd if=file4 count=1 bs=4096 skip=$(( (1 << 50) - 1 )) 2>/dev/null) \
+    <(dd if=/tmp/lcfs-testfile count=1 bs=4096 2>/dev/null)
+rm -f file2 file3 file4 /tmp/lcfs-testfile
+
+#Look up files while the inode cache of the layer is resized.
+mkdir icache
+touch icache/file{0..19999} &
+PID=$!
+set +x
+while kill -0 $PID 2>/dev/null
+do
+    ls -l icache > /dev/null
+    echo 2 > /proc/sys/vm/drop_caches
+done
+set -x
+wait $PID
+echo 2 > /proc/sys/vm/drop_caches
+test `ls -l icache | grep -c file` -eq 20000
+rm -fr icache
+
+#Resume reading a directory while its hash table grows.
+mkdir readdir
+touch readdir/file{0..999}
+$TESTDIR readdir strict
+rm -fr readdir
+
 $XATTR
 
 rm -fr file file1 passwd
@@ -151,6 +207,36 @@ docker build .
 cd -
 rm -fr /tmp/lcfs-build
 
+#Look up names present and missing in packed directories of image layers,
+#both hashed and small ones.
+docker run --rm docker/whalesay /bin/bash -c 'for d in /usr/bin /usr/games; \
+    do cd $d && for f in *; do test -e "$f" && test ! -e "$f.lcfs" || \
+    exit 1; done; done'
+
+#Rename in an inherited directory right when its overlay is materialized.
+docker run --rm docker/whalesay /bin/bash -c 'cd /usr/bin && \
+    for (( i = 0; i < 31; i++ )); do touch lcfs$i; done && \
+    mv yes lcfs-yes && ls -l lcfs-yes && lcfs-yes | head -1 && \
+    test ! -e yes'
+
+#Resume reading inherited directories while entries are added over those.
+docker run --rm -v $TESTDIR:/testdir docker/whalesay /testdir /usr/bin
+docker run --rm -v $TESTDIR:/testdir docker/whalesay /testdir /etc
+
+#Release metadata of image layers once the kernel forgets their inodes, and
+#read it back.
+$LCFS icache $MNT 1
+find $MNT/lcfs -maxdepth 4 -type f | head -1000 > /tmp/lcfs-files
+xargs -d '\n' md5sum < /tmp/lcfs-files > /tmp/lcfs-sums
+ls -lR $MNT/lcfs > /tmp/lcfs-ls
+echo 2 > /proc/sys/vm/drop_caches
+sleep 30
+$LCFS stats $MNT .
+md5sum --quiet -c /tmp/lcfs-sums
+ls -lR $MNT/lcfs | diff /tmp/lcfs-ls -
+$LCFS icache $MNT 0
+rm -f /tmp/lcfs-files /tmp/lcfs-sums /tmp/lcfs-ls
+
 CID=`docker ps --all --format {{.ID}}`
 docker commit ${CID} hello
 
@@ -187,6 +273,11 @@ do
     touch dir/file$i
 done
 set -x
+
+#Create a file with an emap extent longer than 65535 blocks.
+dd if=/dev/urandom of=large count=66000 bs=4096
+dd if=/dev/urandom of=large count=1 bs=4096 conv=notrunc,fsync
+md5sum large > /tmp/lcfs-large.md5
 touch $MNT/tmp/file
 cd -
 
@@ -194,12 +285,25 @@ umount -f $MNT/plugins/*/rootfs/lcfs
 umount -f $MNT $MNT2 2>/dev/null
 sleep 10
 
+#Mount with io_uring disabled, for falling back to synchronous I/O.
+URING=/proc/sys/kernel/io_uring_disabled
+if [ -e $URING ]
+then
+    URING_DISABLED=`cat $URING`
+    echo 2 > $URING
+fi
 $LCFS daemon $DEVICE $MNT $MNT2
 sleep 10
+if [ -e $URING ]
+then
+    echo $URING_DISABLED > $URING
+fi
 cd $MNT
 ls -ltRi > /dev/null
 stat file
 stat dir
+md5sum -c /tmp/lcfs-large.md5
+rm -f large /tmp/lcfs-large.md5
 
 set +x
 for (( i = 0; i < 500; i += 2 ))
@@ -209,6 +313,10 @@ do
 done
 set -x
 rmdir dir
+
+#Written with synchronous I/O, read back after mounting again.
+dd if=/dev/urandom of=sync count=256 bs=4096
+md5sum sync > /tmp/lcfs-sync.md5
 cd -
 
 umount -f $MNT $MNT2 2>/dev/null
@@ -219,6 +327,8 @@ sleep 10
 cd $MNT
 
 ls -ltRi > /dev/null
+md5sum -c /tmp/lcfs-sync.md5
+rm -f sync /tmp/lcfs-sync.md5
 touch file
 dd if=/dev/urandom of=file count=10 bs=4096
 rm -fr $MNT/*
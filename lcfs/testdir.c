@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <string.h>
+
+#define TESTFILE  ".readdir.test"
+#define TESTCOUNT 4000
+
+/* Names read from a directory along with offsets to continue after those */
+struct entries {
+    char **e_names;
+    long *e_offsets;
+    int e_count;
+    int e_size;
+};
+
+/* Read up to max entries from the current position of the directory */
+static void
+readEntries(DIR *dir, struct entries *entries, int max) {
+    struct dirent *dirent;
+
+    while ((max < 0) || (entries->e_count < max)) {
+        dirent = readdir(dir);
+        if (dirent == NULL) {
+            break;
+        }
+        if (entries->e_count == entries->e_size) {
+            entries->e_size = entries->e_size ? entries->e_size * 2 : 1024;
+            entries->e_names = realloc(entries->e_names,
+                                       entries->e_size * sizeof(char *));
+            entries->e_offsets = realloc(entries->e_offsets,
+                                         entries->e_size * sizeof(long));
+            assert(entries->e_names && entries->e_offsets);
+        }
+        entries->e_names[entries->e_count] = strdup(dirent->d_name);
+        entries->e_offsets[entries->e_count] = telldir(dir);
+        entries->e_count++;
+    }
+}
+
+static int
+compareNames(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/* Create or remove files in the directory */
+static void
+updateFiles(int fd, bool create) {
+    char name[32];
+    int i, err;
+
+    for (i = 0; i < TESTCOUNT; i++) {
+        sprintf(name, "%s%d", TESTFILE, i);
+        if (create) {
+            err = openat(fd, name, O_CREAT | O_WRONLY, 0644);
+            assert(err >= 0);
+            close(err);
+        } else {
+            err = unlinkat(fd, name, 0);
+            assert(err == 0);
+        }
+    }
+}
+
+/* Test readdir offsets of a directory while entries are added to it.  Every
+ * entry present from the start should be returned after resuming at an
+ * offset, and without duplicates unless strict checking is not requested, as
+ * reading starts over if a directory inherited from a parent layer is copied
+ * in the middle.
+ */
+int
+main(int argc, char *argv[]) {
+    struct entries all = {}, part = {};
+    struct dirent *dirent;
+    bool strict;
+    char **names;
+    int i, fd;
+    DIR *dir;
+
+    assert((argc == 2) || (argc == 3));
+    strict = (argc == 3) && (strcmp(argv[2], "strict") == 0);
+    fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    assert(fd >= 0);
+
+    /* Read the whole directory and check continuing from every offset */
+    dir = opendir(argv[1]);
+    assert(dir);
+    readEntries(dir, &all, -1);
+    assert(all.e_count > 2);
+    for (i = 0; i < (all.e_count - 1); i++) {
+        seekdir(dir, all.e_offsets[i]);
+        dirent = readdir(dir);
+        assert(dirent && (strcmp(dirent->d_name, all.e_names[i + 1]) == 0));
+    }
+    closedir(dir);
+
+    /* Read half of the directory and the rest after adding many entries */
+    dir = opendir(argv[1]);
+    assert(dir);
+    readEntries(dir, &part, all.e_count / 2);
+    updateFiles(fd, true);
+    seekdir(dir, part.e_offsets[part.e_count - 1]);
+    readEntries(dir, &part, -1);
+    closedir(dir);
+    updateFiles(fd, false);
+
+    /* Look for entries missing or returned more than once */
+    names = malloc(part.e_count * sizeof(char *));
+    assert(names);
+    memcpy(names, part.e_names, part.e_count * sizeof(char *));
+    qsort(names, part.e_count, sizeof(char *), compareNames);
+    for (i = 1; strict && (i < part.e_count); i++) {
+        assert(strcmp(names[i - 1], names[i]) != 0);
+    }
+    for (i = 0; i < all.e_count; i++) {
+        assert(bsearch(&all.e_names[i], names, part.e_count, sizeof(char *),
+                       compareNames));
+    }
+    free(names);
+
+    /* Offsets should not change after the hash table is resized */
+    if (strict) {
+        dir = opendir(argv[1]);
+        assert(dir);
+        for (i = 0; i < (all.e_count - 1); i++) {
+            seekdir(dir, all.e_offsets[i]);
+            dirent = readdir(dir);
+            assert(dirent &&
+                   (strcmp(dirent->d_name, all.e_names[i + 1]) == 0));
+        }
+        closedir(dir);
+    }
+    close(fd);
+    return 0;
+}
@@ -5,8 +5,10 @@
 #include <fcntl.h>
 #include <sys/xattr.h>
 #include <assert.h>
+#include <string.h>
 
 #define TESTFILE  ".xattr.test"
+#define TESTFILE2 ".xattr.test2"
 
 /* Test various extended attributes operations */
 int
@@ -65,5 +67,28 @@ main() {
     assert(size == -1);
     err = setxattr(TESTFILE, "attr3", "val", 3, 0);
     assert(err == 0);
+
+    /* Names and values are shared with other files using the same ones */
+    rmdir(TESTFILE2);
+    err = mkdir(TESTFILE2, 0777);
+    assert(err == 0);
+    err = setxattr(TESTFILE2, "attr3", "val", 3, 0);
+    assert(err == 0);
+    err = removexattr(TESTFILE2, "attr3");
+    assert(err == 0);
+    size = getxattr(TESTFILE, "attr3", buf, sizeof(buf));
+    assert((size == 3) && (memcmp(buf, "val", 3) == 0));
+    err = setxattr(TESTFILE2, "attr3", "val", 3, 0);
+    assert(err == 0);
+    err = setxattr(TESTFILE2, "attr3", "value", 5, 0);
+    assert(err == 0);
+    size = getxattr(TESTFILE, "attr3", buf, sizeof(buf));
+    assert((size == 3) && (memcmp(buf, "val", 3) == 0));
+    size = getxattr(TESTFILE2, "attr3", buf, sizeof(buf));
+    assert((size == 5) && (memcmp(buf, "value", 5) == 0));
+    err = rmdir(TESTFILE2);
+    assert(err == 0);
+    size = getxattr(TESTFILE, "attr3", buf, sizeof(buf));
+    assert((size == 3) && (memcmp(buf, "val", 3) == 0));
     return 0;
 }
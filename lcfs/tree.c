@@ -0,0 +1,215 @@
+#include "includes.h"
+
+/* Return height of a subtree */
+static inline int32_t
+lc_treeHeight(struct tnode *node) {
+    return node ? node->tn_height : 0;
+}
+
+/* Recompute height of a node from its children */
+static inline void
+lc_treeUpdateHeight(struct tnode *node) {
+    int32_t left = lc_treeHeight(node->tn_left);
+    int32_t right = lc_treeHeight(node->tn_right);
+
+    node->tn_height = ((left > right) ? left : right) + 1;
+}
+
+/* Make a new node take the place of an old node under the parent */
+static inline void
+lc_treeReplace(struct tree *tree, struct tnode *parent, struct tnode *old,
+               struct tnode *new) {
+    if (parent == NULL) {
+        tree->t_root = new;
+    } else if (parent->tn_left == old) {
+        parent->tn_left = new;
+    } else {
+        assert(parent->tn_right == old);
+        parent->tn_right = new;
+    }
+    if (new) {
+        new->tn_parent = parent;
+    }
+}
+
+/* Rotate a subtree to the left and return the new root of the subtree */
+static struct tnode *
+lc_treeRotateLeft(struct tree *tree, struct tnode *node) {
+    struct tnode *right = node->tn_right;
+
+    node->tn_right = right->tn_left;
+    if (right->tn_left) {
+        right->tn_left->tn_parent = node;
+    }
+    lc_treeReplace(tree, node->tn_parent, node, right);
+    right->tn_left = node;
+    node->tn_parent = right;
+    lc_treeUpdateHeight(node);
+    lc_treeUpdateHeight(right);
+    return right;
+}
+
+/* Rotate a subtree to the right and return the new root of the subtree */
+static struct tnode *
+lc_treeRotateRight(struct tree *tree, struct tnode *node) {
+    struct tnode *left = node->tn_left;
+
+    node->tn_left = left->tn_right;
+    if (left->tn_right) {
+        left->tn_right->tn_parent = node;
+    }
+    lc_treeReplace(tree, node->tn_parent, node, left);
+    left->tn_right = node;
+    node->tn_parent = left;
+    lc_treeUpdateHeight(node);
+    lc_treeUpdateHeight(left);
+    return left;
+}
+
+/* Restore balance of the tree starting from the node up to the root */
+static void
+lc_treeRebalance(struct tree *tree, struct tnode *node) {
+    struct tnode *left, *right;
+    int32_t balance;
+
+    while (node) {
+        lc_treeUpdateHeight(node);
+        left = node->tn_left;
+        right = node->tn_right;
+        balance = lc_treeHeight(left) - lc_treeHeight(right);
+        if (balance > 1) {
+            if (lc_treeHeight(left->tn_left) <
+                lc_treeHeight(left->tn_right)) {
+                lc_treeRotateLeft(tree, left);
+            }
+            node = lc_treeRotateRight(tree, node);
+        } else if (balance < -1) {
+            if (lc_treeHeight(right->tn_right) <
+                lc_treeHeight(right->tn_left)) {
+                lc_treeRotateRight(tree, right);
+            }
+            node = lc_treeRotateLeft(tree, node);
+        }
+        node = node->tn_parent;
+    }
+}
+
+/* Initialize a tree */
+void
+lc_treeInit(struct tree *tree, lc_treeCompare compare) {
+    tree->t_root = NULL;
+    tree->t_compare = compare;
+    tree->t_count = 0;
+}
+
+/* Insert a node to the tree */
+void
+lc_treeInsert(struct tree *tree, struct tnode *node) {
+    struct tnode *parent = NULL, **link = &tree->t_root;
+
+    while (*link) {
+        parent = *link;
+        link = (tree->t_compare(node, parent) < 0) ?
+               &parent->tn_left : &parent->tn_right;
+    }
+    node->tn_left = NULL;
+    node->tn_right = NULL;
+    node->tn_parent = parent;
+    node->tn_height = 1;
+    *link = node;
+    tree->t_count++;
+    lc_treeRebalance(tree, parent);
+}
+
+/* Remove a node from the tree */
+void
+lc_treeRemove(struct tree *tree, struct tnode *node) {
+    struct tnode *next, *parent, *child;
+
+    assert(tree->t_count);
+    tree->t_count--;
+    if (node->tn_left && node->tn_right) {
+
+        /* Replace the node with the next node in order */
+        next = node->tn_right;
+        while (next->tn_left) {
+            next = next->tn_left;
+        }
+        parent = next->tn_parent;
+        if (parent == node) {
+            parent = next;
+        } else {
+            lc_treeReplace(tree, parent, next, next->tn_right);
+            next->tn_right = node->tn_right;
+            node->tn_right->tn_parent = next;
+        }
+        lc_treeReplace(tree, node->tn_parent, node, next);
+        next->tn_left = node->tn_left;
+        node->tn_left->tn_parent = next;
+    } else {
+        child = node->tn_left ? node->tn_left : node->tn_right;
+        parent = node->tn_parent;
+        lc_treeReplace(tree, parent, node, child);
+    }
+    lc_treeRebalance(tree, parent);
+}
+
+/* Return the first node in the tree */
+struct tnode *
+lc_treeFirst(struct tree *tree) {
+    struct tnode *node = tree->t_root;
+
+    while (node && node->tn_left) {
+        node = node->tn_left;
+    }
+    return node;
+}
+
+/* Return the node after the specified one in order */
+struct tnode *
+lc_treeNext(struct tnode *node) {
+    struct tnode *parent;
+
+    if (node->tn_right) {
+        node = node->tn_right;
+        while (node->tn_left) {
+            node = node->tn_left;
+        }
+        return node;
+    }
+    parent = node->tn_parent;
+    while (parent && (parent->tn_right == node)) {
+        node = parent;
+        parent = node->tn_parent;
+    }
+    return parent;
+}
+
+/* Find a node matching the key.  If there is no exact match, return the
+ * smallest node ordered after the key if ceil is set, otherwise the largest
+ * node ordered before the key.
+ */
+struct tnode *
+lc_treeSearch(struct tree *tree, struct tnode *key, bool ceil) {
+    struct tnode *node = tree->t_root, *found = NULL;
+    int cmp;
+
+    while (node) {
+        cmp = tree->t_compare(key, node);
+        if (cmp == 0) {
+            return node;
+        }
+        if (cmp < 0) {
+            if (ceil) {
+                found = node;
+            }
+            node = node->tn_left;
+        } else {
+            if (!ceil) {
+                found = node;
+            }
+            node = node->tn_right;
+        }
+    }
+    return found;
+}
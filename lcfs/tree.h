@@ -0,0 +1,38 @@
+#ifndef _TREE_H_
+#define _TREE_H_
+
+/* A node in a balanced (AVL) tree, embedded in the objects in the tree */
+struct tnode {
+
+    /* Left child */
+    struct tnode *tn_left;
+
+    /* Right child */
+    struct tnode *tn_right;
+
+    /* Parent node */
+    struct tnode *tn_parent;
+
+    /* Height of the subtree rooted at this node */
+    int32_t tn_height;
+} __attribute__((packed));
+
+/* Compare two nodes of a tree, returning negative, zero or positive value
+ * if first node is ordered before, same as or after the second.
+ */
+typedef int (*lc_treeCompare)(struct tnode *a, struct tnode *b);
+
+/* A balanced tree */
+struct tree {
+
+    /* Root of the tree */
+    struct tnode *t_root;
+
+    /* Function ordering nodes in the tree */
+    lc_treeCompare t_compare;
+
+    /* Number of nodes in the tree */
+    uint64_t t_count;
+} __attribute__((packed));
+
+#endif
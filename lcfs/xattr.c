@@ -10,14 +10,15 @@ lc_xattrLink(struct inode *inode, const char *name, int len,
 
     assert(size < LC_BLOCK_SIZE);
     assert(len < LC_BLOCK_SIZE);
-    xattr->x_name = lc_malloc(fs, len + 1, LC_MEMTYPE_XATTRNAME);
-    memcpy(xattr->x_name, name, len);
-    xattr->x_name[len] = 0;
+
+    /* Names and values are interned, as the same ones are used by many
+     * files in every layer, like security labels.
+     */
+    xattr->x_name = lc_istringGet(name, len);
 
     /* Check if value provided for the attribute */
     if (size) {
-        xattr->x_value = lc_malloc(fs, size, LC_MEMTYPE_XATTRVALUE);
-        memcpy(xattr->x_value, value, size);
+        xattr->x_value = lc_istringGet(value, size);
     } else {
         xattr->x_value = NULL;
     }
@@ -103,18 +104,10 @@ lc_xattrAdd(fuse_req_t req, ino_t ino, const char *name,
                 fuse_reply_err(req, 0);
 
                 /* Replace the attribute with new value */
-                if (xattr->x_value && (size != xattr->x_size)) {
-                    lc_free(fs, xattr->x_value, xattr->x_size,
-                            LC_MEMTYPE_XATTRVALUE);
-                    xattr->x_value = NULL;
-                }
-                if (size) {
-                    if (xattr->x_value == NULL) {
-                        xattr->x_value = lc_malloc(fs, size,
-                                                   LC_MEMTYPE_XATTRVALUE);
-                    }
-                    memcpy(xattr->x_value, value, size);
+                if (xattr->x_value) {
+                    lc_istringRelease(xattr->x_value);
                 }
+                xattr->x_value = size ? lc_istringGet(value, size) : NULL;
                 xattr->x_size = size;
                 lc_updateInodeTimes(inode, false, true);
                 lc_markInodeDirty(inode, LC_INODE_XATTRDIRTY);
@@ -301,10 +294,9 @@ out:
 static inline void
 lc_freeXattr(struct fs *fs, struct xattr *xattr) {
     if (xattr->x_value) {
-        lc_free(fs, xattr->x_value, xattr->x_size, LC_MEMTYPE_XATTRVALUE);
+        lc_istringRelease(xattr->x_value);
     }
-    lc_free(fs, xattr->x_name, strlen(xattr->x_name) + 1,
-            LC_MEMTYPE_XATTRNAME);
+    lc_istringRelease(xattr->x_name);
     lc_free(fs, xattr, sizeof(struct xattr), LC_MEMTYPE_XATTR);
 }
 
@@ -386,13 +378,8 @@ lc_xattrCopy(struct inode *inode, struct inode *parent) {
     xattr = parent->i_xattr;
     while (xattr) {
         new = lc_malloc(fs, sizeof(struct xattr), LC_MEMTYPE_XATTR);
-        new->x_name = lc_malloc(fs, strlen(xattr->x_name) + 1,
-                                LC_MEMTYPE_XATTRNAME);
-        strcpy(new->x_name, xattr->x_name);
-        if (xattr->x_value) {
-            new->x_value = lc_malloc(fs, xattr->x_size, LC_MEMTYPE_XATTRVALUE);
-            memcpy(new->x_value, xattr->x_value, xattr->x_size);
-        }
+        new->x_name = lc_istringDup(xattr->x_name);
+        new->x_value = xattr->x_value ? lc_istringDup(xattr->x_value) : NULL;
         new->x_size = xattr->x_size;
         new->x_next = inode->i_xattr;
         inode->i_xattr = new;
@@ -511,14 +498,7 @@ lc_xattrRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
 
     assert(inode->i_xattrData == NULL);
     if (block != LC_INVALID_BLOCK) {
-
-        /* Enable extended attributes on the file system if not enabled already
-         */
-        if (!fs->fs_xattrEnabled) {
-            gfs->gfs_xattr_enabled = true;
-            fs->fs_xattrEnabled = true;
-            lc_printf("Enabled extended attributes\n");
-        }
+        lc_xattrEnable(gfs, fs);
         lc_xattrInit(fs, inode);
     }
 
@@ -549,6 +529,16 @@ lc_xattrRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
     }
 }
 
+/* Enable extended attributes on the file system if not enabled already */
+void
+lc_xattrEnable(struct gfs *gfs, struct fs *fs) {
+    if (!fs->fs_xattrEnabled) {
+        gfs->gfs_xattr_enabled = true;
+        fs->fs_xattrEnabled = true;
+        lc_printf("Enabled extended attributes\n");
+    }
+}
+
 /* Free all the extended attributes of an inode */
 void
 lc_xattrFree(struct inode *inode) {